@@ -28,5 +28,13 @@ rm -rf \
     src/.deps \
     src/.libs \
     src/Makefile.in \
+    mock/.deps \
+    mock/.libs \
+    mock/Makefile.in \
+    demos/.deps \
+    demos/Makefile.in \
+    tests/.deps \
+    tests/Makefile.in \
+    test-driver \
     stamp-h1 \
     missing
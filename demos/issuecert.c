@@ -0,0 +1,512 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Bulk certificate issuance with a CA key of the token.  The CA
+ * certificate and key are loaded once, the module initialized and the
+ * token logged in once, and certificate requests read from a directory or
+ * as a stream of PEM blocks on stdin are shared out to a pool of threads:
+ * each checks a request, builds the TBSCertificate, has the engine sign it
+ * on a session of its pool and writes the certificate, while the main
+ * thread keeps reading requests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/store.h>
+#include <openssl/engine.h>
+#include <openssl/x509v3.h>
+
+#define QUEUE_PER_THREAD    4
+#define SERIAL_LEN          16
+
+typedef struct {
+    X509_REQ *req;
+    char *name;                 /* of the request file, NULL on stdin */
+} REQUEST;
+
+/*
+ * The requests read and not taken by a worker yet, a ring of
+ * QUEUE_PER_THREAD entries per worker so that reading stays ahead of
+ * signing without holding the whole input in memory.
+ */
+typedef struct {
+    REQUEST *ring;
+    size_t size;
+    unsigned long put;
+    unsigned long got;
+    int eof;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    X509 *ca;
+    EVP_PKEY *cakey;
+    const EVP_MD *md;
+    long days;
+    const char *outdir;         /* NULL for stdout */
+    pthread_mutex_t out_lock;
+    unsigned long issued;
+    unsigned long rejected;
+    unsigned long failed;
+} ISSUER;
+
+static void queue_put(ISSUER *is, X509_REQ *req, const char *name)
+{
+    REQUEST *r;
+
+    pthread_mutex_lock(&is->lock);
+    while (is->put - is->got == is->size)
+        pthread_cond_wait(&is->cond, &is->lock);
+    r = &is->ring[is->put % is->size];
+    r->req = req;
+    r->name = name != NULL ? strdup(name) : NULL;
+    is->put++;
+    pthread_cond_broadcast(&is->cond);
+    pthread_mutex_unlock(&is->lock);
+}
+
+/* the next request, 0 once the input is over */
+static int queue_get(ISSUER *is, REQUEST *r)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&is->lock);
+    while (is->got == is->put && !is->eof)
+        pthread_cond_wait(&is->cond, &is->lock);
+    if (is->got < is->put) {
+        *r = is->ring[is->got % is->size];
+        is->got++;
+        ok = 1;
+        pthread_cond_broadcast(&is->cond);
+    }
+    pthread_mutex_unlock(&is->lock);
+    return ok;
+}
+
+static void queue_end(ISSUER *is)
+{
+    pthread_mutex_lock(&is->lock);
+    is->eof = 1;
+    pthread_cond_broadcast(&is->cond);
+    pthread_mutex_unlock(&is->lock);
+}
+
+static int add_ext(X509 *cert, X509V3_CTX *v3ctx, int nid, const char *value)
+{
+    X509_EXTENSION *ext;
+    int ok;
+
+    if ((ext = X509V3_EXT_conf_nid(NULL, v3ctx, nid, value)) == NULL)
+        return 0;
+    ok = X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+    return ok;
+}
+
+/*
+ * A random positive serial number, unique without any state shared
+ * between the threads or the runs of the tool.
+ */
+static int set_serial(X509 *cert)
+{
+    unsigned char buf[SERIAL_LEN];
+    BIGNUM *bn = NULL;
+    int ok;
+
+    if (RAND_bytes(buf, sizeof(buf)) <= 0)
+        return 0;
+    buf[0] = (buf[0] & 0x7f) | 0x40;
+    ok = (bn = BN_bin2bn(buf, sizeof(buf), NULL)) != NULL
+         && BN_to_ASN1_INTEGER(bn, X509_get_serialNumber(cert)) != NULL;
+    BN_free(bn);
+    return ok;
+}
+
+/*
+ * The certificate of |req|: its subject, key and subjectAltName and
+ * extendedKeyUsage, the other extensions fixed by the CA, valid for
+ * |is->days| from now.
+ */
+static X509 *build_cert(ISSUER *is, X509_REQ *req)
+{
+    static const int copied[] = { NID_subject_alt_name, NID_ext_key_usage };
+    STACK_OF(X509_EXTENSION) *exts = NULL;
+    X509_EXTENSION *ext;
+    X509V3_CTX v3ctx;
+    EVP_PKEY *pkey;
+    X509 *cert;
+    size_t i;
+    int j, ok = 0;
+
+    if ((cert = X509_new()) == NULL)
+        return NULL;
+    if ((pkey = X509_REQ_get0_pubkey(req)) == NULL
+        || !X509_set_version(cert, X509_VERSION_3)
+        || !set_serial(cert)
+        || !X509_set_issuer_name(cert, X509_get_subject_name(is->ca))
+        || !X509_set_subject_name(cert, X509_REQ_get_subject_name(req))
+        || X509_gmtime_adj(X509_getm_notBefore(cert), 0) == NULL
+        || X509_time_adj_ex(X509_getm_notAfter(cert), is->days, 0,
+                            NULL) == NULL
+        || !X509_set_pubkey(cert, pkey))
+        goto end;
+
+    X509V3_set_ctx(&v3ctx, is->ca, cert, NULL, NULL, 0);
+    if (!add_ext(cert, &v3ctx, NID_basic_constraints, "critical,CA:FALSE")
+        || !add_ext(cert, &v3ctx, NID_key_usage,
+                    "critical,digitalSignature,keyEncipherment")
+        || !add_ext(cert, &v3ctx, NID_subject_key_identifier, "hash")
+        || !add_ext(cert, &v3ctx, NID_authority_key_identifier,
+                    "keyid,issuer"))
+        goto end;
+
+    exts = X509_REQ_get_extensions(req);
+    for (i = 0; i < sizeof(copied) / sizeof(copied[0]); i++) {
+        j = X509v3_get_ext_by_NID(exts, copied[i], -1);
+        if (j >= 0 && (ext = X509v3_get_ext(exts, j)) != NULL
+            && !X509_add_ext(cert, ext, -1))
+            goto end;
+    }
+    ok = 1;
+
+ end:
+    sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+    if (!ok) {
+        X509_free(cert);
+        cert = NULL;
+    }
+    return cert;
+}
+
+static int write_cert(ISSUER *is, X509 *cert, const char *name)
+{
+    char path[4096], *hex = NULL;
+    const char *base;
+    size_t len;
+    FILE *f;
+    int ok;
+
+    if (is->outdir == NULL) {
+        pthread_mutex_lock(&is->out_lock);
+        ok = PEM_write_X509(stdout, cert) && fflush(stdout) == 0;
+        pthread_mutex_unlock(&is->out_lock);
+        return ok;
+    }
+
+    /* <request name without its extension>.crt, or <serial>.crt */
+    if (name != NULL) {
+        base = strrchr(name, '/');
+        base = base != NULL ? base + 1 : name;
+        len = strcspn(base, ".");
+    } else {
+        BIGNUM *bn = ASN1_INTEGER_to_BN(X509_get0_serialNumber(cert), NULL);
+
+        hex = bn != NULL ? BN_bn2hex(bn) : NULL;
+        BN_free(bn);
+        if ((base = hex) == NULL)
+            return 0;
+        len = strlen(base);
+    }
+    snprintf(path, sizeof(path), "%s/%.*s.crt", is->outdir, (int)len, base);
+    OPENSSL_free(hex);
+
+    if ((f = fopen(path, "w")) == NULL)
+        return 0;
+    ok = PEM_write_X509(f, cert);
+    return fclose(f) == 0 && ok;
+}
+
+static void *issue_worker(void *arg)
+{
+    ISSUER *is = arg;
+    REQUEST r;
+    X509 *cert;
+    EVP_PKEY *pkey;
+    const char *what;
+    int ok;
+
+    while (queue_get(is, &r)) {
+        cert = NULL;
+        ok = 0;
+
+        /* only requests signed by the key they carry */
+        if ((pkey = X509_REQ_get0_pubkey(r.req)) == NULL
+            || X509_REQ_verify(r.req, pkey) <= 0) {
+            what = "rejected, bad request signature";
+        } else if ((cert = build_cert(is, r.req)) == NULL
+                   || X509_sign(cert, is->cakey, is->md) <= 0) {
+            what = "signing failed";
+            ok = -1;
+        } else if (!write_cert(is, cert, r.name)) {
+            what = "cannot write the certificate";
+            ok = -1;
+        } else {
+            ok = 1;
+        }
+
+        pthread_mutex_lock(&is->out_lock);
+        if (ok > 0) {
+            is->issued++;
+        } else {
+            if (ok == 0)
+                is->rejected++;
+            else
+                is->failed++;
+            fprintf(stderr, "%s: %s\n", r.name != NULL ? r.name : "stdin",
+                    what);
+            ERR_print_errors_fp(stderr);
+        }
+        pthread_mutex_unlock(&is->out_lock);
+        ERR_clear_error();
+
+        X509_free(cert);
+        X509_REQ_free(r.req);
+        free(r.name);
+    }
+    return NULL;
+}
+
+static X509_REQ *read_req_file(const char *path)
+{
+    X509_REQ *req;
+    BIO *in;
+
+    if ((in = BIO_new_file(path, "rb")) == NULL)
+        return NULL;
+    if ((req = PEM_read_bio_X509_REQ(in, NULL, NULL, NULL)) == NULL) {
+        ERR_clear_error();
+        (void)BIO_reset(in);
+        req = d2i_X509_REQ_bio(in, NULL);
+    }
+    BIO_free(in);
+    return req;
+}
+
+/* queue the regular files of |dir|, PEM or DER requests */
+static int read_dir(ISSUER *is, const char *dir)
+{
+    char path[4096];
+    struct dirent *de;
+    struct stat st;
+    X509_REQ *req;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL)
+        return 0;
+    while ((de = readdir(d)) != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if ((req = read_req_file(path)) == NULL) {
+            fprintf(stderr, "%s: not a certificate request\n", path);
+            ERR_clear_error();
+            pthread_mutex_lock(&is->out_lock);
+            is->rejected++;
+            pthread_mutex_unlock(&is->out_lock);
+            continue;
+        }
+        queue_put(is, req, path);
+    }
+    closedir(d);
+    return 1;
+}
+
+/* queue PEM requests from stdin as they arrive, until its end */
+static int read_stream(ISSUER *is)
+{
+    X509_REQ *req;
+    BIO *in;
+    unsigned long e;
+
+    if ((in = BIO_new_fp(stdin, BIO_NOCLOSE)) == NULL)
+        return 0;
+    for (;;) {
+        if ((req = PEM_read_bio_X509_REQ(in, NULL, NULL, NULL)) != NULL) {
+            queue_put(is, req, NULL);
+            continue;
+        }
+        e = ERR_peek_last_error();
+        ERR_clear_error();
+        if (ERR_GET_LIB(e) == ERR_LIB_PEM
+            && ERR_GET_REASON(e) == PEM_R_NO_START_LINE)
+            break;
+        fprintf(stderr, "stdin: not a certificate request\n");
+        pthread_mutex_lock(&is->out_lock);
+        is->rejected++;
+        pthread_mutex_unlock(&is->out_lock);
+    }
+    BIO_free(in);
+    return 1;
+}
+
+static int issue(ISSUER *is, const char *indir, int nthreads)
+{
+    pthread_t *tids;
+    struct timespec t0, t1;
+    double secs;
+    int i, n, ok;
+
+    is->size = (size_t)nthreads * QUEUE_PER_THREAD;
+    if ((tids = calloc(nthreads, sizeof(*tids))) == NULL
+        || (is->ring = calloc(is->size, sizeof(*is->ring))) == NULL) {
+        free(tids);
+        return 0;
+    }
+    pthread_mutex_init(&is->lock, NULL);
+    pthread_mutex_init(&is->out_lock, NULL);
+    pthread_cond_init(&is->cond, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (n = 0; n < nthreads; n++)
+        if (pthread_create(&tids[n], NULL, issue_worker, is) != 0)
+            break;
+    if (n == 0) {
+        fprintf(stderr, "cannot start any worker thread\n");
+        ok = 0;
+    } else {
+        ok = indir != NULL ? read_dir(is, indir) : read_stream(is);
+    }
+    queue_end(is);
+    for (i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    pthread_cond_destroy(&is->cond);
+    pthread_mutex_destroy(&is->out_lock);
+    pthread_mutex_destroy(&is->lock);
+    free(is->ring);
+    free(tids);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%lu issued, %lu rejected, %lu failed, %d threads, "
+            "%.2f s, %.1f certs/s\n", is->issued, is->rejected, is->failed,
+            n, secs, secs > 0 ? is->issued / secs : 0);
+    return ok && is->rejected == 0 && is->failed == 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: issuecert [-i csrdir] [-o outdir|-] "
+            "[-t threads] [-v days]\n"
+            "                 modpkcs11 pin id [md]\n"
+            "  id   id of the CA key and certificate on the token\n"
+            "  -i   issue the requests of a directory, PEM or DER (default "
+            "a stream\n"
+            "       of PEM requests on stdin)\n"
+            "  -o   directory of the certificates, <name>.crt or "
+            "<serial>.crt,\n"
+            "       - for PEM on stdout (default .)\n"
+            "  -t   signing threads (default 8)\n"
+            "  -v   days of validity (default 1)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    OSSL_STORE_CTX *store_ctx = NULL;
+    OSSL_STORE_INFO *info = NULL;
+    ENGINE *engine = NULL;
+    const char *indir = NULL, *outdir = ".";
+    const char *module, *pin, *id, *md;
+    char certuri[512], privuri[512];
+    ISSUER is;
+    int c, nthreads = 8, ret = 1;
+
+    memset(&is, 0, sizeof(is));
+    is.days = 1;
+    while ((c = getopt(argc, argv, "i:o:t:v:")) != -1) {
+        switch (c) {
+        case 'i':
+            indir = optarg;
+            break;
+        case 'o':
+            outdir = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'v':
+            is.days = atol(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind < 3 || argc - optind > 4 || nthreads < 1
+        || is.days < 1)
+        usage();
+    module = argv[optind];
+    pin = argv[optind + 1];
+    id = argv[optind + 2];
+    md = argc - optind == 4 ? argv[optind + 3] : "sha256";
+    is.outdir = strcmp(outdir, "-") == 0 ? NULL : outdir;
+
+    if ((is.md = EVP_get_digestbyname(md)) == NULL) {
+        fprintf(stderr, "Unknown digest %s\n", md);
+        goto err;
+    }
+
+    if ((engine = ENGINE_by_id("pkcs11")) == NULL)
+        goto err;
+    if (!ENGINE_set_default(engine, -1) || !ENGINE_init(engine)) {
+        ENGINE_free(engine);
+        engine = NULL;
+        goto err;
+    }
+
+    /* the CA certificate and key once, for every request */
+    snprintf(certuri, sizeof(certuri),
+             "pkcs11:type=cert;module-path=%s;id=%s", module, id);
+    if ((store_ctx = OSSL_STORE_open(certuri, NULL, NULL, NULL,
+                                     NULL)) == NULL)
+        goto err;
+    if ((info = OSSL_STORE_load(store_ctx)) == NULL
+        || (is.ca = OSSL_STORE_INFO_get1_CERT(info)) == NULL) {
+        fprintf(stderr, "CA certificate %s not found\n", id);
+        goto err;
+    }
+
+    snprintf(privuri, sizeof(privuri),
+             "pkcs11:type=private;module-path=%s;id=%s;pin-value=%s",
+             module, id, pin);
+    if ((is.cakey = ENGINE_load_private_key(engine, privuri, NULL,
+                                            NULL)) == NULL)
+        goto err;
+    if (X509_check_private_key(is.ca, is.cakey) != 1) {
+        fprintf(stderr, "CA key %s does not match its certificate\n", id);
+        goto err;
+    }
+
+    ret = issue(&is, indir, nthreads) ? 0 : 2;
+    goto end;
+
+ err:
+    fprintf(stderr, "Error issuing certificates\n");
+    ERR_print_errors_fp(stderr);
+
+ end:
+    OSSL_STORE_INFO_free(info);
+    OSSL_STORE_close(store_ctx);
+    X509_free(is.ca);
+    EVP_PKEY_free(is.cakey);
+    if (engine != NULL) {
+        ENGINE_finish(engine);
+        ENGINE_free(engine);
+    }
+    return ret;
+}
@@ -0,0 +1,611 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Throughput and latency benchmark of the engine's RSA private key
+ * operations.  N threads each keep up to D operations in flight (as ASYNC
+ * jobs, so deeper queues only overlap when the engine pauses its jobs) for
+ * a fixed duration after a warm-up, and the results are printed as text,
+ * CSV or JSON: ops/s, latency percentiles, CPU time per operation and the
+ * failed operations grouped by the CK_RV the engine reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/async.h>
+#include "e_pkcs11_err.h"
+
+#define OP_SIGN         0
+#define OP_DECRYPT      1
+#define NOPS            2
+#define MAX_RVS         32
+#define RV_OTHER        (~0UL)
+
+static const char *op_names[NOPS] = { "sign", "decrypt" };
+
+static const struct {
+    unsigned long rv;
+    const char *name;
+} rv_names[] = {
+    { 0x00000001UL, "CKR_CANCEL" },
+    { 0x00000002UL, "CKR_HOST_MEMORY" },
+    { 0x00000005UL, "CKR_GENERAL_ERROR" },
+    { 0x00000006UL, "CKR_FUNCTION_FAILED" },
+    { 0x00000007UL, "CKR_ARGUMENTS_BAD" },
+    { 0x00000020UL, "CKR_DATA_INVALID" },
+    { 0x00000021UL, "CKR_DATA_LEN_RANGE" },
+    { 0x00000030UL, "CKR_DEVICE_ERROR" },
+    { 0x00000031UL, "CKR_DEVICE_MEMORY" },
+    { 0x00000032UL, "CKR_DEVICE_REMOVED" },
+    { 0x00000040UL, "CKR_ENCRYPTED_DATA_INVALID" },
+    { 0x00000041UL, "CKR_ENCRYPTED_DATA_LEN_RANGE" },
+    { 0x00000050UL, "CKR_FUNCTION_CANCELED" },
+    { 0x00000054UL, "CKR_FUNCTION_NOT_SUPPORTED" },
+    { 0x00000060UL, "CKR_KEY_HANDLE_INVALID" },
+    { 0x00000068UL, "CKR_KEY_FUNCTION_NOT_PERMITTED" },
+    { 0x00000070UL, "CKR_MECHANISM_INVALID" },
+    { 0x00000082UL, "CKR_OBJECT_HANDLE_INVALID" },
+    { 0x00000090UL, "CKR_OPERATION_ACTIVE" },
+    { 0x00000091UL, "CKR_OPERATION_NOT_INITIALIZED" },
+    { 0x000000A0UL, "CKR_PIN_INCORRECT" },
+    { 0x000000B0UL, "CKR_SESSION_CLOSED" },
+    { 0x000000B1UL, "CKR_SESSION_COUNT" },
+    { 0x000000B3UL, "CKR_SESSION_HANDLE_INVALID" },
+    { 0x000000E0UL, "CKR_TOKEN_NOT_PRESENT" },
+    { 0x00000101UL, "CKR_USER_NOT_LOGGED_IN" },
+    { 0x00000190UL, "CKR_CRYPTOKI_NOT_INITIALIZED" },
+};
+
+typedef struct {
+    unsigned long rv;
+    unsigned long count;
+} RV_COUNT;
+
+typedef struct {
+    unsigned long long *lat;    /* ns */
+    size_t nlat, size;
+    unsigned long errors;
+    RV_COUNT rvs[MAX_RVS];
+    size_t nrvs;
+} STATS;
+
+typedef struct {
+    int op;
+    int ok;
+    unsigned long long start;
+    EVP_PKEY_CTX *ctx[NOPS];
+    ASYNC_JOB *job;
+    ASYNC_WAIT_CTX *wait;
+} SLOT;
+
+typedef struct {
+    pthread_t tid;
+    unsigned int seed;
+    STATS stats[NOPS];
+    int failed;
+} WORKER;
+
+static ENGINE *engine = NULL;
+static EVP_PKEY *key = NULL;
+static unsigned char digest[32];
+static unsigned char ciphertext[1024];
+static size_t ciphertext_len = 0;
+static int depth = 1;
+static int sign_pct = 100;
+static unsigned long long measure_start;
+static volatile int stop = 0;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double cpu_us(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6
+           + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static const char *rv_name(unsigned long rv, char *buf, size_t len)
+{
+    size_t i;
+
+    if (rv == RV_OTHER)
+        return "other";
+    for (i = 0; i < sizeof(rv_names) / sizeof(rv_names[0]); i++)
+        if (rv_names[i].rv == rv)
+            return rv_names[i].name;
+    snprintf(buf, len, "CKR_0x%08lX", rv);
+    return buf;
+}
+
+static void count_rv(STATS *st, unsigned long rv, unsigned long n)
+{
+    size_t i;
+
+    for (i = 0; i < st->nrvs; i++)
+        if (st->rvs[i].rv == rv)
+            break;
+    if (i == st->nrvs) {
+        if (st->nrvs == MAX_RVS)
+            i = MAX_RVS - 1;
+        else
+            st->rvs[st->nrvs++].rv = rv;
+    }
+    st->rvs[i].count += n;
+}
+
+/*
+ * Drain the error queue of the calling thread and return the CK_RV carried
+ * by the first engine error, or RV_OTHER.
+ */
+static unsigned long take_rv(void)
+{
+    unsigned long e, rv = RV_OTHER, v;
+    const char *data;
+    int flags;
+
+    while ((e = ERR_get_error_all(NULL, NULL, NULL, &data, &flags)) != 0) {
+        if (rv == RV_OTHER && ERR_GET_LIB(e) == ERR_LIB_PKCS11
+            && (flags & ERR_TXT_STRING) && data != NULL
+            && sscanf(data, "rv=%lx", &v) == 1)
+            rv = v;
+    }
+    return rv;
+}
+
+static void record(STATS *st, unsigned long long start, int ok)
+{
+    unsigned long long now = now_ns(), *tmp;
+    size_t size;
+
+    if (start < measure_start || stop) {
+        if (!ok)
+            ERR_clear_error();
+        return;
+    }
+    if (!ok) {
+        st->errors++;
+        count_rv(st, take_rv(), 1);
+        return;
+    }
+    if (st->nlat == st->size) {
+        size = st->size ? st->size * 2 : 4096;
+        if ((tmp = realloc(st->lat, size * sizeof(*tmp))) == NULL)
+            return;
+        st->lat = tmp;
+        st->size = size;
+    }
+    st->lat[st->nlat++] = now - start;
+}
+
+static int run_op(SLOT *s)
+{
+    unsigned char out[1024];
+    size_t outlen = sizeof(out);
+
+    if (s->op == OP_SIGN)
+        return EVP_PKEY_sign(s->ctx[OP_SIGN], out, &outlen, digest,
+                             sizeof(digest)) > 0;
+    return EVP_PKEY_decrypt(s->ctx[OP_DECRYPT], out, &outlen, ciphertext,
+                            ciphertext_len) > 0;
+}
+
+static int job_fn(void *arg)
+{
+    SLOT *s = *(SLOT **)arg;
+
+    s->ok = run_op(s);
+    return s->ok;
+}
+
+static int slot_init(SLOT *s)
+{
+    memset(s, 0, sizeof(*s));
+    if ((s->ctx[OP_SIGN] = EVP_PKEY_CTX_new(key, NULL)) == NULL
+        || EVP_PKEY_sign_init(s->ctx[OP_SIGN]) <= 0
+        || EVP_PKEY_CTX_set_rsa_padding(s->ctx[OP_SIGN],
+                                        RSA_PKCS1_PADDING) <= 0
+        || EVP_PKEY_CTX_set_signature_md(s->ctx[OP_SIGN], EVP_sha256()) <= 0
+        || (s->ctx[OP_DECRYPT] = EVP_PKEY_CTX_new(key, NULL)) == NULL
+        || EVP_PKEY_decrypt_init(s->ctx[OP_DECRYPT]) <= 0
+        || EVP_PKEY_CTX_set_rsa_padding(s->ctx[OP_DECRYPT],
+                                        RSA_PKCS1_PADDING) <= 0)
+        return 0;
+    if (depth > 1 && (s->wait = ASYNC_WAIT_CTX_new()) == NULL)
+        return 0;
+    return 1;
+}
+
+static void slot_free(SLOT *s)
+{
+    EVP_PKEY_CTX_free(s->ctx[OP_SIGN]);
+    EVP_PKEY_CTX_free(s->ctx[OP_DECRYPT]);
+    ASYNC_WAIT_CTX_free(s->wait);
+}
+
+static int next_op(WORKER *w)
+{
+    return (int)(rand_r(&w->seed) % 100) < sign_pct ? OP_SIGN : OP_DECRYPT;
+}
+
+static void *worker(void *arg)
+{
+    WORKER *w = arg;
+    SLOT *slots, *s;
+    int i, ret, progress;
+
+    if ((slots = calloc(depth, sizeof(*slots))) == NULL) {
+        w->failed = 1;
+        return NULL;
+    }
+    for (i = 0; i < depth; i++)
+        if (!slot_init(&slots[i]))
+            goto err;
+
+    if (depth == 1) {
+        s = &slots[0];
+        while (!stop) {
+            s->op = next_op(w);
+            s->start = now_ns();
+            s->ok = run_op(s);
+            record(&w->stats[s->op], s->start, s->ok);
+        }
+        goto done;
+    }
+
+    if (!ASYNC_init_thread(depth, depth))
+        goto err;
+    while (!stop) {
+        progress = 0;
+        for (i = 0; i < depth; i++) {
+            s = &slots[i];
+            if (s->job == NULL) {
+                s->op = next_op(w);
+                s->start = now_ns();
+            }
+            switch (ASYNC_start_job(&s->job, s->wait, &ret, job_fn, &s,
+                                    sizeof(s))) {
+            case ASYNC_FINISH:
+                record(&w->stats[s->op], s->start, s->ok);
+                s->job = NULL;
+                progress = 1;
+                break;
+            case ASYNC_PAUSE:
+                break;
+            default:
+                record(&w->stats[s->op], s->start, 0);
+                s->job = NULL;
+                break;
+            }
+        }
+        if (!progress)
+            sched_yield();
+    }
+    /* let the paused jobs complete before tearing the thread down */
+    for (i = 0; i < depth; i++) {
+        s = &slots[i];
+        while (s->job != NULL
+               && ASYNC_start_job(&s->job, s->wait, &ret, job_fn, &s,
+                                  sizeof(s)) == ASYNC_PAUSE)
+            sched_yield();
+    }
+    ASYNC_cleanup_thread();
+    goto done;
+
+ err:
+    w->failed = 1;
+ done:
+    for (i = 0; i < depth; i++)
+        slot_free(&slots[i]);
+    free(slots);
+    ERR_clear_error();
+    return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const STATS *st, double q)
+{
+    size_t i;
+
+    if (st->nlat == 0)
+        return 0;
+    i = (size_t)(q * st->nlat + 0.999999);
+    if (i > 0)
+        i--;
+    if (i >= st->nlat)
+        i = st->nlat - 1;
+    return st->lat[i] / 1e3;
+}
+
+static int merge(STATS *dst, const STATS *src)
+{
+    unsigned long long *tmp;
+    size_t i;
+
+    if (src->nlat > 0) {
+        tmp = realloc(dst->lat, (dst->nlat + src->nlat) * sizeof(*tmp));
+        if (tmp == NULL)
+            return 0;
+        dst->lat = tmp;
+        memcpy(dst->lat + dst->nlat, src->lat, src->nlat * sizeof(*tmp));
+        dst->nlat += src->nlat;
+    }
+    dst->errors += src->errors;
+    for (i = 0; i < src->nrvs; i++)
+        count_rv(dst, src->rvs[i].rv, src->rvs[i].count);
+    return 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -k uri      private key (default: mock module key rsa0)\n"
+            "  -m path     PKCS#11 module, else $PKCS11_MODULE_PATH\n"
+            "  -w mode     sign, decrypt or mixed (default: sign)\n"
+            "  -p pct      share of signatures in the mixed mode (50)\n"
+            "  -t n        threads (1)\n"
+            "  -q n        operations in flight per thread (1)\n"
+            "  -d secs     measured duration (10)\n"
+            "  -W secs     warm-up before measuring (1)\n"
+            "  -f format   text, csv or json (default: text)\n"
+            "  -H          omit the CSV header line\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *key_uri = "pkcs11:object=rsa0;type=private;pin-value=1234";
+    const char *module = NULL, *format = "text", *mode = "sign";
+    char *uri = NULL, buf[32];
+    int threads = 1, header = 1, c, i, o, first;
+    double duration = 10, warmup = 1, elapsed, cpu0 = 0, cpu1 = 0;
+    double ops, nops;
+    unsigned long long t0 = 0, t1 = 0;
+    unsigned char pt[32];
+    EVP_PKEY_CTX *ctx = NULL;
+    WORKER *workers = NULL;
+    STATS total[NOPS];
+    struct timespec ts;
+    size_t j;
+    int ret = 1;
+
+    while ((c = getopt(argc, argv, "k:m:w:p:t:q:d:W:f:H")) != -1) {
+        switch (c) {
+        case 'k':
+            key_uri = optarg;
+            break;
+        case 'm':
+            module = optarg;
+            break;
+        case 'w':
+            mode = optarg;
+            break;
+        case 'p':
+            sign_pct = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'W':
+            warmup = atof(optarg);
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'H':
+            header = 0;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (strcmp(mode, "sign") == 0)
+        sign_pct = 100;
+    else if (strcmp(mode, "decrypt") == 0)
+        sign_pct = 0;
+    else if (strcmp(mode, "mixed") != 0)
+        usage(argv[0]);
+    else if (sign_pct == 100)
+        sign_pct = 50;
+    if (threads < 1 || depth < 1 || duration <= 0 || warmup < 0
+        || sign_pct < 0 || sign_pct > 100
+        || (strcmp(format, "text") != 0 && strcmp(format, "csv") != 0
+            && strcmp(format, "json") != 0))
+        usage(argv[0]);
+
+    /* the engine tokenises the URI in place */
+    if ((uri = OPENSSL_strdup(key_uri)) == NULL
+        || (engine = ENGINE_by_id("pkcs11")) == NULL
+        || (module != NULL
+            && !ENGINE_ctrl_cmd_string(engine, "MODULE_PATH", module, 0))
+        || !ENGINE_set_default(engine, ENGINE_METHOD_RSA)
+        || !ENGINE_init(engine)
+        || (key = ENGINE_load_private_key(engine, uri, NULL, NULL)) == NULL)
+        goto err;
+    if (EVP_PKEY_get_base_id(key) != EVP_PKEY_RSA) {
+        fprintf(stderr, "%s: not an RSA key\n", key_uri);
+        goto end;
+    }
+
+    memset(digest, 0x5a, sizeof(digest));
+    memset(pt, 0xa5, sizeof(pt));
+    ciphertext_len = sizeof(ciphertext);
+    if ((ctx = EVP_PKEY_CTX_new(key, NULL)) == NULL
+        || EVP_PKEY_encrypt_init(ctx) <= 0
+        || EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0
+        || EVP_PKEY_encrypt(ctx, ciphertext, &ciphertext_len, pt,
+                            sizeof(pt)) <= 0)
+        goto err;
+
+    if ((workers = calloc(threads, sizeof(*workers))) == NULL)
+        goto err;
+    t0 = now_ns();
+    measure_start = t0 + (unsigned long long)(warmup * 1e9);
+    for (i = 0; i < threads; i++) {
+        workers[i].seed = (unsigned int)(t0 + i);
+        if (pthread_create(&workers[i].tid, NULL, worker, &workers[i]) != 0) {
+            fprintf(stderr, "cannot start thread %d\n", i);
+            stop = 1;
+            threads = i;
+            goto join;
+        }
+    }
+
+    ts.tv_sec = (time_t)warmup;
+    ts.tv_nsec = (long)((warmup - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    cpu0 = cpu_us();
+    t0 = now_ns();
+    ts.tv_sec = (time_t)duration;
+    ts.tv_nsec = (long)((duration - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    stop = 1;
+    t1 = now_ns();
+    cpu1 = cpu_us();
+    ret = 0;
+
+ join:
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        if (workers[i].failed) {
+            fprintf(stderr, "thread %d could not set up its operations\n", i);
+            ret = 1;
+        }
+    }
+    if (ret != 0)
+        goto end;
+
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < threads; i++)
+        for (o = 0; o < NOPS; o++)
+            if (!merge(&total[o], &workers[i].stats[o]))
+                goto err;
+    nops = 0;
+    for (o = 0; o < NOPS; o++) {
+        qsort(total[o].lat, total[o].nlat, sizeof(*total[o].lat), cmp_ull);
+        nops += total[o].nlat + total[o].errors;
+    }
+    elapsed = (t1 - t0) / 1e9;
+
+    if (strcmp(format, "json") == 0)
+        printf("{\"mode\":\"%s\",\"threads\":%d,\"depth\":%d,"
+               "\"duration\":%.3f,\"results\":[", mode, threads, depth,
+               elapsed);
+    else if (strcmp(format, "csv") == 0 && header)
+        printf("op,mode,threads,depth,duration_s,ops,ops_per_s,p50_us,"
+               "p99_us,p999_us,cpu_us_per_op,errors,errors_by_rv\n");
+    else if (strcmp(format, "text") == 0)
+        printf("%-8s %10s %10s %10s %10s %10s %10s %8s\n", "op", "ops",
+               "ops/s", "p50_us", "p99_us", "p99.9_us", "cpu_us/op",
+               "errors");
+
+    first = 1;
+    for (o = 0; o < NOPS; o++) {
+        STATS *st = &total[o];
+
+        if (st->nlat == 0 && st->errors == 0)
+            continue;
+        ops = st->nlat;
+        /* CPU time is shared out in proportion to the operations issued */
+        if (strcmp(format, "json") == 0) {
+            printf("%s{\"op\":\"%s\",\"ops\":%.0f,\"ops_per_s\":%.1f,"
+                   "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+                   "\"cpu_us_per_op\":%.2f,\"errors\":%lu,\"errors_by_rv\":{",
+                   first ? "" : ",", op_names[o], ops, ops / elapsed,
+                   percentile(st, 0.5), percentile(st, 0.99),
+                   percentile(st, 0.999), nops ? (cpu1 - cpu0) / nops : 0,
+                   st->errors);
+            for (j = 0; j < st->nrvs; j++)
+                printf("%s\"%s\":%lu", j ? "," : "",
+                       rv_name(st->rvs[j].rv, buf, sizeof(buf)),
+                       st->rvs[j].count);
+            printf("}}");
+        } else if (strcmp(format, "csv") == 0) {
+            printf("%s,%s,%d,%d,%.3f,%.0f,%.1f,%.1f,%.1f,%.1f,%.2f,%lu,",
+                   op_names[o], mode, threads, depth, elapsed, ops,
+                   ops / elapsed, percentile(st, 0.5), percentile(st, 0.99),
+                   percentile(st, 0.999), nops ? (cpu1 - cpu0) / nops : 0,
+                   st->errors);
+            for (j = 0; j < st->nrvs; j++)
+                printf("%s%s=%lu", j ? " " : "",
+                       rv_name(st->rvs[j].rv, buf, sizeof(buf)),
+                       st->rvs[j].count);
+            printf("\n");
+        } else {
+            printf("%-8s %10.0f %10.1f %10.1f %10.1f %10.1f %10.2f %8lu\n",
+                   op_names[o], ops, ops / elapsed, percentile(st, 0.5),
+                   percentile(st, 0.99), percentile(st, 0.999),
+                   nops ? (cpu1 - cpu0) / nops : 0, st->errors);
+            for (j = 0; j < st->nrvs; j++)
+                printf("    %-30s %lu\n",
+                       rv_name(st->rvs[j].rv, buf, sizeof(buf)),
+                       st->rvs[j].count);
+        }
+        first = 0;
+    }
+    if (strcmp(format, "json") == 0)
+        printf("]}\n");
+    else if (strcmp(format, "text") == 0)
+        printf("%d threads, depth %d, %.3f s measured\n", threads, depth,
+               elapsed);
+    for (o = 0; o < NOPS; o++)
+        free(total[o].lat);
+    goto end;
+
+ err:
+    ERR_print_errors_fp(stderr);
+    ret = 1;
+ end:
+    if (workers != NULL) {
+        for (i = 0; i < threads; i++)
+            for (o = 0; o < NOPS; o++)
+                free(workers[i].stats[o].lat);
+        free(workers);
+    }
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(key);
+    if (engine != NULL) {
+        ENGINE_finish(engine);
+        ENGINE_free(engine);
+    }
+    OPENSSL_free(uri);
+    return ret;
+}
@@ -0,0 +1,387 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Microbenchmarks of the engine's own work per operation.  The engine is
+ * linked in (src/libpkcs11.la) rather than loaded, so its internal steps
+ * can be timed one by one, and it is pointed at a module that answers
+ * immediately - by default the mock module with no latency and fake
+ * private key maths - so what is left is the engine's CPU time.  Every
+ * benchmark reports ns/op and the OpenSSL allocations (count and bytes)
+ * per operation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rsa.h>
+#include <openssl/store.h>
+#include "e_pkcs11.h"
+
+/* exported by the engine through IMPLEMENT_DYNAMIC_BIND_FN */
+int bind_engine(ENGINE *e, const char *id, const dynamic_fns *fns);
+
+typedef struct {
+    const char *name;
+    int (*run)(void);
+    int per_object;         /* divide the results by the store objects */
+} BENCH;
+
+static unsigned long long allocs = 0;
+static unsigned long long alloc_bytes = 0;
+
+static ENGINE *engine = NULL;
+static EVP_PKEY *pkey = NULL;
+static RSA *rsa = NULL;
+static PKCS11_CTX *ctx = NULL;
+static CK_SESSION_HANDLE session = 0;
+static CK_OBJECT_HANDLE key = 0;
+static const char *key_uri = "pkcs11:object=rsa0;type=private;pin-value=1234";
+static const char *store_uri = "pkcs11:type=cert";
+static char uri_buf[1024];
+static unsigned char digest[32];
+static int store_objects = 64;
+static int store_count = 0;
+
+/* the mock module shares our libcrypto, leave its allocations out */
+static void count(size_t num, const char *file)
+{
+    if (file != NULL && strstr(file, "pkcs11mock") != NULL)
+        return;
+    allocs++;
+    alloc_bytes += num;
+}
+
+static void *count_malloc(size_t num, const char *file, int line)
+{
+    count(num, file);
+    return malloc(num);
+}
+
+static void *count_realloc(void *addr, size_t num, const char *file,
+                           int line)
+{
+    count(num, file);
+    return realloc(addr, num);
+}
+
+static void count_free(void *addr, const char *file, int line)
+{
+    free(addr);
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* pkcs11_parse() tokenises its argument, give it a fresh copy every time */
+static const char *uri_copy(const char *uri)
+{
+    strncpy(uri_buf, uri, sizeof(uri_buf) - 1);
+    return uri_buf;
+}
+
+static int run_parse(void)
+{
+    return pkcs11_parse(ctx, uri_copy(key_uri), 0);
+}
+
+static int run_encode_pkcs1(void)
+{
+    unsigned char *out = NULL;
+    int len = 0, ok;
+
+    ok = pkcs11_rsa_encode_pkcs1(&out, &len, NID_sha256, digest,
+                                 sizeof(digest));
+    OPENSSL_free(out);
+    return ok;
+}
+
+static int run_get_slot(void)
+{
+    return pkcs11_get_slot(ctx);
+}
+
+static int run_find_private_key(void)
+{
+    return pkcs11_find_private_key(session, ctx) != 0;
+}
+
+static int run_load_pkey(void)
+{
+    EVP_PKEY *k = pkcs11_load_pkey(session, ctx, key);
+
+    EVP_PKEY_free(k);
+    return k != NULL;
+}
+
+static int run_rsa_sign(void)
+{
+    unsigned char sig[1024];
+    unsigned int siglen = sizeof(sig);
+
+    return RSA_sign(NID_sha256, digest, sizeof(digest), sig, &siglen, rsa);
+}
+
+static int run_store(void)
+{
+    OSSL_STORE_CTX *store;
+    OSSL_STORE_INFO *info;
+    int n = 0;
+
+    if ((store = OSSL_STORE_open(uri_copy(store_uri), NULL, NULL, NULL,
+                                 NULL)) == NULL)
+        return 0;
+    while (!OSSL_STORE_eof(store)) {
+        if ((info = OSSL_STORE_load(store)) == NULL)
+            break;
+        OSSL_STORE_INFO_free(info);
+        n++;
+    }
+    OSSL_STORE_close(store);
+    store_count = n;
+    return n > 0;
+}
+
+static const BENCH benches[] = {
+    { "parse", run_parse, 0 },
+    { "encode_pkcs1", run_encode_pkcs1, 0 },
+    { "get_slot", run_get_slot, 0 },
+    { "find_private_key", run_find_private_key, 0 },
+    { "load_pkey", run_load_pkey, 0 },
+    { "rsa_sign", run_rsa_sign, 0 },
+    { "store_per_object", run_store, 1 },
+};
+
+static int selected(const char *name, int argc, char **argv)
+{
+    int i;
+
+    if (optind >= argc)
+        return 1;
+    for (i = optind; i < argc; i++)
+        if (strcmp(argv[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * Run |b| in batches of growing size until a batch lasts |min_ns|, and
+ * report the figures of that batch.
+ */
+static int measure(const BENCH *b, unsigned long long min_ns,
+                   double *ns, double *nallocs, double *nbytes,
+                   unsigned long *iters)
+{
+    unsigned long n, i;
+    unsigned long long t0, t1, a0, b0;
+
+    for (n = 1;; n *= 2) {
+        a0 = allocs;
+        b0 = alloc_bytes;
+        t0 = now_ns();
+        for (i = 0; i < n; i++)
+            if (!b->run())
+                return 0;
+        t1 = now_ns();
+        if (t1 - t0 >= min_ns || n >= (1UL << 30))
+            break;
+    }
+    *ns = (double)(t1 - t0) / n;
+    *nallocs = (double)(allocs - a0) / n;
+    *nbytes = (double)(alloc_bytes - b0) / n;
+    *iters = n;
+    return 1;
+}
+
+static int engine_start(const char *module)
+{
+    dynamic_fns fns;
+    char *uri = NULL;
+    int ok = 0;
+
+    memset(&fns, 0, sizeof(fns));
+    fns.static_state = ENGINE_get_static_state();
+    if ((engine = ENGINE_new()) == NULL
+        || !bind_engine(engine, "pkcs11", &fns)
+        || (module != NULL
+            && !ENGINE_ctrl_cmd_string(engine, "MODULE_PATH", module, 0))
+        || !ENGINE_init(engine)
+        || !ENGINE_set_default(engine, ENGINE_METHOD_RSA)
+        || (uri = OPENSSL_strdup(key_uri)) == NULL
+        || (pkey = ENGINE_load_private_key(engine, uri, NULL, NULL)) == NULL
+        || (rsa = EVP_PKEY_get1_RSA(pkey)) == NULL)
+        goto end;
+
+    /*
+     * A session and key handle of our own for the step benchmarks; the
+     * token is already logged in by the key load.
+     */
+    ctx = pkcs11_get_ctx(rsa);
+    if (!pkcs11_parse(ctx, uri_copy(key_uri), 0)
+        || !pkcs11_get_slot(ctx)
+        || !pkcs11_start_session(ctx, &session)
+        || (key = pkcs11_find_private_key(session, ctx)) == 0)
+        goto end;
+    ok = 1;
+
+ end:
+    OPENSSL_free(uri);
+    return ok;
+}
+
+static void engine_stop(void)
+{
+    if (session != 0)
+        pkcs11_end_session(session);
+    session = 0;
+    RSA_free(rsa);
+    rsa = NULL;
+    EVP_PKEY_free(pkey);
+    pkey = NULL;
+    if (engine != NULL) {
+        ENGINE_finish(engine);
+        ENGINE_free(engine);
+    }
+    engine = NULL;
+}
+
+static void usage(const char *prog)
+{
+    size_t i;
+
+    fprintf(stderr,
+            "usage: %s [options] [benchmark...]\n"
+            "  -m path     PKCS#11 module, else $PKCS11_MODULE_PATH\n"
+            "  -k uri      private key (default: mock module key rsa0)\n"
+            "  -s uri      store URI (default: %s)\n"
+            "  -n n        objects in the mock store (64)\n"
+            "  -T ms       minimum time per benchmark (200)\n"
+            "  -f format   text, csv or json (default: text)\n"
+            "benchmarks:", prog, store_uri);
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+        fprintf(stderr, " %s", benches[i].name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *module = NULL, *format = "text";
+    double min_ms = 200, ns, nallocs, nbytes;
+    char conf[256];
+    unsigned long iters;
+    int c, first = 1, ret = 1;
+    size_t i;
+
+    /* before anything else allocates */
+    CRYPTO_set_mem_functions(count_malloc, count_realloc, count_free);
+
+    while ((c = getopt(argc, argv, "m:k:s:n:T:f:")) != -1) {
+        switch (c) {
+        case 'm':
+            module = optarg;
+            break;
+        case 'k':
+            key_uri = optarg;
+            break;
+        case 's':
+            store_uri = optarg;
+            break;
+        case 'n':
+            store_objects = atoi(optarg);
+            break;
+        case 'T':
+            min_ms = atof(optarg);
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (min_ms <= 0 || store_objects < 1
+        || (strcmp(format, "text") != 0 && strcmp(format, "csv") != 0
+            && strcmp(format, "json") != 0))
+        usage(argv[0]);
+
+    /*
+     * Zero-latency backend unless the mock is configured otherwise, with
+     * some certificates for the store listing.
+     */
+    BIO_snprintf(conf, sizeof(conf),
+                 "crypto=fake;key=label=rsa0,id=01,type=rsa,cert=yes;"
+                 "key=label=obj,id=20,type=ec,cert=yes,count=%d",
+                 store_objects);
+    setenv("PKCS11MOCK", conf, 0);
+    memset(digest, 0x5a, sizeof(digest));
+    if (!engine_start(module))
+        goto err;
+
+    if (strcmp(format, "json") == 0)
+        printf("[");
+    else if (strcmp(format, "csv") == 0)
+        printf("benchmark,iterations,ns_per_op,allocs_per_op,"
+               "bytes_per_op\n");
+    else
+        printf("%-18s %12s %12s %10s %10s\n", "benchmark", "iterations",
+               "ns/op", "allocs/op", "bytes/op");
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        const BENCH *b = &benches[i];
+
+        if (!selected(b->name, argc, argv))
+            continue;
+        if (!measure(b, (unsigned long long)(min_ms * 1e6), &ns, &nallocs,
+                     &nbytes, &iters))
+            goto err;
+        if (b->per_object) {
+            ns /= store_count;
+            nallocs /= store_count;
+            nbytes /= store_count;
+        }
+        if (strcmp(format, "json") == 0)
+            printf("%s{\"benchmark\":\"%s\",\"iterations\":%lu,"
+                   "\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,"
+                   "\"bytes_per_op\":%.1f}", first ? "" : ",", b->name,
+                   iters, ns, nallocs, nbytes);
+        else if (strcmp(format, "csv") == 0)
+            printf("%s,%lu,%.1f,%.2f,%.1f\n", b->name, iters, ns, nallocs,
+                   nbytes);
+        else
+            printf("%-18s %12lu %12.1f %10.2f %10.1f\n", b->name, iters, ns,
+                   nallocs, nbytes);
+        fflush(stdout);
+        first = 0;
+    }
+    if (strcmp(format, "json") == 0)
+        printf("]\n");
+    ret = 0;
+    goto end;
+
+ err:
+    fprintf(stderr, "benchmark failed\n");
+    ERR_print_errors_fp(stderr);
+ end:
+    engine_stop();
+    return ret;
+}
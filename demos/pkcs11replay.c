@@ -0,0 +1,465 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Replays a PKCS#11 call trace recorded with the engine TRACE_FILE ctrl
+ * (or PKCS11_TRACE_FILE).  Every recorded thread becomes a thread that
+ * issues the same engine operations (key loads, RSA signatures and
+ * decryptions, store listings) at the recorded offsets, and when the
+ * module is the mock module every PKCS#11 call is scripted to take the
+ * recorded time and return the recorded result.  The report compares the
+ * recorded and replayed operation latencies.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/store.h>
+#include "e_pkcs11_rec.h"
+#include "pkcs11mock.h"
+
+static const char *func_names[] = {
+#define CK_PKCS11_FUNCTION_INFO(name) #name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+};
+
+static const char *op_names[] = {
+    "other", "load_key", "sign", "decrypt", "store"
+};
+#define NOPS (sizeof(op_names) / sizeof(op_names[0]))
+
+typedef struct {
+    unsigned long long start;   /* us since the trace start */
+    unsigned long long recorded;
+    unsigned long long replayed;
+    long long lag;
+    unsigned int op;
+    int recorded_ok;
+    int replayed_ok;
+    PKCS11_REC *calls;
+    size_t ncalls;
+} OP;
+
+typedef struct {
+    unsigned int id;
+    OP *ops;
+    size_t nops;
+    pthread_t tid;
+} THREAD;
+
+static ENGINE *engine = NULL;
+static EVP_PKEY *key = NULL;
+static unsigned char ciphertext[1024];
+static size_t ciphertext_len = 0;
+static const char *key_uri = "pkcs11:object=rsa0;type=private;pin-value=1234";
+static const char *store_uri = "pkcs11:type=cert";
+static double speed = 1.0;
+static int script = 1;
+static unsigned long long epoch;
+static PKCS11MOCK_SCRIPT_CALL_FN script_call = NULL;
+static PKCS11MOCK_SCRIPT_CLEAR_FN script_clear = NULL;
+
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long get_le(const unsigned char *p, int n)
+{
+    unsigned long long v = 0;
+
+    while (n-- > 0)
+        v = (v << 8) | p[n];
+    return v;
+}
+
+static PKCS11_REC *read_trace(const char *path, size_t *count)
+{
+    FILE *fp;
+    unsigned char buf[64];
+    PKCS11_REC *recs = NULL, *tmp;
+    size_t n = 0, size, recsize;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        perror(path);
+        return NULL;
+    }
+    if (fread(buf, 1, PKCS11_REC_HEADER_SIZE, fp) != PKCS11_REC_HEADER_SIZE
+        || memcmp(buf, PKCS11_REC_MAGIC, 4) != 0
+        || get_le(buf + 4, 2) != PKCS11_REC_VERSION
+        || (recsize = get_le(buf + 6, 2)) < PKCS11_REC_RECORD_SIZE
+        || recsize > sizeof(buf)) {
+        fprintf(stderr, "%s: not a PKCS#11 trace\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    for (size = 0; fread(buf, 1, recsize, fp) == recsize; n++) {
+        if (n == size) {
+            size = size ? size * 2 : 1024;
+            if ((tmp = realloc(recs, size * sizeof(*recs))) == NULL)
+                break;
+            recs = tmp;
+        }
+        recs[n].start = get_le(buf, 8);
+        recs[n].duration = get_le(buf + 8, 4);
+        recs[n].rv = get_le(buf + 12, 4);
+        recs[n].thread = get_le(buf + 16, 2);
+        recs[n].session = get_le(buf + 18, 2);
+        recs[n].func = buf[20];
+        recs[n].op = buf[21];
+        recs[n].flags = buf[22];
+    }
+    fclose(fp);
+    *count = n;
+    return recs;
+}
+
+/* Splits the trace into per-thread lists of engine operations */
+static THREAD *split_trace(PKCS11_REC *recs, size_t n, size_t *nthreads)
+{
+    THREAD *threads = NULL, *t;
+    OP *op;
+    size_t i, j, nt = 0;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < nt && threads[j].id != recs[i].thread; j++)
+            continue;
+        if (j == nt) {
+            threads = realloc(threads, (nt + 1) * sizeof(*threads));
+            memset(&threads[nt], 0, sizeof(*threads));
+            threads[nt++].id = recs[i].thread;
+        }
+        t = &threads[j];
+        if (t->nops == 0 || (recs[i].flags & PKCS11_REC_FLAG_FIRST)
+            || recs[i].op != t->ops[t->nops - 1].op) {
+            t->ops = realloc(t->ops, (t->nops + 1) * sizeof(*t->ops));
+            op = &t->ops[t->nops++];
+            memset(op, 0, sizeof(*op));
+            op->start = recs[i].start;
+            op->op = recs[i].op < NOPS ? recs[i].op : PKCS11_REC_OP_NONE;
+            op->recorded_ok = 1;
+        }
+        op = &t->ops[t->nops - 1];
+        op->calls = realloc(op->calls, (op->ncalls + 1) * sizeof(*op->calls));
+        op->calls[op->ncalls++] = recs[i];
+        op->recorded = recs[i].start + recs[i].duration - op->start;
+        if (recs[i].rv != 0)
+            op->recorded_ok = 0;
+    }
+    *nthreads = nt;
+    return threads;
+}
+
+static int do_sign(void)
+{
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+    unsigned char md[32], sig[1024];
+    size_t siglen = sizeof(sig);
+    int ok;
+
+    memset(md, 0x5a, sizeof(md));
+    ok = ctx != NULL && EVP_PKEY_sign_init(ctx) > 0
+         && EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) > 0
+         && EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) > 0
+         && EVP_PKEY_sign(ctx, sig, &siglen, md, sizeof(md)) > 0;
+    EVP_PKEY_CTX_free(ctx);
+    return ok;
+}
+
+static int do_decrypt(void)
+{
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+    unsigned char out[1024];
+    size_t outlen = sizeof(out);
+    int ok;
+
+    ok = ctx != NULL && EVP_PKEY_decrypt_init(ctx) > 0
+         && EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) > 0
+         && EVP_PKEY_decrypt(ctx, out, &outlen, ciphertext,
+                             ciphertext_len) > 0;
+    EVP_PKEY_CTX_free(ctx);
+    return ok;
+}
+
+/* the engine tokenises the URI in place, so hand it a private copy */
+static EVP_PKEY *load_key(void)
+{
+    char *uri = OPENSSL_strdup(key_uri);
+    EVP_PKEY *k = NULL;
+
+    if (uri != NULL)
+        k = ENGINE_load_private_key(engine, uri, NULL, NULL);
+    OPENSSL_free(uri);
+    return k;
+}
+
+static int do_load_key(void)
+{
+    EVP_PKEY *k = load_key();
+
+    EVP_PKEY_free(k);
+    return k != NULL;
+}
+
+static int do_store(void)
+{
+    OSSL_STORE_CTX *store;
+    OSSL_STORE_INFO *info;
+    char *uri;
+    int n = 0;
+
+    if ((uri = OPENSSL_strdup(store_uri)) == NULL)
+        return 0;
+    store = OSSL_STORE_open(uri, NULL, NULL, NULL, NULL);
+    OPENSSL_free(uri);
+    if (store == NULL)
+        return 0;
+    while (!OSSL_STORE_eof(store)) {
+        if ((info = OSSL_STORE_load(store)) == NULL)
+            break;
+        OSSL_STORE_INFO_free(info);
+        n++;
+    }
+    OSSL_STORE_close(store);
+    return n > 0;
+}
+
+static void sleep_until(unsigned long long t)
+{
+    unsigned long long now = now_us();
+    struct timespec ts;
+
+    if (t <= now)
+        return;
+    ts.tv_sec = (t - now) / 1000000;
+    ts.tv_nsec = ((t - now) % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        continue;
+}
+
+static void *replay_thread(void *arg)
+{
+    THREAD *t = arg;
+    unsigned long long target, begin;
+    size_t i, j;
+    OP *op;
+
+    for (i = 0; i < t->nops; i++) {
+        op = &t->ops[i];
+        target = epoch + (unsigned long long)(op->start / speed);
+        sleep_until(target);
+        if (script_call != NULL) {
+            for (j = 0; j < op->ncalls; j++)
+                script_call(func_names[op->calls[j].func],
+                            op->calls[j].duration, op->calls[j].rv);
+        }
+        begin = now_us();
+        op->lag = (long long)(begin - target);
+        switch (op->op) {
+        case PKCS11_REC_OP_SIGN:
+            op->replayed_ok = do_sign();
+            break;
+        case PKCS11_REC_OP_DECRYPT:
+            op->replayed_ok = do_decrypt();
+            break;
+        case PKCS11_REC_OP_LOAD_KEY:
+            op->replayed_ok = do_load_key();
+            break;
+        case PKCS11_REC_OP_STORE:
+            op->replayed_ok = do_store();
+            break;
+        default:
+            op->replayed_ok = 1;
+            break;
+        }
+        op->replayed = now_us() - begin;
+        if (script_clear != NULL)
+            script_clear();
+        ERR_clear_error();
+    }
+    return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long pct(unsigned long long *v, size_t n, double p)
+{
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+
+    return n == 0 ? 0 : v[i];
+}
+
+static void report(THREAD *threads, size_t nthreads, double wall)
+{
+    unsigned long long *rec, *rep;
+    size_t i, j, k, n, rec_err, rep_err;
+    double lag;
+
+    printf("%-9s %7s %7s %7s %9s %9s %9s %9s %9s\n", "op", "count",
+           "rec_err", "rep_err", "rec_p50", "rep_p50", "rec_p99", "rep_p99",
+           "lag_avg");
+    for (k = 0; k < NOPS; k++) {
+        for (n = i = 0; i < nthreads; i++)
+            for (j = 0; j < threads[i].nops; j++)
+                n += threads[i].ops[j].op == k;
+        if (n == 0)
+            continue;
+        rec = malloc(n * sizeof(*rec));
+        rep = malloc(n * sizeof(*rep));
+        rec_err = rep_err = 0;
+        lag = 0;
+        for (n = i = 0; i < nthreads; i++) {
+            for (j = 0; j < threads[i].nops; j++) {
+                OP *op = &threads[i].ops[j];
+
+                if (op->op != k)
+                    continue;
+                rec[n] = op->recorded;
+                rep[n++] = op->replayed;
+                rec_err += !op->recorded_ok;
+                rep_err += !op->replayed_ok;
+                lag += op->lag;
+            }
+        }
+        qsort(rec, n, sizeof(*rec), cmp_ull);
+        qsort(rep, n, sizeof(*rep), cmp_ull);
+        printf("%-9s %7zu %7zu %7zu %9llu %9llu %9llu %9llu %9.0f\n",
+               op_names[k], n, rec_err, rep_err, pct(rec, n, 0.5),
+               pct(rep, n, 0.5), pct(rec, n, 0.99), pct(rep, n, 0.99),
+               lag / n);
+        free(rec);
+        free(rep);
+    }
+    printf("latencies in us, %zu threads, replayed in %.3f s\n", nthreads,
+           wall);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] trace\n"
+            "  -m module   PKCS#11 module (default $PKCS11_MODULE_PATH)\n"
+            "  -k uri      private key used for sign/decrypt/load_key\n"
+            "  -s uri      store URI used for store operations\n"
+            "  -x speed    replay speed factor (default 1.0)\n"
+            "  -n          do not script per-call latencies and results\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    PKCS11_REC *recs;
+    THREAD *threads;
+    EVP_PKEY_CTX *ctx = NULL;
+    unsigned char pt[32];
+    void *handle;
+    size_t n, nthreads, i;
+    unsigned long long t0;
+    int c, ret = 1;
+
+    while ((c = getopt(argc, argv, "m:k:s:x:n")) != -1) {
+        switch (c) {
+        case 'm':
+            module = optarg;
+            break;
+        case 'k':
+            key_uri = optarg;
+            break;
+        case 's':
+            store_uri = optarg;
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'n':
+            script = 0;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || module == NULL || speed <= 0)
+        usage(argv[0]);
+
+    if ((recs = read_trace(argv[optind], &n)) == NULL)
+        return 1;
+    threads = split_trace(recs, n, &nthreads);
+    fprintf(stderr, "%zu calls from %zu threads\n", n, nthreads);
+
+    if ((engine = ENGINE_by_id("pkcs11")) == NULL
+        || !ENGINE_ctrl_cmd_string(engine, "MODULE_PATH", module, 0)
+        || !ENGINE_set_default(engine, ENGINE_METHOD_RSA)
+        || !ENGINE_init(engine))
+        goto err;
+    if ((key = load_key()) == NULL)
+        goto err;
+
+    /* ciphertext for the decrypt operations, made with the public half */
+    memset(pt, 0x5a, sizeof(pt));
+    ciphertext_len = sizeof(ciphertext);
+    if ((ctx = EVP_PKEY_CTX_new(key, NULL)) == NULL
+        || EVP_PKEY_encrypt_init(ctx) <= 0
+        || EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0
+        || EVP_PKEY_encrypt(ctx, ciphertext, &ciphertext_len, pt,
+                            sizeof(pt)) <= 0)
+        goto err;
+
+    /* the engine loaded the module already, this only finds it */
+    if (script && (handle = dlopen(module, RTLD_NOW | RTLD_NOLOAD)) != NULL) {
+        script_call = (PKCS11MOCK_SCRIPT_CALL_FN)
+            dlsym(handle, "pkcs11mock_script_call");
+        script_clear = (PKCS11MOCK_SCRIPT_CLEAR_FN)
+            dlsym(handle, "pkcs11mock_script_clear");
+        if (script_call == NULL || script_clear == NULL)
+            script_call = NULL, script_clear = NULL;
+    }
+    if (script && script_call == NULL)
+        fprintf(stderr, "not a mock module, per-call timings not replayed\n");
+
+    epoch = t0 = now_us() + 10000;
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i].tid, NULL, replay_thread, &threads[i]);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i].tid, NULL);
+
+    report(threads, nthreads, (now_us() - t0) / 1e6);
+    ret = 0;
+
+ err:
+    if (ret)
+        ERR_print_errors_fp(stderr);
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(key);
+    ENGINE_finish(engine);
+    ENGINE_free(engine);
+    free(recs);
+    return ret;
+}
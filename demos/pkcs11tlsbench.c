@@ -0,0 +1,433 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * TLS handshake benchmark.  A server SSL_CTX holding the token key and N
+ * threads, each running full handshakes (no session resumption) between a
+ * fresh client and server SSL connected by an in-memory BIO pair, so the
+ * engine is driven exactly as a TLS server drives it, without a network.
+ * Reports handshakes per second and handshake latency percentiles for
+ * TLS 1.2 and/or TLS 1.3, optionally with SSL_MODE_ASYNC on the server.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/store.h>
+#include <openssl/x509.h>
+
+typedef struct {
+    pthread_t tid;
+    unsigned long long *lat;    /* ns */
+    size_t nlat, size;
+    unsigned long errors;
+    unsigned long async_waits;
+} WORKER;
+
+static SSL_CTX *server_ctx = NULL;
+static SSL_CTX *client_ctx = NULL;
+static unsigned long long measure_start;
+static volatile int stop = 0;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static X509 *load_cert(const char *uri)
+{
+    OSSL_STORE_CTX *store;
+    OSSL_STORE_INFO *info;
+    X509 *cert = NULL;
+    char *copy;
+    FILE *fp;
+
+    if (strncmp(uri, "pkcs11:", 7) != 0) {
+        if ((fp = fopen(uri, "r")) == NULL) {
+            perror(uri);
+            return NULL;
+        }
+        cert = PEM_read_X509(fp, NULL, NULL, NULL);
+        fclose(fp);
+        return cert;
+    }
+
+    /* the engine tokenises the URI in place */
+    if ((copy = OPENSSL_strdup(uri)) == NULL)
+        return NULL;
+    store = OSSL_STORE_open(copy, NULL, NULL, NULL, NULL);
+    OPENSSL_free(copy);
+    if (store == NULL)
+        return NULL;
+    while (cert == NULL && !OSSL_STORE_eof(store)) {
+        if ((info = OSSL_STORE_load(store)) == NULL)
+            break;
+        if (OSSL_STORE_INFO_get_type(info) == OSSL_STORE_INFO_CERT)
+            cert = OSSL_STORE_INFO_get1_CERT(info);
+        OSSL_STORE_INFO_free(info);
+    }
+    OSSL_STORE_close(store);
+    return cert;
+}
+
+static int retry(SSL *ssl, int r, WORKER *w)
+{
+    switch (SSL_get_error(ssl, r)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return 1;
+    case SSL_ERROR_WANT_ASYNC:
+    case SSL_ERROR_WANT_ASYNC_JOB:
+        w->async_waits++;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Run one handshake to completion, alternating between both ends until
+ * neither has anything left to do.
+ */
+static int handshake(WORKER *w)
+{
+    SSL *client = NULL, *server = NULL;
+    BIO *cbio = NULL, *sbio = NULL;
+    int cdone = 0, sdone = 0, r, i, ok = 0;
+
+    if ((client = SSL_new(client_ctx)) == NULL
+        || (server = SSL_new(server_ctx)) == NULL
+        || !BIO_new_bio_pair(&cbio, 0, &sbio, 0))
+        goto end;
+    SSL_set_bio(client, cbio, cbio);
+    SSL_set_bio(server, sbio, sbio);
+    SSL_set_connect_state(client);
+    SSL_set_accept_state(server);
+
+    for (i = 0; i < 10000 && !(cdone && sdone); i++) {
+        if (!cdone) {
+            if ((r = SSL_do_handshake(client)) == 1)
+                cdone = 1;
+            else if (!retry(client, r, w))
+                goto end;
+        }
+        if (!sdone) {
+            if ((r = SSL_do_handshake(server)) == 1)
+                sdone = 1;
+            else if (!retry(server, r, w))
+                goto end;
+        }
+    }
+    ok = cdone && sdone;
+
+ end:
+    SSL_free(client);
+    SSL_free(server);
+    return ok;
+}
+
+static void *worker(void *arg)
+{
+    WORKER *w = arg;
+    unsigned long long start, *tmp;
+    size_t size;
+    int ok;
+
+    while (!stop) {
+        start = now_ns();
+        ok = handshake(w);
+        if (start < measure_start || stop) {
+            ERR_clear_error();
+            continue;
+        }
+        if (!ok) {
+            if (w->errors++ == 0)
+                ERR_print_errors_fp(stderr);
+            ERR_clear_error();
+            continue;
+        }
+        if (w->nlat == w->size) {
+            size = w->size ? w->size * 2 : 1024;
+            if ((tmp = realloc(w->lat, size * sizeof(*tmp))) == NULL)
+                break;
+            w->lat = tmp;
+            w->size = size;
+        }
+        w->lat[w->nlat++] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const unsigned long long *lat, size_t n, double q)
+{
+    size_t i;
+
+    if (n == 0)
+        return 0;
+    i = (size_t)(q * n + 0.999999);
+    if (i > 0)
+        i--;
+    if (i >= n)
+        i = n - 1;
+    return lat[i] / 1e3;
+}
+
+static int setup(int version, int async, X509 *cert, EVP_PKEY *key)
+{
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+    server_ctx = SSL_CTX_new(TLS_server_method());
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    if (server_ctx == NULL || client_ctx == NULL
+        || !SSL_CTX_set_min_proto_version(server_ctx, version)
+        || !SSL_CTX_set_max_proto_version(server_ctx, version)
+        || !SSL_CTX_set_min_proto_version(client_ctx, version)
+        || !SSL_CTX_set_max_proto_version(client_ctx, version)
+        || !SSL_CTX_use_certificate(server_ctx, cert)
+        || !SSL_CTX_use_PrivateKey(server_ctx, key))
+        return 0;
+
+    /* every handshake is a full one */
+    SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_num_tickets(server_ctx, 0);
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+    if (async)
+        SSL_CTX_set_mode(server_ctx, SSL_MODE_ASYNC);
+    return 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -k uri      server private key (default: mock module key rsa0)\n"
+            "  -c cert     certificate, pkcs11: URI or PEM file\n"
+            "              (default: the certificate of rsa0)\n"
+            "  -m path     PKCS#11 module, else $PKCS11_MODULE_PATH\n"
+            "  -v version  1.2, 1.3 or all (default: all)\n"
+            "  -t n        threads (1)\n"
+            "  -a          SSL_MODE_ASYNC on the server\n"
+            "  -d secs     measured duration per version (10)\n"
+            "  -W secs     warm-up before measuring (1)\n"
+            "  -f format   text, csv or json (default: text)\n"
+            "  -H          omit the CSV header line\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        int version;
+    } versions[] = {
+        { "1.2", TLS1_2_VERSION },
+        { "1.3", TLS1_3_VERSION },
+    };
+    const char *key_uri = "pkcs11:object=rsa0;type=private;pin-value=1234";
+    const char *cert_uri = "pkcs11:object=rsa0;type=cert";
+    const char *module = NULL, *format = "text", *version = "all";
+    int threads = 1, async = 0, header = 1, c, i, first = 1, ret = 1;
+    double duration = 10, warmup = 1, elapsed, n;
+    unsigned long long t0, t1, *lat = NULL, *tmp;
+    unsigned long errors, waits;
+    size_t v, nlat;
+    ENGINE *engine = NULL;
+    EVP_PKEY *key = NULL;
+    X509 *cert = NULL;
+    WORKER *workers = NULL;
+    struct timespec ts;
+    char *uri = NULL;
+
+    while ((c = getopt(argc, argv, "k:c:m:v:t:ad:W:f:H")) != -1) {
+        switch (c) {
+        case 'k':
+            key_uri = optarg;
+            break;
+        case 'c':
+            cert_uri = optarg;
+            break;
+        case 'm':
+            module = optarg;
+            break;
+        case 'v':
+            version = optarg;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'a':
+            async = 1;
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'W':
+            warmup = atof(optarg);
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'H':
+            header = 0;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (threads < 1 || duration <= 0 || warmup < 0
+        || (strcmp(version, "all") != 0 && strcmp(version, "1.2") != 0
+            && strcmp(version, "1.3") != 0)
+        || (strcmp(format, "text") != 0 && strcmp(format, "csv") != 0
+            && strcmp(format, "json") != 0))
+        usage(argv[0]);
+
+    if ((uri = OPENSSL_strdup(key_uri)) == NULL
+        || (engine = ENGINE_by_id("pkcs11")) == NULL
+        || (module != NULL
+            && !ENGINE_ctrl_cmd_string(engine, "MODULE_PATH", module, 0))
+        || !ENGINE_set_default(engine, ENGINE_METHOD_RSA)
+        || !ENGINE_init(engine)
+        || (key = ENGINE_load_private_key(engine, uri, NULL, NULL)) == NULL
+        || (cert = load_cert(cert_uri)) == NULL
+        || (workers = calloc(threads, sizeof(*workers))) == NULL)
+        goto err;
+
+    if (strcmp(format, "json") == 0)
+        printf("{\"threads\":%d,\"async\":%s,\"results\":[", threads,
+               async ? "true" : "false");
+    else if (strcmp(format, "csv") == 0 && header)
+        printf("version,threads,async,duration_s,handshakes,hs_per_s,"
+               "p50_us,p99_us,p999_us,errors,async_waits\n");
+    else if (strcmp(format, "text") == 0)
+        printf("%-8s %10s %10s %10s %10s %10s %8s %8s\n", "version",
+               "handshakes", "hs/s", "p50_us", "p99_us", "p99.9_us",
+               "errors", "waits");
+
+    for (v = 0; v < sizeof(versions) / sizeof(versions[0]); v++) {
+        if (strcmp(version, "all") != 0
+            && strcmp(version, versions[v].name) != 0)
+            continue;
+        if (!setup(versions[v].version, async, cert, key))
+            goto err;
+
+        memset(workers, 0, threads * sizeof(*workers));
+        stop = 0;
+        measure_start = now_ns() + (unsigned long long)(warmup * 1e9);
+        for (i = 0; i < threads; i++) {
+            if (pthread_create(&workers[i].tid, NULL, worker,
+                               &workers[i]) != 0) {
+                fprintf(stderr, "cannot start thread %d\n", i);
+                stop = 1;
+                while (--i >= 0)
+                    pthread_join(workers[i].tid, NULL);
+                goto end;
+            }
+        }
+        ts.tv_sec = (time_t)warmup;
+        ts.tv_nsec = (long)((warmup - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+        t0 = now_ns();
+        ts.tv_sec = (time_t)duration;
+        ts.tv_nsec = (long)((duration - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+        stop = 1;
+        t1 = now_ns();
+
+        nlat = 0;
+        errors = waits = 0;
+        for (i = 0; i < threads; i++) {
+            pthread_join(workers[i].tid, NULL);
+            errors += workers[i].errors;
+            waits += workers[i].async_waits;
+            if (workers[i].nlat > 0) {
+                tmp = realloc(lat, (nlat + workers[i].nlat) * sizeof(*lat));
+                if (tmp == NULL)
+                    goto err;
+                lat = tmp;
+                memcpy(lat + nlat, workers[i].lat,
+                       workers[i].nlat * sizeof(*lat));
+                nlat += workers[i].nlat;
+            }
+            free(workers[i].lat);
+            workers[i].lat = NULL;
+        }
+        qsort(lat, nlat, sizeof(*lat), cmp_ull);
+        elapsed = (t1 - t0) / 1e9;
+        n = nlat;
+
+        if (strcmp(format, "json") == 0)
+            printf("%s{\"version\":\"TLSv%s\",\"duration\":%.3f,"
+                   "\"handshakes\":%.0f,\"hs_per_s\":%.1f,\"p50_us\":%.1f,"
+                   "\"p99_us\":%.1f,\"p999_us\":%.1f,\"errors\":%lu,"
+                   "\"async_waits\":%lu}", first ? "" : ",",
+                   versions[v].name, elapsed, n, n / elapsed,
+                   percentile(lat, nlat, 0.5), percentile(lat, nlat, 0.99),
+                   percentile(lat, nlat, 0.999), errors, waits);
+        else if (strcmp(format, "csv") == 0)
+            printf("TLSv%s,%d,%d,%.3f,%.0f,%.1f,%.1f,%.1f,%.1f,%lu,%lu\n",
+                   versions[v].name, threads, async, elapsed, n, n / elapsed,
+                   percentile(lat, nlat, 0.5), percentile(lat, nlat, 0.99),
+                   percentile(lat, nlat, 0.999), errors, waits);
+        else
+            printf("TLSv%-4s %10.0f %10.1f %10.1f %10.1f %10.1f %8lu %8lu\n",
+                   versions[v].name, n, n / elapsed,
+                   percentile(lat, nlat, 0.5), percentile(lat, nlat, 0.99),
+                   percentile(lat, nlat, 0.999), errors, waits);
+        fflush(stdout);
+        first = 0;
+    }
+    if (strcmp(format, "json") == 0)
+        printf("]}\n");
+    else if (strcmp(format, "text") == 0)
+        printf("%d threads%s, %.3f s measured per version\n", threads,
+               async ? ", SSL_MODE_ASYNC" : "", duration);
+    ret = 0;
+    goto end;
+
+ err:
+    ERR_print_errors_fp(stderr);
+ end:
+    if (workers != NULL) {
+        for (i = 0; i < threads; i++)
+            free(workers[i].lat);
+        free(workers);
+    }
+    free(lat);
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    if (engine != NULL) {
+        ENGINE_finish(engine);
+        ENGINE_free(engine);
+    }
+    OPENSSL_free(uri);
+    return ret;
+}
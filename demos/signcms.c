@@ -8,30 +8,676 @@
  * https://www.openssl.org/source/license.html
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <openssl/pem.h>
 #include <openssl/cms.h>
 #include <openssl/err.h>
 #include <openssl/store.h>
 #include <openssl/engine.h>
 
-int main(int argc, char **argv)
+#define MAX_SIGNERS     8
+
+typedef struct {
+    X509 *cert;
+    EVP_PKEY *key;
+} SIGNER;
+
+/*
+ * Batch mode: the signer certificate and key are loaded once and the
+ * inputs are shared out to a pool of threads, each of which hashes a
+ * file, has the engine sign it (on a session of the engine's pool) and
+ * writes the result, so files are read, signed and written in parallel.
+ */
+typedef struct {
+    char **paths;
+    size_t npaths;
+    size_t size;
+    size_t next;
+    pthread_mutex_t lock;
+    const char *outdir;
+    const SIGNER *signers;
+    int nsigners;
+    const EVP_MD *md;
+    int flags;
+    int stream;
+    unsigned long done;
+    unsigned long failed;
+    unsigned long long bytes;
+} BATCH;
+
+typedef struct {
+    pthread_t tid;
+    CMS_SignerInfo *si;
+    int ok;
+} SIGN_JOB;
+
+static void *sign_job(void *arg)
+{
+    SIGN_JOB *job = arg;
+
+    if (!(job->ok = CMS_SignerInfo_sign(job->si)))
+        ERR_print_errors_fp(stderr);
+    return NULL;
+}
+
+/*
+ * Add every signer to |cms| for content whose digest is |dgst|, computed
+ * once for all of them, and sign the SignerInfos at the same time: the
+ * engine gives each signature a session of its own, so n signatures take
+ * about as long as one.
+ */
+static int add_signers(CMS_ContentInfo *cms, const SIGNER *signers,
+                       int nsigners, const EVP_MD *md,
+                       const unsigned char *dgst, unsigned int dlen,
+                       int flags)
+{
+    SIGN_JOB jobs[MAX_SIGNERS];
+    CMS_SignerInfo *si;
+    int i, n, ok = 1;
+
+    for (i = 0; i < nsigners; i++) {
+        si = CMS_add1_signer(cms, signers[i].cert, signers[i].key, md,
+                             flags);
+        /* what CMS_final() would add from the content */
+        if (si == NULL
+            || !CMS_signed_add1_attr_by_NID(si, NID_pkcs9_messageDigest,
+                                            V_ASN1_OCTET_STRING, dgst, dlen)
+            || !CMS_signed_add1_attr_by_NID(si, NID_pkcs9_contentType,
+                                            V_ASN1_OBJECT,
+                                            OBJ_nid2obj(NID_pkcs7_data), -1))
+            return 0;
+        jobs[i].si = si;
+        jobs[i].ok = 0;
+    }
+
+    /* the first one on this thread */
+    for (n = 1; n < nsigners; n++)
+        if (pthread_create(&jobs[n].tid, NULL, sign_job, &jobs[n]) != 0)
+            break;
+    sign_job(&jobs[0]);
+    for (i = 1; i < n; i++)
+        pthread_join(jobs[i].tid, NULL);
+    for (i = n; i < nsigners; i++)
+        sign_job(&jobs[i]);
+
+    for (i = 0; i < nsigners; i++)
+        ok &= jobs[i].ok;
+    return ok;
+}
+
+/* the whole content, for a signature that embeds it */
+static unsigned char *read_file(const char *path, size_t *len)
+{
+    unsigned char *data = NULL;
+    struct stat st;
+    FILE *f;
+
+    if ((f = fopen(path, "rb")) == NULL)
+        return NULL;
+    if (fstat(fileno(f), &st) == 0
+        && (data = malloc(st.st_size > 0 ? st.st_size : 1)) != NULL
+        && fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+        free(data);
+        data = NULL;
+    }
+    *len = st.st_size;
+    fclose(f);
+    return data;
+}
+
+static int sign_file_one(const char *inpath, const char *outpath,
+                         X509 *signer, EVP_PKEY *key, const EVP_MD *md,
+                         int flags)
 {
     BIO *in = NULL, *out = NULL;
-    X509 *signer = NULL;
-    EVP_PKEY *key = NULL;
     CMS_ContentInfo *cms = NULL;
+    int ret = 0;
+
+    /* no output for an input that cannot be read */
+    if ((in = BIO_new_file(inpath, "rb")) == NULL
+        || (out = BIO_new_file(outpath, "wb")) == NULL)
+        goto err;
+
+    cms = CMS_sign(NULL, NULL, NULL, in, flags);
+    if (cms == NULL)
+        goto err;
+
+    if (CMS_add1_signer(cms, signer, key, md, flags) == NULL)
+        goto err;
+
+    if (!CMS_final(cms, in, NULL, flags))
+        goto err;
+
+    /* Write out ASN1 */
+    if (!i2d_CMS_bio(out, cms))
+        goto err;
+
+    ret = 1;
+
+ err:
+    CMS_ContentInfo_free(cms);
+    BIO_free(in);
+    BIO_free(out);
+    return ret;
+}
+
+/*
+ * Streaming mode, for inputs of any size in constant memory.  A reader
+ * thread fills a ring of aligned chunks with pread() while the calling
+ * thread hashes the chunks already read, and the signature is detached:
+ * the content is not copied into the CMS structure, only its digest
+ * goes into the signed attributes, and the engine signs their DigestInfo.
+ */
+#define STREAM_CHUNK    (8 << 20)
+#define STREAM_BUFS     4
+#define STREAM_ALIGN    4096
+
+typedef struct {
+    int fd;
+    unsigned char *buf[STREAM_BUFS];
+    size_t len[STREAM_BUFS];
+    unsigned long read;         /* chunks filled */
+    unsigned long hashed;       /* chunks hashed */
+    int eof;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} STREAM;
+
+static void *stream_reader(void *arg)
+{
+    STREAM *s = arg;
+    unsigned char *buf;
+    off_t off = 0;
+    size_t len;
+    ssize_t n;
+    int slot, error = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (s->read - s->hashed == STREAM_BUFS && !s->error)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (s->error) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        slot = s->read % STREAM_BUFS;
+        pthread_mutex_unlock(&s->lock);
+
+        /* a whole chunk unless the file ends */
+        buf = s->buf[slot];
+        for (len = 0; len < STREAM_CHUNK; len += n) {
+            n = pread(s->fd, buf + len, STREAM_CHUNK - len, off + len);
+            if (n <= 0) {
+                error = n < 0;
+                break;
+            }
+        }
+        off += len;
+
+        pthread_mutex_lock(&s->lock);
+        s->len[slot] = len;
+        s->read++;
+        s->eof = len < STREAM_CHUNK;
+        s->error = error;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        if (len < STREAM_CHUNK)
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * Read |inpath| through the ring and pass every chunk to each of |mctx|,
+ * with EVP_DigestSignUpdate() if |sign| and EVP_DigestUpdate() otherwise,
+ * while the reader thread fills the next chunks.
+ */
+static int stream_update(const char *inpath, EVP_MD_CTX **mctx, int n,
+                         int sign)
+{
+    STREAM s;
+    pthread_t reader;
+    int i, slot, ok = 0, started = 0;
+
+    memset(&s, 0, sizeof(s));
+    if ((s.fd = open(inpath, O_RDONLY)) < 0)
+        return 0;
+    posix_fadvise(s.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    for (i = 0; i < STREAM_BUFS; i++)
+        if (posix_memalign((void **)&s.buf[i], STREAM_ALIGN,
+                           STREAM_CHUNK) != 0)
+            goto end;
+    if (pthread_create(&reader, NULL, stream_reader, &s) != 0)
+        goto end;
+    started = 1;
+
+    for (;;) {
+        pthread_mutex_lock(&s.lock);
+        while (s.hashed == s.read && !s.eof && !s.error)
+            pthread_cond_wait(&s.cond, &s.lock);
+        if (s.error || s.hashed == s.read) {
+            ok = !s.error;
+            pthread_mutex_unlock(&s.lock);
+            break;
+        }
+        slot = s.hashed % STREAM_BUFS;
+        pthread_mutex_unlock(&s.lock);
+
+        for (i = 0; i < n; i++)
+            if ((sign ? EVP_DigestSignUpdate(mctx[i], s.buf[slot],
+                                             s.len[slot])
+                      : EVP_DigestUpdate(mctx[i], s.buf[slot],
+                                         s.len[slot])) <= 0)
+                break;
+
+        pthread_mutex_lock(&s.lock);
+        s.hashed++;
+        if (i < n)
+            s.error = 1;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+    }
+
+ end:
+    if (started)
+        pthread_join(reader, NULL);
+    for (i = 0; i < STREAM_BUFS; i++)
+        free(s.buf[i]);
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+    close(s.fd);
+    return ok;
+}
+
+static int stream_digest(const char *inpath, const EVP_MD *md,
+                         unsigned char *dgst, unsigned int *dlen)
+{
+    EVP_MD_CTX *mctx;
+    int ok;
+
+    ok = (mctx = EVP_MD_CTX_new()) != NULL
+         && EVP_DigestInit_ex(mctx, md, NULL)
+         && stream_update(inpath, &mctx, 1, 0)
+         && EVP_DigestFinal_ex(mctx, dgst, dlen);
+    EVP_MD_CTX_free(mctx);
+    return ok;
+}
+
+/*
+ * Without signed attributes the signature covers the content itself, so
+ * the chunks go to the EVP_DigestSignUpdate() of every signer as they are
+ * read.  With TOKEN_DIGEST (-d) the token does the hashing, one large
+ * C_SignUpdate() per chunk while the reader fills the next one.
+ */
+static int sign_file_stream_noattr(const char *inpath, const char *outpath,
+                                   const SIGNER *signers, int nsigners,
+                                   const EVP_MD *md, int flags)
+{
+    EVP_MD_CTX *mctx[MAX_SIGNERS];
+    CMS_SignerInfo *si[MAX_SIGNERS];
+    CMS_ContentInfo *cms = NULL;
+    BIO *out = NULL;
+    unsigned char *sig;
+    size_t siglen;
+    int i, ret = 0;
+
+    memset(mctx, 0, sizeof(mctx));
+    cms = CMS_sign(NULL, NULL, NULL, NULL, flags);
+    if (cms == NULL)
+        goto err;
+
+    for (i = 0; i < nsigners; i++) {
+        si[i] = CMS_add1_signer(cms, signers[i].cert, signers[i].key, md,
+                                flags);
+        if (si[i] == NULL || (mctx[i] = EVP_MD_CTX_new()) == NULL
+            || EVP_DigestSignInit(mctx[i], NULL, md, NULL,
+                                  signers[i].key) <= 0)
+            goto err;
+    }
+
+    if (!stream_update(inpath, mctx, nsigners, 1))
+        goto err;
+
+    for (i = 0; i < nsigners; i++) {
+        if (EVP_DigestSignFinal(mctx[i], NULL, &siglen) <= 0
+            || (sig = OPENSSL_malloc(siglen)) == NULL)
+            goto err;
+        if (EVP_DigestSignFinal(mctx[i], sig, &siglen) <= 0) {
+            OPENSSL_free(sig);
+            goto err;
+        }
+        ASN1_STRING_set0(CMS_SignerInfo_get0_signature(si[i]), sig, siglen);
+    }
+
+    if ((out = BIO_new_file(outpath, "wb")) == NULL)
+        goto err;
+
+    /* Write out ASN1 */
+    if (!i2d_CMS_bio(out, cms))
+        goto err;
+
+    ret = 1;
+
+ err:
+    for (i = 0; i < nsigners; i++)
+        EVP_MD_CTX_free(mctx[i]);
+    CMS_ContentInfo_free(cms);
+    BIO_free(out);
+    return ret;
+}
+
+static int sign_file_stream(const char *inpath, const char *outpath,
+                            const SIGNER *signers, int nsigners,
+                            const EVP_MD *md, int flags)
+{
+    BIO *out = NULL;
+    CMS_ContentInfo *cms = NULL;
+    unsigned char dgst[EVP_MAX_MD_SIZE];
+    unsigned int dlen;
+    int ret = 0;
+
+    flags = (flags & ~CMS_STREAM) | CMS_DETACHED | CMS_PARTIAL;
+
+    if (flags & CMS_NOATTR)
+        return sign_file_stream_noattr(inpath, outpath, signers, nsigners,
+                                       md, flags);
+
+    if (!stream_digest(inpath, md, dgst, &dlen))
+        goto err;
+
+    cms = CMS_sign(NULL, NULL, NULL, NULL, flags);
+    if (cms == NULL)
+        goto err;
+
+    if (!add_signers(cms, signers, nsigners, md, dgst, dlen, flags))
+        goto err;
+
+    if ((out = BIO_new_file(outpath, "wb")) == NULL)
+        goto err;
+
+    /* Write out ASN1 */
+    if (!i2d_CMS_bio(out, cms))
+        goto err;
+
+    ret = 1;
+
+ err:
+    CMS_ContentInfo_free(cms);
+    BIO_free(out);
+    return ret;
+}
+
+static int sign_file(const char *inpath, const char *outpath,
+                     const SIGNER *signers, int nsigners, const EVP_MD *md,
+                     int flags)
+{
+    BIO *out = NULL;
+    CMS_ContentInfo *cms = NULL;
+    ASN1_OCTET_STRING **content;
+    unsigned char dgst[EVP_MAX_MD_SIZE], *data = NULL;
+    unsigned int dlen;
+    size_t len;
+    int ret = 0;
+
+    if (nsigners == 1)
+        return sign_file_one(inpath, outpath, signers[0].cert,
+                             signers[0].key, md, flags);
+
+    flags = (flags & ~CMS_STREAM) | CMS_PARTIAL;
+
+    if ((data = read_file(inpath, &len)) == NULL
+        || !EVP_Digest(data, len, dgst, &dlen, md, NULL))
+        goto err;
+
+    cms = CMS_sign(NULL, NULL, NULL, NULL, flags);
+    if (cms == NULL || (content = CMS_get0_content(cms)) == NULL)
+        goto err;
+    if (*content == NULL && (*content = ASN1_OCTET_STRING_new()) == NULL)
+        goto err;
+    if (!ASN1_OCTET_STRING_set(*content, data, len))
+        goto err;
+
+    if (!add_signers(cms, signers, nsigners, md, dgst, dlen, flags))
+        goto err;
+
+    if ((out = BIO_new_file(outpath, "wb")) == NULL)
+        goto err;
+
+    /* Write out ASN1 */
+    if (!i2d_CMS_bio(out, cms))
+        goto err;
+
+    ret = 1;
+
+ err:
+    CMS_ContentInfo_free(cms);
+    BIO_free(out);
+    free(data);
+    return ret;
+}
+
+static int batch_add(BATCH *b, const char *path)
+{
+    char **paths;
+    size_t size;
+
+    if (b->npaths == b->size) {
+        size = b->size == 0 ? 256 : b->size * 2;
+        paths = realloc(b->paths, size * sizeof(*paths));
+        if (paths == NULL)
+            return 0;
+        b->paths = paths;
+        b->size = size;
+    }
+    if ((b->paths[b->npaths] = strdup(path)) == NULL)
+        return 0;
+    b->npaths++;
+    return 1;
+}
+
+/* regular files of a directory, or the lines of a manifest file */
+static int batch_read(BATCH *b, const char *src)
+{
+    struct stat st;
+    char path[4096];
+    struct dirent *de;
+    DIR *dir;
+    FILE *f;
+    size_t len;
+    int ok = 1;
+
+    if (stat(src, &st) != 0)
+        return 0;
+
+    if (S_ISDIR(st.st_mode)) {
+        if ((dir = opendir(src)) == NULL)
+            return 0;
+        while (ok && (de = readdir(dir)) != NULL) {
+            snprintf(path, sizeof(path), "%s/%s", src, de->d_name);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+                ok = batch_add(b, path);
+        }
+        closedir(dir);
+        return ok;
+    }
+
+    if ((f = fopen(src, "r")) == NULL)
+        return 0;
+    while (ok && fgets(path, sizeof(path), f) != NULL) {
+        len = strcspn(path, "\r\n");
+        path[len] = '\0';
+        if (len > 0 && path[0] != '#')
+            ok = batch_add(b, path);
+    }
+    fclose(f);
+    return ok;
+}
+
+static void *batch_worker(void *arg)
+{
+    BATCH *b = arg;
+    char outpath[4096];
+    const char *inpath, *name;
+    struct stat st;
+    size_t i;
+    int ok;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->npaths)
+            break;
+
+        inpath = b->paths[i];
+        name = strrchr(inpath, '/');
+        name = name != NULL ? name + 1 : inpath;
+        snprintf(outpath, sizeof(outpath), "%s/%s.der", b->outdir, name);
+        if (b->stream)
+            ok = sign_file_stream(inpath, outpath, b->signers, b->nsigners,
+                                  b->md, b->flags);
+        else
+            ok = sign_file(inpath, outpath, b->signers, b->nsigners, b->md,
+                           b->flags);
+
+        pthread_mutex_lock(&b->lock);
+        if (ok) {
+            b->done++;
+            if (stat(inpath, &st) == 0)
+                b->bytes += st.st_size;
+        } else {
+            b->failed++;
+            fprintf(stderr, "%s: signing failed\n", inpath);
+            ERR_print_errors_fp(stderr);
+        }
+        pthread_mutex_unlock(&b->lock);
+        ERR_clear_error();
+    }
+    return NULL;
+}
+
+static int batch_sign(BATCH *b, int nthreads)
+{
+    pthread_t *tids;
+    struct timespec t0, t1;
+    double secs;
+    int i, n;
+
+    if ((tids = calloc(nthreads, sizeof(*tids))) == NULL)
+        return 0;
+    pthread_mutex_init(&b->lock, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (n = 0; n < nthreads; n++)
+        if (pthread_create(&tids[n], NULL, batch_worker, b) != 0)
+            break;
+    /* with no thread at all, sign here */
+    if (n == 0)
+        batch_worker(b);
+    for (i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    pthread_mutex_destroy(&b->lock);
+    free(tids);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%lu signed, %lu failed, %d threads, %.2f s, "
+            "%.1f files/s, %.2f MB/s\n", b->done, b->failed, n > 0 ? n : 1,
+            secs, secs > 0 ? b->done / secs : 0,
+            secs > 0 ? b->bytes / secs / 1e6 : 0);
+    return b->failed == 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: signcms [-s [-n]] [-d] infile modpkcs11 pin "
+            "id[,id...] [md]\n"
+            "       signcms -b manifest|dir [-o outdir] [-t threads] "
+            "[-s [-n]] [-d]\n"
+            "               modpkcs11 pin id[,id...] [md]\n"
+            "  id   key and certificate id, several for as many signers "
+            "(at most %d)\n"
+            "  -b   sign every file of a directory, or listed one per line "
+            "in a manifest\n"
+            "  -o   directory of the signed files, <name>.der (default .)\n"
+            "  -t   signing threads (default 8)\n"
+            "  -s   stream the input in constant memory, hashing while "
+            "reading,\n"
+            "       into a detached signature\n"
+            "  -n   no signed attributes, the signature covers the content "
+            "itself\n"
+            "  -d   have the token hash what it signs (TOKEN_DIGEST), for "
+            "cards\n"
+            "       that refuse CKM_RSA_PKCS\n", MAX_SIGNERS);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    SIGNER signers[MAX_SIGNERS];
     OSSL_STORE_CTX *store_ctx = NULL;
+    OSSL_STORE_INFO *info = NULL;
     ENGINE *engine = NULL;
     const EVP_MD *sign_md = NULL;
+    const char *batch = NULL, *outdir = ".", *infile = NULL;
+    const char *module, *pin, *md;
+    char *ids = NULL, *id, *save = NULL;
+    BATCH b;
+    size_t i;
+    int c, nthreads = 8, stream = 0, noattr = 0, token_digest = 0;
+    int nsigners = 0;
     typedef struct pw_cb_data {
         const void *password;
         const char *prompt_info;
     } PW_CB_DATA;
 
-    if (argc < 5 || argc > 6) {
-        fprintf(stderr, "Usage: signcms infile modpkcs11 pin id [md]\n");
-        exit(1);
+    while ((c = getopt(argc, argv, "b:o:t:snd")) != -1) {
+        switch (c) {
+        case 'b':
+            batch = optarg;
+            break;
+        case 'o':
+            outdir = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 's':
+            stream = 1;
+            break;
+        case 'n':
+            noattr = 1;
+            break;
+        case 'd':
+            token_digest = 1;
+            break;
+        default:
+            usage();
+        }
     }
+    if (batch == NULL) {
+        if (optind >= argc)
+            usage();
+        infile = argv[optind++];
+    }
+    if (argc - optind < 3 || argc - optind > 4 || nthreads < 1
+        || (noattr && !stream))
+        usage();
+    module = argv[optind];
+    pin = argv[optind + 1];
+    md = argc - optind == 4 ? argv[optind + 3] : "sha256";
 
     int ret = 1;
     char certuri[512];
@@ -40,10 +686,17 @@ int main(int argc, char **argv)
     int flags = CMS_CADES | CMS_STREAM | CMS_NOSMIMECAP |
                 CMS_BINARY | CMS_PARTIAL;
 
-    in = BIO_new_file(argv[1], "r");
-    out = BIO_new_file("out.der", "wb");
-    if (!in || !out)
+    if (noattr)
+        flags = (flags & ~CMS_CADES) | CMS_NOATTR;
+
+    memset(&b, 0, sizeof(b));
+    memset(signers, 0, sizeof(signers));
+    if ((ids = strdup(argv[optind + 2])) == NULL)
         goto err;
+    if (batch != NULL && !batch_read(&b, batch)) {
+        fprintf(stderr, "Can't read %s\n", batch);
+        goto err;
+    }
 
     OpenSSL_add_all_algorithms();
     ERR_load_crypto_strings();
@@ -56,58 +709,78 @@ int main(int argc, char **argv)
 
     ENGINE_init(engine);
 
-    sprintf(certuri,"pkcs11:type=cert;module-path=%s;id=%s",argv[2],argv[3]);
-    char *uri = &certuri[0];
-    if ((store_ctx = OSSL_STORE_open(uri, NULL, NULL, NULL, NULL)) == NULL)
+    if (token_digest
+        && !ENGINE_ctrl_cmd(engine, "TOKEN_DIGEST", 1, NULL, NULL, 0))
         goto err;
 
-    OSSL_STORE_INFO *info = OSSL_STORE_load(store_ctx);
+    /* certificates and keys once, for every file */
+    for (id = strtok_r(ids, ",", &save); id != NULL;
+         id = strtok_r(NULL, ",", &save)) {
+        if (nsigners == MAX_SIGNERS)
+            usage();
+        SIGNER *signer = &signers[nsigners++];
 
-    if (!info) {
-        fprintf(stderr, "ID not found\nUse openssl storeutl -engine pkcs11 ");
-        fprintf(stderr, "'pkcs11:module-path=%s'\n",argv[2]);
-        goto err;
-    }
+        sprintf(certuri,"pkcs11:type=cert;module-path=%s;id=%s",module,id);
+        char *uri = &certuri[0];
+        if ((store_ctx = OSSL_STORE_open(uri, NULL, NULL, NULL, NULL)) == NULL)
+            goto err;
 
-    signer = OSSL_STORE_INFO_get0_CERT(info);
+        info = OSSL_STORE_load(store_ctx);
 
-    if (!signer)
-        goto err;
+        if (!info) {
+            fprintf(stderr, "ID %s not found\n", id);
+            fprintf(stderr, "Use openssl storeutl -engine pkcs11 ");
+            fprintf(stderr, "'pkcs11:module-path=%s'\n",module);
+            goto err;
+        }
 
-    cms = CMS_sign(NULL, NULL, NULL, in, flags);
-    if (cms == NULL)
-        goto err;
+        signer->cert = OSSL_STORE_INFO_get1_CERT(info);
+        OSSL_STORE_INFO_free(info);
+        info = NULL;
+        OSSL_STORE_close(store_ctx);
+        store_ctx = NULL;
 
-    CMS_SignerInfo *si;
+        if (!signer->cert)
+            goto err;
 
-    sprintf(privuri,"pkcs11:type=private;module-path=%s;id=%s;pin-value=%s",
-            argv[2],argv[3],argv[4]);
-    char *keyuri = &privuri[0];
+        sprintf(privuri,
+                "pkcs11:type=private;module-path=%s;id=%s;pin-value=%s",
+                module,id,pin);
+        char *keyuri = &privuri[0];
 
-    PW_CB_DATA cb_data;
-    cb_data.password = NULL;
-    cb_data.prompt_info = keyuri;
-    key = ENGINE_load_private_key(engine, keyuri, NULL, &cb_data);
+        PW_CB_DATA cb_data;
+        cb_data.password = NULL;
+        cb_data.prompt_info = keyuri;
+        signer->key = ENGINE_load_private_key(engine, keyuri, NULL, &cb_data);
 
-    if (key == NULL)
-        goto err;
+        if (signer->key == NULL)
+            goto err;
+    }
+    if (nsigners == 0)
+        usage();
 
-    sign_md = EVP_get_digestbyname(argv[5] != NULL ? argv[5] : "sha256");
+    sign_md = EVP_get_digestbyname(md);
 
     if (sign_md == NULL)
         goto err;
 
-    si = CMS_add1_signer(cms, signer, key, sign_md, flags);
-
-    if (si == NULL)
-        goto err;
-
-    if (!CMS_final(cms, in, NULL, flags))
-        goto err;
-
-    /* Write out ASN1 */
-    if (!i2d_CMS_bio(out,cms))
-        goto err;
+    if (batch == NULL && stream) {
+        if (!sign_file_stream(infile, "out.der", signers, nsigners, sign_md,
+                              flags))
+            goto err;
+    } else if (batch == NULL) {
+        if (!sign_file(infile, "out.der", signers, nsigners, sign_md, flags))
+            goto err;
+    } else {
+        b.outdir = outdir;
+        b.signers = signers;
+        b.nsigners = nsigners;
+        b.md = sign_md;
+        b.flags = flags;
+        b.stream = stream;
+        if (!batch_sign(&b, nthreads))
+            goto end;
+    }
 
     ret = 0;
 
@@ -117,13 +790,19 @@ int main(int argc, char **argv)
         ERR_print_errors_fp(stderr);
     }
 
+ end:
+    OSSL_STORE_INFO_free(info);
+    OSSL_STORE_close(store_ctx);
+    for (c = 0; c < nsigners; c++) {
+        X509_free(signers[c].cert);
+        EVP_PKEY_free(signers[c].key);
+    }
+    free(ids);
     ENGINE_finish(engine);
     ENGINE_free(engine);
     ENGINE_cleanup();
-    CMS_ContentInfo_free(cms);
-    X509_free(signer);
-    EVP_PKEY_free(key);
-    BIO_free(in);
-    BIO_free(out);
+    for (i = 0; i < b.npaths; i++)
+        free(b.paths[i]);
+    free(b.paths);
     return ret;
 }
@@ -0,0 +1,603 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Spooled signing.  Producers append sign requests (digest, key URI and
+ * the path the signature is written to) to a journal file and return as
+ * soon as they are on disk; a single consumer drains the journal through
+ * the engine at the rate the token sustains, so that a burst of requests
+ * waits in the journal instead of piling up in front of the token.
+ *
+ * The journal is a header followed by the records, appended only:
+ *
+ *   end    committed by the producers once their records are synced
+ *   done   committed by the consumer once the signatures of every record
+ *          before it are written
+ *
+ * A record past |end| is not there yet: a producer that dies while
+ * appending leaves at most a torn record that the next one overwrites.
+ * The consumer writes every signature to a temporary file renamed over
+ * the result, so after a crash it replays from |done| and rewrites the
+ * signatures of the batch it was on, with the same result.  When the
+ * consumer is done with everything, the journal is truncated back to its
+ * header.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/engine.h>
+
+#define SPOOL_MAGIC     "P11SPOOL"
+#define SPOOL_DATA      4096    /* the header page, then the records */
+#define SPOOL_END       8       /* offsets of the header fields */
+#define SPOOL_DONE      16
+#define LOCK_APPEND     0       /* bytes locked by a producer ... */
+#define LOCK_DRAIN      1       /* ... and by the consumer */
+#define MAX_LINE        4096
+#define MAX_KEYS        64
+
+typedef struct {
+    char magic[8];
+    uint64_t end;
+    uint64_t done;
+} SPOOL_HEADER;
+
+/* followed by the digest, the key URI and the output path */
+typedef struct {
+    uint32_t len;               /* of the whole record, a multiple of 8 */
+    int32_t md_nid;
+    uint16_t dlen;
+    uint16_t urilen;
+    uint16_t pathlen;
+    uint16_t pad;
+} SPOOL_RECORD;
+
+typedef struct {
+    const EVP_MD *md;
+    unsigned char dgst[EVP_MAX_MD_SIZE];
+    size_t dlen;
+    char *uri;
+    char *path;
+    EVP_PKEY *key;
+    int ok;
+} JOB;
+
+/* the records of one batch, signed by a pool of threads */
+typedef struct {
+    JOB *jobs;
+    size_t njobs;
+    size_t next;
+    pthread_mutex_t lock;
+    double rate;                /* signatures per second, 0 for no limit */
+    double slot;                /* when the next signature may start */
+} BATCH;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int lock_byte(int fd, off_t byte, int type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+    while (fcntl(fd, F_SETLKW, &fl) != 0)
+        if (errno != EINTR)
+            return 0;
+    return 1;
+}
+
+static int write_u64(int fd, off_t off, uint64_t v)
+{
+    return pwrite(fd, &v, sizeof(v), off) == sizeof(v) && fdatasync(fd) == 0;
+}
+
+/* open |path|, creating an empty journal if there is none */
+static int spool_open(const char *path)
+{
+    SPOOL_HEADER h;
+    struct stat st;
+    int fd, ok;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+        return -1;
+    if (!lock_byte(fd, LOCK_APPEND, F_WRLCK) || fstat(fd, &st) != 0)
+        goto err;
+    if (st.st_size < SPOOL_DATA) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, SPOOL_MAGIC, sizeof(h.magic));
+        h.end = h.done = SPOOL_DATA;
+        ok = ftruncate(fd, SPOOL_DATA) == 0
+             && pwrite(fd, &h, sizeof(h), 0) == sizeof(h)
+             && fdatasync(fd) == 0;
+    } else {
+        ok = pread(fd, &h, sizeof(h), 0) == sizeof(h)
+             && memcmp(h.magic, SPOOL_MAGIC, sizeof(h.magic)) == 0;
+    }
+    lock_byte(fd, LOCK_APPEND, F_UNLCK);
+    if (ok)
+        return fd;
+    fprintf(stderr, "%s: not a signing journal\n", path);
+
+ err:
+    close(fd);
+    return -1;
+}
+
+/*
+ * Append the record of "md hexdigest keyuri outpath" to |buf|.
+ * Returns the new length of |buf|, 0 on a malformed request.
+ */
+static size_t record_add(unsigned char **buf, size_t *size, size_t len,
+                         const char *mdname, const char *hex,
+                         const char *uri, const char *path)
+{
+    SPOOL_RECORD r;
+    const EVP_MD *md;
+    unsigned char *dgst = NULL, *p;
+    long dlen;
+    size_t n;
+
+    memset(&r, 0, sizeof(r));
+    if ((md = EVP_get_digestbyname(mdname)) == NULL
+        || (dgst = OPENSSL_hexstr2buf(hex, &dlen)) == NULL
+        || dlen != EVP_MD_get_size(md)
+        || strlen(uri) > UINT16_MAX || strlen(path) > UINT16_MAX)
+        goto err;
+    r.md_nid = EVP_MD_get_type(md);
+    r.dlen = (uint16_t)dlen;
+    r.urilen = (uint16_t)strlen(uri);
+    r.pathlen = (uint16_t)strlen(path);
+    n = sizeof(r) + r.dlen + r.urilen + r.pathlen;
+    r.len = (uint32_t)((n + 7) & ~(size_t)7);
+
+    if (len + r.len > *size) {
+        n = *size == 0 ? 65536 : *size;
+        while (n < len + r.len)
+            n *= 2;
+        if ((p = realloc(*buf, n)) == NULL)
+            goto err;
+        *buf = p;
+        *size = n;
+    }
+    p = *buf + len;
+    memset(p, 0, r.len);
+    memcpy(p, &r, sizeof(r));
+    p += sizeof(r);
+    memcpy(p, dgst, r.dlen);
+    memcpy(p + r.dlen, uri, r.urilen);
+    memcpy(p + r.dlen + r.urilen, path, r.pathlen);
+    OPENSSL_free(dgst);
+    return len + r.len;
+
+ err:
+    OPENSSL_free(dgst);
+    return 0;
+}
+
+/*
+ * Producer: append one request, or with |argv| NULL one per line of stdin,
+ * with a single write and sync for all of them.
+ */
+static int spool_put(const char *path, char **argv)
+{
+    unsigned char *buf = NULL;
+    char line[MAX_LINE], *f[4], *save;
+    size_t size = 0, len = 0, n;
+    unsigned long lineno = 0;
+    uint64_t end;
+    int fd, i, ok = 0;
+
+    if (argv != NULL) {
+        len = record_add(&buf, &size, 0, argv[0], argv[1], argv[2], argv[3]);
+        if (len == 0)
+            fprintf(stderr, "malformed request\n");
+    } else {
+        while (fgets(line, sizeof(line), stdin) != NULL) {
+            lineno++;
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0' || line[0] == '#')
+                continue;
+            f[0] = strtok_r(line, " \t", &save);
+            for (i = 1; i < 4; i++)
+                f[i] = strtok_r(NULL, " \t", &save);
+            if (f[3] == NULL
+                || (n = record_add(&buf, &size, len, f[0], f[1], f[2],
+                                   f[3])) == 0) {
+                fprintf(stderr, "stdin:%lu: malformed request\n", lineno);
+                len = 0;
+                break;
+            }
+            len = n;
+        }
+    }
+    if (len == 0) {
+        free(buf);
+        return 0;
+    }
+
+    if ((fd = spool_open(path)) < 0)
+        goto end;
+    if (lock_byte(fd, LOCK_APPEND, F_WRLCK)) {
+        ok = pread(fd, &end, sizeof(end), SPOOL_END) == sizeof(end)
+             && pwrite(fd, buf, len, end) == (ssize_t)len
+             && fdatasync(fd) == 0
+             && write_u64(fd, SPOOL_END, end + len);
+        lock_byte(fd, LOCK_APPEND, F_UNLCK);
+    }
+    close(fd);
+
+ end:
+    if (!ok)
+        perror(path);
+    free(buf);
+    return ok;
+}
+
+/* the signature of |job|, to a temporary file renamed over the result */
+static int job_sign(JOB *job)
+{
+    EVP_PKEY_CTX *ctx = NULL;
+    unsigned char sig[1024];
+    char tmp[MAX_LINE + 8];
+    size_t siglen = sizeof(sig);
+    FILE *f;
+    int ok;
+
+    ok = (ctx = EVP_PKEY_CTX_new(job->key, NULL)) != NULL
+         && EVP_PKEY_sign_init(ctx) > 0
+         && (EVP_PKEY_get_base_id(job->key) != EVP_PKEY_RSA
+             || EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) > 0)
+         && EVP_PKEY_CTX_set_signature_md(ctx, job->md) > 0
+         && EVP_PKEY_sign(ctx, sig, &siglen, job->dgst, job->dlen) > 0;
+    EVP_PKEY_CTX_free(ctx);
+    if (!ok)
+        return 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->path);
+    if ((f = fopen(tmp, "wb")) == NULL)
+        return 0;
+    ok = fwrite(sig, 1, siglen, f) == siglen;
+    ok &= fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok &= fclose(f) == 0;
+    return ok && rename(tmp, job->path) == 0;
+}
+
+static void *batch_worker(void *arg)
+{
+    BATCH *b = arg;
+    struct timespec ts;
+    double wait;
+    size_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        wait = 0;
+        if (i < b->njobs && b->rate > 0) {
+            /* one signature every 1/rate seconds, no catching up later */
+            if (b->slot < now())
+                b->slot = now();
+            wait = b->slot - now();
+            b->slot += 1 / b->rate;
+        }
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->njobs)
+            break;
+        if (wait > 0) {
+            ts.tv_sec = (time_t)wait;
+            ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+            nanosleep(&ts, NULL);
+        }
+
+        if (b->jobs[i].key != NULL)
+            b->jobs[i].ok = job_sign(&b->jobs[i]);
+        if (!b->jobs[i].ok) {
+            fprintf(stderr, "%s: signing failed\n", b->jobs[i].path);
+            ERR_print_errors_fp(stderr);
+        }
+        ERR_clear_error();
+    }
+    return NULL;
+}
+
+typedef struct {
+    char *uri;
+    EVP_PKEY *key;
+} KEY;
+
+/* keys are loaded once, on the thread that reads the journal */
+static EVP_PKEY *key_get(ENGINE *e, KEY *keys, int *nkeys, const char *uri)
+{
+    char *tmp;
+    int i;
+
+    for (i = 0; i < *nkeys; i++)
+        if (strcmp(keys[i].uri, uri) == 0)
+            return keys[i].key;
+    if (*nkeys == MAX_KEYS)
+        return NULL;
+    /* the engine tokenises the URI in place */
+    if ((tmp = OPENSSL_strdup(uri)) == NULL)
+        return NULL;
+    keys[*nkeys].key = ENGINE_load_private_key(e, tmp, NULL, NULL);
+    OPENSSL_free(tmp);
+    if (keys[*nkeys].key == NULL) {
+        fprintf(stderr, "%s: cannot load the key\n", uri);
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+    keys[*nkeys].uri = OPENSSL_strdup(uri);
+    return keys[(*nkeys)++].key;
+}
+
+/* the job of the record at |p|, 0 if it is not a valid record */
+static int job_parse(JOB *job, const unsigned char *p, size_t avail)
+{
+    SPOOL_RECORD r;
+
+    memset(job, 0, sizeof(*job));
+    if (avail < sizeof(r))
+        return 0;
+    memcpy(&r, p, sizeof(r));
+    if (r.len < sizeof(r) || r.len % 8 != 0 || r.len > avail
+        || sizeof(r) + r.dlen + r.urilen + r.pathlen > r.len
+        || r.dlen > EVP_MAX_MD_SIZE
+        || (job->md = EVP_get_digestbynid(r.md_nid)) == NULL)
+        return 0;
+    p += sizeof(r);
+    memcpy(job->dgst, p, r.dlen);
+    job->dlen = r.dlen;
+    job->uri = OPENSSL_strndup((const char *)p + r.dlen, r.urilen);
+    job->path = OPENSSL_strndup((const char *)p + r.dlen + r.urilen,
+                                r.pathlen);
+    return job->uri != NULL && job->path != NULL;
+}
+
+typedef struct {
+    int batch;
+    int threads;
+    double rate;
+    int follow;
+} DRAIN_OPTS;
+
+/*
+ * Consumer: sign the records from |done| on, a batch at a time, commit
+ * |done| after each batch and, with |follow|, wait for more.
+ */
+static int spool_drain(const char *path, ENGINE *e, const DRAIN_OPTS *o)
+{
+    KEY keys[MAX_KEYS];
+    BATCH b;
+    pthread_t *tids = NULL;
+    unsigned char *map = MAP_FAILED;
+    size_t maplen = 0, i;
+    uint64_t end, done, off;
+    unsigned long nsigned = 0, nfailed = 0;
+    double t0 = now(), secs;
+    int fd, n, t, nkeys = 0, ok = 0;
+
+    memset(&b, 0, sizeof(b));
+    if ((fd = spool_open(path)) < 0)
+        return 0;
+    /* one consumer at a time, producers go on appending */
+    if (!lock_byte(fd, LOCK_DRAIN, F_WRLCK)
+        || (b.jobs = calloc(o->batch, sizeof(*b.jobs))) == NULL
+        || (tids = calloc(o->threads, sizeof(*tids))) == NULL)
+        goto end;
+    pthread_mutex_init(&b.lock, NULL);
+    b.rate = o->rate;
+
+    if (pread(fd, &done, sizeof(done), SPOOL_DONE) != sizeof(done)
+        || pread(fd, &end, sizeof(end), SPOOL_END) != sizeof(end))
+        goto end;
+    if (done < end)
+        fprintf(stderr, "%llu bytes pending from offset %llu\n",
+                (unsigned long long)(end - done), (unsigned long long)done);
+
+    for (;;) {
+        if (pread(fd, &end, sizeof(end), SPOOL_END) != sizeof(end))
+            goto end;
+        if (done == end) {
+            /* all signed: start over at the header unless more came */
+            if (end > SPOOL_DATA && lock_byte(fd, LOCK_APPEND, F_WRLCK)) {
+                if (pread(fd, &end, sizeof(end), SPOOL_END) == sizeof(end)
+                    && end == done
+                    && write_u64(fd, SPOOL_DONE, SPOOL_DATA)
+                    && write_u64(fd, SPOOL_END, SPOOL_DATA)
+                    && ftruncate(fd, SPOOL_DATA) == 0)
+                    end = done = SPOOL_DATA;
+                lock_byte(fd, LOCK_APPEND, F_UNLCK);
+                if (map != MAP_FAILED && done == SPOOL_DATA) {
+                    munmap(map, maplen);
+                    map = MAP_FAILED;
+                    maplen = 0;
+                }
+            }
+            if (!o->follow && done == end)
+                break;
+            if (done == end)
+                usleep(50000);
+            continue;
+        }
+
+        if (end > maplen) {
+            if (map != MAP_FAILED)
+                munmap(map, maplen);
+            maplen = end;
+            map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED)
+                goto end;
+        }
+
+        /* the next batch of records, with their keys */
+        for (b.njobs = 0, off = done;
+             off < end && b.njobs < (size_t)o->batch; b.njobs++) {
+            if (!job_parse(&b.jobs[b.njobs], map + off, end - off)) {
+                fprintf(stderr, "%s: corrupt record at offset %llu\n", path,
+                        (unsigned long long)off);
+                goto end;
+            }
+            b.jobs[b.njobs].key = key_get(e, keys, &nkeys,
+                                          b.jobs[b.njobs].uri);
+            off += ((const SPOOL_RECORD *)(map + off))->len;
+        }
+
+        b.next = 0;
+        t = o->threads < (int)b.njobs ? o->threads : (int)b.njobs;
+        for (n = 0; n < t; n++)
+            if (pthread_create(&tids[n], NULL, batch_worker, &b) != 0)
+                break;
+        if (n == 0)
+            batch_worker(&b);
+        while (n > 0)
+            pthread_join(tids[--n], NULL);
+
+        for (i = 0; i < b.njobs; i++) {
+            if (b.jobs[i].ok)
+                nsigned++;
+            else
+                nfailed++;
+            OPENSSL_free(b.jobs[i].uri);
+            OPENSSL_free(b.jobs[i].path);
+        }
+        /* a failed request is reported, not retried forever */
+        if (!write_u64(fd, SPOOL_DONE, off))
+            goto end;
+        done = off;
+    }
+    ok = 1;
+
+ end:
+    if (!ok)
+        perror(path);
+    secs = now() - t0;
+    fprintf(stderr, "%lu signed, %lu failed, %.2f s, %.1f signatures/s\n",
+            nsigned, nfailed, secs, secs > 0 ? nsigned / secs : 0);
+    if (map != MAP_FAILED)
+        munmap(map, maplen);
+    for (n = 0; n < nkeys; n++) {
+        OPENSSL_free(keys[n].uri);
+        EVP_PKEY_free(keys[n].key);
+    }
+    if (tids != NULL)
+        pthread_mutex_destroy(&b.lock);
+    free(tids);
+    free(b.jobs);
+    close(fd);
+    return ok && nfailed == 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: signspool put journal md hexdigest keyuri "
+            "outfile\n"
+            "       signspool put journal < requests\n"
+            "       signspool drain [-m module] [-r rate] [-t threads] "
+            "[-b batch] [-f]\n"
+            "                 journal\n"
+            "  requests   one \"md hexdigest keyuri outfile\" per line\n"
+            "  -m   PKCS#11 module, else $PKCS11_MODULE_PATH\n"
+            "  -r   signatures per second at most (default no limit)\n"
+            "  -t   signing threads (default 8)\n"
+            "  -b   records signed between two commits (default 256)\n"
+            "  -f   keep waiting for requests once the journal is drained\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    DRAIN_OPTS o;
+    ENGINE *engine = NULL;
+    const char *module = NULL;
+    int c, ret = 1;
+
+    if (argc < 3)
+        usage();
+    if (strcmp(argv[1], "put") == 0) {
+        if (argc != 3 && argc != 7)
+            usage();
+        return spool_put(argv[2], argc == 7 ? &argv[3] : NULL) ? 0 : 1;
+    }
+    if (strcmp(argv[1], "drain") != 0)
+        usage();
+
+    o.batch = 256;
+    o.threads = 8;
+    o.rate = 0;
+    o.follow = 0;
+    optind = 2;
+    while ((c = getopt(argc, argv, "m:r:t:b:f")) != -1) {
+        switch (c) {
+        case 'm':
+            module = optarg;
+            break;
+        case 'r':
+            o.rate = atof(optarg);
+            break;
+        case 't':
+            o.threads = atoi(optarg);
+            break;
+        case 'b':
+            o.batch = atoi(optarg);
+            break;
+        case 'f':
+            o.follow = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 1 || o.threads < 1 || o.batch < 1 || o.rate < 0)
+        usage();
+
+    if ((engine = ENGINE_by_id("pkcs11")) == NULL
+        || (module != NULL
+            && !ENGINE_ctrl_cmd_string(engine, "MODULE_PATH", module, 0))
+        || !ENGINE_set_default(engine, ENGINE_METHOD_RSA)) {
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    if (!ENGINE_init(engine)) {
+        ERR_print_errors_fp(stderr);
+        ENGINE_free(engine);
+        engine = NULL;
+        goto end;
+    }
+
+    ret = spool_drain(argv[optind], engine, &o) ? 0 : 2;
+
+ end:
+    if (engine != NULL) {
+        ENGINE_finish(engine);
+        ENGINE_free(engine);
+    }
+    return ret;
+}
@@ -0,0 +1,2923 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Mock PKCS#11 module.  Keys, certificates and data objects live in memory
+ * and the private key operations are done with OpenSSL.  Every entry point
+ * can be slowed down with a latency distribution or made to fail, and the
+ * number of concurrent crypto operations can be capped per token, so the
+ * engine can be benchmarked and regression tested without an HSM.
+ * See pkcs11mock.h for the configuration syntax.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <openssl/core_names.h>
+
+#define CK_PTR *
+#define CK_DECLARE_FUNCTION(returnType, name) \
+   returnType name
+#define CK_DECLARE_FUNCTION_POINTER(returnType, name) \
+   returnType (* name)
+#define CK_CALLBACK_FUNCTION(returnType, name) \
+   returnType (* name)
+
+#ifndef NULL_PTR
+# define NULL_PTR 0
+#endif
+
+#include "pkcs11.h"
+#include "pkcs11mock.h"
+
+#define OSSL_NELEM(x)    (sizeof(x)/sizeof((x)[0]))
+
+#define MOCK_MAX_FAULTS     4
+#define MOCK_MAX_SLOTS      16
+#define MOCK_SESSION_BITS   20
+#define MOCK_SESSION_MASK   ((1UL << MOCK_SESSION_BITS) - 1)
+#define MOCK_SCRIPT_MAX     256
+#define MOCK_MEMORY         (1UL << 20) /* public and private, per token */
+#define MOCK_OBJECT_SIZE    1024        /* of the memory, per object */
+#define MOCK_GONE           ((CK_SLOT_ID)-1)    /* slot of a destroyed object */
+
+typedef enum {
+#define CK_PKCS11_FUNCTION_INFO(name) MOCK_F_##name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+    MOCK_F_NUM
+} MOCK_FUNC;
+
+static const char *mock_func_names[] = {
+#define CK_PKCS11_FUNCTION_INFO(name) #name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+};
+
+enum {
+    MOCK_DIST_NONE,
+    MOCK_DIST_FIXED,
+    MOCK_DIST_UNIFORM,
+    MOCK_DIST_NORMAL,
+    MOCK_DIST_EXP,
+    MOCK_DIST_LOGNORMAL
+};
+
+enum {
+    MOCK_OP_NONE,
+    MOCK_OP_FIND,
+    MOCK_OP_SIGN,
+    MOCK_OP_VERIFY,
+    MOCK_OP_ENCRYPT,
+    MOCK_OP_DECRYPT
+};
+
+typedef struct {
+    int kind;
+    double a;
+    double b;
+} MOCK_DIST;
+
+typedef struct {
+    CK_RV rv;                   /* 0 means hang */
+    double prob;
+} MOCK_FAULT;
+
+typedef struct {
+    MOCK_DIST latency;
+    MOCK_FAULT faults[MOCK_MAX_FAULTS];
+    int nfaults;
+} MOCK_FUNC_CONF;
+
+typedef struct {
+    int data;                   /* CKO_DATA object instead of a key */
+    CK_SLOT_ID slot;
+    char *label;
+    unsigned char *id;
+    long idlen;
+    int type;
+    int bits;
+    char *curve;
+    char *file;
+    char *cert_file;
+    char *value;
+    int cert;
+    int always_auth;
+    int private;
+    int count;
+} MOCK_SPEC;
+
+typedef struct {
+    int nslots;
+    unsigned long max_sessions;
+    int lanes;
+    int max_inflight;
+    int fake_crypto;
+    int no_raw_sign;            /* only hash-and-sign mechanisms sign */
+    long hang_ms;
+    unsigned long seed;
+    char pin[64];
+    MOCK_SPEC *specs;
+    int nspecs;
+    MOCK_FUNC_CONF funcs[MOCK_F_NUM];
+} MOCK_CONF;
+
+typedef struct {
+    CK_OBJECT_HANDLE handle;
+    CK_SLOT_ID slot;
+    CK_OBJECT_CLASS class;
+    CK_BBOOL private;
+    CK_BBOOL always_auth;
+    EVP_PKEY *pkey;
+    CK_ATTRIBUTE *attrs;
+    CK_ULONG nattrs;
+} MOCK_OBJECT;
+
+typedef struct {
+    CK_SLOT_ID id;
+    int logged_in;
+    unsigned long nsessions;
+    int lanes_busy;
+    char serial[17];            /* provisioned, else from the slot id */
+} MOCK_TOKEN;
+
+typedef struct {
+    CK_SESSION_HANDLE handle;   /* 0 when the slot is free */
+    MOCK_TOKEN *token;
+    CK_FLAGS flags;
+    pthread_mutex_t lock;
+    int op;
+    CK_MECHANISM_TYPE mech;
+    MOCK_OBJECT *key;
+    int ctx_auth;
+    EVP_MD_CTX *md;
+    const EVP_MD *param_md;
+    const EVP_MD *param_mgf1;
+    int param_saltlen;
+    CK_OBJECT_HANDLE *found;
+    CK_ULONG nfound;
+    CK_ULONG pos;
+    unsigned long calls[MOCK_F_NUM];
+    unsigned long ncalls;
+} MOCK_SESSION;
+
+typedef struct {
+    char *name;
+    EVP_PKEY *pkey;
+    X509 *cert;
+} MOCK_KEYCACHE;
+
+typedef struct {
+    int func;
+    double latency;
+    CK_RV rv;
+} MOCK_SCRIPT;
+
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mock_cond = PTHREAD_COND_INITIALIZER;
+static int mock_initialized = 0;
+static int mock_finalizing = 0;
+static MOCK_CONF mock_conf;
+static char **mock_overrides = NULL;
+static int mock_noverrides = 0;
+static MOCK_TOKEN mock_tokens[MOCK_MAX_SLOTS];
+static MOCK_OBJECT *mock_objects = NULL;
+static CK_ULONG mock_nobjects = 0;
+static MOCK_SESSION **mock_sessions = NULL;
+static size_t mock_nsessions = 0;
+static unsigned long mock_session_gen = 0;
+static int mock_inflight = 0;
+static int mock_lanes_peak = 0;
+static MOCK_KEYCACHE *mock_keycache = NULL;
+static int mock_nkeycache = 0;
+static unsigned long mock_rng_seq = 0;
+static __thread unsigned long long mock_rng_state = 0;
+static __thread MOCK_SCRIPT mock_script[MOCK_SCRIPT_MAX];
+static __thread int mock_script_head = 0;
+static __thread int mock_script_len = 0;
+static __thread double mock_script_latency = -1;
+
+static unsigned long mock_calls[MOCK_F_NUM];
+
+static CK_FUNCTION_LIST mock_function_list;
+
+/*-
+ * Random numbers, latency and faults
+ * ----------------------------------
+ */
+
+static double mock_rand(void)
+{
+    unsigned long long x;
+
+    if (mock_rng_state == 0) {
+        pthread_mutex_lock(&mock_lock);
+        mock_rng_state = (mock_conf.seed + 1) * 0x9E3779B97F4A7C15ULL
+                         ^ ((unsigned long long)++mock_rng_seq << 32);
+        pthread_mutex_unlock(&mock_lock);
+        if (mock_rng_state == 0)
+            mock_rng_state = 1;
+    }
+    x = mock_rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    mock_rng_state = x;
+    return ((x * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double mock_gauss(void)
+{
+    double u = mock_rand();
+
+    if (u < 1e-300)
+        u = 1e-300;
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * mock_rand());
+}
+
+static double mock_sample(const MOCK_DIST *d)
+{
+    double v = 0;
+
+    switch (d->kind) {
+    case MOCK_DIST_FIXED:
+        v = d->a;
+        break;
+    case MOCK_DIST_UNIFORM:
+        v = d->a + (d->b - d->a) * mock_rand();
+        break;
+    case MOCK_DIST_NORMAL:
+        v = d->a + d->b * mock_gauss();
+        break;
+    case MOCK_DIST_EXP:
+        v = -d->a * log(1.0 - mock_rand());
+        break;
+    case MOCK_DIST_LOGNORMAL:
+        v = d->a * exp(d->b * mock_gauss());
+        break;
+    }
+    return v < 0 ? 0 : v;
+}
+
+static void mock_sleep_us(double us)
+{
+    struct timespec ts;
+
+    if (us <= 0)
+        return;
+    ts.tv_sec = (time_t)(us / 1e6);
+    ts.tv_nsec = (long)((us - ts.tv_sec * 1e6) * 1e3);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        continue;
+}
+
+static void mock_delay(MOCK_FUNC f)
+{
+    if (mock_script_latency >= 0) {
+        mock_sleep_us(mock_script_latency);
+        mock_script_latency = -1;
+        return;
+    }
+    mock_sleep_us(mock_sample(&mock_conf.funcs[f].latency));
+}
+
+/* Pops the scripted entry for |f| from the thread's queue, if any */
+static const MOCK_SCRIPT *mock_script_next(MOCK_FUNC f)
+{
+    const MOCK_SCRIPT *sc;
+    int i;
+
+    for (i = 0; i < mock_script_len; i++) {
+        sc = &mock_script[(mock_script_head + i) % MOCK_SCRIPT_MAX];
+        if (sc->func != (int)f)
+            continue;
+        mock_script_head = (mock_script_head + i + 1) % MOCK_SCRIPT_MAX;
+        mock_script_len -= i + 1;
+        return sc;
+    }
+    return NULL;
+}
+
+static void mock_hang(void)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += mock_conf.hang_ms / 1000;
+    deadline.tv_nsec += (mock_conf.hang_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&mock_lock);
+    while (!mock_finalizing) {
+        if (mock_conf.hang_ms == 0)
+            pthread_cond_wait(&mock_cond, &mock_lock);
+        else if (pthread_cond_timedwait(&mock_cond, &mock_lock,
+                                        &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&mock_lock);
+}
+
+static int mock_is_lane_func(MOCK_FUNC f)
+{
+    switch (f) {
+    case MOCK_F_C_Sign:
+    case MOCK_F_C_SignUpdate:
+    case MOCK_F_C_SignFinal:
+    case MOCK_F_C_Verify:
+    case MOCK_F_C_VerifyUpdate:
+    case MOCK_F_C_VerifyFinal:
+    case MOCK_F_C_Encrypt:
+    case MOCK_F_C_Decrypt:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void mock_session_close(CK_SESSION_HANDLE h);
+
+/* Count a call of |f|, on session |h| too unless it is 0 */
+static void mock_count(MOCK_FUNC f, CK_SESSION_HANDLE h)
+{
+    size_t idx = (size_t)(h & MOCK_SESSION_MASK);
+    MOCK_SESSION *s;
+
+    __atomic_fetch_add(&mock_calls[f], 1, __ATOMIC_RELAXED);
+    if (h == 0)
+        return;
+    pthread_mutex_lock(&mock_lock);
+    if (idx > 0 && idx <= mock_nsessions
+        && (s = mock_sessions[idx - 1])->handle == h) {
+        s->calls[f]++;
+        s->ncalls++;
+    }
+    pthread_mutex_unlock(&mock_lock);
+}
+
+/*
+ * Common prologue of every entry point: injects the configured faults and,
+ * for non crypto functions, the configured latency.  Crypto functions take
+ * their latency while holding a lane, see mock_lane_enter().
+ */
+static CK_RV mock_enter(MOCK_FUNC f, CK_SESSION_HANDLE h)
+{
+    const MOCK_FUNC_CONF *fc = &mock_conf.funcs[f];
+    const MOCK_SCRIPT *sc;
+    int i;
+
+    mock_count(f, h);
+    if (!mock_initialized)
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    if (mock_script_len > 0 && (sc = mock_script_next(f)) != NULL) {
+        if (sc->rv != CKR_OK) {
+            mock_sleep_us(sc->latency);
+            return sc->rv;
+        }
+        mock_script_latency = sc->latency;
+        if (!mock_is_lane_func(f))
+            mock_delay(f);
+        return CKR_OK;
+    }
+
+    for (i = 0; i < fc->nfaults; i++) {
+        if (mock_rand() >= fc->faults[i].prob)
+            continue;
+        if (fc->faults[i].rv == 0) {
+            mock_hang();
+            continue;
+        }
+        if (fc->faults[i].rv == CKR_SESSION_CLOSED && h != 0)
+            mock_session_close(h);
+        return fc->faults[i].rv;
+    }
+
+    if (!mock_is_lane_func(f))
+        mock_delay(f);
+    return CKR_OK;
+}
+
+static void mock_lane_enter(MOCK_TOKEN *t, MOCK_FUNC f)
+{
+    pthread_mutex_lock(&mock_lock);
+    while ((mock_conf.lanes > 0 && t->lanes_busy >= mock_conf.lanes)
+           || (mock_conf.max_inflight > 0
+               && mock_inflight >= mock_conf.max_inflight))
+        pthread_cond_wait(&mock_cond, &mock_lock);
+    t->lanes_busy++;
+    mock_inflight++;
+    if (t->lanes_busy > mock_lanes_peak)
+        mock_lanes_peak = t->lanes_busy;
+    pthread_mutex_unlock(&mock_lock);
+
+    mock_delay(f);
+}
+
+static void mock_lane_leave(MOCK_TOKEN *t)
+{
+    pthread_mutex_lock(&mock_lock);
+    t->lanes_busy--;
+    mock_inflight--;
+    pthread_cond_broadcast(&mock_cond);
+    pthread_mutex_unlock(&mock_lock);
+}
+
+/*-
+ * Configuration
+ * -------------
+ */
+
+static char *mock_trim(char *s)
+{
+    char *e;
+
+    while (isspace((unsigned char)*s))
+        s++;
+    e = s + strlen(s);
+    while (e > s && isspace((unsigned char)e[-1]))
+        *--e = '\0';
+    return s;
+}
+
+static int mock_func_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; i < MOCK_F_NUM; i++) {
+        if (strcmp(mock_func_names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int mock_parse_dist(MOCK_DIST *d, const char *val)
+{
+    MOCK_DIST t = { MOCK_DIST_NONE, 0, 0 };
+
+    if (strcmp(val, "none") == 0)
+        ;
+    else if (sscanf(val, "fixed:%lf", &t.a) == 1)
+        t.kind = MOCK_DIST_FIXED;
+    else if (sscanf(val, "uniform:%lf:%lf", &t.a, &t.b) == 2)
+        t.kind = MOCK_DIST_UNIFORM;
+    else if (sscanf(val, "normal:%lf:%lf", &t.a, &t.b) == 2)
+        t.kind = MOCK_DIST_NORMAL;
+    else if (sscanf(val, "exp:%lf", &t.a) == 1)
+        t.kind = MOCK_DIST_EXP;
+    else if (sscanf(val, "lognormal:%lf:%lf", &t.a, &t.b) == 2)
+        t.kind = MOCK_DIST_LOGNORMAL;
+    else
+        return 0;
+    *d = t;
+    return 1;
+}
+
+static int mock_parse_faults(MOCK_FUNC_CONF *fc, char *val)
+{
+    MOCK_FAULT faults[MOCK_MAX_FAULTS];
+    int n = 0;
+    char *item, *save = NULL, *colon;
+
+    if (strcmp(val, "none") == 0) {
+        fc->nfaults = 0;
+        return 1;
+    }
+    for (item = strtok_r(val, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        item = mock_trim(item);
+        if (n == MOCK_MAX_FAULTS || (colon = strrchr(item, ':')) == NULL)
+            return 0;
+        *colon = '\0';
+        faults[n].prob = atof(colon + 1);
+        if (strcmp(item, "device_error") == 0)
+            faults[n].rv = CKR_DEVICE_ERROR;
+        else if (strcmp(item, "session_closed") == 0)
+            faults[n].rv = CKR_SESSION_CLOSED;
+        else if (strcmp(item, "general_error") == 0)
+            faults[n].rv = CKR_GENERAL_ERROR;
+        else if (strcmp(item, "device_removed") == 0)
+            faults[n].rv = CKR_DEVICE_REMOVED;
+        else if (strcmp(item, "hang") == 0)
+            faults[n].rv = 0;
+        else if ((faults[n].rv = strtoul(item, NULL, 0)) == 0)
+            return 0;
+        n++;
+    }
+    memcpy(fc->faults, faults, sizeof(faults[0]) * n);
+    fc->nfaults = n;
+    return 1;
+}
+
+static int mock_parse_spec(MOCK_CONF *conf, char *val, int data)
+{
+    MOCK_SPEC *specs, s;
+    char *item, *save = NULL, *eq, *k, *v;
+
+    memset(&s, 0, sizeof(s));
+    s.data = data;
+    s.type = EVP_PKEY_RSA;
+    s.bits = 2048;
+    s.cert = !data;
+    s.count = 1;
+
+    for (item = strtok_r(val, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        if ((eq = strchr(item, '=')) == NULL)
+            goto err;
+        *eq = '\0';
+        k = mock_trim(item);
+        v = mock_trim(eq + 1);
+        if (strcmp(k, "slot") == 0) {
+            s.slot = strtoul(v, NULL, 0);
+        } else if (strcmp(k, "label") == 0) {
+            OPENSSL_free(s.label);
+            s.label = OPENSSL_strdup(v);
+        } else if (strcmp(k, "id") == 0) {
+            OPENSSL_free(s.id);
+            if ((s.id = OPENSSL_hexstr2buf(v, &s.idlen)) == NULL)
+                goto err;
+        } else if (strcmp(k, "type") == 0) {
+            if (strcmp(v, "rsa") == 0)
+                s.type = EVP_PKEY_RSA;
+            else if (strcmp(v, "ec") == 0)
+                s.type = EVP_PKEY_EC;
+            else
+                goto err;
+        } else if (strcmp(k, "bits") == 0) {
+            s.bits = atoi(v);
+        } else if (strcmp(k, "curve") == 0) {
+            OPENSSL_free(s.curve);
+            s.curve = OPENSSL_strdup(v);
+        } else if (strcmp(k, "file") == 0) {
+            OPENSSL_free(s.file);
+            s.file = OPENSSL_strdup(v);
+        } else if (strcmp(k, "cert_file") == 0) {
+            OPENSSL_free(s.cert_file);
+            s.cert_file = OPENSSL_strdup(v);
+        } else if (strcmp(k, "value") == 0) {
+            OPENSSL_free(s.value);
+            s.value = OPENSSL_strdup(v);
+        } else if (strcmp(k, "cert") == 0) {
+            s.cert = strcmp(v, "yes") == 0;
+        } else if (strcmp(k, "always_auth") == 0) {
+            s.always_auth = strcmp(v, "yes") == 0;
+        } else if (strcmp(k, "private") == 0) {
+            s.private = strcmp(v, "yes") == 0;
+        } else if (strcmp(k, "count") == 0) {
+            s.count = atoi(v);
+        } else {
+            goto err;
+        }
+    }
+    if (s.label == NULL || s.count < 1 || s.slot >= MOCK_MAX_SLOTS)
+        goto err;
+    if (s.type == EVP_PKEY_EC && s.curve == NULL)
+        s.curve = OPENSSL_strdup("prime256v1");
+
+    specs = OPENSSL_realloc(conf->specs,
+                            sizeof(*specs) * (conf->nspecs + 1));
+    if (specs == NULL)
+        goto err;
+    conf->specs = specs;
+    conf->specs[conf->nspecs++] = s;
+    return 1;
+
+ err:
+    OPENSSL_free(s.label);
+    OPENSSL_free(s.id);
+    OPENSSL_free(s.curve);
+    OPENSSL_free(s.file);
+    OPENSSL_free(s.cert_file);
+    OPENSSL_free(s.value);
+    return 0;
+}
+
+static int mock_conf_line(MOCK_CONF *conf, char *line, int tunables_only)
+{
+    char *eq, *key, *val;
+    int f, lo, hi;
+
+    line = mock_trim(line);
+    if (*line == '\0' || *line == '#')
+        return 1;
+    if ((eq = strchr(line, '=')) == NULL)
+        return 0;
+    *eq = '\0';
+    key = mock_trim(line);
+    val = mock_trim(eq + 1);
+
+    if (strcmp(key, "slots") == 0) {
+        if (!tunables_only)
+            conf->nslots = atoi(val);
+        return conf->nslots > 0 && conf->nslots <= MOCK_MAX_SLOTS;
+    } else if (strcmp(key, "max_sessions") == 0) {
+        conf->max_sessions = strtoul(val, NULL, 0);
+    } else if (strcmp(key, "lanes") == 0) {
+        conf->lanes = atoi(val);
+    } else if (strcmp(key, "max_inflight") == 0) {
+        conf->max_inflight = atoi(val);
+    } else if (strcmp(key, "crypto") == 0) {
+        conf->fake_crypto = strcmp(val, "fake") == 0;
+    } else if (strcmp(key, "raw_sign") == 0) {
+        conf->no_raw_sign = strcmp(val, "no") == 0;
+    } else if (strcmp(key, "hang_ms") == 0) {
+        conf->hang_ms = atol(val);
+    } else if (strcmp(key, "seed") == 0) {
+        conf->seed = strtoul(val, NULL, 0);
+    } else if (strcmp(key, "pin") == 0) {
+        if (strlen(val) >= sizeof(conf->pin))
+            return 0;
+        strcpy(conf->pin, val);
+    } else if (strcmp(key, "key") == 0 || strcmp(key, "data") == 0) {
+        return tunables_only
+               || mock_parse_spec(conf, val, strcmp(key, "data") == 0);
+    } else if (strncmp(key, "latency.", 8) == 0
+               || strncmp(key, "fault.", 6) == 0) {
+        const char *fname = strchr(key, '.') + 1;
+
+        if (strcmp(fname, "*") == 0) {
+            lo = 0;
+            hi = MOCK_F_NUM - 1;
+        } else if ((f = mock_func_lookup(fname)) >= 0) {
+            lo = hi = f;
+        } else {
+            return 0;
+        }
+        for (f = lo; f <= hi; f++) {
+            if (key[0] == 'l') {
+                if (!mock_parse_dist(&conf->funcs[f].latency, val))
+                    return 0;
+            } else {
+                char *tmp = OPENSSL_strdup(val);
+                int ok = tmp != NULL
+                         && mock_parse_faults(&conf->funcs[f], tmp);
+
+                OPENSSL_free(tmp);
+                if (!ok)
+                    return 0;
+            }
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static int mock_conf_text(MOCK_CONF *conf, const char *text, int tunables_only)
+{
+    char *buf, *line, *save = NULL;
+    int ok = 1;
+
+    if ((buf = OPENSSL_strdup(text)) == NULL)
+        return 0;
+    for (line = strtok_r(buf, ";\n", &save); line != NULL;
+         line = strtok_r(NULL, ";\n", &save)) {
+        if (!mock_conf_line(conf, line, tunables_only)) {
+            fprintf(stderr, "pkcs11mock: bad configuration line \"%s\"\n",
+                    line);
+            ok = 0;
+        }
+    }
+    OPENSSL_free(buf);
+    return ok;
+}
+
+static int mock_conf_file(MOCK_CONF *conf, const char *filename)
+{
+    FILE *fp;
+    char line[1024];
+    int ok = 1;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "pkcs11mock: cannot open %s\n", filename);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+        ok &= mock_conf_text(conf, line, 0);
+    fclose(fp);
+    return ok;
+}
+
+static void mock_conf_free(MOCK_CONF *conf)
+{
+    int i;
+
+    for (i = 0; i < conf->nspecs; i++) {
+        OPENSSL_free(conf->specs[i].label);
+        OPENSSL_free(conf->specs[i].id);
+        OPENSSL_free(conf->specs[i].curve);
+        OPENSSL_free(conf->specs[i].file);
+        OPENSSL_free(conf->specs[i].cert_file);
+        OPENSSL_free(conf->specs[i].value);
+    }
+    OPENSSL_free(conf->specs);
+    memset(conf, 0, sizeof(*conf));
+}
+
+static int mock_conf_load(MOCK_CONF *conf)
+{
+    const char *env;
+    int i, ok = 1;
+
+    mock_conf_free(conf);
+    conf->nslots = 1;
+    conf->max_sessions = 64;
+    conf->hang_ms = 0;
+    strcpy(conf->pin, "1234");
+
+    if ((env = getenv("PKCS11MOCK_CONF")) != NULL)
+        ok &= mock_conf_file(conf, env);
+    if ((env = getenv("PKCS11MOCK")) != NULL)
+        ok &= mock_conf_text(conf, env, 0);
+    for (i = 0; i < mock_noverrides; i++)
+        ok &= mock_conf_text(conf, mock_overrides[i], 1);
+
+    if (conf->nspecs == 0) {
+        char rsa[] = "label=rsa0,id=01,type=rsa,bits=2048";
+        char ec[] = "label=ec0,id=02,type=ec,curve=prime256v1";
+
+        ok &= mock_parse_spec(conf, rsa, 0);
+        ok &= mock_parse_spec(conf, ec, 0);
+    }
+    return ok;
+}
+
+/*-
+ * Objects
+ * -------
+ */
+
+static X509 *mock_selfsign(EVP_PKEY *pkey, const char *cn)
+{
+    static long serial = 0;
+    X509 *x = X509_new();
+    X509_NAME *name = NULL;
+
+    if (x == NULL
+        || !X509_set_version(x, 2)
+        || !ASN1_INTEGER_set(X509_get_serialNumber(x), ++serial)
+        || X509_gmtime_adj(X509_getm_notBefore(x), 0) == NULL
+        || X509_gmtime_adj(X509_getm_notAfter(x), 365L * 24 * 3600) == NULL
+        || !X509_set_pubkey(x, pkey)
+        || (name = X509_get_subject_name(x)) == NULL
+        || !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                       (const unsigned char *)cn, -1, -1, 0)
+        || !X509_set_issuer_name(x, name)
+        || !X509_sign(x, pkey, EVP_sha256())) {
+        X509_free(x);
+        return NULL;
+    }
+    return x;
+}
+
+/*
+ * The mock usually runs inside a process where the engine has been made the
+ * default RSA implementation, and every RSA object created afterwards would
+ * call back into the engine.  Mock RSA keys are therefore bound to a copy of
+ * the built-in method, which also makes OpenSSL treat them as foreign keys
+ * and keep them away from the provider, which would create an engine backed
+ * RSA object of its own.
+ */
+static RSA_METHOD *mock_rsa_meth = NULL;
+
+static int mock_rsa_bind(RSA *rsa)
+{
+    if (mock_rsa_meth == NULL
+        && (mock_rsa_meth = RSA_meth_dup(RSA_PKCS1_OpenSSL())) == NULL)
+        return 0;
+    return RSA_set_method(rsa, mock_rsa_meth);
+}
+
+/* Wraps a bound RSA key, frees it on error */
+static EVP_PKEY *mock_rsa_pkey(RSA *rsa)
+{
+    EVP_PKEY *pkey = EVP_PKEY_new();
+
+    if (pkey == NULL || !EVP_PKEY_assign_RSA(pkey, rsa)) {
+        EVP_PKEY_free(pkey);
+        RSA_free(rsa);
+        return NULL;
+    }
+    return pkey;
+}
+
+static EVP_PKEY *mock_keygen(const MOCK_SPEC *spec)
+{
+    EVP_PKEY *pkey = NULL;
+    RSA *rsa;
+    BIGNUM *e;
+    BIO *in;
+
+    if (spec->file != NULL) {
+        if ((in = BIO_new_file(spec->file, "r")) == NULL)
+            return NULL;
+        pkey = PEM_read_bio_PrivateKey(in, NULL, NULL, NULL);
+        BIO_free(in);
+        if (pkey == NULL || EVP_PKEY_get_base_id(pkey) != EVP_PKEY_RSA)
+            return pkey;
+        rsa = EVP_PKEY_get1_RSA(pkey);
+        EVP_PKEY_free(pkey);
+        if (rsa == NULL || !mock_rsa_bind(rsa)) {
+            RSA_free(rsa);
+            return NULL;
+        }
+        return mock_rsa_pkey(rsa);
+    } else if (spec->type == EVP_PKEY_RSA) {
+        rsa = RSA_new();
+        e = BN_new();
+        if (rsa == NULL || e == NULL || !BN_set_word(e, RSA_F4)
+            || !mock_rsa_bind(rsa)
+            || !RSA_generate_key_ex(rsa, spec->bits, e, NULL)) {
+            RSA_free(rsa);
+            rsa = NULL;
+        }
+        BN_free(e);
+        return rsa != NULL ? mock_rsa_pkey(rsa) : NULL;
+    }
+    return EVP_PKEY_Q_keygen(NULL, NULL, "EC", spec->curve);
+}
+
+/*
+ * Generating RSA keys is slow, so the key material survives C_Finalize and
+ * is reused by any later C_Initialize with the same key line.
+ */
+static MOCK_KEYCACHE *mock_key_material(const MOCK_SPEC *spec)
+{
+    MOCK_KEYCACHE *cache, *kc;
+    char name[512];
+    BIO *in;
+    int i;
+
+    BIO_snprintf(name, sizeof(name), "%s|%d|%d|%s|%s|%s", spec->label,
+                 spec->type, spec->bits, spec->curve ? spec->curve : "",
+                 spec->file ? spec->file : "",
+                 spec->cert_file ? spec->cert_file : "");
+    for (i = 0; i < mock_nkeycache; i++) {
+        if (strcmp(mock_keycache[i].name, name) == 0)
+            return &mock_keycache[i];
+    }
+
+    cache = OPENSSL_realloc(mock_keycache,
+                            sizeof(*cache) * (mock_nkeycache + 1));
+    if (cache == NULL)
+        return NULL;
+    mock_keycache = cache;
+    kc = &mock_keycache[mock_nkeycache];
+    memset(kc, 0, sizeof(*kc));
+
+    if ((kc->pkey = mock_keygen(spec)) == NULL) {
+        fprintf(stderr, "pkcs11mock: cannot create key %s\n", spec->label);
+        return NULL;
+    }
+    if (spec->cert_file != NULL) {
+        if ((in = BIO_new_file(spec->cert_file, "r")) != NULL) {
+            kc->cert = PEM_read_bio_X509(in, NULL, NULL, NULL);
+            BIO_free(in);
+        }
+    } else {
+        kc->cert = mock_selfsign(kc->pkey, spec->label);
+    }
+    if (kc->cert == NULL || (kc->name = OPENSSL_strdup(name)) == NULL) {
+        EVP_PKEY_free(kc->pkey);
+        X509_free(kc->cert);
+        return NULL;
+    }
+    mock_nkeycache++;
+    return kc;
+}
+
+static int mock_obj_attr(MOCK_OBJECT *o, CK_ATTRIBUTE_TYPE type,
+                         const void *value, CK_ULONG len)
+{
+    CK_ATTRIBUTE *attrs;
+
+    attrs = OPENSSL_realloc(o->attrs, sizeof(*attrs) * (o->nattrs + 1));
+    if (attrs == NULL)
+        return 0;
+    o->attrs = attrs;
+    attrs[o->nattrs].type = type;
+    attrs[o->nattrs].ulValueLen = len;
+    attrs[o->nattrs].pValue = OPENSSL_memdup(value, len > 0 ? len : 1);
+    if (attrs[o->nattrs].pValue == NULL)
+        return 0;
+    o->nattrs++;
+    return 1;
+}
+
+static int mock_obj_bool(MOCK_OBJECT *o, CK_ATTRIBUTE_TYPE type, CK_BBOOL v)
+{
+    return mock_obj_attr(o, type, &v, sizeof(v));
+}
+
+static int mock_obj_ulong(MOCK_OBJECT *o, CK_ATTRIBUTE_TYPE type, CK_ULONG v)
+{
+    return mock_obj_attr(o, type, &v, sizeof(v));
+}
+
+static int mock_obj_der(MOCK_OBJECT *o, CK_ATTRIBUTE_TYPE type,
+                        unsigned char *der, int len)
+{
+    int ok = len > 0 && mock_obj_attr(o, type, der, len);
+
+    OPENSSL_free(der);
+    return ok;
+}
+
+static int mock_obj_bn(MOCK_OBJECT *o, CK_ATTRIBUTE_TYPE type,
+                       const BIGNUM *bn)
+{
+    unsigned char buf[1024];
+    int len = BN_num_bytes(bn);
+
+    if (len > (int)sizeof(buf))
+        return 0;
+    BN_bn2bin(bn, buf);
+    return mock_obj_attr(o, type, buf, len);
+}
+
+static int mock_obj_key_attrs(MOCK_OBJECT *o, EVP_PKEY *pkey, int public)
+{
+    if (EVP_PKEY_get_base_id(pkey) == EVP_PKEY_RSA) {
+        const RSA *rsa = EVP_PKEY_get0_RSA(pkey);
+
+        return mock_obj_ulong(o, CKA_KEY_TYPE, CKK_RSA)
+               && mock_obj_bn(o, CKA_MODULUS, RSA_get0_n(rsa))
+               && mock_obj_bn(o, CKA_PUBLIC_EXPONENT, RSA_get0_e(rsa))
+               && mock_obj_ulong(o, CKA_MODULUS_BITS, EVP_PKEY_get_bits(pkey));
+    } else {
+        char group[80];
+        unsigned char point[256], *der = NULL;
+        size_t plen = 0;
+        ASN1_OCTET_STRING *os;
+        int len;
+
+        if (!mock_obj_ulong(o, CKA_KEY_TYPE, CKK_EC)
+            || !EVP_PKEY_get_utf8_string_param(pkey,
+                                               OSSL_PKEY_PARAM_GROUP_NAME,
+                                               group, sizeof(group), NULL))
+            return 0;
+        len = i2d_ASN1_OBJECT(OBJ_nid2obj(OBJ_sn2nid(group)), &der);
+        if (!mock_obj_der(o, CKA_EC_PARAMS, der, len))
+            return 0;
+        if (!public)
+            return 1;
+        if (!EVP_PKEY_get_octet_string_param(pkey,
+                                             OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY,
+                                             point, sizeof(point), &plen)
+            || (os = ASN1_OCTET_STRING_new()) == NULL)
+            return 0;
+        der = NULL;
+        len = ASN1_OCTET_STRING_set(os, point, (int)plen)
+              ? i2d_ASN1_OCTET_STRING(os, &der) : 0;
+        ASN1_OCTET_STRING_free(os);
+        return mock_obj_der(o, CKA_EC_POINT, der, len);
+    }
+}
+
+static MOCK_OBJECT *mock_obj_new(const MOCK_SPEC *spec, int idx,
+                                 CK_OBJECT_CLASS class)
+{
+    MOCK_OBJECT *objs, *o;
+    char label[256];
+    unsigned char id[64];
+    size_t idlen = spec->idlen;
+
+    objs = OPENSSL_realloc(mock_objects, sizeof(*objs) * (mock_nobjects + 1));
+    if (objs == NULL)
+        return NULL;
+    mock_objects = objs;
+    o = &mock_objects[mock_nobjects];
+    memset(o, 0, sizeof(*o));
+    o->handle = ++mock_nobjects;
+    o->slot = spec->slot;
+    o->class = class;
+
+    /* replicated objects get a numeric suffix and two more id bytes */
+    if (spec->count > 1)
+        BIO_snprintf(label, sizeof(label), "%s%d", spec->label, idx);
+    else
+        BIO_snprintf(label, sizeof(label), "%s", spec->label);
+    if (idlen > sizeof(id) - 2)
+        idlen = sizeof(id) - 2;
+    if (idlen > 0)
+        memcpy(id, spec->id, idlen);
+    if (spec->count > 1) {
+        id[idlen++] = (unsigned char)(idx >> 8);
+        id[idlen++] = (unsigned char)idx;
+    }
+
+    if (!mock_obj_ulong(o, CKA_CLASS, class)
+        || !mock_obj_bool(o, CKA_TOKEN, CK_TRUE)
+        || !mock_obj_attr(o, CKA_LABEL, label, strlen(label))
+        || !mock_obj_attr(o, CKA_ID, id, idlen))
+        return NULL;
+    return o;
+}
+
+static int mock_objects_create(const MOCK_SPEC *spec)
+{
+    MOCK_KEYCACHE *kc = NULL;
+    MOCK_OBJECT *o;
+    unsigned char *der;
+    int i, len;
+
+    if (!spec->data && (kc = mock_key_material(spec)) == NULL)
+        return 0;
+
+    for (i = 0; i < spec->count; i++) {
+        if (spec->data) {
+            const char *v = spec->value != NULL ? spec->value : "";
+
+            if ((o = mock_obj_new(spec, i, CKO_DATA)) == NULL
+                || !mock_obj_bool(o, CKA_PRIVATE, (CK_BBOOL)spec->private)
+                || !mock_obj_attr(o, CKA_VALUE, v, strlen(v)))
+                return 0;
+            o->private = (CK_BBOOL)spec->private;
+            continue;
+        }
+
+        if ((o = mock_obj_new(spec, i, CKO_PRIVATE_KEY)) == NULL
+            || !mock_obj_bool(o, CKA_PRIVATE, CK_TRUE)
+            || !mock_obj_bool(o, CKA_SENSITIVE, CK_TRUE)
+            || !mock_obj_bool(o, CKA_EXTRACTABLE, CK_FALSE)
+            || !mock_obj_bool(o, CKA_SIGN, CK_TRUE)
+            || !mock_obj_bool(o, CKA_DECRYPT,
+                              (CK_BBOOL)(spec->type == EVP_PKEY_RSA))
+            || !mock_obj_bool(o, CKA_ALWAYS_AUTHENTICATE,
+                              (CK_BBOOL)spec->always_auth)
+            || !mock_obj_key_attrs(o, kc->pkey, 0))
+            return 0;
+        o->private = CK_TRUE;
+        o->always_auth = (CK_BBOOL)spec->always_auth;
+        o->pkey = kc->pkey;
+
+        if ((o = mock_obj_new(spec, i, CKO_PUBLIC_KEY)) == NULL
+            || !mock_obj_bool(o, CKA_PRIVATE, CK_FALSE)
+            || !mock_obj_bool(o, CKA_VERIFY, CK_TRUE)
+            || !mock_obj_bool(o, CKA_ENCRYPT,
+                              (CK_BBOOL)(spec->type == EVP_PKEY_RSA))
+            || !mock_obj_key_attrs(o, kc->pkey, 1))
+            return 0;
+        o->pkey = kc->pkey;
+
+        if (!spec->cert)
+            continue;
+        if ((o = mock_obj_new(spec, i, CKO_CERTIFICATE)) == NULL
+            || !mock_obj_bool(o, CKA_PRIVATE, CK_FALSE)
+            || !mock_obj_ulong(o, CKA_CERTIFICATE_TYPE, CKC_X_509))
+            return 0;
+        der = NULL;
+        len = i2d_X509(kc->cert, &der);
+        if (!mock_obj_der(o, CKA_VALUE, der, len))
+            return 0;
+        der = NULL;
+        len = i2d_X509_NAME(X509_get_subject_name(kc->cert), &der);
+        if (!mock_obj_der(o, CKA_SUBJECT, der, len))
+            return 0;
+        der = NULL;
+        len = i2d_X509_NAME(X509_get_issuer_name(kc->cert), &der);
+        if (!mock_obj_der(o, CKA_ISSUER, der, len))
+            return 0;
+        der = NULL;
+        len = i2d_ASN1_INTEGER(X509_get_serialNumber(kc->cert), &der);
+        if (!mock_obj_der(o, CKA_SERIAL_NUMBER, der, len))
+            return 0;
+    }
+    return 1;
+}
+
+static void mock_objects_free(void)
+{
+    CK_ULONG i, j;
+
+    for (i = 0; i < mock_nobjects; i++) {
+        for (j = 0; j < mock_objects[i].nattrs; j++)
+            OPENSSL_free(mock_objects[i].attrs[j].pValue);
+        OPENSSL_free(mock_objects[i].attrs);
+    }
+    OPENSSL_free(mock_objects);
+    mock_objects = NULL;
+    mock_nobjects = 0;
+}
+
+static MOCK_OBJECT *mock_object_get(MOCK_SESSION *s, CK_OBJECT_HANDLE h)
+{
+    MOCK_OBJECT *o;
+
+    if (h == 0 || h > mock_nobjects)
+        return NULL;
+    o = &mock_objects[h - 1];
+    if (o->slot != s->token->id || (o->private && !s->token->logged_in))
+        return NULL;
+    return o;
+}
+
+static CK_ATTRIBUTE *mock_object_attr(MOCK_OBJECT *o, CK_ATTRIBUTE_TYPE type)
+{
+    CK_ULONG i;
+
+    for (i = 0; i < o->nattrs; i++) {
+        if (o->attrs[i].type == type)
+            return &o->attrs[i];
+    }
+    return NULL;
+}
+
+static int mock_object_match(MOCK_OBJECT *o, CK_ATTRIBUTE *tmpl, CK_ULONG n)
+{
+    CK_ATTRIBUTE *a;
+    CK_ULONG i;
+
+    for (i = 0; i < n; i++) {
+        a = mock_object_attr(o, tmpl[i].type);
+        if (a == NULL || a->ulValueLen != tmpl[i].ulValueLen
+            || (a->ulValueLen > 0
+                && memcmp(a->pValue, tmpl[i].pValue, a->ulValueLen) != 0))
+            return 0;
+    }
+    return 1;
+}
+
+/*-
+ * Sessions
+ * --------
+ */
+
+static MOCK_SESSION *mock_session_get(CK_SESSION_HANDLE h)
+{
+    MOCK_SESSION *s = NULL;
+    size_t idx = (size_t)(h & MOCK_SESSION_MASK);
+
+    pthread_mutex_lock(&mock_lock);
+    if (idx > 0 && idx <= mock_nsessions
+        && mock_sessions[idx - 1]->handle == h)
+        s = mock_sessions[idx - 1];
+    pthread_mutex_unlock(&mock_lock);
+
+    if (s == NULL)
+        return NULL;
+    pthread_mutex_lock(&s->lock);
+    if (s->handle != h) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+    return s;
+}
+
+static void mock_session_put(MOCK_SESSION *s)
+{
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void mock_op_end(MOCK_SESSION *s)
+{
+    EVP_MD_CTX_free(s->md);
+    s->md = NULL;
+    OPENSSL_free(s->found);
+    s->found = NULL;
+    s->nfound = s->pos = 0;
+    s->op = MOCK_OP_NONE;
+    s->key = NULL;
+    s->ctx_auth = 0;
+}
+
+/* Called with s->lock and mock_lock held */
+static void mock_session_release(MOCK_SESSION *s)
+{
+    mock_op_end(s);
+    s->handle = 0;
+    if (--s->token->nsessions == 0)
+        s->token->logged_in = 0;
+}
+
+static void mock_session_close(CK_SESSION_HANDLE h)
+{
+    MOCK_SESSION *s = mock_session_get(h);
+
+    if (s == NULL)
+        return;
+    pthread_mutex_lock(&mock_lock);
+    mock_session_release(s);
+    pthread_mutex_unlock(&mock_lock);
+    mock_session_put(s);
+}
+
+static MOCK_TOKEN *mock_token_get(CK_SLOT_ID slot)
+{
+    if (slot >= (CK_SLOT_ID)mock_conf.nslots)
+        return NULL;
+    return &mock_tokens[slot];
+}
+
+static void mock_pad(CK_UTF8CHAR *dst, const char *src, size_t len)
+{
+    size_t n = strlen(src);
+
+    memset(dst, ' ', len);
+    memcpy(dst, src, n < len ? n : len);
+}
+
+/*-
+ * Crypto helpers
+ * --------------
+ */
+
+/* Digest of a hash-and-sign mechanism or of a PSS/OAEP hashAlg */
+static const EVP_MD *mock_mech_md(CK_MECHANISM_TYPE mech)
+{
+    switch (mech) {
+    case CKM_SHA1_RSA_PKCS:
+    case CKM_ECDSA_SHA1:
+    case CKM_SHA_1:
+        return EVP_sha1();
+    case CKM_SHA224_RSA_PKCS:
+    case CKM_ECDSA_SHA224:
+    case CKM_SHA224:
+        return EVP_sha224();
+    case CKM_SHA256_RSA_PKCS:
+    case CKM_ECDSA_SHA256:
+    case CKM_SHA256:
+        return EVP_sha256();
+    case CKM_SHA384_RSA_PKCS:
+    case CKM_ECDSA_SHA384:
+    case CKM_SHA384:
+        return EVP_sha384();
+    case CKM_SHA512_RSA_PKCS:
+    case CKM_ECDSA_SHA512:
+    case CKM_SHA512:
+        return EVP_sha512();
+    }
+    return NULL;
+}
+
+static const EVP_MD *mock_mgf_md(CK_RSA_PKCS_MGF_TYPE mgf)
+{
+    switch (mgf) {
+    case CKG_MGF1_SHA1:
+        return EVP_sha1();
+    case CKG_MGF1_SHA224:
+        return EVP_sha224();
+    case CKG_MGF1_SHA256:
+        return EVP_sha256();
+    case CKG_MGF1_SHA384:
+        return EVP_sha384();
+    case CKG_MGF1_SHA512:
+        return EVP_sha512();
+    }
+    return NULL;
+}
+
+static int mock_mech_is_hash_sign(CK_MECHANISM_TYPE mech)
+{
+    switch (mech) {
+    case CKM_SHA1_RSA_PKCS:
+    case CKM_SHA224_RSA_PKCS:
+    case CKM_SHA256_RSA_PKCS:
+    case CKM_SHA384_RSA_PKCS:
+    case CKM_SHA512_RSA_PKCS:
+    case CKM_ECDSA_SHA1:
+    case CKM_ECDSA_SHA224:
+    case CKM_ECDSA_SHA256:
+    case CKM_ECDSA_SHA384:
+    case CKM_ECDSA_SHA512:
+        return 1;
+    }
+    return 0;
+}
+
+static int mock_mech_is_ec(CK_MECHANISM_TYPE mech)
+{
+    return mech == CKM_ECDSA || (mech >= CKM_ECDSA_SHA1
+                                 && mech <= CKM_ECDSA_SHA512);
+}
+
+static CK_MECHANISM_TYPE mock_mechs[] = {
+    CKM_RSA_PKCS, CKM_RSA_X_509, CKM_RSA_PKCS_PSS, CKM_RSA_PKCS_OAEP,
+    CKM_SHA1_RSA_PKCS, CKM_SHA224_RSA_PKCS, CKM_SHA256_RSA_PKCS,
+    CKM_SHA384_RSA_PKCS, CKM_SHA512_RSA_PKCS,
+    CKM_ECDSA, CKM_ECDSA_SHA1, CKM_ECDSA_SHA224, CKM_ECDSA_SHA256,
+    CKM_ECDSA_SHA384, CKM_ECDSA_SHA512
+};
+
+/* Validates the mechanism against the key and records its parameters */
+static CK_RV mock_op_init(MOCK_SESSION *s, int op, CK_MECHANISM_PTR mech,
+                          CK_OBJECT_HANDLE key)
+{
+    MOCK_OBJECT *o;
+    int rsa;
+
+    if (mech == NULL)
+        return CKR_ARGUMENTS_BAD;
+    if (s->op != MOCK_OP_NONE)
+        return CKR_OPERATION_ACTIVE;
+    if ((o = mock_object_get(s, key)) == NULL)
+        return CKR_KEY_HANDLE_INVALID;
+    if (o->pkey == NULL)
+        return CKR_KEY_TYPE_INCONSISTENT;
+    if (o->private && !s->token->logged_in)
+        return CKR_USER_NOT_LOGGED_IN;
+    if ((op == MOCK_OP_SIGN || op == MOCK_OP_DECRYPT)
+        && o->class != CKO_PRIVATE_KEY)
+        return CKR_KEY_FUNCTION_NOT_PERMITTED;
+    if (op == MOCK_OP_ENCRYPT && o->class != CKO_PUBLIC_KEY)
+        return CKR_KEY_FUNCTION_NOT_PERMITTED;
+
+    rsa = EVP_PKEY_get_base_id(o->pkey) == EVP_PKEY_RSA;
+    s->param_md = s->param_mgf1 = NULL;
+    s->param_saltlen = 0;
+
+    switch (mech->mechanism) {
+    case CKM_RSA_PKCS:
+    case CKM_RSA_X_509:
+        if (!rsa)
+            return CKR_KEY_TYPE_INCONSISTENT;
+        /* a qualified signature card hashes what it signs itself */
+        if (op == MOCK_OP_SIGN && mock_conf.no_raw_sign)
+            return CKR_MECHANISM_INVALID;
+        break;
+    case CKM_RSA_PKCS_PSS:
+        {
+            CK_RSA_PKCS_PSS_PARAMS *p = mech->pParameter;
+
+            if (!rsa || (op != MOCK_OP_SIGN && op != MOCK_OP_VERIFY))
+                return CKR_KEY_TYPE_INCONSISTENT;
+            if (p == NULL || mech->ulParameterLen != sizeof(*p)
+                || (s->param_md = mock_mech_md(p->hashAlg)) == NULL
+                || (s->param_mgf1 = mock_mgf_md(p->mgf)) == NULL)
+                return CKR_MECHANISM_PARAM_INVALID;
+            s->param_saltlen = (int)p->sLen;
+        }
+        break;
+    case CKM_RSA_PKCS_OAEP:
+        {
+            CK_RSA_PKCS_OAEP_PARAMS *p = mech->pParameter;
+
+            if (!rsa || (op != MOCK_OP_DECRYPT && op != MOCK_OP_ENCRYPT))
+                return CKR_KEY_TYPE_INCONSISTENT;
+            if (p == NULL || mech->ulParameterLen != sizeof(*p)
+                || (s->param_md = mock_mech_md(p->hashAlg)) == NULL
+                || (s->param_mgf1 = mock_mgf_md(p->mgf)) == NULL
+                || p->ulSourceDataLen != 0)
+                return CKR_MECHANISM_PARAM_INVALID;
+        }
+        break;
+    case CKM_ECDSA:
+        if (rsa || op == MOCK_OP_DECRYPT || op == MOCK_OP_ENCRYPT)
+            return CKR_KEY_TYPE_INCONSISTENT;
+        break;
+    default:
+        if (!mock_mech_is_hash_sign(mech->mechanism))
+            return CKR_MECHANISM_INVALID;
+        if (rsa == mock_mech_is_ec(mech->mechanism)
+            || op == MOCK_OP_DECRYPT || op == MOCK_OP_ENCRYPT)
+            return CKR_KEY_TYPE_INCONSISTENT;
+        if ((s->md = EVP_MD_CTX_new()) == NULL)
+            return CKR_HOST_MEMORY;
+        if ((op == MOCK_OP_SIGN
+             && !EVP_DigestSignInit(s->md, NULL, mock_mech_md(mech->mechanism),
+                                    NULL, o->pkey))
+            || (op == MOCK_OP_VERIFY
+                && !EVP_DigestVerifyInit(s->md, NULL,
+                                         mock_mech_md(mech->mechanism),
+                                         NULL, o->pkey))) {
+            EVP_MD_CTX_free(s->md);
+            s->md = NULL;
+            return CKR_FUNCTION_FAILED;
+        }
+        break;
+    }
+
+    s->op = op;
+    s->mech = mech->mechanism;
+    s->key = o;
+    s->ctx_auth = 0;
+    return CKR_OK;
+}
+
+static size_t mock_sig_size(MOCK_OBJECT *key)
+{
+    if (EVP_PKEY_get_base_id(key->pkey) == EVP_PKEY_RSA)
+        return EVP_PKEY_get_size(key->pkey);
+    return 2 * ((EVP_PKEY_get_bits(key->pkey) + 7) / 8);
+}
+
+/* Converts a DER ECDSA signature into the PKCS#11 r || s form */
+static int mock_ecdsa_raw(unsigned char *out, size_t n,
+                          const unsigned char *der, size_t derlen)
+{
+    ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &der, (long)derlen);
+    const BIGNUM *r, *s;
+    int ok;
+
+    if (sig == NULL)
+        return 0;
+    ECDSA_SIG_get0(sig, &r, &s);
+    ok = BN_bn2binpad(r, out, (int)n / 2) > 0
+         && BN_bn2binpad(s, out + n / 2, (int)n / 2) > 0;
+    ECDSA_SIG_free(sig);
+    return ok;
+}
+
+static int mock_ecdsa_der(unsigned char **der, const unsigned char *raw,
+                          size_t n)
+{
+    ECDSA_SIG *sig = ECDSA_SIG_new();
+    BIGNUM *r = BN_bin2bn(raw, (int)n / 2, NULL);
+    BIGNUM *s = BN_bin2bn(raw + n / 2, (int)n / 2, NULL);
+    int len = -1;
+
+    if (sig != NULL && r != NULL && s != NULL && ECDSA_SIG_set0(sig, r, s)) {
+        r = s = NULL;
+        len = i2d_ECDSA_SIG(sig, der);
+    }
+    BN_free(r);
+    BN_free(s);
+    ECDSA_SIG_free(sig);
+    return len;
+}
+
+static int mock_pkey_ctx_params(MOCK_SESSION *s, EVP_PKEY_CTX *pctx)
+{
+    switch (s->mech) {
+    case CKM_RSA_PKCS:
+        return EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PADDING) > 0;
+    case CKM_RSA_X_509:
+        return EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_NO_PADDING) > 0;
+    case CKM_RSA_PKCS_PSS:
+        return EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PSS_PADDING) > 0
+               && EVP_PKEY_CTX_set_signature_md(pctx, s->param_md) > 0
+               && EVP_PKEY_CTX_set_rsa_mgf1_md(pctx, s->param_mgf1) > 0
+               && EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx,
+                                                   s->param_saltlen) > 0;
+    case CKM_RSA_PKCS_OAEP:
+        return EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_OAEP_PADDING) > 0
+               && EVP_PKEY_CTX_set_rsa_oaep_md(pctx, s->param_md) > 0
+               && EVP_PKEY_CTX_set_rsa_mgf1_md(pctx, s->param_mgf1) > 0;
+    }
+    return 1;
+}
+
+/* Single shot private or public key operation on s->key */
+static CK_RV mock_pkey_op(MOCK_SESSION *s, const unsigned char *in,
+                          size_t inlen, unsigned char *out, size_t *outlen)
+{
+    EVP_PKEY_CTX *pctx;
+    unsigned char buf[1024], *der = NULL;
+    size_t k = EVP_PKEY_get_size(s->key->pkey);
+    CK_RV rv = CKR_FUNCTION_FAILED;
+    int ok = 0;
+
+    if (s->mech == CKM_RSA_X_509 && inlen < k) {
+        /* raw RSA input is an integer, left pad it to the modulus size */
+        if (k > sizeof(buf))
+            return CKR_DATA_LEN_RANGE;
+        memset(buf, 0, k - inlen);
+        memcpy(buf + k - inlen, in, inlen);
+        in = buf;
+        inlen = k;
+    }
+
+    if (mock_conf.fake_crypto && s->op != MOCK_OP_VERIFY) {
+        if (s->op == MOCK_OP_DECRYPT) {
+            *outlen = inlen < *outlen ? inlen : *outlen;
+            memcpy(out, in, *outlen);
+        } else {
+            memset(out, 0x5a, *outlen);
+        }
+        return CKR_OK;
+    }
+
+    pctx = EVP_PKEY_CTX_new(s->key->pkey, NULL);
+    if (pctx == NULL)
+        return CKR_HOST_MEMORY;
+
+    switch (s->op) {
+    case MOCK_OP_SIGN:
+        if (EVP_PKEY_sign_init(pctx) <= 0 || !mock_pkey_ctx_params(s, pctx))
+            break;
+        if (s->mech == CKM_ECDSA) {
+            size_t derlen = sizeof(buf);
+
+            ok = EVP_PKEY_sign(pctx, buf, &derlen, in, inlen) > 0
+                 && mock_ecdsa_raw(out, *outlen, buf, derlen);
+        } else {
+            ok = EVP_PKEY_sign(pctx, out, outlen, in, inlen) > 0;
+        }
+        break;
+    case MOCK_OP_DECRYPT:
+        ok = EVP_PKEY_decrypt_init(pctx) > 0 && mock_pkey_ctx_params(s, pctx)
+             && EVP_PKEY_decrypt(pctx, out, outlen, in, inlen) > 0;
+        if (!ok)
+            rv = CKR_ENCRYPTED_DATA_INVALID;
+        break;
+    case MOCK_OP_ENCRYPT:
+        ok = EVP_PKEY_encrypt_init(pctx) > 0 && mock_pkey_ctx_params(s, pctx)
+             && EVP_PKEY_encrypt(pctx, out, outlen, in, inlen) > 0;
+        break;
+    case MOCK_OP_VERIFY:
+        if (EVP_PKEY_verify_init(pctx) <= 0 || !mock_pkey_ctx_params(s, pctx))
+            break;
+        /* here |out| is the signature to check against |in| */
+        if (s->mech == CKM_ECDSA) {
+            int len = mock_ecdsa_der(&der, out, *outlen);
+
+            ok = len > 0 && EVP_PKEY_verify(pctx, der, len, in, inlen) > 0;
+            OPENSSL_free(der);
+        } else {
+            ok = EVP_PKEY_verify(pctx, out, *outlen, in, inlen) > 0;
+        }
+        if (!ok)
+            rv = CKR_SIGNATURE_INVALID;
+        break;
+    }
+    EVP_PKEY_CTX_free(pctx);
+    return ok ? CKR_OK : rv;
+}
+
+/* Finishes a hash-and-sign operation fed through s->md */
+static CK_RV mock_md_final(MOCK_SESSION *s, unsigned char *out, size_t *outlen)
+{
+    unsigned char buf[1024];
+    size_t len = sizeof(buf);
+
+    if (mock_conf.fake_crypto && s->op == MOCK_OP_SIGN) {
+        memset(out, 0x5a, *outlen);
+        return CKR_OK;
+    }
+    if (s->op == MOCK_OP_VERIFY) {
+        unsigned char *der = NULL;
+        int derlen, ok;
+
+        if (!mock_mech_is_ec(s->mech))
+            return EVP_DigestVerifyFinal(s->md, out, *outlen) > 0
+                   ? CKR_OK : CKR_SIGNATURE_INVALID;
+        derlen = mock_ecdsa_der(&der, out, *outlen);
+        ok = derlen > 0 && EVP_DigestVerifyFinal(s->md, der, derlen) > 0;
+        OPENSSL_free(der);
+        return ok ? CKR_OK : CKR_SIGNATURE_INVALID;
+    }
+    if (!mock_mech_is_ec(s->mech))
+        return EVP_DigestSignFinal(s->md, out, outlen) > 0
+               ? CKR_OK : CKR_FUNCTION_FAILED;
+    if (EVP_DigestSignFinal(s->md, buf, &len) <= 0
+        || !mock_ecdsa_raw(out, *outlen, buf, len))
+        return CKR_FUNCTION_FAILED;
+    return CKR_OK;
+}
+
+/*
+ * Shared implementation of C_Sign, C_Encrypt and C_Decrypt including the
+ * PKCS#11 length query and CKR_BUFFER_TOO_SMALL conventions.
+ */
+static CK_RV mock_crypt(MOCK_FUNC f, int op, CK_SESSION_HANDLE h,
+                        CK_BYTE_PTR in, CK_ULONG inlen,
+                        CK_BYTE_PTR out, CK_ULONG_PTR outlen)
+{
+    MOCK_SESSION *s;
+    size_t need, len;
+    CK_RV rv;
+
+    if ((rv = mock_enter(f, h)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(h)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (s->op != op) {
+        mock_session_put(s);
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    if (outlen == NULL || (in == NULL && inlen > 0)) {
+        rv = CKR_ARGUMENTS_BAD;
+        goto end;
+    }
+    if (s->key->always_auth && op == MOCK_OP_SIGN && !s->ctx_auth) {
+        rv = CKR_USER_NOT_LOGGED_IN;
+        goto end;
+    }
+
+    need = op == MOCK_OP_SIGN ? mock_sig_size(s->key)
+                              : (size_t)EVP_PKEY_get_size(s->key->pkey);
+    if (out == NULL) {
+        *outlen = need;
+        mock_session_put(s);
+        return CKR_OK;
+    }
+    if (*outlen < need && op != MOCK_OP_DECRYPT) {
+        *outlen = need;
+        mock_session_put(s);
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    mock_lane_enter(s->token, f);
+    len = op == MOCK_OP_DECRYPT ? *outlen : need;
+    if (s->md != NULL) {
+        rv = EVP_DigestSignUpdate(s->md, in, inlen) > 0
+             ? mock_md_final(s, out, &len) : CKR_FUNCTION_FAILED;
+    } else {
+        rv = mock_pkey_op(s, in, inlen, out, &len);
+    }
+    mock_lane_leave(s->token);
+    if (rv == CKR_OK)
+        *outlen = len;
+
+ end:
+    mock_op_end(s);
+    mock_session_put(s);
+    return rv;
+}
+
+/*-
+ * General purpose functions
+ * -------------------------
+ */
+
+CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
+{
+    CK_C_INITIALIZE_ARGS *args = pInitArgs;
+    int i;
+
+    mock_count(MOCK_F_C_Initialize, 0);
+    if (args != NULL && args->pReserved != NULL)
+        return CKR_ARGUMENTS_BAD;
+
+    pthread_mutex_lock(&mock_lock);
+    if (mock_initialized) {
+        pthread_mutex_unlock(&mock_lock);
+        return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+    }
+    if (!mock_conf_load(&mock_conf))
+        goto err;
+
+    memset(mock_tokens, 0, sizeof(mock_tokens));
+    for (i = 0; i < mock_conf.nslots; i++)
+        mock_tokens[i].id = i;
+    for (i = 0; i < mock_conf.nspecs; i++) {
+        if (mock_conf.specs[i].slot >= (CK_SLOT_ID)mock_conf.nslots
+            || !mock_objects_create(&mock_conf.specs[i]))
+            goto err;
+    }
+    mock_finalizing = 0;
+    mock_inflight = 0;
+    mock_initialized = 1;
+    pthread_mutex_unlock(&mock_lock);
+    return CKR_OK;
+
+ err:
+    mock_objects_free();
+    pthread_mutex_unlock(&mock_lock);
+    return CKR_GENERAL_ERROR;
+}
+
+CK_RV C_Finalize(CK_VOID_PTR pReserved)
+{
+    size_t i;
+
+    mock_count(MOCK_F_C_Finalize, 0);
+    if (pReserved != NULL)
+        return CKR_ARGUMENTS_BAD;
+
+    pthread_mutex_lock(&mock_lock);
+    if (!mock_initialized) {
+        pthread_mutex_unlock(&mock_lock);
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    mock_initialized = 0;
+    mock_finalizing = 1;
+    pthread_cond_broadcast(&mock_cond);
+    for (i = 0; i < mock_nsessions; i++) {
+        if (mock_sessions[i]->handle != 0) {
+            mock_op_end(mock_sessions[i]);
+            mock_sessions[i]->handle = 0;
+        }
+    }
+    mock_objects_free();
+    pthread_mutex_unlock(&mock_lock);
+    return CKR_OK;
+}
+
+CK_RV C_GetInfo(CK_INFO_PTR pInfo)
+{
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_GetInfo, 0)) != CKR_OK)
+        return rv;
+    if (pInfo == NULL)
+        return CKR_ARGUMENTS_BAD;
+    memset(pInfo, 0, sizeof(*pInfo));
+    pInfo->cryptokiVersion.major = CRYPTOKI_VERSION_MAJOR;
+    pInfo->cryptokiVersion.minor = CRYPTOKI_VERSION_MINOR;
+    mock_pad(pInfo->manufacturerID, "pkcs11engine",
+             sizeof(pInfo->manufacturerID));
+    mock_pad(pInfo->libraryDescription, "pkcs11engine mock module",
+             sizeof(pInfo->libraryDescription));
+    pInfo->libraryVersion.major = 0;
+    pInfo->libraryVersion.minor = 1;
+    return CKR_OK;
+}
+
+CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
+{
+    mock_count(MOCK_F_C_GetFunctionList, 0);
+    if (ppFunctionList == NULL)
+        return CKR_ARGUMENTS_BAD;
+    *ppFunctionList = &mock_function_list;
+    return CKR_OK;
+}
+
+/*-
+ * Slot and token management
+ * -------------------------
+ */
+
+CK_RV C_GetSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
+                    CK_ULONG_PTR pulCount)
+{
+    CK_ULONG i, n = mock_conf.nslots;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_GetSlotList, 0)) != CKR_OK)
+        return rv;
+    if (pulCount == NULL)
+        return CKR_ARGUMENTS_BAD;
+    if (pSlotList != NULL) {
+        if (*pulCount < n) {
+            *pulCount = n;
+            return CKR_BUFFER_TOO_SMALL;
+        }
+        for (i = 0; i < n; i++)
+            pSlotList[i] = i;
+    }
+    *pulCount = n;
+    return CKR_OK;
+}
+
+CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
+{
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_GetSlotInfo, 0)) != CKR_OK)
+        return rv;
+    if (mock_token_get(slotID) == NULL)
+        return CKR_SLOT_ID_INVALID;
+    if (pInfo == NULL)
+        return CKR_ARGUMENTS_BAD;
+    memset(pInfo, 0, sizeof(*pInfo));
+    mock_pad(pInfo->slotDescription, "pkcs11engine mock slot",
+             sizeof(pInfo->slotDescription));
+    mock_pad(pInfo->manufacturerID, "pkcs11engine",
+             sizeof(pInfo->manufacturerID));
+    pInfo->flags = CKF_TOKEN_PRESENT;
+    return CKR_OK;
+}
+
+CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
+{
+    MOCK_TOKEN *t;
+    char buf[33];
+    CK_ULONG i, used[2] = { 0, 0 };
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_GetTokenInfo, 0)) != CKR_OK)
+        return rv;
+    if ((t = mock_token_get(slotID)) == NULL)
+        return CKR_SLOT_ID_INVALID;
+    if (pInfo == NULL)
+        return CKR_ARGUMENTS_BAD;
+    memset(pInfo, 0, sizeof(*pInfo));
+    BIO_snprintf(buf, sizeof(buf), "mock-token-%lu", slotID);
+    mock_pad(pInfo->label, buf, sizeof(pInfo->label));
+    mock_pad(pInfo->manufacturerID, "pkcs11engine",
+             sizeof(pInfo->manufacturerID));
+    mock_pad(pInfo->model, "mock", sizeof(pInfo->model));
+    BIO_snprintf(buf, sizeof(buf), "MOCK%012lu", slotID);
+    pthread_mutex_lock(&mock_lock);
+    if (t->serial[0] != '\0')
+        strcpy(buf, t->serial);
+    pthread_mutex_unlock(&mock_lock);
+    mock_pad(pInfo->serialNumber, buf, sizeof(pInfo->serialNumber));
+    pInfo->flags = CKF_TOKEN_INITIALIZED | CKF_USER_PIN_INITIALIZED
+                   | CKF_LOGIN_REQUIRED;
+    pInfo->ulMaxSessionCount = mock_conf.max_sessions;
+    pInfo->ulSessionCount = t->nsessions;
+    pInfo->ulMaxRwSessionCount = mock_conf.max_sessions;
+    pInfo->ulMaxPinLen = sizeof(mock_conf.pin) - 1;
+    pInfo->ulMinPinLen = 1;
+    /* what the objects of the token take, as provisioning changes it */
+    pthread_mutex_lock(&mock_lock);
+    for (i = 0; i < mock_nobjects; i++)
+        if (mock_objects[i].slot == slotID)
+            used[mock_objects[i].private != 0] += MOCK_OBJECT_SIZE;
+    pthread_mutex_unlock(&mock_lock);
+    pInfo->ulTotalPublicMemory = MOCK_MEMORY;
+    pInfo->ulFreePublicMemory = MOCK_MEMORY - used[0];
+    pInfo->ulTotalPrivateMemory = MOCK_MEMORY;
+    pInfo->ulFreePrivateMemory = MOCK_MEMORY - used[1];
+    return CKR_OK;
+}
+
+CK_RV C_GetMechanismList(CK_SLOT_ID slotID,
+                         CK_MECHANISM_TYPE_PTR pMechanismList,
+                         CK_ULONG_PTR pulCount)
+{
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_GetMechanismList, 0)) != CKR_OK)
+        return rv;
+    if (mock_token_get(slotID) == NULL)
+        return CKR_SLOT_ID_INVALID;
+    if (pulCount == NULL)
+        return CKR_ARGUMENTS_BAD;
+    if (pMechanismList != NULL) {
+        if (*pulCount < OSSL_NELEM(mock_mechs)) {
+            *pulCount = OSSL_NELEM(mock_mechs);
+            return CKR_BUFFER_TOO_SMALL;
+        }
+        memcpy(pMechanismList, mock_mechs, sizeof(mock_mechs));
+    }
+    *pulCount = OSSL_NELEM(mock_mechs);
+    return CKR_OK;
+}
+
+CK_RV C_GetMechanismInfo(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type,
+                         CK_MECHANISM_INFO_PTR pInfo)
+{
+    size_t i;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_GetMechanismInfo, 0)) != CKR_OK)
+        return rv;
+    if (mock_token_get(slotID) == NULL)
+        return CKR_SLOT_ID_INVALID;
+    if (pInfo == NULL)
+        return CKR_ARGUMENTS_BAD;
+    for (i = 0; i < OSSL_NELEM(mock_mechs); i++) {
+        if (mock_mechs[i] != type)
+            continue;
+        pInfo->ulMinKeySize = mock_mech_is_ec(type) ? 256 : 1024;
+        pInfo->ulMaxKeySize = mock_mech_is_ec(type) ? 521 : 8192;
+        pInfo->flags = CKF_HW | CKF_SIGN | CKF_VERIFY;
+        if (type == CKM_RSA_PKCS || type == CKM_RSA_X_509
+            || type == CKM_RSA_PKCS_OAEP)
+            pInfo->flags |= CKF_ENCRYPT | CKF_DECRYPT;
+        if (type == CKM_RSA_PKCS_OAEP)
+            pInfo->flags &= ~(CKF_SIGN | CKF_VERIFY);
+        return CKR_OK;
+    }
+    return CKR_MECHANISM_INVALID;
+}
+
+CK_RV C_InitToken(CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen,
+                  CK_UTF8CHAR_PTR pLabel)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin,
+                CK_ULONG ulPinLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SetPIN(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin,
+               CK_ULONG ulOldLen, CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/*-
+ * Session management
+ * ------------------
+ */
+
+CK_RV C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags,
+                    CK_VOID_PTR pApplication, CK_NOTIFY Notify,
+                    CK_SESSION_HANDLE_PTR phSession)
+{
+    MOCK_SESSION **sessions, *s = NULL;
+    MOCK_TOKEN *t;
+    size_t i;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_OpenSession, 0)) != CKR_OK)
+        return rv;
+    if ((t = mock_token_get(slotID)) == NULL)
+        return CKR_SLOT_ID_INVALID;
+    if (!(flags & CKF_SERIAL_SESSION))
+        return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
+    if (phSession == NULL)
+        return CKR_ARGUMENTS_BAD;
+
+    pthread_mutex_lock(&mock_lock);
+    if (mock_conf.max_sessions > 0 && t->nsessions >= mock_conf.max_sessions) {
+        pthread_mutex_unlock(&mock_lock);
+        return CKR_SESSION_COUNT;
+    }
+    for (i = 0; i < mock_nsessions; i++) {
+        if (mock_sessions[i]->handle == 0) {
+            s = mock_sessions[i];
+            break;
+        }
+    }
+    if (s == NULL) {
+        if (mock_nsessions == MOCK_SESSION_MASK
+            || (sessions = OPENSSL_realloc(mock_sessions, sizeof(*sessions)
+                                           * (mock_nsessions + 1))) == NULL
+            || (s = OPENSSL_zalloc(sizeof(*s))) == NULL) {
+            pthread_mutex_unlock(&mock_lock);
+            return CKR_HOST_MEMORY;
+        }
+        mock_sessions = sessions;
+        pthread_mutex_init(&s->lock, NULL);
+        mock_sessions[mock_nsessions++] = s;
+        i = mock_nsessions - 1;
+    }
+    s->token = t;
+    s->flags = flags;
+    s->op = MOCK_OP_NONE;
+    memset(s->calls, 0, sizeof(s->calls));
+    s->ncalls = 0;
+    s->handle = (++mock_session_gen << MOCK_SESSION_BITS) | (i + 1);
+    t->nsessions++;
+    *phSession = s->handle;
+    pthread_mutex_unlock(&mock_lock);
+    return CKR_OK;
+}
+
+CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
+{
+    MOCK_SESSION *s;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_CloseSession, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    pthread_mutex_lock(&mock_lock);
+    mock_session_release(s);
+    pthread_mutex_unlock(&mock_lock);
+    mock_session_put(s);
+    return CKR_OK;
+}
+
+CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
+{
+    MOCK_TOKEN *t;
+    size_t i;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_CloseAllSessions, 0)) != CKR_OK)
+        return rv;
+    if ((t = mock_token_get(slotID)) == NULL)
+        return CKR_SLOT_ID_INVALID;
+    for (i = 0; i < mock_nsessions; i++) {
+        CK_SESSION_HANDLE h = mock_sessions[i]->handle;
+
+        if (h != 0 && mock_sessions[i]->token == t)
+            mock_session_close(h);
+    }
+    return CKR_OK;
+}
+
+CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo)
+{
+    MOCK_SESSION *s;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_GetSessionInfo, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (pInfo != NULL) {
+        pInfo->slotID = s->token->id;
+        pInfo->flags = s->flags;
+        pInfo->ulDeviceError = 0;
+        if (s->flags & CKF_RW_SESSION)
+            pInfo->state = s->token->logged_in ? CKS_RW_USER_FUNCTIONS
+                                               : CKS_RW_PUBLIC_SESSION;
+        else
+            pInfo->state = s->token->logged_in ? CKS_RO_USER_FUNCTIONS
+                                               : CKS_RO_PUBLIC_SESSION;
+    }
+    mock_session_put(s);
+    return pInfo != NULL ? CKR_OK : CKR_ARGUMENTS_BAD;
+}
+
+CK_RV C_GetOperationState(CK_SESSION_HANDLE hSession,
+                          CK_BYTE_PTR pOperationState,
+                          CK_ULONG_PTR pulOperationStateLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SetOperationState(CK_SESSION_HANDLE hSession,
+                          CK_BYTE_PTR pOperationState,
+                          CK_ULONG ulOperationStateLen,
+                          CK_OBJECT_HANDLE hEncryptionKey,
+                          CK_OBJECT_HANDLE hAuthenticationKey)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType,
+              CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+    MOCK_SESSION *s;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_Login, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+
+    pthread_mutex_lock(&mock_lock);
+    if (pPin == NULL || ulPinLen != strlen(mock_conf.pin)
+        || memcmp(pPin, mock_conf.pin, ulPinLen) != 0) {
+        rv = CKR_PIN_INCORRECT;
+    } else if (userType == CKU_CONTEXT_SPECIFIC) {
+        if (s->op == MOCK_OP_NONE || s->key == NULL)
+            rv = CKR_OPERATION_NOT_INITIALIZED;
+        else if (!s->token->logged_in)
+            rv = CKR_USER_NOT_LOGGED_IN;
+        else
+            s->ctx_auth = 1;
+    } else if (userType != CKU_USER && userType != CKU_SO) {
+        rv = CKR_USER_TYPE_INVALID;
+    } else if (s->token->logged_in) {
+        rv = CKR_USER_ALREADY_LOGGED_IN;
+    } else {
+        s->token->logged_in = 1;
+    }
+    pthread_mutex_unlock(&mock_lock);
+    mock_session_put(s);
+    return rv;
+}
+
+CK_RV C_Logout(CK_SESSION_HANDLE hSession)
+{
+    MOCK_SESSION *s;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_Logout, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    pthread_mutex_lock(&mock_lock);
+    if (!s->token->logged_in)
+        rv = CKR_USER_NOT_LOGGED_IN;
+    s->token->logged_in = 0;
+    pthread_mutex_unlock(&mock_lock);
+    mock_session_put(s);
+    return rv;
+}
+
+/*-
+ * Object management
+ * -----------------
+ */
+
+CK_RV C_CreateObject(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate,
+                     CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phObject)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_CopyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+                   CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+                   CK_OBJECT_HANDLE_PTR phNewObject)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_GetObjectSize(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+                      CK_ULONG_PTR pulSize)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession,
+                          CK_OBJECT_HANDLE hObject,
+                          CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+    MOCK_SESSION *s;
+    MOCK_OBJECT *o;
+    CK_ATTRIBUTE *a;
+    CK_ULONG i;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_GetAttributeValue, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if ((o = mock_object_get(s, hObject)) == NULL) {
+        mock_session_put(s);
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+    if (pTemplate == NULL && ulCount > 0) {
+        mock_session_put(s);
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    for (i = 0; i < ulCount; i++) {
+        if (o->class == CKO_PRIVATE_KEY
+            && (pTemplate[i].type == CKA_PRIVATE_EXPONENT
+                || pTemplate[i].type == CKA_PRIME_1
+                || pTemplate[i].type == CKA_PRIME_2
+                || pTemplate[i].type == CKA_VALUE)) {
+            pTemplate[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+            rv = CKR_ATTRIBUTE_SENSITIVE;
+        } else if ((a = mock_object_attr(o, pTemplate[i].type)) == NULL) {
+            pTemplate[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+            rv = CKR_ATTRIBUTE_TYPE_INVALID;
+        } else if (pTemplate[i].pValue == NULL) {
+            pTemplate[i].ulValueLen = a->ulValueLen;
+        } else if (pTemplate[i].ulValueLen < a->ulValueLen) {
+            pTemplate[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+            rv = CKR_BUFFER_TOO_SMALL;
+        } else {
+            memcpy(pTemplate[i].pValue, a->pValue, a->ulValueLen);
+            pTemplate[i].ulValueLen = a->ulValueLen;
+        }
+    }
+    mock_session_put(s);
+    return rv;
+}
+
+CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession,
+                          CK_OBJECT_HANDLE hObject,
+                          CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,
+                        CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+    MOCK_SESSION *s;
+    CK_ULONG i;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_FindObjectsInit, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (s->op != MOCK_OP_NONE) {
+        mock_session_put(s);
+        return CKR_OPERATION_ACTIVE;
+    }
+    if (pTemplate == NULL && ulCount > 0) {
+        mock_session_put(s);
+        return CKR_ARGUMENTS_BAD;
+    }
+    s->found = OPENSSL_malloc(sizeof(*s->found) * (mock_nobjects + 1));
+    if (s->found == NULL) {
+        mock_session_put(s);
+        return CKR_HOST_MEMORY;
+    }
+    s->nfound = s->pos = 0;
+    for (i = 1; i <= mock_nobjects; i++) {
+        MOCK_OBJECT *o = mock_object_get(s, i);
+
+        if (o != NULL && mock_object_match(o, pTemplate, ulCount))
+            s->found[s->nfound++] = i;
+    }
+    s->op = MOCK_OP_FIND;
+    mock_session_put(s);
+    return CKR_OK;
+}
+
+CK_RV C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
+                    CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount)
+{
+    MOCK_SESSION *s;
+    CK_ULONG n;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_FindObjects, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (s->op != MOCK_OP_FIND) {
+        mock_session_put(s);
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    if (phObject == NULL || pulObjectCount == NULL) {
+        mock_session_put(s);
+        return CKR_ARGUMENTS_BAD;
+    }
+    n = s->nfound - s->pos;
+    if (n > ulMaxObjectCount)
+        n = ulMaxObjectCount;
+    memcpy(phObject, s->found + s->pos, n * sizeof(*phObject));
+    s->pos += n;
+    *pulObjectCount = n;
+    mock_session_put(s);
+    return CKR_OK;
+}
+
+CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession)
+{
+    MOCK_SESSION *s;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_FindObjectsFinal, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (s->op != MOCK_OP_FIND)
+        rv = CKR_OPERATION_NOT_INITIALIZED;
+    else
+        mock_op_end(s);
+    mock_session_put(s);
+    return rv;
+}
+
+/*-
+ * Encryption and decryption
+ * -------------------------
+ */
+
+static CK_RV mock_init_op(MOCK_FUNC f, int op, CK_SESSION_HANDLE h,
+                          CK_MECHANISM_PTR mech, CK_OBJECT_HANDLE key)
+{
+    MOCK_SESSION *s;
+    CK_RV rv;
+
+    if ((rv = mock_enter(f, h)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(h)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    rv = mock_op_init(s, op, mech, key);
+    mock_session_put(s);
+    return rv;
+}
+
+CK_RV C_EncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                    CK_OBJECT_HANDLE hKey)
+{
+    return mock_init_op(MOCK_F_C_EncryptInit, MOCK_OP_ENCRYPT, hSession,
+                        pMechanism, hKey);
+}
+
+CK_RV C_Encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+                CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData,
+                CK_ULONG_PTR pulEncryptedDataLen)
+{
+    return mock_crypt(MOCK_F_C_Encrypt, MOCK_OP_ENCRYPT, hSession,
+                      pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+}
+
+CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+                      CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart,
+                      CK_ULONG_PTR pulEncryptedPartLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,
+                     CK_BYTE_PTR pLastEncryptedPart,
+                     CK_ULONG_PTR pulLastEncryptedPartLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                    CK_OBJECT_HANDLE hKey)
+{
+    return mock_init_op(MOCK_F_C_DecryptInit, MOCK_OP_DECRYPT, hSession,
+                        pMechanism, hKey);
+}
+
+CK_RV C_Decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData,
+                CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData,
+                CK_ULONG_PTR pulDataLen)
+{
+    return mock_crypt(MOCK_F_C_Decrypt, MOCK_OP_DECRYPT, hSession,
+                      pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+}
+
+CK_RV C_DecryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart,
+                      CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart,
+                      CK_ULONG_PTR pulPartLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastPart,
+                     CK_ULONG_PTR pulLastPartLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/*-
+ * Message digesting
+ * -----------------
+ */
+
+CK_RV C_DigestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_Digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+               CK_ULONG ulDataLen, CK_BYTE_PTR pDigest,
+               CK_ULONG_PTR pulDigestLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DigestUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+                     CK_ULONG ulPartLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DigestKey(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DigestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest,
+                    CK_ULONG_PTR pulDigestLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/*-
+ * Signing and MACing
+ * ------------------
+ */
+
+CK_RV C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                 CK_OBJECT_HANDLE hKey)
+{
+    return mock_init_op(MOCK_F_C_SignInit, MOCK_OP_SIGN, hSession,
+                        pMechanism, hKey);
+}
+
+CK_RV C_Sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+             CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
+             CK_ULONG_PTR pulSignatureLen)
+{
+    return mock_crypt(MOCK_F_C_Sign, MOCK_OP_SIGN, hSession,
+                      pData, ulDataLen, pSignature, pulSignatureLen);
+}
+
+static CK_RV mock_update(MOCK_FUNC f, int op, CK_SESSION_HANDLE h,
+                         CK_BYTE_PTR part, CK_ULONG len)
+{
+    MOCK_SESSION *s;
+    CK_RV rv;
+    int ok;
+
+    if ((rv = mock_enter(f, h)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(h)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (s->op != op) {
+        mock_session_put(s);
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    if (s->md == NULL) {
+        /* raw mechanisms are single-part only */
+        mock_op_end(s);
+        mock_session_put(s);
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
+    mock_lane_enter(s->token, f);
+    ok = op == MOCK_OP_SIGN ? EVP_DigestSignUpdate(s->md, part, len)
+                            : EVP_DigestVerifyUpdate(s->md, part, len);
+    mock_lane_leave(s->token);
+    if (!ok) {
+        mock_op_end(s);
+        rv = CKR_FUNCTION_FAILED;
+    }
+    mock_session_put(s);
+    return rv;
+}
+
+CK_RV C_SignUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+                   CK_ULONG ulPartLen)
+{
+    return mock_update(MOCK_F_C_SignUpdate, MOCK_OP_SIGN, hSession,
+                       pPart, ulPartLen);
+}
+
+CK_RV C_SignFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+                  CK_ULONG_PTR pulSignatureLen)
+{
+    MOCK_SESSION *s;
+    size_t need;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_SignFinal, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (s->op != MOCK_OP_SIGN || s->md == NULL) {
+        mock_session_put(s);
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    if (pulSignatureLen == NULL) {
+        rv = CKR_ARGUMENTS_BAD;
+        goto end;
+    }
+    if (s->key->always_auth && !s->ctx_auth) {
+        rv = CKR_USER_NOT_LOGGED_IN;
+        goto end;
+    }
+    need = mock_sig_size(s->key);
+    if (pSignature == NULL || *pulSignatureLen < need) {
+        rv = pSignature == NULL ? CKR_OK : CKR_BUFFER_TOO_SMALL;
+        *pulSignatureLen = need;
+        mock_session_put(s);
+        return rv;
+    }
+    mock_lane_enter(s->token, MOCK_F_C_SignFinal);
+    rv = mock_md_final(s, pSignature, &need);
+    mock_lane_leave(s->token);
+    if (rv == CKR_OK)
+        *pulSignatureLen = need;
+
+ end:
+    mock_op_end(s);
+    mock_session_put(s);
+    return rv;
+}
+
+CK_RV C_SignRecoverInit(CK_SESSION_HANDLE hSession,
+                        CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SignRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+                    CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
+                    CK_ULONG_PTR pulSignatureLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/*-
+ * Verifying signatures and MACs
+ * -----------------------------
+ */
+
+CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                   CK_OBJECT_HANDLE hKey)
+{
+    return mock_init_op(MOCK_F_C_VerifyInit, MOCK_OP_VERIFY, hSession,
+                        pMechanism, hKey);
+}
+
+CK_RV C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+               CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
+               CK_ULONG ulSignatureLen)
+{
+    MOCK_SESSION *s;
+    size_t siglen = ulSignatureLen;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_Verify, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (s->op != MOCK_OP_VERIFY) {
+        mock_session_put(s);
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    if (pSignature == NULL || (pData == NULL && ulDataLen > 0)) {
+        rv = CKR_ARGUMENTS_BAD;
+    } else {
+        mock_lane_enter(s->token, MOCK_F_C_Verify);
+        if (s->md != NULL)
+            rv = EVP_DigestVerifyUpdate(s->md, pData, ulDataLen) > 0
+                 ? mock_md_final(s, pSignature, &siglen)
+                 : CKR_FUNCTION_FAILED;
+        else
+            rv = mock_pkey_op(s, pData, ulDataLen, pSignature, &siglen);
+        mock_lane_leave(s->token);
+    }
+    mock_op_end(s);
+    mock_session_put(s);
+    return rv;
+}
+
+CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+                     CK_ULONG ulPartLen)
+{
+    return mock_update(MOCK_F_C_VerifyUpdate, MOCK_OP_VERIFY, hSession,
+                       pPart, ulPartLen);
+}
+
+CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+                    CK_ULONG ulSignatureLen)
+{
+    MOCK_SESSION *s;
+    size_t siglen = ulSignatureLen;
+    CK_RV rv;
+
+    if ((rv = mock_enter(MOCK_F_C_VerifyFinal, hSession)) != CKR_OK)
+        return rv;
+    if ((s = mock_session_get(hSession)) == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (s->op != MOCK_OP_VERIFY || s->md == NULL) {
+        mock_session_put(s);
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    if (pSignature == NULL) {
+        rv = CKR_ARGUMENTS_BAD;
+    } else {
+        mock_lane_enter(s->token, MOCK_F_C_VerifyFinal);
+        rv = mock_md_final(s, pSignature, &siglen);
+        mock_lane_leave(s->token);
+    }
+    mock_op_end(s);
+    mock_session_put(s);
+    return rv;
+}
+
+CK_RV C_VerifyRecoverInit(CK_SESSION_HANDLE hSession,
+                          CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_VerifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+                      CK_ULONG ulSignatureLen, CK_BYTE_PTR pData,
+                      CK_ULONG_PTR pulDataLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/*-
+ * Dual-function cryptographic operations
+ * --------------------------------------
+ */
+
+CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+                            CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart,
+                            CK_ULONG_PTR pulEncryptedPartLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptDigestUpdate(CK_SESSION_HANDLE hSession,
+                            CK_BYTE_PTR pEncryptedPart,
+                            CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart,
+                            CK_ULONG_PTR pulPartLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SignEncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+                          CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart,
+                          CK_ULONG_PTR pulEncryptedPartLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptVerifyUpdate(CK_SESSION_HANDLE hSession,
+                            CK_BYTE_PTR pEncryptedPart,
+                            CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart,
+                            CK_ULONG_PTR pulPartLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/*-
+ * Key management
+ * --------------
+ */
+
+CK_RV C_GenerateKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                    CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+                    CK_OBJECT_HANDLE_PTR phKey)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,
+                        CK_MECHANISM_PTR pMechanism,
+                        CK_ATTRIBUTE_PTR pPublicKeyTemplate,
+                        CK_ULONG ulPublicKeyAttributeCount,
+                        CK_ATTRIBUTE_PTR pPrivateKeyTemplate,
+                        CK_ULONG ulPrivateKeyAttributeCount,
+                        CK_OBJECT_HANDLE_PTR phPublicKey,
+                        CK_OBJECT_HANDLE_PTR phPrivateKey)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_WrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                CK_OBJECT_HANDLE hWrappingKey, CK_OBJECT_HANDLE hKey,
+                CK_BYTE_PTR pWrappedKey, CK_ULONG_PTR pulWrappedKeyLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                  CK_OBJECT_HANDLE hUnwrappingKey, CK_BYTE_PTR pWrappedKey,
+                  CK_ULONG ulWrappedKeyLen, CK_ATTRIBUTE_PTR pTemplate,
+                  CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                  CK_OBJECT_HANDLE hBaseKey, CK_ATTRIBUTE_PTR pTemplate,
+                  CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/*-
+ * Random number generation
+ * ------------------------
+ */
+
+CK_RV C_SeedRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed,
+                   CK_ULONG ulSeedLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomData,
+                       CK_ULONG ulRandomLen)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/*-
+ * Parallel function management and slot events
+ * --------------------------------------------
+ */
+
+CK_RV C_GetFunctionStatus(CK_SESSION_HANDLE hSession)
+{
+    return CKR_FUNCTION_NOT_PARALLEL;
+}
+
+CK_RV C_CancelFunction(CK_SESSION_HANDLE hSession)
+{
+    return CKR_FUNCTION_NOT_PARALLEL;
+}
+
+CK_RV C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot,
+                         CK_VOID_PTR pRserved)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static CK_FUNCTION_LIST mock_function_list = {
+    { CRYPTOKI_VERSION_MAJOR, CRYPTOKI_VERSION_MINOR },
+#define CK_PKCS11_FUNCTION_INFO(name) name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+};
+
+/*-
+ * Control interface
+ * -----------------
+ */
+
+int pkcs11mock_configure(const char *conf)
+{
+    char **overrides;
+    int ok;
+
+    pthread_mutex_lock(&mock_lock);
+    ok = mock_conf_text(&mock_conf, conf, 1);
+    overrides = OPENSSL_realloc(mock_overrides,
+                                sizeof(*overrides) * (mock_noverrides + 1));
+    if (overrides != NULL) {
+        mock_overrides = overrides;
+        if ((mock_overrides[mock_noverrides] = OPENSSL_strdup(conf)) != NULL)
+            mock_noverrides++;
+    }
+    pthread_cond_broadcast(&mock_cond);
+    pthread_mutex_unlock(&mock_lock);
+    return ok;
+}
+
+static int mock_obj_set(MOCK_OBJECT *o, CK_ATTRIBUTE_TYPE type,
+                        const void *value, CK_ULONG len)
+{
+    CK_ATTRIBUTE *a = mock_object_attr(o, type);
+    void *copy;
+
+    if (a == NULL)
+        return mock_obj_attr(o, type, value, len);
+    if ((copy = OPENSSL_memdup(value, len > 0 ? len : 1)) == NULL)
+        return 0;
+    OPENSSL_free(a->pValue);
+    a->pValue = copy;
+    a->ulValueLen = len;
+    return 1;
+}
+
+/* One line of pkcs11mock_provision(); mock_lock held */
+static int mock_provision_line(char *line)
+{
+    MOCK_OBJECT *o;
+    CK_ATTRIBUTE *a;
+    char *eq, *key, *label, *arg = NULL;
+    CK_ULONG i;
+    int n = 0;
+
+    line = mock_trim(line);
+    if (*line == '\0')
+        return 1;
+    if ((eq = strchr(line, '=')) == NULL)
+        return 0;
+    *eq = '\0';
+    key = mock_trim(line);
+    label = mock_trim(eq + 1);
+    if (strcmp(key, "destroy") != 0) {
+        if ((arg = strchr(label, ':')) == NULL)
+            return 0;
+        *arg++ = '\0';
+    }
+    if (strcmp(key, "serial") == 0) {
+        /* another token in the slot, with the same objects */
+        i = strtoul(label, NULL, 10);
+        if (i >= (CK_ULONG)mock_conf.nslots || strlen(arg) >= 17)
+            return 0;
+        strcpy(mock_tokens[i].serial, arg);
+        return 1;
+    }
+
+    for (i = 0; i < mock_nobjects; i++) {
+        o = &mock_objects[i];
+        a = mock_object_attr(o, CKA_LABEL);
+        if (o->slot == MOCK_GONE || a == NULL
+            || a->ulValueLen != strlen(label)
+            || memcmp(a->pValue, label, a->ulValueLen) != 0)
+            continue;
+        if (strcmp(key, "destroy") == 0) {
+            o->slot = MOCK_GONE;
+        } else if (strcmp(key, "rename") == 0) {
+            if (!mock_obj_set(o, CKA_LABEL, arg, strlen(arg)))
+                return 0;
+        } else if (strcmp(key, "value") == 0 && o->class == CKO_DATA) {
+            if (!mock_obj_set(o, CKA_VALUE, arg, strlen(arg)))
+                return 0;
+        } else {
+            continue;
+        }
+        n++;
+    }
+    return n > 0;
+}
+
+int pkcs11mock_provision(const char *conf)
+{
+    char *buf, *line, *save = NULL;
+    int ok = 1;
+
+    if ((buf = OPENSSL_strdup(conf)) == NULL)
+        return 0;
+    pthread_mutex_lock(&mock_lock);
+    for (line = strtok_r(buf, ";\n", &save); line != NULL;
+         line = strtok_r(NULL, ";\n", &save)) {
+        if (!mock_provision_line(line)) {
+            fprintf(stderr, "pkcs11mock: cannot provision \"%s\"\n", line);
+            ok = 0;
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+    OPENSSL_free(buf);
+    return ok;
+}
+
+void pkcs11mock_reset(void)
+{
+    int i;
+
+    pthread_mutex_lock(&mock_lock);
+    for (i = 0; i < mock_noverrides; i++)
+        OPENSSL_free(mock_overrides[i]);
+    OPENSSL_free(mock_overrides);
+    mock_overrides = NULL;
+    mock_noverrides = 0;
+    memset(mock_conf.funcs, 0, sizeof(mock_conf.funcs));
+    pthread_mutex_unlock(&mock_lock);
+}
+
+int pkcs11mock_script_call(const char *func, double latency_us,
+                           unsigned long rv)
+{
+    MOCK_SCRIPT *sc;
+    int f = mock_func_lookup(func);
+
+    if (f < 0 || mock_script_len == MOCK_SCRIPT_MAX)
+        return 0;
+    sc = &mock_script[(mock_script_head + mock_script_len) % MOCK_SCRIPT_MAX];
+    sc->func = f;
+    sc->latency = latency_us;
+    sc->rv = rv;
+    mock_script_len++;
+    return 1;
+}
+
+void pkcs11mock_script_clear(void)
+{
+    mock_script_head = mock_script_len = 0;
+    mock_script_latency = -1;
+}
+
+unsigned long pkcs11mock_calls(const char *func)
+{
+    unsigned long n = 0;
+    int f;
+
+    if (func != NULL) {
+        if ((f = mock_func_lookup(func)) < 0)
+            return 0;
+        return __atomic_load_n(&mock_calls[f], __ATOMIC_RELAXED);
+    }
+    for (f = 0; f < MOCK_F_NUM; f++)
+        n += __atomic_load_n(&mock_calls[f], __ATOMIC_RELAXED);
+    return n;
+}
+
+unsigned long pkcs11mock_session_calls(unsigned long session,
+                                       const char *func)
+{
+    size_t idx = (size_t)(session & MOCK_SESSION_MASK);
+    unsigned long n = 0;
+    MOCK_SESSION *s;
+    int f = -1;
+
+    if (func != NULL && (f = mock_func_lookup(func)) < 0)
+        return 0;
+    pthread_mutex_lock(&mock_lock);
+    if (idx > 0 && idx <= mock_nsessions
+        && (s = mock_sessions[idx - 1])->handle == session)
+        n = f < 0 ? s->ncalls : s->calls[f];
+    pthread_mutex_unlock(&mock_lock);
+    return n;
+}
+
+int pkcs11mock_sessions_called(void)
+{
+    size_t i;
+    int n = 0;
+
+    pthread_mutex_lock(&mock_lock);
+    for (i = 0; i < mock_nsessions; i++)
+        if (mock_sessions[i]->handle != 0 && mock_sessions[i]->ncalls > 0)
+            n++;
+    pthread_mutex_unlock(&mock_lock);
+    return n;
+}
+
+void pkcs11mock_calls_reset(void)
+{
+    size_t i;
+    int f;
+
+    pthread_mutex_lock(&mock_lock);
+    for (f = 0; f < MOCK_F_NUM; f++)
+        __atomic_store_n(&mock_calls[f], 0, __ATOMIC_RELAXED);
+    for (i = 0; i < mock_nsessions; i++) {
+        memset(mock_sessions[i]->calls, 0, sizeof(mock_sessions[i]->calls));
+        mock_sessions[i]->ncalls = 0;
+    }
+    mock_lanes_peak = 0;
+    pthread_mutex_unlock(&mock_lock);
+}
+
+int pkcs11mock_lanes_peak(void)
+{
+    int n;
+
+    pthread_mutex_lock(&mock_lock);
+    n = mock_lanes_peak;
+    pthread_mutex_unlock(&mock_lock);
+    return n;
+}
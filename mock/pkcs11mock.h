@@ -0,0 +1,124 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+#ifndef HEADER_PKCS11MOCK_H
+# define HEADER_PKCS11MOCK_H
+
+/*
+ * Runtime control interface of the mock PKCS#11 module.  Besides
+ * C_GetFunctionList the module exports the functions below; test and
+ * benchmark programs resolve them with dlsym() on the same module file the
+ * engine was pointed at.
+ *
+ * The initial configuration is read by C_Initialize from the file named by
+ * $PKCS11MOCK_CONF and then from the inline string in $PKCS11MOCK (lines
+ * separated by newlines or ';').  Recognised lines:
+ *
+ *   slots = N                  tokens to expose (slot ids 0..N-1)
+ *   max_sessions = N           per-token session limit (CKR_SESSION_COUNT)
+ *   lanes = N                  per-token concurrent crypto operations
+ *   max_inflight = N           module-wide concurrent crypto operations
+ *   pin = 1234                 user PIN of every token
+ *   crypto = real|fake         fake skips the private key maths
+ *   raw_sign = yes|no          no refuses CKM_RSA_PKCS and CKM_RSA_X_509
+ *                              signatures, as qualified signature cards do
+ *   hang_ms = N                duration of an injected hang, 0 = forever
+ *   seed = N                   seed of the latency/fault generator
+ *   key = slot=0,label=rsa0,id=01,type=rsa,bits=2048,cert=yes,
+ *         always_auth=no,count=1,file=key.pem,cert_file=cert.pem
+ *   key = label=ec0,id=02,type=ec,curve=prime256v1
+ *   data = slot=0,label=cfg,id=10,value=text,private=no,count=1
+ *   latency.C_Sign = fixed:U | uniform:A:B | normal:MEAN:SD
+ *                    | exp:MEAN | lognormal:MEDIAN:SIGMA | none
+ *   fault.C_Sign = device_error:P,session_closed:P,hang:P,0x30:P | none
+ *
+ * Latencies are in microseconds, P is a probability in [0, 1] and
+ * "latency.*" / "fault.*" apply to every function.  Without any "key" line
+ * a token holds an RSA-2048 key "rsa0" (id 01) and a P-256 key "ec0"
+ * (id 02), each with a self-signed certificate.
+ */
+
+/*
+ * Apply configuration lines at runtime.  Tunables take effect immediately
+ * and are replayed after the environment on every later C_Initialize; key
+ * and data lines only take effect on the next C_Initialize.
+ * Returns 1 on success, 0 on a malformed line.
+ */
+int pkcs11mock_configure(const char *conf);
+
+/* Forget every configuration applied with pkcs11mock_configure(). */
+void pkcs11mock_reset(void);
+
+/*
+ * Change the objects of the tokens as another host provisioning them
+ * would, between operations of the engine.  Lines as above:
+ *
+ *   destroy = tls              objects labelled "tls" are gone
+ *   rename = tls-next:tls      objects labelled "tls-next" become "tls"
+ *   value = generation:2       CKA_VALUE of the data objects "generation"
+ *   serial = 0:OTHER           another token, of that serial, in slot 0
+ *
+ * Every token reports its free memory going down by 1024 bytes per
+ * object.  Returns 0 on a malformed line or a label no object has.
+ */
+int pkcs11mock_provision(const char *conf);
+
+/*
+ * Script the next call of |func| (e.g. "C_Sign") made by the calling
+ * thread: it takes |latency_us| microseconds instead of a sample of the
+ * configured distribution and, unless |rv| is CKR_OK, fails with |rv|
+ * without doing anything.  Scripted calls are queued per thread and
+ * consumed in order; queued calls of other functions are skipped when a
+ * later entry matches, so a caller that makes fewer calls than scripted does
+ * not stall the queue.  Returns 0 if |func| is unknown or the queue is full.
+ */
+int pkcs11mock_script_call(const char *func, double latency_us,
+                           unsigned long rv);
+
+/* Drop the calls still queued for the calling thread. */
+void pkcs11mock_script_clear(void);
+
+/*
+ * Calls of |func| (e.g. "C_FindObjects", NULL for every function) since
+ * the module was loaded or the last pkcs11mock_calls_reset(), including
+ * the calls that failed.
+ */
+unsigned long pkcs11mock_calls(const char *func);
+
+/* Same, made on |session| since it was opened; 0 once it is closed. */
+unsigned long pkcs11mock_session_calls(unsigned long session,
+                                       const char *func);
+
+/* Open sessions that were called since the last pkcs11mock_calls_reset(). */
+int pkcs11mock_sessions_called(void);
+
+/* Zero every call counter, of the module and of its sessions. */
+void pkcs11mock_calls_reset(void);
+
+/*
+ * Most crypto operations a token had in flight at once, since the last
+ * pkcs11mock_calls_reset().
+ */
+int pkcs11mock_lanes_peak(void);
+
+typedef int (*PKCS11MOCK_CONFIGURE_FN)(const char *conf);
+typedef void (*PKCS11MOCK_RESET_FN)(void);
+typedef int (*PKCS11MOCK_PROVISION_FN)(const char *conf);
+typedef int (*PKCS11MOCK_SCRIPT_CALL_FN)(const char *func, double latency_us,
+                                         unsigned long rv);
+typedef void (*PKCS11MOCK_SCRIPT_CLEAR_FN)(void);
+typedef unsigned long (*PKCS11MOCK_CALLS_FN)(const char *func);
+typedef unsigned long (*PKCS11MOCK_SESSION_CALLS_FN)(unsigned long session,
+                                                     const char *func);
+typedef int (*PKCS11MOCK_SESSIONS_CALLED_FN)(void);
+typedef void (*PKCS11MOCK_CALLS_RESET_FN)(void);
+typedef int (*PKCS11MOCK_LANES_PEAK_FN)(void);
+
+#endif
@@ -9,11 +9,21 @@
  */
 
 #include "e_pkcs11.h"
-#include "e_pkcs11_err.c"
+#include "e_pkcs11_err.h"
+#include "e_pkcs11_call.h"
+#include "e_pkcs11_rec.h"
 #include "dso.h"
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <openssl/bn.h>
 
 #define OSSL_NELEM(x)    (sizeof(x)/sizeof((x)[0]))
+#define PKCS11_MODULUS_MAX      1024    /* RSA-8192 */
+#define PKCS11_EXPONENT_MAX     16
+#define PKCS11_EC_PARAMS_MAX    128     /* a named curve */
+#define PKCS11_EC_POINT_MAX     160     /* P-521, uncompressed, as DER */
+#define PKCS11_NAME_MAX         256     /* CKA_LABEL and CKA_ID in listings */
 
 struct X509_sig_st {
     X509_ALGOR *algor;
@@ -21,14 +31,282 @@ struct X509_sig_st {
 };
 
 typedef CK_RV pkcs11_pFunc(CK_FUNCTION_LIST **pkcs11_funcs);
-static CK_RV pkcs11_load_functions(const char *library_path);
+static CK_RV pkcs11_load_functions(const char *library_path, DSO **dso,
+                                   CK_FUNCTION_LIST **funcs);
 static CK_FUNCTION_LIST *pkcs11_funcs;
-static int pkcs11_get_key(OSSL_STORE_LOADER_CTX *store_ctx,
-                          CK_OBJECT_HANDLE obj);
+static CK_FUNCTION_LIST *pkcs11_module_funcs = NULL; /* not recorded */
+static DSO *pkcs11_dso = NULL;
+
+#ifdef PKCS11_STATIC_MODULE
+/*
+ * The module linked into the engine at build time.  While it is the one
+ * in use and its calls are not recorded, it is called directly rather
+ * than through its function list.
+ */
+static CK_FUNCTION_LIST *pkcs11_static_funcs = NULL;
+static int pkcs11_direct = 0;
+# define PKCS11_CALL(f, ...) \
+    PKCS11_CALL_VIA(f, pkcs11_direct ? f(__VA_ARGS__)  \
+                                     : pkcs11_funcs->f(__VA_ARGS__))
+#else
+# define PKCS11_CALL(f, ...) PKCS11_CALL_ON(pkcs11_funcs, f, __VA_ARGS__)
+#endif
+
 static int pkcs11_get_cert(OSSL_STORE_LOADER_CTX *store_ctx,
-                           CK_OBJECT_HANDLE obj);
-static int pkcs11_rsa_encode_pkcs1(unsigned char **out, int *out_len, int type,
-                                   const unsigned char *m, unsigned int m_len);
+                           CK_OBJECT_HANDLE obj, CK_ATTRIBUTE *value);
+static int pkcs11_get_key(OSSL_STORE_LOADER_CTX *store_ctx,
+                          CK_OBJECT_HANDLE obj, CK_ATTRIBUTE *modulus,
+                          CK_ATTRIBUTE *exponent);
+static char *pkcs11_module = NULL;
+static int pkcs11_initialized = 0;
+
+/*
+ * Module reloads.  Every call goes through pkcs11_funcs, so it is only
+ * swapped while nothing uses the module: |pkcs11_busy| counts the sessions
+ * handed out and the token queries under way, |pkcs11_held| keeps new
+ * ones waiting while a reload waits for those, and |pkcs11_generation|
+ * tells the key handles found on an older module.  Entering and leaving
+ * only touch the counter unless the module is held; the waits on either
+ * side sleep on |pkcs11_module_cond|.  |pkcs11_hold_lock| makes a hold
+ * exclusive, as a reload and a profile may want one at the same time.
+ */
+static unsigned int pkcs11_busy = 0;
+static int pkcs11_held = 0;
+static unsigned int pkcs11_generation = 0;
+static int pkcs11_os_locking = 1;
+static pthread_mutex_t pkcs11_hold_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pkcs11_module_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pkcs11_module_cond = PTHREAD_COND_INITIALIZER;
+
+/* Wake a hold waiting for the module to be unused */
+static void pkcs11_module_idle(void)
+{
+    if (!__atomic_load_n(&pkcs11_held, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock(&pkcs11_module_lock);
+    pthread_cond_broadcast(&pkcs11_module_cond);
+    pthread_mutex_unlock(&pkcs11_module_lock);
+}
+
+static void pkcs11_module_enter(void)
+{
+    for (;;) {
+        __atomic_add_fetch(&pkcs11_busy, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&pkcs11_held, __ATOMIC_SEQ_CST))
+            return;
+        /* a hold came first, let it go and wait for its release */
+        if (__atomic_sub_fetch(&pkcs11_busy, 1, __ATOMIC_SEQ_CST) == 0)
+            pkcs11_module_idle();
+        pthread_mutex_lock(&pkcs11_module_lock);
+        while (__atomic_load_n(&pkcs11_held, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&pkcs11_module_cond, &pkcs11_module_lock);
+        pthread_mutex_unlock(&pkcs11_module_lock);
+    }
+}
+
+static void pkcs11_module_leave(void)
+{
+    if (__atomic_sub_fetch(&pkcs11_busy, 1, __ATOMIC_SEQ_CST) == 0)
+        pkcs11_module_idle();
+}
+
+/**
+ * Read the attributes of an object in a single C_GetAttributeValue() call.
+ * The template gives every variable length attribute a buffer that is
+ * usually large enough; an attribute that does not fit, or that the object
+ * does not have or keeps secret, comes back with CK_UNAVAILABLE_INFORMATION
+ * instead of failing the call, see pkcs11_get_attribute_alloc().
+ * @param session
+ * @param obj
+ * @param tmpl
+ * @param count
+ * @return CKR_OK, or the error of the call
+ */
+static CK_RV pkcs11_get_attributes(CK_SESSION_HANDLE session,
+                                   CK_OBJECT_HANDLE obj, CK_ATTRIBUTE *tmpl,
+                                   CK_ULONG count)
+{
+    CK_RV rv;
+
+    rv = PKCS11_CALL(C_GetAttributeValue, session, obj, tmpl, count);
+    if (rv == CKR_ATTRIBUTE_TYPE_INVALID || rv == CKR_ATTRIBUTE_SENSITIVE
+        || rv == CKR_BUFFER_TOO_SMALL)
+        return CKR_OK;
+    return rv;
+}
+
+/**
+ * Read one attribute that did not fit its buffer, asking for its size
+ * first.  On success |attr| points to a buffer the caller frees with
+ * OPENSSL_free().
+ * @param session
+ * @param obj
+ * @param attr
+ * @return 1 on success, 0 on error
+ */
+static int pkcs11_get_attribute_alloc(CK_SESSION_HANDLE session,
+                                      CK_OBJECT_HANDLE obj,
+                                      CK_ATTRIBUTE *attr)
+{
+    CK_RV rv;
+
+    attr->pValue = NULL;
+    attr->ulValueLen = 0;
+    rv = PKCS11_CALL(C_GetAttributeValue, session, obj, attr, 1);
+    if (rv != CKR_OK || attr->ulValueLen == CK_UNAVAILABLE_INFORMATION) {
+        return 0;
+    }
+    if ((attr->pValue = OPENSSL_malloc(attr->ulValueLen + 1)) == NULL)
+        return 0;
+    rv = PKCS11_CALL(C_GetAttributeValue, session, obj, attr, 1);
+    if (rv != CKR_OK) {
+        OPENSSL_free(attr->pValue);
+        attr->pValue = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Forget the cached loads of a key the token no longer knows, and with
+ * CACHE_CHECK those of every key of its token, which another host changed.
+ * @param ctx
+ * @param key
+ * @param rv the error of the call that used the key handle
+ */
+static void pkcs11_key_stale(PKCS11_CTX *ctx, const PKCS11_KEY *key, CK_RV rv)
+{
+    if (pkcs11_rv_class(rv) != PKCS11_RV_OBJECT)
+        return;
+    pkcs11_key_cache_drop(ctx, key);
+    pkcs11_sync_stale(ctx, key->slotid);
+}
+
+/**
+ * Make sure the handle of a key is of the module in use, finding the
+ * object of a key loaded before a module reload by its modulus.  Called
+ * with a session of the key's slot, so the module cannot change meanwhile.
+ * @param ctx
+ * @param rsa
+ * @param key the copy of the operation, updated
+ * @param session
+ * @return 1 on success, 0 if the key is not on the module
+ */
+static int pkcs11_key_current(PKCS11_CTX *ctx, const RSA *rsa,
+                              PKCS11_KEY *key, CK_SESSION_HANDLE session)
+{
+    unsigned int gen = __atomic_load_n(&pkcs11_generation, __ATOMIC_ACQUIRE);
+    const BIGNUM *n;
+    CK_OBJECT_HANDLE handle;
+
+    if (key->module == gen)
+        return 1;
+    RSA_get0_key(rsa, &n, NULL, NULL);
+    handle = pkcs11_find_key_by_modulus(pkcs11_funcs, session, n);
+    if (handle == CK_INVALID_HANDLE) {
+        PKCS11err(PKCS11_F_PKCS11_RELOAD_MODULE,
+                  PKCS11_R_KEY_OBJECT_NOT_FOUND);
+        return 0;
+    }
+    PKCS11_trace("Key handle %lu is %lu on the reloaded module\n",
+                 key->handle, handle);
+    pkcs11_key_rebound(rsa, key, handle, gen);
+    key->handle = handle;
+    key->module = gen;
+    return 1;
+}
+
+/**
+ * Set up the counters of the operations under way on the keys.
+ * @param ctx
+ */
+void pkcs11_key_ops_init(PKCS11_CTX *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < PKCS11_KEY_STRIPES; i++) {
+        pthread_mutex_init(&ctx->key_ops[i].lock, NULL);
+        pthread_cond_init(&ctx->key_ops[i].done, NULL);
+        ctx->key_ops[i].n = 0;
+    }
+}
+
+void pkcs11_key_ops_free(PKCS11_CTX *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < PKCS11_KEY_STRIPES; i++) {
+        pthread_mutex_destroy(&ctx->key_ops[i].lock);
+        pthread_cond_destroy(&ctx->key_ops[i].done);
+    }
+}
+
+/**
+ * Wait until the key may start another operation, for a profile that caps
+ * the operations under way on a key object.  Called once the handle is of
+ * the module in use; the counters are shared by keys whose handles fall
+ * on the same stripe, which only makes the wait longer.
+ * @param ctx
+ * @param key
+ * @return what to give back to pkcs11_key_ops_leave(), 0 if not counted
+ */
+int pkcs11_key_ops_enter(PKCS11_CTX *ctx, const PKCS11_KEY *key)
+{
+    unsigned int max = ctx->profile.key_ops;
+    size_t i = key->handle % PKCS11_KEY_STRIPES;
+    PKCS11_KEY_OPS *ops = &ctx->key_ops[i];
+
+    if (max == 0)
+        return 0;
+    pthread_mutex_lock(&ops->lock);
+    while (ops->n >= max)
+        pthread_cond_wait(&ops->done, &ops->lock);
+    ops->n++;
+    pthread_mutex_unlock(&ops->lock);
+    return (int)i + 1;
+}
+
+/**
+ * End an operation counted by pkcs11_key_ops_enter(), on the stripe it
+ * was counted on whatever the key's handle or the profile became since.
+ * @param ctx
+ * @param ops what pkcs11_key_ops_enter() returned
+ */
+void pkcs11_key_ops_leave(PKCS11_CTX *ctx, int ops)
+{
+    PKCS11_KEY_OPS *stripe;
+
+    if (ops == 0)
+        return;
+    stripe = &ctx->key_ops[ops - 1];
+    pthread_mutex_lock(&stripe->lock);
+    stripe->n--;
+    pthread_cond_signal(&stripe->done);
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/**
+ * PKCS#1 v1.5 type 1 padding of a DigestInfo on the host, for a profile
+ * that signs with the raw CKM_RSA_X_509.
+ * @param from
+ * @param flen
+ * @param num the modulus size, that of the padded block
+ * @return the block, to free with OPENSSL_clear_free(), or NULL
+ */
+static unsigned char *pkcs11_pad_pkcs1(const unsigned char *from, int flen,
+                                       int num)
+{
+    unsigned char *to;
+
+    if ((to = OPENSSL_malloc(num)) == NULL)
+        return NULL;
+    if (RSA_padding_add_PKCS1_type_1(to, num, from, flen) <= 0) {
+        PKCS11err(PKCS11_F_PKCS11_RSA_SIGN, PKCS11_R_PADDING_ADD_FAILED);
+        OPENSSL_free(to);
+        return NULL;
+    }
+    return to;
+}
 
 int pkcs11_rsa_sign(int alg, const unsigned char *md,
                     unsigned int md_len, unsigned char *sigret,
@@ -36,26 +314,23 @@ int pkcs11_rsa_sign(int alg, const unsigned char *md,
 {
     CK_RV rv;
     PKCS11_CTX *ctx;
+    PKCS11_KEY keybuf, *key = NULL;
     CK_ULONG num;
     CK_MECHANISM sign_mechanism = { 0 };
-    CK_BBOOL bAwaysAuthentificate = CK_TRUE;
-    CK_ATTRIBUTE keyAttribute[1] = {{ 0 }};
     CK_SESSION_HANDLE session = 0;
-    unsigned char *tmps = NULL;
-    int encoded_len = 0;
+    unsigned char *tmps = NULL, *padded = NULL;
+    int encoded_len = 0, ret, ops;
     const unsigned char *encoded = NULL;
-    CK_OBJECT_HANDLE key = 0;
 
     ctx = pkcs11_get_ctx(rsa);
-    if (!ctx->session) {
-        return RSA_meth_get_sign(RSA_PKCS1_OpenSSL())
-            (alg, md, md_len, sigret, siglen, rsa);
-    }
+    /* a named key may be rotated meanwhile, keep the version it had */
+    if (pkcs11_key_get(rsa, &keybuf))
+        key = &keybuf;
+    pkcs11_rec_op(PKCS11_REC_OP_SIGN);
 
-    session = ctx->session;
     num = RSA_size(rsa);
     if (!pkcs11_rsa_encode_pkcs1(&tmps, &encoded_len, alg, md, md_len))
-        goto err;
+        return 0;
     encoded = tmps;
     if ((unsigned int)encoded_len > (num - RSA_PKCS1_PADDING_SIZE)) {
         PKCS11err(PKCS11_F_PKCS11_RSA_SIGN,
@@ -63,49 +338,201 @@ int pkcs11_rsa_sign(int alg, const unsigned char *md,
         goto err;
     }
 
-    sign_mechanism.mechanism = CKM_RSA_PKCS;
-    key = (CK_OBJECT_HANDLE) RSA_get_ex_data(rsa, rsa_pkcs11_idx);
+    if (key == NULL) {
+        /*
+         * Not a token key: the default method has no sign callback any
+         * more, so pad here and let it do the private key operation.
+         */
+        ret = RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL())
+            (encoded_len, encoded, sigret, (RSA *)rsa, RSA_PKCS1_PADDING);
+        if (ret <= 0)
+            goto err;
+        *siglen = ret;
+        OPENSSL_clear_free(tmps, encoded_len);
+        return 1;
+    }
 
-    rv = pkcs11_funcs->C_SignInit(session, &sign_mechanism, key);
+    if (ctx->profile.raw_rsa) {
+        /* the module signs raw blocks better than it pads them */
+        if ((padded = pkcs11_pad_pkcs1(encoded, encoded_len, num)) == NULL)
+            goto err;
+        sign_mechanism.mechanism = CKM_RSA_X_509;
+    } else {
+        sign_mechanism.mechanism = CKM_RSA_PKCS;
+    }
 
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_SignInit failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_RSA_SIGN, PKCS11_R_SIGN_INIT_FAILED);
+    if (!pkcs11_session_get(ctx, key->slotid, &session))
         goto err;
-    }
+    if (!pkcs11_key_current(ctx, rsa, key, session))
+        goto end;
+    ops = pkcs11_key_ops_enter(ctx, key);
 
-    keyAttribute[0].type = CKA_ALWAYS_AUTHENTICATE;
-    keyAttribute[0].pValue = &bAwaysAuthentificate;
-    keyAttribute[0].ulValueLen = sizeof(bAwaysAuthentificate);
-    rv = pkcs11_funcs->C_GetAttributeValue(session, key,
-                                           keyAttribute,
-                                           OSSL_NELEM(keyAttribute));
+    rv = PKCS11_CALL(C_SignInit, session, &sign_mechanism, key->handle);
 
-    if (rv != CKR_OK && rv != CKR_ATTRIBUTE_TYPE_INVALID) {
-        PKCS11_trace("C_GetAttributeValue failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_RSA_SIGN,
-                  PKCS11_R_GETATTRIBUTEVALUE_FAILED);
-        goto err;
+    if (rv != CKR_OK) {
+        PKCS11err_rv(PKCS11_F_PKCS11_RSA_SIGN, PKCS11_R_SIGN_INIT_FAILED, rv);
+        pkcs11_key_stale(ctx, key, rv);
+        goto leave;
     }
 
-    if (rv != CKR_ATTRIBUTE_TYPE_INVALID && bAwaysAuthentificate
-        && !pkcs11_login(session, ctx, CKU_CONTEXT_SPECIFIC))
-        goto err;
+    if (key->always_auth
+        && !pkcs11_login(session, ctx, key->slotid,
+                         CKU_CONTEXT_SPECIFIC))
+        goto leave;
 
     /* Sign */
-    rv = pkcs11_funcs->C_Sign(session, (CK_BYTE *) encoded, encoded_len,
-                              sigret, &num);
+    if (padded != NULL)
+        rv = PKCS11_CALL(C_Sign, session, padded, num, sigret, &num);
+    else
+        rv = PKCS11_CALL(C_Sign, session, (CK_BYTE *) encoded, encoded_len,
+                         sigret, &num);
 
     if (rv != CKR_OK) {
-        PKCS11_trace("C_Sign failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_RSA_SIGN, PKCS11_R_SIGN_FAILED);
-        goto err;
+        PKCS11err_rv(PKCS11_F_PKCS11_RSA_SIGN, PKCS11_R_SIGN_FAILED, rv);
+        goto leave;
     }
     *siglen = num;
 
+    pkcs11_key_ops_leave(ctx, ops);
+    pkcs11_session_put(ctx, key->slotid, session, 1);
+    OPENSSL_clear_free(tmps, encoded_len);
+    OPENSSL_clear_free(padded, RSA_size(rsa));
+    return 1;
+
+ leave:
+    pkcs11_key_ops_leave(ctx, ops);
+ end:
+    pkcs11_session_put(ctx, key->slotid, session, 0);
+ err:
+    OPENSSL_clear_free(tmps, encoded_len);
+    OPENSSL_clear_free(padded, RSA_size(rsa));
+    return 0;
+}
+
+/**
+ * Start a multi-part hash-and-sign operation, e.g. CKM_SHA256_RSA_PKCS,
+ * on a session of the key's slot.  The session stays with the operation
+ * until pkcs11_digest_sign_final(), or until the caller gives it back
+ * with pkcs11_key_ops_leave() and pkcs11_session_put() without reuse.
+ * @param ctx
+ * @param rsa
+ * @param key as got with pkcs11_key_get(), updated after a module reload
+ * @param mechanism
+ * @param session the session of the operation
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_digest_sign_init(PKCS11_CTX *ctx, const RSA *rsa,
+                            PKCS11_KEY *key, CK_MECHANISM_TYPE mechanism,
+                            CK_SESSION_HANDLE *session, int *ops)
+{
+    CK_RV rv;
+    CK_MECHANISM sign_mechanism = { 0 };
+
+    pkcs11_rec_op(PKCS11_REC_OP_SIGN);
+    if (!pkcs11_session_get(ctx, key->slotid, session))
+        return 0;
+    if (!pkcs11_key_current(ctx, rsa, key, *session))
+        goto err;
+    *ops = pkcs11_key_ops_enter(ctx, key);
+
+    sign_mechanism.mechanism = mechanism;
+    rv = PKCS11_CALL(C_SignInit, *session, &sign_mechanism, key->handle);
+
+    if (rv != CKR_OK) {
+        PKCS11err_rv(PKCS11_F_PKCS11_DIGEST_SIGN, PKCS11_R_SIGN_INIT_FAILED,
+                     rv);
+        pkcs11_key_stale(ctx, key, rv);
+        goto leave;
+    }
+
+    if (key->always_auth
+        && !pkcs11_login(*session, ctx, key->slotid,
+                         CKU_CONTEXT_SPECIFIC))
+        goto leave;
     return 1;
 
+ leave:
+    pkcs11_key_ops_leave(ctx, *ops);
  err:
+    pkcs11_session_put(ctx, key->slotid, *session, 0);
+    return 0;
+}
+
+/**
+ * Feed data to the operation started by pkcs11_digest_sign_init().  A
+ * failure ends the operation on the token but the session is left to
+ * the caller.
+ * @param session
+ * @param data
+ * @param len
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_digest_sign_update(CK_SESSION_HANDLE session,
+                              const unsigned char *data, size_t len)
+{
+    CK_RV rv;
+
+    rv = PKCS11_CALL(C_SignUpdate, session, (CK_BYTE *) data, len);
+
+    if (rv != CKR_OK) {
+        PKCS11err_rv(PKCS11_F_PKCS11_DIGEST_SIGN,
+                     PKCS11_R_SIGN_UPDATE_FAILED, rv);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Finish the operation started by pkcs11_digest_sign_init() and give its
+ * session back to the pool, whether or not the token signed.
+ * @param ctx
+ * @param key
+ * @param session
+ * @param ops as set by pkcs11_digest_sign_init()
+ * @param sig
+ * @param siglen the size of |sig| on input, of the signature on output
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_digest_sign_final(PKCS11_CTX *ctx, const PKCS11_KEY *key,
+                             CK_SESSION_HANDLE session, int ops,
+                             unsigned char *sig, size_t *siglen)
+{
+    CK_RV rv;
+    CK_ULONG num = *siglen;
+
+    rv = PKCS11_CALL(C_SignFinal, session, sig, &num);
+
+    if (rv != CKR_OK) {
+        PKCS11err_rv(PKCS11_F_PKCS11_DIGEST_SIGN, PKCS11_R_SIGN_FAILED, rv);
+        pkcs11_key_ops_leave(ctx, ops);
+        pkcs11_session_put(ctx, key->slotid, session, 0);
+        return 0;
+    }
+    *siglen = num;
+
+    pkcs11_key_ops_leave(ctx, ops);
+    pkcs11_session_put(ctx, key->slotid, session, 1);
+    return 1;
+}
+
+/**
+ * Map an RSA_METHOD padding mode to the PKCS#11 mechanism doing the same.
+ * RSA_NO_PADDING is what OpenSSL uses once it has applied PSS or OAEP
+ * itself, so it becomes the raw CKM_RSA_X_509.
+ * @param padding
+ * @param mechanism
+ * @return 1 on success, 0 if the token cannot do this padding
+ */
+static int pkcs11_rsa_mechanism(int padding, CK_MECHANISM_TYPE *mechanism)
+{
+    switch (padding) {
+    case RSA_PKCS1_PADDING:
+        *mechanism = CKM_RSA_PKCS;
+        return 1;
+    case RSA_NO_PADDING:
+        *mechanism = CKM_RSA_X_509;
+        return 1;
+    }
     return 0;
 }
 
@@ -114,92 +541,108 @@ int pkcs11_rsa_priv_enc(int flen, const unsigned char *from,
 {
     CK_RV rv;
     PKCS11_CTX *ctx;
+    PKCS11_KEY keybuf, *key = NULL;
     CK_ULONG num;
     CK_MECHANISM enc_mechanism = { 0 };
-    CK_BBOOL bAwaysAuthentificate = CK_TRUE;
-    CK_ATTRIBUTE keyAttribute[1] = {{ 0 }};
     CK_SESSION_HANDLE session = 0;
-    CK_OBJECT_HANDLE key = 0;
-    int useSign = 0;
+    unsigned char *padded = NULL;
+    int useSign, ops;
 
     ctx = pkcs11_get_ctx(rsa);
+    /* a named key may be rotated meanwhile, keep the version it had */
+    if (pkcs11_key_get(rsa, &keybuf))
+        key = &keybuf;
+    pkcs11_rec_op(PKCS11_REC_OP_SIGN);
 
-    if (!ctx->session) {
+    if (key == NULL) {
         return RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL())
             (flen, from, to, rsa, padding);
     }
 
-    session = ctx->session;
-
     num = RSA_size(rsa);
 
-    enc_mechanism.mechanism = CKM_RSA_PKCS;
-    CRYPTO_THREAD_write_lock(ctx->lock);
-
-    key = (CK_OBJECT_HANDLE) RSA_get_ex_data(rsa, rsa_pkcs11_idx);
-    rv = pkcs11_funcs->C_EncryptInit(session, &enc_mechanism, key);
-
-    if (rv == CKR_KEY_FUNCTION_NOT_PERMITTED) {
-        PKCS11_trace("C_EncryptInit failed try SignInit, error: %#08X\n", rv);
-        rv = pkcs11_funcs->C_SignInit(session, &enc_mechanism, key);
+    if (!pkcs11_rsa_mechanism(padding, &enc_mechanism.mechanism)) {
+        PKCS11err(PKCS11_F_PKCS11_RSA_PRIV_ENC, PKCS11_R_UNSUPPORTED_PADDING);
+        return -1;
+    }
+    if (ctx->profile.raw_rsa && padding == RSA_PKCS1_PADDING) {
+        if ((padded = pkcs11_pad_pkcs1(from, flen, num)) == NULL)
+            return -1;
+        from = padded;
+        flen = num;
+        enc_mechanism.mechanism = CKM_RSA_X_509;
+    }
+    if (!pkcs11_session_get(ctx, key->slotid, &session))
+        goto end;
+    if (!pkcs11_key_current(ctx, rsa, key, session))
+        goto err;
+    ops = pkcs11_key_ops_enter(ctx, key);
 
-        if (rv != CKR_OK) {
-            PKCS11_trace("C_SignInit failed, error: %#08X\n", rv);
-            PKCS11err(PKCS11_F_PKCS11_RSA_PRIV_ENC, PKCS11_R_SIGN_INIT_FAILED);
-            goto err;
+    useSign = key->sign_only;
+    if (!useSign) {
+        rv = PKCS11_CALL(C_EncryptInit, session, &enc_mechanism,
+                         key->handle);
+        if (rv == CKR_KEY_FUNCTION_NOT_PERMITTED) {
+            PKCS11_trace("C_EncryptInit failed try SignInit, error: %#08X\n",
+                         rv);
+            /* the key will not change its mind, go straight to C_Sign */
+            pkcs11_key_sign_only(rsa, key);
+            useSign = 1;
+        } else if (rv != CKR_OK) {
+            PKCS11err_rv(PKCS11_F_PKCS11_RSA_PRIV_ENC,
+                         PKCS11_R_ENCRYPT_FAILED, rv);
+            pkcs11_key_stale(ctx, key, rv);
+            goto leave;
         }
-        useSign = 1;
     }
+    if (useSign) {
+        rv = PKCS11_CALL(C_SignInit, session, &enc_mechanism, key->handle);
 
-    keyAttribute[0].type = CKA_ALWAYS_AUTHENTICATE;
-    keyAttribute[0].pValue = &bAwaysAuthentificate;
-    keyAttribute[0].ulValueLen = sizeof(bAwaysAuthentificate);
-
-    rv = pkcs11_funcs->C_GetAttributeValue(session, key,
-                                           keyAttribute,
-                                           OSSL_NELEM(keyAttribute));
-
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_RSA_PRIV_ENC,
-                  PKCS11_R_GETATTRIBUTEVALUE_FAILED);
-        goto err;
+        if (rv != CKR_OK) {
+            PKCS11err_rv(PKCS11_F_PKCS11_RSA_PRIV_ENC,
+                         PKCS11_R_SIGN_INIT_FAILED, rv);
+            pkcs11_key_stale(ctx, key, rv);
+            goto leave;
+        }
     }
 
-    if (bAwaysAuthentificate
-        && !pkcs11_login(session, ctx, CKU_CONTEXT_SPECIFIC))
-        goto err;
+    if (key->always_auth
+        && !pkcs11_login(session, ctx, key->slotid,
+                         CKU_CONTEXT_SPECIFIC))
+        goto leave;
 
     if (!useSign) {
         /* Encrypt */
-        rv = pkcs11_funcs->C_Encrypt(session, (CK_BYTE *) from,
-                                     flen, to, &num);
+        rv = PKCS11_CALL(C_Encrypt, session, (CK_BYTE *) from,
+                         flen, to, &num);
         if (rv != CKR_OK) {
-            PKCS11_trace("C_Encrypt failed, error: %#08X\n", rv);
-            PKCS11err(PKCS11_F_PKCS11_RSA_PRIV_ENC, PKCS11_R_ENCRYPT_FAILED);
-            goto err;
+            PKCS11err_rv(PKCS11_F_PKCS11_RSA_PRIV_ENC,
+                         PKCS11_R_ENCRYPT_FAILED, rv);
+            goto leave;
         }
     } else {
         /* Sign */
-        rv = pkcs11_funcs->C_Sign(session, (CK_BYTE *) from,
-                                  flen, to, &num);
+        rv = PKCS11_CALL(C_Sign, session, (CK_BYTE *) from,
+                         flen, to, &num);
         if (rv != CKR_OK) {
-            PKCS11_trace("C_Sign failed, error: %#08X\n", rv);
-            PKCS11err(PKCS11_F_PKCS11_RSA_PRIV_ENC, PKCS11_R_SIGN_FAILED);
-            goto err;
+            PKCS11err_rv(PKCS11_F_PKCS11_RSA_PRIV_ENC,
+                         PKCS11_R_SIGN_FAILED, rv);
+            goto leave;
         }
     }
 
-    CRYPTO_THREAD_unlock(ctx->lock);
-
-    /* FIXME useless call */
-    ERR_load_PKCS11_strings();
-    ERR_unload_PKCS11_strings();
-
+    pkcs11_key_ops_leave(ctx, ops);
+    pkcs11_session_put(ctx, key->slotid, session, 1);
+    OPENSSL_clear_free(padded, RSA_size(rsa));
     return num;
 
+ leave:
+    pkcs11_key_ops_leave(ctx, ops);
  err:
-    return 0;
+    pkcs11_session_put(ctx, key->slotid, session, 0);
+ end:
+    OPENSSL_clear_free(padded, RSA_size(rsa));
+    return -1;
 }
 
 int pkcs11_rsa_priv_dec(int flen, const unsigned char *from,
@@ -207,94 +650,115 @@ int pkcs11_rsa_priv_dec(int flen, const unsigned char *from,
 {
     CK_RV rv;
     PKCS11_CTX *ctx;
+    PKCS11_KEY keybuf, *key = NULL;
     CK_ULONG num;
     CK_MECHANISM enc_mechanism = { 0 };
-    CK_BBOOL bAwaysAuthentificate = CK_FALSE;
-    CK_ATTRIBUTE keyAttribute[1] = {{ 0 }};
     CK_SESSION_HANDLE session = 0;
-    CK_OBJECT_HANDLE key = 0;
-    int useVerify = 0;
+    int useVerify = 0, ops;
 
     ctx = pkcs11_get_ctx(rsa);
+    /* a named key may be rotated meanwhile, keep the version it had */
+    if (pkcs11_key_get(rsa, &keybuf))
+        key = &keybuf;
+    pkcs11_rec_op(PKCS11_REC_OP_DECRYPT);
 
-    if (!ctx->session) {
+    if (key == NULL) {
         return RSA_meth_get_priv_dec(RSA_PKCS1_OpenSSL())
             (flen, from, to, rsa, padding);
     }
 
-    session = ctx->session;
-
     num = RSA_size(rsa);
 
-    enc_mechanism.mechanism = CKM_RSA_PKCS;
-    CRYPTO_THREAD_write_lock(ctx->lock);
+    if (!pkcs11_rsa_mechanism(padding, &enc_mechanism.mechanism)) {
+        PKCS11err(PKCS11_F_PKCS11_RSA_PRIV_DEC, PKCS11_R_UNSUPPORTED_PADDING);
+        return -1;
+    }
+    if (!pkcs11_session_get(ctx, key->slotid, &session))
+        return -1;
+    if (!pkcs11_key_current(ctx, rsa, key, session))
+        goto err;
+    ops = pkcs11_key_ops_enter(ctx, key);
 
-    key = (CK_OBJECT_HANDLE) RSA_get_ex_data(rsa, rsa_pkcs11_idx);
-    rv = pkcs11_funcs->C_DecryptInit(session, &enc_mechanism, key);
+    rv = PKCS11_CALL(C_DecryptInit, session, &enc_mechanism, key->handle);
 
     if (rv == CKR_KEY_FUNCTION_NOT_PERMITTED) {
         PKCS11_trace("C_DecryptInit failed try VerifyInit, error: %#08X\n", rv);
-        rv = pkcs11_funcs->C_VerifyInit(session, &enc_mechanism, key);
+        rv = PKCS11_CALL(C_VerifyInit, session, &enc_mechanism, key->handle);
 
         if (rv != CKR_OK) {
-            PKCS11_trace("C_VerifyInit failed, error: %#08X\n", rv);
-            PKCS11err(PKCS11_F_PKCS11_RSA_PRIV_DEC, PKCS11_R_VERIFY_INIT_FAILED);
-            goto err;
+            PKCS11err_rv(PKCS11_F_PKCS11_RSA_PRIV_DEC,
+                         PKCS11_R_VERIFY_INIT_FAILED, rv);
+            goto leave;
         }
         useVerify = 1;
+    } else if (rv != CKR_OK) {
+        PKCS11err_rv(PKCS11_F_PKCS11_RSA_PRIV_DEC,
+                     PKCS11_R_DECRYPT_FAILED, rv);
+        pkcs11_key_stale(ctx, key, rv);
+        goto leave;
     }
 
-    keyAttribute[0].type = CKA_ALWAYS_AUTHENTICATE;
-    keyAttribute[0].pValue = &bAwaysAuthentificate;
-    keyAttribute[0].ulValueLen = sizeof(bAwaysAuthentificate);
-
-    rv = pkcs11_funcs->C_GetAttributeValue(session, key,
-                                           keyAttribute,
-                                           OSSL_NELEM(keyAttribute));
-
-    if (bAwaysAuthentificate
-        && !pkcs11_login(session, ctx, CKU_CONTEXT_SPECIFIC))
-        goto err;
+    if (key->always_auth
+        && !pkcs11_login(session, ctx, key->slotid,
+                         CKU_CONTEXT_SPECIFIC))
+        goto leave;
 
     if (!useVerify) {
         /* Decrypt */
-        rv = pkcs11_funcs->C_Decrypt(session, (CK_BYTE *) from,
-                                     flen, to, &num);
+        rv = PKCS11_CALL(C_Decrypt, session, (CK_BYTE *) from,
+                         flen, to, &num);
         if (rv != CKR_OK) {
-            PKCS11_trace("C_Decrypt failed, error: %#08X\n", rv);
-            PKCS11err(PKCS11_F_PKCS11_RSA_PRIV_DEC, PKCS11_R_DECRYPT_FAILED);
-            goto err;
+            PKCS11err_rv(PKCS11_F_PKCS11_RSA_PRIV_DEC,
+                         PKCS11_R_DECRYPT_FAILED, rv);
+            goto leave;
         }
     } else {
         /* Verify */
-        rv = pkcs11_funcs->C_Verify(session, (CK_BYTE *) from,
-                                    flen, to, num);
+        rv = PKCS11_CALL(C_Verify, session, (CK_BYTE *) from,
+                         flen, to, num);
         if (rv != CKR_OK) {
-            PKCS11_trace("C_Verify failed, error: %#08X\n", rv);
-            PKCS11err(PKCS11_F_PKCS11_RSA_PRIV_DEC, PKCS11_R_VERIFY_FAILED);
-            goto err;
+            PKCS11err_rv(PKCS11_F_PKCS11_RSA_PRIV_DEC,
+                         PKCS11_R_VERIFY_FAILED, rv);
+            goto leave;
         }
     }
 
-    CRYPTO_THREAD_unlock(ctx->lock);
-
+    pkcs11_key_ops_leave(ctx, ops);
+    pkcs11_session_put(ctx, key->slotid, session, 1);
     return num;
 
+ leave:
+    pkcs11_key_ops_leave(ctx, ops);
  err:
-    return 0;
+    pkcs11_session_put(ctx, key->slotid, session, 0);
+    return -1;
 }
 
 /**
- * Load the PKCS#11 functions into global function list.
+ * Load a PKCS#11 module and get its function list.
  * @param library_path
- * @return
+ * @param dso the module, to free once done with it
+ * @param funcs
+ * @return CKR_OK, or the error
  */
-static CK_RV pkcs11_load_functions(const char *library_path)
+static CK_RV pkcs11_load_functions(const char *library_path, DSO **dso,
+                                   CK_FUNCTION_LIST **funcs)
 {
     CK_RV rv;
     DSO *pkcs11_dso = NULL;
     pkcs11_pFunc *pFunc;
 
+#ifdef PKCS11_STATIC_MODULE
+    if (strcmp(library_path, PKCS11_STATIC_MODULE) == 0) {
+        /* linked in, nothing to load */
+        *dso = NULL;
+        rv = C_GetFunctionList(funcs);
+        if (rv == CKR_OK)
+            pkcs11_static_funcs = *funcs;
+        return rv;
+    }
+#endif
+
     pkcs11_dso = DSO_load(NULL, library_path, NULL, 0);
 
     if (pkcs11_dso == NULL) {
@@ -310,90 +774,362 @@ static CK_RV pkcs11_load_functions(const char *library_path)
                      library_path);
         PKCS11err(PKCS11_F_PKCS11_LOAD_FUNCTIONS,
                   PKCS11_R_GETFUNCTIONLIST_NOT_FOUND);
+        DSO_free(pkcs11_dso);
         return CKR_FUNCTION_NOT_SUPPORTED;
     }
 
-    rv = pFunc(&pkcs11_funcs);
-    return rv;
+    rv = pFunc(funcs);
+    if (rv != CKR_OK) {
+        DSO_free(pkcs11_dso);
+        return rv;
+    }
+    *dso = pkcs11_dso;
+    return CKR_OK;
+}
+
+/* The engine's mutexes, for a module that is not to use its own */
+static CK_RV pkcs11_mutex_create(CK_VOID_PTR_PTR mutex)
+{
+    if ((*mutex = CRYPTO_THREAD_lock_new()) == NULL)
+        return CKR_HOST_MEMORY;
+    return CKR_OK;
+}
+
+static CK_RV pkcs11_mutex_destroy(CK_VOID_PTR mutex)
+{
+    CRYPTO_THREAD_lock_free(mutex);
+    return CKR_OK;
+}
+
+static CK_RV pkcs11_mutex_lock(CK_VOID_PTR mutex)
+{
+    return CRYPTO_THREAD_write_lock(mutex) ? CKR_OK : CKR_GENERAL_ERROR;
+}
+
+static CK_RV pkcs11_mutex_unlock(CK_VOID_PTR mutex)
+{
+    return CRYPTO_THREAD_unlock(mutex) ? CKR_OK : CKR_GENERAL_ERROR;
+}
+
+/* C_Initialize() with the module's own locking, or with our mutexes */
+static CK_RV pkcs11_module_init(CK_FUNCTION_LIST *funcs, int os_locking)
+{
+    CK_C_INITIALIZE_ARGS args = { 0 };
+
+    if (os_locking) {
+        args.flags = CKF_OS_LOCKING_OK;
+    } else {
+        args.CreateMutex = pkcs11_mutex_create;
+        args.DestroyMutex = pkcs11_mutex_destroy;
+        args.LockMutex = pkcs11_mutex_lock;
+        args.UnlockMutex = pkcs11_mutex_unlock;
+    }
+    return PKCS11_CALL_ON(funcs, C_Initialize, &args);
 }
 
 /**
- * Initialize the PKCS#11 library.
- * This loads the function list and initializes PKCS#11.
+ * Load a PKCS#11 module and initialize it, without using it yet.
  * @param library_path
- * @return
+ * @param dso
+ * @param funcs
+ * @return CKR_OK, CKR_CRYPTOKI_ALREADY_INITIALIZED if this module is
+ *         initialized already, or the error
  */
-CK_RV pkcs11_initialize(const char *library_path)
+CK_RV pkcs11_module_open(const char *library_path, DSO **dso,
+                         CK_FUNCTION_LIST **funcs)
 {
     CK_RV rv;
-    CK_C_INITIALIZE_ARGS args = { 0 };
 
     if (library_path == NULL) {
         return CKR_ARGUMENTS_BAD;
     }
 
-    rv = pkcs11_load_functions(library_path);
+    rv = pkcs11_load_functions(library_path, dso, funcs);
     if (rv != CKR_OK) {
         PKCS11_trace("Getting PKCS11 function list failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_INITIALIZE,
-                  PKCS11_R_GETTING_FUNCTION_LIST_FAILED);
+        PKCS11err_rv(PKCS11_F_PKCS11_INITIALIZE,
+                  PKCS11_R_GETTING_FUNCTION_LIST_FAILED, rv);
         return rv;
     }
 
-    args.flags = CKF_OS_LOCKING_OK;
-    rv = pkcs11_funcs->C_Initialize(&args);
+    rv = pkcs11_module_init(*funcs, 1);
     if (rv != CKR_OK && rv != CKR_CRYPTOKI_ALREADY_INITIALIZED) {
-        PKCS11_trace("C_Initialize failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_INITIALIZE, PKCS11_R_INITIALIZE_FAILED);
-        return rv;
+        PKCS11err_rv(PKCS11_F_PKCS11_INITIALIZE,
+                     PKCS11_R_INITIALIZE_FAILED, rv);
+        DSO_free(*dso);
+        *dso = NULL;
     }
-
-    return CKR_OK;
+    return rv;
 }
 
-void pkcs11_finalize(void)
+/* Make a module the one in use, called through the call recorder */
+static void pkcs11_module_use(DSO *dso, CK_FUNCTION_LIST *funcs)
 {
-    pkcs11_funcs->C_Finalize(NULL);
+    pkcs11_dso = dso;
+    pkcs11_module_funcs = funcs;
+    pkcs11_funcs = pkcs11_rec_wrap(funcs);
+    pkcs11_os_locking = 1;
+#ifdef PKCS11_STATIC_MODULE
+    pkcs11_direct = funcs == pkcs11_static_funcs && pkcs11_funcs == funcs;
+#endif
 }
 
-int pkcs11_get_slot(PKCS11_CTX *ctx)
+/**
+ * Initialize the PKCS#11 library.
+ * This loads the function list and initializes PKCS#11.
+ * @param library_path
+ * @return
+ */
+CK_RV pkcs11_initialize(const char *library_path)
 {
     CK_RV rv;
-    CK_ULONG slotCount;
-    CK_SLOT_ID slotId;
-    CK_SLOT_ID_PTR slotList = NULL;
-    CK_TOKEN_INFO tokenInfo;
-    unsigned int i;
-    int match = 1;
-
-    rv = pkcs11_funcs->C_GetSlotList(CK_TRUE, NULL, &slotCount);
+    CK_FUNCTION_LIST *funcs = NULL;
+    DSO *dso = NULL;
 
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_GetSlotList failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_GET_SLOT, PKCS11_R_GET_SLOTLIST_FAILED);
-        goto err;
+    if (library_path == NULL) {
+        return CKR_ARGUMENTS_BAD;
     }
 
-    if (slotCount == 0) {
-        PKCS11err(PKCS11_F_PKCS11_GET_SLOT, PKCS11_R_SLOT_NOT_FOUND);
-        goto err;
+    /* every key load and store open comes here, load the module once */
+    if (pkcs11_initialized && strcmp(pkcs11_module, library_path) == 0)
+        return CKR_OK;
+
+    rv = pkcs11_module_open(library_path, &dso, &funcs);
+    if (rv != CKR_OK && rv != CKR_CRYPTOKI_ALREADY_INITIALIZED)
+        return rv;
+    pkcs11_module_use(dso, funcs);
+
+    OPENSSL_free(pkcs11_module);
+    if ((pkcs11_module = OPENSSL_strdup(library_path)) == NULL)
+        return CKR_HOST_MEMORY;
+    pkcs11_initialized = 1;
+    return CKR_OK;
+}
+
+void pkcs11_finalize(void)
+{
+    PKCS11_CALL(C_Finalize, NULL);
+    pkcs11_initialized = 0;
+}
+
+/**
+ * The module in use, as loaded, or NULL if none is yet.
+ * @return its function list, without the call recorder
+ */
+CK_FUNCTION_LIST *pkcs11_module_current(void)
+{
+    return pkcs11_initialized ? pkcs11_module_funcs : NULL;
+}
+
+/**
+ * Wait for the operations under way on the module to finish, keeping new
+ * ones from starting, until pkcs11_module_release().
+ * @param wait_ms the longest wait
+ * @return 1 once the module is unused, 0 if it is still used after
+ *         |wait_ms|, and then not held
+ */
+int pkcs11_module_hold(long wait_ms)
+{
+    struct timespec end;
+    int ret = 1;
+
+    /* another hold is let finish first */
+    pthread_mutex_lock(&pkcs11_hold_lock);
+    clock_gettime(CLOCK_REALTIME, &end);
+    end.tv_sec += wait_ms / 1000;
+    end.tv_nsec += (wait_ms % 1000) * 1000000;
+    if (end.tv_nsec >= 1000000000) {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000;
     }
+    pthread_mutex_lock(&pkcs11_module_lock);
+    __atomic_store_n(&pkcs11_held, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pkcs11_busy, __ATOMIC_SEQ_CST) != 0) {
+        if (pthread_cond_timedwait(&pkcs11_module_cond, &pkcs11_module_lock,
+                                   &end) == ETIMEDOUT
+            && __atomic_load_n(&pkcs11_busy, __ATOMIC_SEQ_CST) != 0) {
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pkcs11_module_lock);
+    if (!ret)
+        pkcs11_module_release();
+    return ret;
+}
+
+/**
+ * Let the operations held by pkcs11_module_hold() go on, and the next
+ * hold be taken.
+ */
+void pkcs11_module_release(void)
+{
+    pthread_mutex_lock(&pkcs11_module_lock);
+    __atomic_store_n(&pkcs11_held, 0, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&pkcs11_module_cond);
+    pthread_mutex_unlock(&pkcs11_module_lock);
+    pthread_mutex_unlock(&pkcs11_hold_lock);
+}
 
-    slotList = OPENSSL_malloc(sizeof(CK_SLOT_ID) * slotCount);
+/**
+ * Use another module from now on.  Called with the module held; the keys
+ * found on the previous one become stale.
+ * @param library_path
+ * @param dso the new module on input, the previous one on output
+ * @param funcs the same for their function lists
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_module_swap(const char *library_path, DSO **dso,
+                       CK_FUNCTION_LIST **funcs)
+{
+    CK_FUNCTION_LIST *old_funcs = pkcs11_module_funcs;
+    DSO *old_dso = pkcs11_dso;
+    char *path;
 
-    if (slotList == NULL) {
-        PKCS11err(PKCS11_F_PKCS11_GET_SLOT, ERR_R_MALLOC_FAILURE);
-        goto err;
+    if ((path = OPENSSL_strdup(library_path)) == NULL)
+        return 0;
+    OPENSSL_free(pkcs11_module);
+    pkcs11_module = path;
+    pkcs11_module_use(*dso, *funcs);
+    __atomic_add_fetch(&pkcs11_generation, 1, __ATOMIC_RELEASE);
+    *dso = old_dso;
+    *funcs = old_funcs;
+    return 1;
+}
+
+/**
+ * How many times the module was swapped, which the keys note.
+ * @return the generation of the module in use
+ */
+unsigned int pkcs11_module_generation(void)
+{
+    return __atomic_load_n(&pkcs11_generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Initialize the module in use again, with its own locking or with the
+ * engine's mutexes.  Called with the module held: its sessions are
+ * closed, and the keys find their objects again as after a reload.
+ * @param os_locking
+ * @return 1 on success, 0 on error, the module then keeps its locking
+ */
+int pkcs11_module_relock(int os_locking)
+{
+    CK_RV rv;
+
+    if (!pkcs11_initialized || os_locking == pkcs11_os_locking)
+        return 1;
+    PKCS11_CALL(C_Finalize, NULL);
+    __atomic_add_fetch(&pkcs11_generation, 1, __ATOMIC_RELEASE);
+    rv = pkcs11_module_init(pkcs11_funcs, os_locking);
+    if (rv == CKR_OK) {
+        pkcs11_os_locking = os_locking;
+        return 1;
     }
+    PKCS11err_rv(PKCS11_F_PKCS11_INITIALIZE, PKCS11_R_INITIALIZE_FAILED, rv);
+    if (pkcs11_module_init(pkcs11_funcs, pkcs11_os_locking) != CKR_OK)
+        pkcs11_initialized = 0;
+    return 0;
+}
 
-    rv = pkcs11_funcs->C_GetSlotList(CK_TRUE, slotList, &slotCount);
+/**
+ * C_GetInfo() of the module in use.
+ * @param info
+ * @return the return value of C_GetInfo()
+ */
+CK_RV pkcs11_get_info(CK_INFO *info)
+{
+    CK_RV rv;
+
+    pkcs11_module_enter();
+    rv = PKCS11_CALL(C_GetInfo, info);
+    pkcs11_module_leave();
+    return rv;
+}
+
+/*
+ * The slots with a token, in |buf| if they fit, else in an array to free;
+ * called between pkcs11_module_enter() and pkcs11_module_leave().
+ */
+static int pkcs11_slot_list(CK_SLOT_ID *buf, CK_ULONG size,
+                            CK_SLOT_ID **list, CK_ULONG *count)
+{
+    CK_RV rv;
+
+    /* ask for the list straight away, its size only if it does not fit */
+    *list = buf;
+    *count = size;
+    rv = PKCS11_CALL(C_GetSlotList, CK_TRUE, *list, count);
+
+    if (rv == CKR_BUFFER_TOO_SMALL) {
+        *list = OPENSSL_malloc(sizeof(CK_SLOT_ID) * *count);
+
+        if (*list == NULL) {
+            PKCS11err(PKCS11_F_PKCS11_GET_SLOT, ERR_R_MALLOC_FAILURE);
+            return 0;
+        }
+        rv = PKCS11_CALL(C_GetSlotList, CK_TRUE, *list, count);
+    }
 
     if (rv != CKR_OK) {
-        PKCS11_trace("C_GetSlotList failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_GET_SLOT, PKCS11_R_GET_SLOTLIST_FAILED);
-        OPENSSL_free(slotList);
+        PKCS11err_rv(PKCS11_F_PKCS11_GET_SLOT,
+                     PKCS11_R_GET_SLOTLIST_FAILED, rv);
+        goto err;
+    }
+
+    if (*count == 0) {
+        PKCS11err(PKCS11_F_PKCS11_GET_SLOT, PKCS11_R_SLOT_NOT_FOUND);
         goto err;
     }
+    return 1;
+
+ err:
+    if (*list != buf)
+        OPENSSL_free(*list);
+    *list = NULL;
+    return 0;
+}
+
+/* Whether the URI names a token by its label, model, serial or maker */
+static int pkcs11_token_selected(const PKCS11_CTX *ctx)
+{
+    return ctx->model[0] != 0 || ctx->token[0] != 0
+           || ctx->serial[0] != 0 || ctx->manufacturer[0] != 0;
+}
+
+/* Whether the token in a slot is the one the URI names */
+static int pkcs11_token_match(const PKCS11_CTX *ctx, CK_SLOT_ID slotid)
+{
+    CK_TOKEN_INFO tokenInfo;
+
+    if (PKCS11_CALL(C_GetTokenInfo, slotid, &tokenInfo) != CKR_OK)
+        return 0;
+    if (ctx->model[0] != 0 && memcmp(ctx->model, tokenInfo.model,
+        sizeof(ctx->model)))
+        return 0;
+    if (ctx->token[0] != 0 && memcmp(ctx->token, tokenInfo.label,
+        sizeof(ctx->token)))
+        return 0;
+    if (ctx->serial[0] != 0 && memcmp(ctx->serial,
+        tokenInfo.serialNumber, sizeof(ctx->serial)))
+        return 0;
+    if (ctx->manufacturer[0] != 0 && memcmp(ctx->manufacturer,
+        tokenInfo.manufacturerID, sizeof(ctx->manufacturer)))
+        return 0;
+    return 1;
+}
+
+static int pkcs11_find_slot(PKCS11_CTX *ctx)
+{
+    CK_ULONG slotCount;
+    CK_SLOT_ID slotId;
+    CK_SLOT_ID slots[MAX];
+    CK_SLOT_ID_PTR slotList;
+    unsigned int i;
+    int match = 1;
+
+    if (!pkcs11_slot_list(slots, OSSL_NELEM(slots), &slotList, &slotCount))
+        return 0;
 
     slotId = slotList[0]; /* Default value if slot not set*/
     if (ctx->slotid > 0) {
@@ -401,42 +1137,162 @@ int pkcs11_get_slot(PKCS11_CTX *ctx)
             if (ctx->slotid == slotList[i])
                 slotId = slotList[i];
         }
-    } else {
-        if (ctx->model[0] != 0 || ctx->token[0] != 0
-            || ctx->serial[0] != 0 || ctx->manufacturer[0] != 0) {
-            match = 0;
-            for (i = 0; i < slotCount; i++) {
-                rv = pkcs11_funcs->C_GetTokenInfo(slotList[i], &tokenInfo);
-                if (rv != CKR_OK)
-                    continue;
-                if (ctx->model[0] != 0 && memcmp(ctx->model, tokenInfo.model,
-                    sizeof(ctx->model)))
-                    continue;
-                if (ctx->token[0] != 0 && memcmp(ctx->token, tokenInfo.label,
-                    sizeof(ctx->token)))
-                    continue;
-                if (ctx->serial[0] != 0 && memcmp(ctx->serial,
-                    tokenInfo.serialNumber, sizeof(ctx->serial)))
-                    continue;
-                if (ctx->manufacturer[0] != 0 && memcmp(ctx->manufacturer,
-                    tokenInfo.manufacturerID, sizeof(ctx->manufacturer)))
-                    continue;
+    } else if (pkcs11_token_selected(ctx)) {
+        match = 0;
+        for (i = 0; i < slotCount; i++) {
+            if (pkcs11_token_match(ctx, slotList[i])) {
                 slotId = slotList[i];
                 match = 1;
                 break;
             }
         }
     }
-    OPENSSL_free(slotList);
+    if (slotList != slots)
+        OPENSSL_free(slotList);
 
     if (!match)
         return 0;
 
     ctx->slotid = slotId;
     return 1;
+}
 
- err:
-    return 0;
+int pkcs11_get_slot(PKCS11_CTX *ctx)
+{
+    int ret;
+
+    pkcs11_module_enter();
+    ret = pkcs11_find_slot(ctx);
+    pkcs11_module_leave();
+    /* the first token seen picks the profile */
+    if (ret && !ctx->profile_chosen)
+        ret = pkcs11_profile_select(ctx);
+    return ret;
+}
+
+/**
+ * Every slot a store URI selects: the one of its slot-id, else every
+ * slot whose token it names, else every slot with a token.  |ctx| is left
+ * on the first of them.
+ * @param ctx
+ * @param slots set to an array of them, to free
+ * @param count set to their number
+ * @return 1 on success, 0 on error or if no token matches
+ */
+int pkcs11_get_slots(PKCS11_CTX *ctx, CK_SLOT_ID **slots, size_t *count)
+{
+    CK_SLOT_ID buf[MAX], *list = NULL, *out = NULL;
+    CK_ULONG n = 0, i;
+    size_t found = 0;
+
+    *slots = NULL;
+    *count = 0;
+    if (ctx->slotid > 0) {
+        if (!pkcs11_get_slot(ctx)
+            || (out = OPENSSL_memdup(&ctx->slotid, sizeof(*out))) == NULL)
+            return 0;
+        *slots = out;
+        *count = 1;
+        return 1;
+    }
+
+    pkcs11_module_enter();
+    if (!pkcs11_slot_list(buf, OSSL_NELEM(buf), &list, &n))
+        goto end;
+    if ((out = OPENSSL_malloc(sizeof(*out) * n)) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_GET_SLOT, ERR_R_MALLOC_FAILURE);
+        goto end;
+    }
+    for (i = 0; i < n; i++)
+        if (!pkcs11_token_selected(ctx) || pkcs11_token_match(ctx, list[i]))
+            out[found++] = list[i];
+
+ end:
+    pkcs11_module_leave();
+    if (list != buf)
+        OPENSSL_free(list);
+    if (found == 0) {
+        OPENSSL_free(out);
+        return 0;
+    }
+    ctx->slotid = out[0];
+    if (!ctx->profile_chosen && !pkcs11_profile_select(ctx)) {
+        OPENSSL_free(out);
+        return 0;
+    }
+    *slots = out;
+    *count = found;
+    return 1;
+}
+
+/**
+ * C_GetTokenInfo() of a slot, for the parts of the engine that do not
+ * call the module themselves.
+ * @param slotid
+ * @param info
+ * @return the return value of C_GetTokenInfo()
+ */
+CK_RV pkcs11_get_token_info(CK_SLOT_ID slotid, CK_TOKEN_INFO *info)
+{
+    CK_RV rv;
+
+    pkcs11_module_enter();
+    rv = PKCS11_CALL(C_GetTokenInfo, slotid, info);
+    pkcs11_module_leave();
+    return rv;
+}
+
+/**
+ * The CKO_DATA object of a label, for the cache checks.
+ * @param session
+ * @param label
+ * @return its handle, 0 if there is none
+ */
+CK_OBJECT_HANDLE pkcs11_find_data(CK_SESSION_HANDLE session,
+                                  const char *label)
+{
+    CK_OBJECT_CLASS class = CKO_DATA;
+    CK_ATTRIBUTE tmpl[2];
+    CK_OBJECT_HANDLE obj = 0;
+    CK_ULONG count = 0;
+    CK_RV rv;
+
+    tmpl[0].type = CKA_CLASS;
+    tmpl[0].pValue = &class;
+    tmpl[0].ulValueLen = sizeof(class);
+    tmpl[1].type = CKA_LABEL;
+    tmpl[1].pValue = (void *)label;
+    tmpl[1].ulValueLen = (CK_ULONG)strlen(label);
+
+    if (PKCS11_CALL(C_FindObjectsInit, session, tmpl, 2) != CKR_OK)
+        return 0;
+    rv = PKCS11_CALL(C_FindObjects, session, &obj, 1, &count);
+    if (PKCS11_CALL(C_FindObjectsFinal, session) != CKR_OK || rv != CKR_OK
+        || count == 0)
+        return 0;
+    return obj;
+}
+
+/**
+ * CKA_VALUE of an object, for the cache checks.
+ * @param session
+ * @param obj
+ * @param value
+ * @param len the size of |value|, set to that of the value
+ * @return the return value of C_GetAttributeValue()
+ */
+CK_RV pkcs11_get_value(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj,
+                       CK_BYTE *value, CK_ULONG *len)
+{
+    CK_ATTRIBUTE attr;
+    CK_RV rv;
+
+    attr.type = CKA_VALUE;
+    attr.pValue = value;
+    attr.ulValueLen = *len;
+    rv = PKCS11_CALL(C_GetAttributeValue, session, obj, &attr, 1);
+    *len = attr.ulValueLen;
+    return rv;
 }
 
 int pkcs11_start_session(PKCS11_CTX *ctx, CK_SESSION_HANDLE *session)
@@ -444,38 +1300,254 @@ int pkcs11_start_session(PKCS11_CTX *ctx, CK_SESSION_HANDLE *session)
     CK_RV rv;
     CK_SESSION_HANDLE s = 0;
 
-    rv = pkcs11_funcs->C_OpenSession(ctx->slotid, CKF_SERIAL_SESSION, NULL,
-                                     NULL, &s);
+    rv = PKCS11_CALL(C_OpenSession, ctx->slotid, CKF_SERIAL_SESSION, NULL,
+                     NULL, &s);
     if (rv != CKR_OK) {
-        PKCS11_trace("C_OpenSession failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_START_SESSION,
-                  PKCS11_R_OPEN_SESSION_ERROR);
+        PKCS11err_rv(PKCS11_F_PKCS11_START_SESSION,
+                  PKCS11_R_OPEN_SESSION_ERROR, rv);
         return 0;
     }
     *session = s;
     return 1;
 }
 
-int pkcs11_login(CK_SESSION_HANDLE session, PKCS11_CTX *ctx,
-                 CK_USER_TYPE userType)
+/* The pool of a slot, created if |create|; called with the lock held */
+static PKCS11_POOL *pkcs11_pool_find(PKCS11_CTX *ctx, CK_SLOT_ID slotid,
+                                     int create)
 {
-    /* Binary pins not supported */
+    PKCS11_POOL *pool;
+
+    for (pool = ctx->pools; pool != NULL; pool = pool->next)
+        if (pool->slotid == slotid)
+            return pool;
+    if (!create || (pool = OPENSSL_zalloc(sizeof(*pool))) == NULL)
+        return NULL;
+    pool->slotid = slotid;
+    pool->next = ctx->pools;
+    ctx->pools = pool;
+    return pool;
+}
+
+static long pkcs11_now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Whether a session left idle for a while is still open, for a module
+ * whose sessions time out.  One the token logged out needs a login again.
+ * @param session
+ * @param login set if the session must log in
+ * @param pin whether the vault has the PIN of its token
+ * @return 1 if it can be used, 0 if it is to be closed
+ */
+static int pkcs11_session_alive(CK_SESSION_HANDLE session, int *login,
+                                int pin)
+{
+    CK_SESSION_INFO info;
     CK_RV rv;
-    if (ctx->pin != NULL) {
-        rv = pkcs11_funcs->C_Login(session, userType, ctx->pin, ctx->pinlen);
-        if (rv == CKR_GENERAL_ERROR && userType == CKU_CONTEXT_SPECIFIC) {
-            rv = pkcs11_funcs->C_Login(session, CKU_USER, ctx->pin,
-                                       ctx->pinlen);
+
+    rv = PKCS11_CALL(C_GetSessionInfo, session, &info);
+    if (rv != CKR_OK) {
+        PKCS11_trace("Idle session %lu is gone, error: %#08X\n", session, rv);
+        return 0;
+    }
+    if (pin && (info.state == CKS_RO_PUBLIC_SESSION
+                || info.state == CKS_RW_PUBLIC_SESSION))
+        *login = 1;
+    return 1;
+}
+
+/**
+ * Take a session on a slot for one operation, an idle one from the pool if
+ * there is one, else a new one.  The pool lock is only held to pop the
+ * handle, so operations on different sessions run in parallel.  A pooled
+ * session may come from a user that had no PIN, such as a certificate
+ * search, so it is logged in if no session of the slot has been yet.
+ * With a profile keepalive, a session idle for longer is checked first.
+ * @param ctx
+ * @param slotid
+ * @param session
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_session_get(PKCS11_CTX *ctx, CK_SLOT_ID slotid,
+                       CK_SESSION_HANDLE *session)
+{
+    CK_RV rv;
+    PKCS11_POOL *pool;
+    CK_SESSION_HANDLE s = 0;
+    long since = 0;
+    int found = 0, login, pin = pkcs11_pin_known(ctx, slotid);
+
+    /* until pkcs11_session_put(), the module is not swapped */
+    pkcs11_module_enter();
+    if (!CRYPTO_THREAD_write_lock(ctx->lock))
+        goto err;
+    pool = pkcs11_pool_find(ctx, slotid, 1);
+    if (pool != NULL && pool->nidle > 0) {
+        s = pool->idle[--pool->nidle];
+        since = pool->idle_since[pool->nidle];
+        found = 1;
+    }
+    login = pin && (pool == NULL || !pool->logged_in);
+    CRYPTO_THREAD_unlock(ctx->lock);
+
+    if (found && ctx->profile.keepalive_ms > 0
+        && pkcs11_now_ms() - since > ctx->profile.keepalive_ms
+        && !pkcs11_session_alive(s, &login, pin)) {
+        pkcs11_end_session(s);
+        found = 0;
+    }
+
+    if (!found) {
+        rv = PKCS11_CALL(C_OpenSession, slotid, CKF_SERIAL_SESSION, NULL,
+                         NULL, &s);
+        if (rv != CKR_OK) {
+            PKCS11err_rv(PKCS11_F_PKCS11_START_SESSION,
+                         PKCS11_R_OPEN_SESSION_ERROR, rv);
+            goto err;
         }
-        if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
-            PKCS11_trace("C_Login failed, wrong PIN, error: %#08X\n", rv);
-            printf_stderr("Wrong PIN!\n");
-            return 0;
+        /* the token logs out when its last session is closed */
+        login = pin;
+    }
+    if (login) {
+        if (!pkcs11_login(s, ctx, slotid, CKU_USER)) {
+            pkcs11_end_session(s);
+            goto err;
         }
-    } else {
+        if (pool != NULL && CRYPTO_THREAD_write_lock(ctx->lock)) {
+            pool->logged_in = 1;
+            CRYPTO_THREAD_unlock(ctx->lock);
+        }
+    }
+    *session = s;
+    return 1;
+
+ err:
+    pkcs11_module_leave();
+    return 0;
+}
+
+/**
+ * Give back a session taken with pkcs11_session_get().  A session whose
+ * operation failed may still have it active, so it is closed instead.
+ * @param ctx
+ * @param slotid
+ * @param session
+ * @param reuse
+ */
+void pkcs11_session_put(PKCS11_CTX *ctx, CK_SLOT_ID slotid,
+                        CK_SESSION_HANDLE session, int reuse)
+{
+    PKCS11_POOL *pool;
+    CK_SESSION_HANDLE *idle;
+    long *since;
+    size_t size;
+
+    if (!reuse || !CRYPTO_THREAD_write_lock(ctx->lock)) {
+        pkcs11_end_session(session);
+        pkcs11_module_leave();
+        return;
+    }
+    if ((pool = pkcs11_pool_find(ctx, slotid, 1)) == NULL)
+        goto err;
+    if (pool->nidle == pool->size) {
+        size = pool->size == 0 ? 8 : pool->size * 2;
+        idle = OPENSSL_realloc(pool->idle, size * sizeof(*idle));
+        if (idle == NULL)
+            goto err;
+        pool->idle = idle;
+        since = OPENSSL_realloc(pool->idle_since, size * sizeof(*since));
+        if (since == NULL)
+            goto err;
+        pool->idle_since = since;
+        pool->size = size;
+    }
+    pool->idle_since[pool->nidle] =
+        ctx->profile.keepalive_ms > 0 ? pkcs11_now_ms() : 0;
+    pool->idle[pool->nidle++] = session;
+    CRYPTO_THREAD_unlock(ctx->lock);
+    pkcs11_module_leave();
+    return;
+
+ err:
+    CRYPTO_THREAD_unlock(ctx->lock);
+    pkcs11_end_session(session);
+    pkcs11_module_leave();
+}
+
+/**
+ * Number of idle sessions in the pool of a slot.
+ * @param ctx
+ * @param slotid
+ * @return the idle sessions, 0 if the slot has no pool
+ */
+size_t pkcs11_session_idle(PKCS11_CTX *ctx, CK_SLOT_ID slotid)
+{
+    PKCS11_POOL *pool;
+    size_t n = 0;
+
+    if (!CRYPTO_THREAD_read_lock(ctx->lock))
+        return 0;
+    if ((pool = pkcs11_pool_find(ctx, slotid, 0)) != NULL)
+        n = pool->nidle;
+    CRYPTO_THREAD_unlock(ctx->lock);
+    return n;
+}
+
+/**
+ * Close the idle sessions of every slot and free the pools.
+ * @param ctx
+ */
+void pkcs11_session_pool_free(PKCS11_CTX *ctx)
+{
+    PKCS11_POOL *pool;
+
+    while ((pool = ctx->pools) != NULL) {
+        ctx->pools = pool->next;
+        while (pool->nidle > 0)
+            pkcs11_end_session(pool->idle[--pool->nidle]);
+        OPENSSL_free(pool->idle);
+        OPENSSL_free(pool->idle_since);
+        OPENSSL_free(pool);
+    }
+}
+
+/**
+ * Log in to the token in a slot with its PIN from the vault.  A PIN the
+ * token refuses is dropped from the vault, so it is not tried again.
+ * @param session
+ * @param ctx
+ * @param slotid
+ * @param userType
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_login(CK_SESSION_HANDLE session, PKCS11_CTX *ctx,
+                 CK_SLOT_ID slotid, CK_USER_TYPE userType)
+{
+    /* Binary pins not supported */
+    CK_RV rv;
+    CK_UTF8CHAR pin[PKCS11_PIN_MAX];
+    CK_ULONG pinlen;
+
+    if (!pkcs11_pin_get(ctx, slotid, pin, &pinlen)) {
         PKCS11_trace("C_Login failed, PIN empty\n");
         return 0;
     }
+    rv = PKCS11_CALL(C_Login, session, userType, pin, pinlen);
+    if (rv == CKR_GENERAL_ERROR && userType == CKU_CONTEXT_SPECIFIC)
+        rv = PKCS11_CALL(C_Login, session, CKU_USER, pin, pinlen);
+    OPENSSL_cleanse(pin, sizeof(pin));
+    if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+        PKCS11_trace("C_Login failed, wrong PIN, error: %#08X\n", rv);
+        if (rv == CKR_PIN_INCORRECT)
+            pkcs11_pin_forget(ctx, slotid);
+        printf_stderr("Wrong PIN!\n");
+        return 0;
+    }
     return 1;
 }
 
@@ -483,10 +1555,9 @@ int pkcs11_logout(CK_SESSION_HANDLE session)
 {
     CK_RV rv;
 
-    rv = pkcs11_funcs->C_Logout(session);
+    rv = PKCS11_CALL(C_Logout, session);
     if (rv != CKR_USER_NOT_LOGGED_IN && rv != CKR_OK) {
-        PKCS11_trace("C_Logout failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_LOGOUT, PKCS11_R_LOGOUT_FAILED);
+        PKCS11err_rv(PKCS11_F_PKCS11_LOGOUT, PKCS11_R_LOGOUT_FAILED, rv);
         return 0;
     }
     return 1;
@@ -494,224 +1565,509 @@ int pkcs11_logout(CK_SESSION_HANDLE session)
 
 void pkcs11_end_session(CK_SESSION_HANDLE session)
 {
-    pkcs11_funcs->C_CloseSession(session);
+    PKCS11_CALL(C_CloseSession, session);
 }
 
-CK_OBJECT_HANDLE pkcs11_find_private_key(CK_SESSION_HANDLE session,
-                                         PKCS11_CTX *ctx)
+/**
+ * The first key object of a class the URI just parsed names, by its id
+ * or else by its label.
+ * @param session
+ * @param ctx
+ * @param key_class
+ * @param key_type CK_UNAVAILABLE_INFORMATION for a key of any type
+ * @return the object, or 0 if there is none or on error
+ */
+CK_OBJECT_HANDLE pkcs11_find_key(CK_SESSION_HANDLE session, PKCS11_CTX *ctx,
+                                 CK_OBJECT_CLASS key_class,
+                                 CK_KEY_TYPE key_type)
 {
     CK_RV rv;
-    CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
-    CK_KEY_TYPE key_type = CKK_RSA;
     unsigned long count;
     CK_ATTRIBUTE tmpl[3];
     CK_OBJECT_HANDLE key = 0;
+    int idx = 0;
 
-    tmpl[0].type = CKA_CLASS;
-    tmpl[0].pValue = &key_class;
-    tmpl[0].ulValueLen = sizeof(key_class);
-    tmpl[1].type = CKA_KEY_TYPE;
-    tmpl[1].pValue = &key_type;
-    tmpl[1].ulValueLen = sizeof(key_type);
+    tmpl[idx].type = CKA_CLASS;
+    tmpl[idx].pValue = &key_class;
+    tmpl[idx].ulValueLen = sizeof(key_class);
+    idx++;
+    if (key_type != CK_UNAVAILABLE_INFORMATION) {
+        tmpl[idx].type = CKA_KEY_TYPE;
+        tmpl[idx].pValue = &key_type;
+        tmpl[idx].ulValueLen = sizeof(key_type);
+        idx++;
+    }
 
     if (ctx->id != NULL) {
-        tmpl[2].type = CKA_ID;
-        tmpl[2].pValue = ctx->id;
-        tmpl[2].ulValueLen = ctx->idlen;
+        tmpl[idx].type = CKA_ID;
+        tmpl[idx].pValue = ctx->id;
+        tmpl[idx].ulValueLen = ctx->idlen;
     } else {
-        tmpl[2].type = CKA_LABEL;
-        tmpl[2].pValue = ctx->label;
-        tmpl[2].ulValueLen = (CK_ULONG)strlen((char *)ctx->label);
+        tmpl[idx].type = CKA_LABEL;
+        tmpl[idx].pValue = ctx->label;
+        tmpl[idx].ulValueLen = (CK_ULONG)strlen((char *)ctx->label);
     }
+    idx++;
 
-    rv = pkcs11_funcs->C_FindObjectsInit(session, tmpl, OSSL_NELEM(tmpl));
+    rv = PKCS11_CALL(C_FindObjectsInit, session, tmpl, idx);
 
     if (rv != CKR_OK) {
-        PKCS11_trace("C_FindObjectsInit failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_FIND_PRIVATE_KEY,
-                  PKCS11_R_FIND_OBJECT_INIT_FAILED);
+        PKCS11err_rv(PKCS11_F_PKCS11_FIND_KEY,
+                  PKCS11_R_FIND_OBJECT_INIT_FAILED, rv);
         goto err;
     }
 
-    rv = pkcs11_funcs->C_FindObjects(session, &key, 1, &count);
+    rv = PKCS11_CALL(C_FindObjects, session, &key, 1, &count);
 
     if (rv != CKR_OK) {
-        PKCS11_trace("C_FindObjects failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_FIND_PRIVATE_KEY,
-                  PKCS11_R_FIND_OBJECT_FAILED);
+        PKCS11err_rv(PKCS11_F_PKCS11_FIND_KEY,
+                  PKCS11_R_FIND_OBJECT_FAILED, rv);
         goto err;
     }
 
-    rv = pkcs11_funcs->C_FindObjectsFinal(session);
+    rv = PKCS11_CALL(C_FindObjectsFinal, session);
 
     if (rv != CKR_OK) {
-        PKCS11_trace("C_FindObjectsFinal failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_FIND_PRIVATE_KEY,
-                  PKCS11_R_FIND_OBJECT_FINAL_FAILED);
+        PKCS11err_rv(PKCS11_F_PKCS11_FIND_KEY,
+                  PKCS11_R_FIND_OBJECT_FINAL_FAILED, rv);
         goto err;
     }
+    return key;
+
+ err:
+    return 0;
+}
+
+CK_OBJECT_HANDLE pkcs11_find_private_key(CK_SESSION_HANDLE session,
+                                         PKCS11_CTX *ctx)
+{
+    return pkcs11_find_key(session, ctx, CKO_PRIVATE_KEY, CKK_RSA);
+}
+
+CK_OBJECT_HANDLE pkcs11_find_public_key(CK_SESSION_HANDLE session,
+                                        PKCS11_CTX *ctx)
+{
+    return pkcs11_find_key(session, ctx, CKO_PUBLIC_KEY, CKK_RSA);
+}
+
+/**
+ * Build the EVP_PKEY of a token RSA key from its public half.
+ * @param key copied into the RSA ex_data
+ * @param n the modulus, owned by the key on success
+ * @param e the public exponent, owned by the key on success
+ * @return the key or NULL on error
+ */
+EVP_PKEY *pkcs11_new_pkey(PKCS11_CTX *ctx, const PKCS11_KEY *key,
+                          BIGNUM *n, BIGNUM *e)
+{
+    EVP_PKEY *k = NULL;
+    RSA *rsa = NULL;
+    PKCS11_KEY *pkcs11_key = NULL;
+
+    /* bound to the engine, whether or not it is the default for RSA */
+    k = EVP_PKEY_new();
+    rsa = RSA_new_method(ctx->engine);
+    pkcs11_key = OPENSSL_memdup(key, sizeof(*key));
+
+    if (k == NULL || rsa == NULL || pkcs11_key == NULL
+        || !RSA_set0_key(rsa, n, e, NULL)) {
+        PKCS11err(PKCS11_F_PKCS11_LOAD_PKEY, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+
+    /* object handles are valid in every session, keep the slot with it */
+    RSA_set_ex_data(rsa, rsa_pkcs11_idx, pkcs11_key);
+    RSA_set_flags(rsa, RSA_FLAG_EXT_PKEY);
+    EVP_PKEY_assign_RSA(k, rsa);
+    rsa = NULL;
+    pkcs11_key = NULL;
 
-    rv = pkcs11_funcs->C_GetAttributeValue(session, key,
-                                           tmpl, OSSL_NELEM(tmpl));
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_FIND_PRIVATE_KEY,
-                  PKCS11_R_GETATTRIBUTEVALUE_FAILED);
+    /* EVP_DigestSign() goes through the engine's method, see TOKEN_DIGEST */
+    if (!EVP_PKEY_set1_engine(k, ctx->engine)) {
+        PKCS11err(PKCS11_F_PKCS11_LOAD_PKEY, PKCS11_R_RSA_INIT_FAILED);
         goto err;
     }
-    return key;
+    return k;
 
  err:
-    return 0;
+    OPENSSL_free(pkcs11_key);
+    RSA_free(rsa);
+    EVP_PKEY_free(k);
+    return NULL;
 }
 
-CK_OBJECT_HANDLE pkcs11_find_public_key(CK_SESSION_HANDLE session,
-                                        PKCS11_CTX *ctx)
+/* The EVP_PKEY of object |key| of the token in |slotid| */
+static EVP_PKEY *pkcs11_read_pkey(CK_SESSION_HANDLE session, PKCS11_CTX *ctx,
+                                  CK_OBJECT_HANDLE key, CK_SLOT_ID slotid)
 {
+    EVP_PKEY *k = NULL;
     CK_RV rv;
-    CK_OBJECT_CLASS key_class = CKO_PUBLIC_KEY;
-    CK_KEY_TYPE key_type = CKK_RSA;
-    unsigned long count;
-    CK_ATTRIBUTE tmpl[3];
-    CK_OBJECT_HANDLE key = 0;
-
-    tmpl[0].type = CKA_CLASS;
-    tmpl[0].pValue = &key_class;
-    tmpl[0].ulValueLen = sizeof(key_class);
-    tmpl[1].type = CKA_KEY_TYPE;
-    tmpl[1].pValue = &key_type;
-    tmpl[1].ulValueLen = sizeof(key_type);
-
-    if (ctx->id != NULL) {
-        tmpl[2].type = CKA_ID;
-        tmpl[2].pValue = ctx->id;
-        tmpl[2].ulValueLen = ctx->idlen;
-    } else {
-        tmpl[2].type = CKA_LABEL;
-        tmpl[2].pValue = ctx->label;
-        tmpl[2].ulValueLen = (CK_ULONG)strlen((char *)ctx->label);
-    }
-
-    rv = pkcs11_funcs->C_FindObjectsInit(session, tmpl, OSSL_NELEM(tmpl));
+    CK_BYTE modulus[PKCS11_MODULUS_MAX];
+    CK_BYTE exponent[PKCS11_EXPONENT_MAX];
+    CK_BBOOL always_auth = CK_FALSE;
+    CK_ATTRIBUTE rsa_attributes[3];
+    PKCS11_KEY pkcs11_key = { 0 };
+    BIGNUM *n = NULL, *e = NULL;
+    void *alloc[2] = { NULL, NULL };
+    int i;
 
+    rsa_attributes[0].type = CKA_MODULUS;
+    rsa_attributes[0].pValue = modulus;
+    rsa_attributes[0].ulValueLen = sizeof(modulus);
+    rsa_attributes[1].type = CKA_PUBLIC_EXPONENT;
+    rsa_attributes[1].pValue = exponent;
+    rsa_attributes[1].ulValueLen = sizeof(exponent);
+    rsa_attributes[2].type = CKA_ALWAYS_AUTHENTICATE;
+    rsa_attributes[2].pValue = &always_auth;
+    rsa_attributes[2].ulValueLen = sizeof(always_auth);
+
+    /* one round trip, including what every signature used to ask for */
+    rv = pkcs11_get_attributes(session, key, rsa_attributes,
+                               OSSL_NELEM(rsa_attributes));
     if (rv != CKR_OK) {
-        PKCS11_trace("C_FindObjectsInit failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_FIND_PUBLIC_KEY,
-                  PKCS11_R_FIND_OBJECT_INIT_FAILED);
+        PKCS11err_rv(PKCS11_F_PKCS11_LOAD_PKEY,
+                  PKCS11_R_GETATTRIBUTEVALUE_FAILED, rv);
         goto err;
     }
-
-    rv = pkcs11_funcs->C_FindObjects(session, &key, 1, &count);
-
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_FindObjects failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_FIND_PUBLIC_KEY,
-                  PKCS11_R_FIND_OBJECT_FAILED);
-        goto err;
+    for (i = 0; i < 2; i++) {
+        if (rsa_attributes[i].ulValueLen != CK_UNAVAILABLE_INFORMATION)
+            continue;
+        if (!pkcs11_get_attribute_alloc(session, key, &rsa_attributes[i])) {
+            PKCS11err(PKCS11_F_PKCS11_LOAD_PKEY,
+                      PKCS11_R_GETATTRIBUTEVALUE_FAILED);
+            goto err;
+        }
+        alloc[i] = rsa_attributes[i].pValue;
     }
-
-    rv = pkcs11_funcs->C_FindObjectsFinal(session);
-
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_FindObjectsFinal failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_FIND_PUBLIC_KEY,
-                  PKCS11_R_FIND_OBJECT_FINAL_FAILED);
+    if  (rsa_attributes[0].ulValueLen == 0
+         || rsa_attributes[1].ulValueLen == 0)
         goto err;
-    }
 
-    rv = pkcs11_funcs->C_GetAttributeValue(session, key,
-                                           tmpl, OSSL_NELEM(tmpl));
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_FIND_PUBLIC_KEY,
-                  PKCS11_R_GETATTRIBUTEVALUE_FAILED);
-        goto err;
+    pkcs11_key.handle = key;
+    pkcs11_key.slotid = slotid;
+    pkcs11_key.module = pkcs11_module_generation();
+    pkcs11_key.always_auth =
+        rsa_attributes[2].ulValueLen == sizeof(always_auth) && always_auth;
+    /* a module that gets the attribute wrong is told by its profile */
+    if (ctx->profile.always_auth != PKCS11_AUTH_READ)
+        pkcs11_key.always_auth =
+            ctx->profile.always_auth == PKCS11_AUTH_ALWAYS;
+
+    n = BN_bin2bn(rsa_attributes[0].pValue, rsa_attributes[0].ulValueLen,
+                  NULL);
+    e = BN_bin2bn(rsa_attributes[1].pValue, rsa_attributes[1].ulValueLen,
+                  NULL);
+    if (n == NULL || e == NULL
+        || (k = pkcs11_new_pkey(ctx, &pkcs11_key, n, e)) == NULL) {
+        BN_free(n);
+        BN_free(e);
     }
-    return key;
 
  err:
-    return 0;
+    OPENSSL_free(alloc[0]);
+    OPENSSL_free(alloc[1]);
+    return k;
 }
 
 EVP_PKEY *pkcs11_load_pkey(CK_SESSION_HANDLE session, PKCS11_CTX *ctx,
                            CK_OBJECT_HANDLE key)
 {
-    EVP_PKEY *k = NULL;
-    CK_RV rv;
-    CK_ATTRIBUTE rsa_attributes[2];
-    RSA *rsa = NULL;
+    return pkcs11_read_pkey(session, ctx, key, ctx->slotid);
+}
 
-    rsa_attributes[0].type = CKA_MODULUS;
-    rsa_attributes[0].pValue = NULL;
-    rsa_attributes[0].ulValueLen = 0;
-    rsa_attributes[1].type = CKA_PUBLIC_EXPONENT;
-    rsa_attributes[1].pValue = NULL;
-    rsa_attributes[1].ulValueLen = 0;
+/**
+ * Load again a key whose object is known, without searching for it: one
+ * attribute read.
+ * @param ctx
+ * @param key
+ * @return the key, or NULL if the object is gone or on error
+ */
+EVP_PKEY *pkcs11_reload_pkey(PKCS11_CTX *ctx, const PKCS11_KEY *key)
+{
+    CK_SESSION_HANDLE session;
+    EVP_PKEY *k;
+
+    if (!pkcs11_session_get(ctx, key->slotid, &session))
+        return NULL;
+    /* a handle of the module before a reload may be another object now */
+    if (key->module != pkcs11_module_generation()) {
+        pkcs11_session_put(ctx, key->slotid, session, 1);
+        return NULL;
+    }
+    k = pkcs11_read_pkey(session, ctx, key->handle, key->slotid);
+    pkcs11_session_put(ctx, key->slotid, session, k != NULL);
+    return k;
+}
+
+/**
+ * Read the key pair the URI just parsed names, for the provider: its
+ * private key object, RSA or EC, with the public half.  An EC private key
+ * has no CKA_EC_POINT, which is read from the public key object of the
+ * same id or label.
+ * @param session a session of ctx->slotid
+ * @param ctx
+ * @param kp filled in, to free with pkcs11_key_pair_free()
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_key_pair_read(CK_SESSION_HANDLE session, PKCS11_CTX *ctx,
+                         PKCS11_KEY_PAIR *kp)
+{
+    CK_RV rv;
+    CK_OBJECT_HANDLE obj, pub;
+    CK_KEY_TYPE type = CKK_VENDOR_DEFINED;
+    CK_BBOOL always_auth = CK_FALSE;
+    CK_BYTE modulus[PKCS11_MODULUS_MAX];
+    CK_BYTE exponent[PKCS11_EXPONENT_MAX];
+    CK_BYTE params[PKCS11_EC_PARAMS_MAX];
+    CK_BYTE point[PKCS11_EC_POINT_MAX];
+    CK_ATTRIBUTE tmpl[5];
+    ASN1_OCTET_STRING *os = NULL;
+    const unsigned char *p;
+    void *alloc[3] = { NULL, NULL, NULL };
+    int i, ret = 0;
+
+    memset(kp, 0, sizeof(*kp));
+    obj = pkcs11_find_key(session, ctx, CKO_PRIVATE_KEY,
+                          CK_UNAVAILABLE_INFORMATION);
+    if (obj == 0) {
+        PKCS11err(PKCS11_F_PKCS11_KEY_PAIR_READ,
+                  PKCS11_R_KEY_OBJECT_NOT_FOUND);
+        return 0;
+    }
 
-    rv = pkcs11_funcs->C_GetAttributeValue(session, key,
-                                           rsa_attributes,
-                                           OSSL_NELEM(rsa_attributes));
+    tmpl[0].type = CKA_KEY_TYPE;
+    tmpl[0].pValue = &type;
+    tmpl[0].ulValueLen = sizeof(type);
+    tmpl[1].type = CKA_ALWAYS_AUTHENTICATE;
+    tmpl[1].pValue = &always_auth;
+    tmpl[1].ulValueLen = sizeof(always_auth);
+    tmpl[2].type = CKA_MODULUS;
+    tmpl[2].pValue = modulus;
+    tmpl[2].ulValueLen = sizeof(modulus);
+    tmpl[3].type = CKA_PUBLIC_EXPONENT;
+    tmpl[3].pValue = exponent;
+    tmpl[3].ulValueLen = sizeof(exponent);
+    tmpl[4].type = CKA_EC_PARAMS;
+    tmpl[4].pValue = params;
+    tmpl[4].ulValueLen = sizeof(params);
+
+    rv = pkcs11_get_attributes(session, obj, tmpl, OSSL_NELEM(tmpl));
     if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_LOAD_PKEY,
-                  PKCS11_R_GETATTRIBUTEVALUE_FAILED);
-        goto err;
+        PKCS11err_rv(PKCS11_F_PKCS11_KEY_PAIR_READ,
+                     PKCS11_R_GETATTRIBUTEVALUE_FAILED, rv);
+        return 0;
     }
-    if  (rsa_attributes[0].ulValueLen == 0
-         || rsa_attributes[1].ulValueLen == 0)
-        goto err;
 
-    rsa_attributes[0].pValue = OPENSSL_malloc(rsa_attributes[0].ulValueLen);
-    if (rsa_attributes[0].pValue == NULL) {
-        PKCS11err(PKCS11_F_PKCS11_LOAD_PKEY, ERR_R_MALLOC_FAILURE);
+    kp->type = type;
+    kp->key.handle = obj;
+    kp->key.slotid = ctx->slotid;
+    kp->key.module = pkcs11_module_generation();
+    kp->key.always_auth =
+        tmpl[1].ulValueLen == sizeof(always_auth) && always_auth;
+    /* a module that gets the attribute wrong is told by its profile */
+    if (ctx->profile.always_auth != PKCS11_AUTH_READ)
+        kp->key.always_auth = ctx->profile.always_auth == PKCS11_AUTH_ALWAYS;
+
+    if (type == CKK_RSA) {
+        for (i = 2; i < 4; i++) {
+            if (tmpl[i].ulValueLen != CK_UNAVAILABLE_INFORMATION)
+                continue;
+            if (!pkcs11_get_attribute_alloc(session, obj, &tmpl[i]))
+                goto err;
+            alloc[i - 2] = tmpl[i].pValue;
+        }
+        if (tmpl[2].ulValueLen == 0 || tmpl[3].ulValueLen == 0)
+            goto err;
+        kp->n = BN_bin2bn(tmpl[2].pValue, tmpl[2].ulValueLen, NULL);
+        kp->e = BN_bin2bn(tmpl[3].pValue, tmpl[3].ulValueLen, NULL);
+        if (kp->n == NULL || kp->e == NULL)
+            goto err;
+    } else if (type == CKK_EC) {
+        if (tmpl[4].ulValueLen == CK_UNAVAILABLE_INFORMATION) {
+            /* a curve spelled out rather than named */
+            if (!pkcs11_get_attribute_alloc(session, obj, &tmpl[4]))
+                goto err;
+            kp->ec_params = tmpl[4].pValue;
+        } else if ((kp->ec_params = OPENSSL_memdup(params,
+                                                   tmpl[4].ulValueLen))
+                   == NULL) {
+            goto err;
+        }
+        kp->ec_params_len = tmpl[4].ulValueLen;
+        if (kp->ec_params_len == 0)
+            goto err;
+
+        pub = pkcs11_find_key(session, ctx, CKO_PUBLIC_KEY, CKK_EC);
+        if (pub == 0) {
+            PKCS11err(PKCS11_F_PKCS11_KEY_PAIR_READ,
+                      PKCS11_R_KEY_OBJECT_NOT_FOUND);
+            goto err;
+        }
+        tmpl[0].type = CKA_EC_POINT;
+        tmpl[0].pValue = point;
+        tmpl[0].ulValueLen = sizeof(point);
+        rv = pkcs11_get_attributes(session, pub, tmpl, 1);
+        if (rv != CKR_OK) {
+            PKCS11err_rv(PKCS11_F_PKCS11_KEY_PAIR_READ,
+                         PKCS11_R_GETATTRIBUTEVALUE_FAILED, rv);
+            goto err;
+        }
+        if (tmpl[0].ulValueLen == CK_UNAVAILABLE_INFORMATION) {
+            if (!pkcs11_get_attribute_alloc(session, pub, &tmpl[0]))
+                goto err;
+            alloc[2] = tmpl[0].pValue;
+        }
+        /* some modules leave out the OCTET STRING, take the point as is */
+        p = tmpl[0].pValue;
+        if ((os = d2i_ASN1_OCTET_STRING(NULL, &p, tmpl[0].ulValueLen)) != NULL
+            && p == (unsigned char *)tmpl[0].pValue + tmpl[0].ulValueLen) {
+            kp->ec_point_len = ASN1_STRING_length(os);
+            kp->ec_point = OPENSSL_memdup(ASN1_STRING_get0_data(os),
+                                          kp->ec_point_len);
+        } else {
+            kp->ec_point_len = tmpl[0].ulValueLen;
+            kp->ec_point = OPENSSL_memdup(tmpl[0].pValue, kp->ec_point_len);
+        }
+        if (kp->ec_point == NULL || kp->ec_point_len == 0)
+            goto err;
+    } else {
+        PKCS11err(PKCS11_F_PKCS11_KEY_PAIR_READ,
+                  PKCS11_R_UNKNOWN_ALGORITHM_TYPE);
         goto err;
     }
+    ret = 1;
 
-    rsa_attributes[1].pValue = OPENSSL_malloc(rsa_attributes[1].ulValueLen);
-    if (rsa_attributes[1].pValue == NULL) {
-        PKCS11err(PKCS11_F_PKCS11_LOAD_PKEY, ERR_R_MALLOC_FAILURE);
-        goto err;
+ err:
+    ASN1_OCTET_STRING_free(os);
+    for (i = 0; i < 3; i++)
+        OPENSSL_free(alloc[i]);
+    if (!ret)
+        pkcs11_key_pair_free(kp);
+    return ret;
+}
+
+void pkcs11_key_pair_free(PKCS11_KEY_PAIR *kp)
+{
+    BN_free(kp->n);
+    BN_free(kp->e);
+    OPENSSL_free(kp->ec_params);
+    OPENSSL_free(kp->ec_point);
+    memset(kp, 0, sizeof(*kp));
+}
+
+/**
+ * One single-part private key operation of the provider: C_SignInit and
+ * C_Sign, or C_DecryptInit and C_Decrypt, on a pooled session of the
+ * key's slot.  The handle of an RSA key read before a module reload is
+ * found again by its modulus; an EC key has to be loaded again.
+ * @param ctx
+ * @param kp
+ * @param decrypt
+ * @param mech
+ * @param in
+ * @param inlen
+ * @param out
+ * @param outlen the size of |out|, then the length of the result
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_key_op(PKCS11_CTX *ctx, PKCS11_KEY_PAIR *kp, int decrypt,
+                  CK_MECHANISM *mech, const unsigned char *in, size_t inlen,
+                  unsigned char *out, size_t *outlen)
+{
+    CK_RV rv;
+    CK_SESSION_HANDLE session;
+    CK_ULONG num = *outlen;
+    PKCS11_KEY key = kp->key;
+    unsigned int gen;
+    int ok = 0, ops;
+
+    if (!pkcs11_session_get(ctx, key.slotid, &session))
+        return 0;
+
+    /* the handle before the module, so a handle seen new is of it */
+    key.module = __atomic_load_n(&kp->key.module, __ATOMIC_ACQUIRE);
+    key.handle = __atomic_load_n(&kp->key.handle, __ATOMIC_RELAXED);
+    gen = __atomic_load_n(&pkcs11_generation, __ATOMIC_ACQUIRE);
+    if (key.module != gen) {
+        key.handle = kp->n == NULL ? CK_INVALID_HANDLE
+            : pkcs11_find_key_by_modulus(pkcs11_funcs, session, kp->n);
+        if (key.handle == CK_INVALID_HANDLE) {
+            PKCS11err(PKCS11_F_PKCS11_KEY_OP, PKCS11_R_KEY_OBJECT_NOT_FOUND);
+            goto end;
+        }
+        __atomic_store_n(&kp->key.handle, key.handle, __ATOMIC_RELAXED);
+        __atomic_store_n(&kp->key.module, gen, __ATOMIC_RELEASE);
     }
+    ops = pkcs11_key_ops_enter(ctx, &key);
 
-    rv = pkcs11_funcs->C_GetAttributeValue(session, key,
-                                           rsa_attributes,
-                                           OSSL_NELEM(rsa_attributes));
+    if (decrypt)
+        rv = PKCS11_CALL(C_DecryptInit, session, mech, key.handle);
+    else
+        rv = PKCS11_CALL(C_SignInit, session, mech, key.handle);
     if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue failed, error: %#08X\n", rv);
-        PKCS11err(PKCS11_F_PKCS11_LOAD_PKEY,
-                  PKCS11_R_GETATTRIBUTEVALUE_FAILED);
-        goto err;
+        PKCS11err_rv(PKCS11_F_PKCS11_KEY_OP, decrypt
+                     ? PKCS11_R_DECRYPT_INIT_FAILED
+                     : PKCS11_R_SIGN_INIT_FAILED, rv);
+        goto leave;
     }
 
-    k = EVP_PKEY_new();
-    rsa = RSA_new();
+    if (key.always_auth
+        && !pkcs11_login(session, ctx, key.slotid, CKU_CONTEXT_SPECIFIC))
+        goto leave;
 
-    if (k == NULL || rsa == NULL) {
-        PKCS11err(PKCS11_F_PKCS11_LOAD_PKEY, ERR_R_MALLOC_FAILURE);
-        goto err;
+    if (decrypt)
+        rv = PKCS11_CALL(C_Decrypt, session, (CK_BYTE_PTR)in, inlen, out,
+                         &num);
+    else
+        rv = PKCS11_CALL(C_Sign, session, (CK_BYTE_PTR)in, inlen, out, &num);
+    if (rv != CKR_OK) {
+        PKCS11err_rv(PKCS11_F_PKCS11_KEY_OP, decrypt
+                     ? PKCS11_R_DECRYPT_FAILED : PKCS11_R_SIGN_FAILED, rv);
+        goto leave;
     }
+    *outlen = num;
+    ok = 1;
 
-    RSA_set_ex_data(rsa, rsa_pkcs11_idx, (void *) key);
-    RSA_set0_key(rsa,
-                 BN_bin2bn(rsa_attributes[0].pValue,
-                           rsa_attributes[0].ulValueLen, NULL),
-                 BN_bin2bn(rsa_attributes[1].pValue,
-                           rsa_attributes[1].ulValueLen, NULL),
-                 NULL);
-
-    RSA_set_flags(rsa, RSA_FLAG_EXT_PKEY);
-    EVP_PKEY_assign_RSA(k, rsa);
-    rsa = NULL;
+ leave:
+    pkcs11_key_ops_leave(ctx, ops);
+ end:
+    pkcs11_session_put(ctx, key.slotid, session, ok);
+    return ok;
+}
 
-    OPENSSL_free(rsa_attributes[0].pValue);
-    OPENSSL_free(rsa_attributes[1].pValue);
-    ctx->session = session;
-    return k;
+/**
+ * Next object of the search, asking the token for the profile's batch of
+ * handles at a time, PKCS11_FIND_BATCH unless it says otherwise.
+ * @param ctx
+ * @param obj
+ * @return 1 if |obj| was set, 0 at the end of the search
+ */
+static int pkcs11_search_next_handle(OSSL_STORE_LOADER_CTX *ctx,
+                                     CK_OBJECT_HANDLE *obj)
+{
+    CK_ULONG batch = ctx->pkcs11_ctx->profile.find_batch;
+    CK_RV rv;
 
- err:
-    OPENSSL_free(rsa_attributes[0].pValue);
-    OPENSSL_free(rsa_attributes[1].pValue);
-    return NULL;
+    if (ctx->pos == ctx->nfound) {
+        if (ctx->found_all)
+            return 0;
+        ctx->pos = 0;
+        rv = PKCS11_CALL(C_FindObjects, ctx->session, ctx->found, batch,
+                         &ctx->nfound);
+        if (rv != CKR_OK) {
+            PKCS11_trace("C_FindObjects: Error = 0x%.8lX\n", rv);
+            ctx->nfound = 0;
+            ctx->found_all = 1;
+            return 0;
+        }
+        /* a short batch is the last one, no need to ask again */
+        if (ctx->nfound < batch)
+            ctx->found_all = 1;
+        if (ctx->nfound == 0)
+            return 0;
+    }
+    *obj = ctx->found[ctx->pos++];
+    return 1;
 }
 
 int pkcs11_search_next_ids(OSSL_STORE_LOADER_CTX *ctx, char **name,
@@ -719,62 +2075,63 @@ int pkcs11_search_next_ids(OSSL_STORE_LOADER_CTX *ctx, char **name,
 {
     CK_RV rv;
     CK_OBJECT_HANDLE key;
-    CK_ULONG ulObj = 1;
     unsigned int i;
     CK_ATTRIBUTE template[3];
+    CK_BYTE label[PKCS11_NAME_MAX];
+    CK_BYTE idbuf[PKCS11_NAME_MAX];
     CK_BYTE_PTR id;
-    CK_SESSION_HANDLE session = 0;
-    CK_OBJECT_CLASS key_class;
+    CK_ULONG idlen;
+    CK_OBJECT_CLASS key_class = CKO_DATA;
+    void *alloc[3] = { NULL, NULL, NULL };
 
-    session = ctx->session;
-    rv = pkcs11_funcs->C_FindObjects(session, &key,
-                                     1, &ulObj);
-    if (rv != CKR_OK || ulObj == 0) {
-        *name = NULL;
-        *description = NULL;
-        /* return eof */
-        return 1;
-    }
+    *name = NULL;
+    *description = NULL;
+    if (!pkcs11_search_next_handle(ctx, &key))
+        return 1;           /* return eof */
 
     template[0].type = CKA_CLASS;
     template[0].pValue = &key_class;
     template[0].ulValueLen = sizeof(key_class);
     template[1].type = CKA_LABEL;
-    template[1].pValue = NULL;
-    template[1].ulValueLen = 0;
+    template[1].pValue = label;
+    template[1].ulValueLen = sizeof(label) - 1;
     template[2].type = CKA_ID;
-    template[2].pValue = NULL;
-    template[2].ulValueLen = 0;
+    template[2].pValue = idbuf;
+    template[2].ulValueLen = sizeof(idbuf);
 
-    rv = pkcs11_funcs->C_GetAttributeValue(session, key,
-                                           template,
-                                           OSSL_NELEM(template));
+    rv = pkcs11_get_attributes(ctx->session, key, template,
+                               OSSL_NELEM(template));
     if (rv != CKR_OK) {
-        *name = NULL;
-        *description = NULL;
+        PKCS11_trace("C_GetAttributeValue: rv = 0x%.8lX\n", rv);
         /* return no eof, search next id */
         return 0;
     }
-
-    template[1].pValue = OPENSSL_malloc(template[1].ulValueLen);
-
-    id = (CK_BYTE_PTR) OPENSSL_malloc(template[2].ulValueLen);
-    template[2].pValue = id;
-
-    rv = pkcs11_funcs->C_GetAttributeValue(session, key,
-                                           template,
-                                           OSSL_NELEM(template));
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue: \
-                      rv = 0x%.8lX\n", rv);
+    for (i = 1; i < OSSL_NELEM(template); i++) {
+        if (template[i].ulValueLen != CK_UNAVAILABLE_INFORMATION)
+            continue;
+        if (pkcs11_get_attribute_alloc(ctx->session, key, &template[i])) {
+            alloc[i] = template[i].pValue;
+        } else {
+            /* no such attribute, list the object all the same */
+            template[i].pValue = NULL;
+            template[i].ulValueLen = 0;
+        }
+    }
+    id = template[2].pValue;
+    idlen = template[2].ulValueLen;
+
+    *name = OPENSSL_strndup(template[1].pValue == NULL ? ""
+                            : (char *)template[1].pValue,
+                            template[1].ulValueLen);
+    *description = OPENSSL_malloc(idlen * 3 + 23);
+    if (*name == NULL || *description == NULL) {
+        OPENSSL_free(*name);
+        OPENSSL_free(*description);
+        *name = NULL;
+        *description = NULL;
         goto end;
     }
 
-    *name = template[1].pValue;
-    *(*name + template[1].ulValueLen) = '\0';
-
-    *description = OPENSSL_malloc(template[2].ulValueLen * 3 + 23);
-
     if (key_class == CKO_CERTIFICATE)
         strncpy(*description, "Certificate ID: ", 17);
     else if (key_class == CKO_PUBLIC_KEY)
@@ -784,63 +2141,65 @@ int pkcs11_search_next_ids(OSSL_STORE_LOADER_CTX *ctx, char **name,
     else
         strncpy(*description, "Data        ID: ", 17);
 
-    for (i=0; i < template[2].ulValueLen; i++)
+    for (i=0; i < idlen; i++)
           *(*description + i + 16) = id[i];
 
-    *(*description + template[2].ulValueLen + 16) = '\0';
+    *(*description + idlen + 16) = '\0';
     strncat(*description, " hex: ", 7);
 
-    for (i=0; i < template[2].ulValueLen; i++) {
-          *(*description + 22 + template[2].ulValueLen + (i*2)) = \
+    for (i=0; i < idlen; i++) {
+          *(*description + 22 + idlen + (i*2)) = \
            "0123456789abcdef"[id[i] >> 4];
-          *(*description + 23 + template[2].ulValueLen + (i*2)) = \
+          *(*description + 23 + idlen + (i*2)) = \
            "0123456789abcdef"[id[i] % 16];
     }
-    *(*description + 22 + (template[2].ulValueLen * 3)) = '\0';
-    OPENSSL_free(template[2].pValue);
-    return 0;
+    *(*description + 22 + (idlen * 3)) = '\0';
 
  end:
-    OPENSSL_free(template[2].pValue);
-    return 1;
+    OPENSSL_free(alloc[1]);
+    OPENSSL_free(alloc[2]);
+    return 0;
 }
 
 int pkcs11_search_next_object(OSSL_STORE_LOADER_CTX *ctx,
                               CK_OBJECT_CLASS *class)
 {
     CK_RV rv;
-    CK_ATTRIBUTE template[1];
+    CK_ATTRIBUTE template[4];
     CK_OBJECT_HANDLE obj;
-    CK_ULONG nObj = 0;
-    CK_OBJECT_CLASS key_class;
+    CK_OBJECT_CLASS key_class = CKO_DATA;
+    CK_BYTE modulus[PKCS11_MODULUS_MAX];
+    CK_BYTE exponent[PKCS11_EXPONENT_MAX];
     int ret = 0;
 
+    if (!pkcs11_search_next_handle(ctx, &obj))
+        return 1;
+
+    /* what a certificate or a public key needs, in one round trip */
     template[0].type = CKA_CLASS;
     template[0].pValue = &key_class;
     template[0].ulValueLen = sizeof(key_class);
-
-    rv = pkcs11_funcs->C_FindObjects(ctx->session, &obj,
-                                     1, &nObj);
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_FindObjects: Error = 0x%.8lX\n", rv);
-        return 1;
-    }
-
-    if (nObj == 0)
-        return 1;
-
-    rv = pkcs11_funcs->C_GetAttributeValue(ctx->session, obj,
-                                           template,
-                                           OSSL_NELEM(template));
+    template[1].type = CKA_VALUE;
+    template[1].pValue = ctx->value;
+    template[1].ulValueLen = sizeof(ctx->value);
+    template[2].type = CKA_MODULUS;
+    template[2].pValue = modulus;
+    template[2].ulValueLen = sizeof(modulus);
+    template[3].type = CKA_PUBLIC_EXPONENT;
+    template[3].pValue = exponent;
+    template[3].ulValueLen = sizeof(exponent);
+
+    rv = pkcs11_get_attributes(ctx->session, obj, template,
+                               OSSL_NELEM(template));
     if (rv != CKR_OK) {
         PKCS11_trace("C_GetAttributeValue: \
                       rv = 0x%.8lX\n", rv);
         return 1;
     }
     if (key_class == CKO_CERTIFICATE)
-        ret = pkcs11_get_cert(ctx, obj);
+        ret = pkcs11_get_cert(ctx, obj, &template[1]);
     else if (key_class == CKO_PUBLIC_KEY)
-        ret = pkcs11_get_key(ctx, obj);
+        ret = pkcs11_get_key(ctx, obj, &template[2], &template[3]);
 
     *class = key_class;
     return ret;
@@ -850,183 +2209,144 @@ int pkcs11_search_next_cert(OSSL_STORE_LOADER_CTX *ctx,
                             CK_BYTE **id, CK_ULONG *idlen)
 {
     CK_RV rv;
-    CK_ATTRIBUTE template[2];
+    CK_ATTRIBUTE template[3];
     CK_OBJECT_HANDLE obj;
-    CK_ULONG nObj = 0;
     CK_OBJECT_CLASS key_class = CKO_CERTIFICATE;
+    CK_BYTE idbuf[PKCS11_NAME_MAX];
     int ret = 0;
 
+    if (!pkcs11_search_next_handle(ctx, &obj))
+        return 1;
+
     template[0].type = CKA_CLASS;
     template[0].pValue = &key_class;
     template[0].ulValueLen = sizeof(key_class);
     template[1].type = CKA_ID;
-    template[1].pValue = NULL;
-    template[1].ulValueLen = 0;
-
-    rv = pkcs11_funcs->C_FindObjects(ctx->session, &obj,
-                                     1, &nObj);
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_FindObjects: Error = 0x%.8lX\n", rv);
-        return 1;
-    }
-
-    if (nObj == 0)
-        return 1;
-
-    rv = pkcs11_funcs->C_GetAttributeValue(ctx->session, obj,
-                                           template,
-                                           OSSL_NELEM(template));
+    template[1].pValue = idbuf;
+    template[1].ulValueLen = sizeof(idbuf);
+    template[2].type = CKA_VALUE;
+    template[2].pValue = ctx->value;
+    template[2].ulValueLen = sizeof(ctx->value);
+
+    rv = pkcs11_get_attributes(ctx->session, obj, template,
+                               OSSL_NELEM(template));
     if (rv != CKR_OK) {
         PKCS11_trace("C_GetAttributeValue: \
                       rv = 0x%.8lX\n", rv);
         return 1;
     }
 
-    template[1].pValue = OPENSSL_malloc(template[1].ulValueLen);
-
-    rv = pkcs11_funcs->C_GetAttributeValue(ctx->session, obj,
-                                           template,
-                                           OSSL_NELEM(template));
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue: \
-                      rv = 0x%.8lX\n", rv);
+    if (template[1].ulValueLen == CK_UNAVAILABLE_INFORMATION) {
+        if (!pkcs11_get_attribute_alloc(ctx->session, obj, &template[1]))
+            return 1;
+        *id = template[1].pValue;
+    } else if ((*id = OPENSSL_memdup(idbuf, template[1].ulValueLen + 1))
+               == NULL) {
         return 1;
     }
+    *idlen = template[1].ulValueLen;
 
-    ret = pkcs11_get_cert(ctx, obj);
-    *id = (CK_BYTE *) template[1].pValue;
-    *idlen = (CK_ULONG) template[1].ulValueLen;
+    ret = pkcs11_get_cert(ctx, obj, &template[2]);
+    if (ret) {
+        OPENSSL_free(*id);
+        *id = NULL;
+    }
     return ret;
 }
 
-void pkcs11_close_operation(CK_SESSION_HANDLE session)
+int pkcs11_close_operation(CK_SESSION_HANDLE session)
 {
     CK_RV rv;
 
-    rv = pkcs11_funcs->C_FindObjectsFinal(session);
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_FindObjectsFinal failed, error: %#08X\n", rv);
+    rv = PKCS11_CALL(C_FindObjectsFinal, session);
+    if (rv != CKR_OK && rv != CKR_OPERATION_NOT_INITIALIZED) {
+        return 0;
     }
+    return 1;
 }
 
+/**
+ * Decode the certificate of a search result.
+ * @param store_ctx
+ * @param obj
+ * @param value CKA_VALUE as read with the rest of the object
+ * @return 0 on success, 1 on error
+ */
 static int pkcs11_get_cert(OSSL_STORE_LOADER_CTX *store_ctx,
-                           CK_OBJECT_HANDLE obj)
+                           CK_OBJECT_HANDLE obj, CK_ATTRIBUTE *value)
 {
-    CK_RV rv;
-    CK_OBJECT_CLASS key_class = CKO_CERTIFICATE;
-    CK_ATTRIBUTE tmpl_cert[2];
     const unsigned char *tmpcert = NULL;
+    void *alloc = NULL;
 
-    tmpl_cert[0].type = CKA_CLASS;
-    tmpl_cert[0].pValue = &key_class;
-    tmpl_cert[0].ulValueLen = sizeof(key_class);
-    tmpl_cert[1].type = CKA_VALUE;
-    tmpl_cert[1].pValue = NULL;
-    tmpl_cert[1].ulValueLen = 0;
-
-    rv = pkcs11_funcs->C_GetAttributeValue(store_ctx->session, obj,
-                                           tmpl_cert,
-                                           OSSL_NELEM(tmpl_cert));
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue: \
-                      rv = 0x%.8lX\n", rv);
-        goto end;
-    }
-
-    tmpl_cert[1].pValue = OPENSSL_malloc(tmpl_cert[1].ulValueLen);
-
-    rv = pkcs11_funcs->C_GetAttributeValue(store_ctx->session, obj,
-                                           tmpl_cert,
-                                           OSSL_NELEM(tmpl_cert));
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue: \
-                      rv = 0x%.8lX\n", rv);
-        goto end;
+    if (value->ulValueLen == CK_UNAVAILABLE_INFORMATION) {
+        /* larger than PKCS11_VALUE_MAX */
+        if (!pkcs11_get_attribute_alloc(store_ctx->session, obj, value))
+            return 1;
+        alloc = value->pValue;
     }
 
-    if (tmpl_cert[1].ulValueLen > 0) {
-        tmpcert= tmpl_cert[1].pValue;
-        store_ctx->cert = d2i_X509(NULL, &tmpcert,
-                                   tmpl_cert[1].ulValueLen);
-        return 0;
+    if (value->ulValueLen > 0) {
+        tmpcert = value->pValue;
+        store_ctx->cert = d2i_X509(NULL, &tmpcert, value->ulValueLen);
     } else {
         PKCS11_trace("Certificate is empty\n");
-        OPENSSL_free(tmpl_cert[1].pValue);
     }
-
- end:
-    return 1;
+    OPENSSL_free(alloc);
+    return store_ctx->cert == NULL;
 }
 
+/**
+ * Build the public key of a search result.
+ * @param store_ctx
+ * @param obj
+ * @param modulus CKA_MODULUS as read with the rest of the object
+ * @param exponent CKA_PUBLIC_EXPONENT as read with the rest of the object
+ * @return 0 on success, 1 on error
+ */
 static int pkcs11_get_key(OSSL_STORE_LOADER_CTX *store_ctx,
-                         CK_OBJECT_HANDLE obj)
+                          CK_OBJECT_HANDLE obj, CK_ATTRIBUTE *modulus,
+                          CK_ATTRIBUTE *exponent)
 {
-    CK_RV rv;
-    CK_OBJECT_CLASS key_class = CKO_PUBLIC_KEY;
-    CK_ATTRIBUTE tmpl_key[3];
-    CK_BYTE_PTR pMod, pExp;
+    CK_ATTRIBUTE *tmpl_key[2];
+    void *alloc[2] = { NULL, NULL };
     EVP_PKEY* pRsaKey = NULL;
-    RSA* rsa;
-
-    tmpl_key[0].type = CKA_CLASS;
-    tmpl_key[0].pValue = &key_class;
-    tmpl_key[0].ulValueLen = sizeof(key_class);
-    tmpl_key[1].type = CKA_MODULUS;
-    tmpl_key[1].pValue = NULL;
-    tmpl_key[1].ulValueLen = 0;
-    tmpl_key[2].type = CKA_PUBLIC_EXPONENT;
-    tmpl_key[2].pValue = NULL;
-    tmpl_key[2].ulValueLen = 0;
-
-    rv = pkcs11_funcs->C_GetAttributeValue(store_ctx->session, obj,
-                                           tmpl_key,
-                                           OSSL_NELEM(tmpl_key));
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue: \
-                      rv = 0x%.8lX\n", rv);
-        goto end;
-    }
-
-    pMod = (CK_BYTE_PTR) OPENSSL_malloc(tmpl_key[1].ulValueLen);
-    tmpl_key[1].pValue = pMod;
-
-    pExp = (CK_BYTE_PTR) OPENSSL_malloc(tmpl_key[2].ulValueLen);
-    tmpl_key[2].pValue = pExp;
-
-    rv = pkcs11_funcs->C_GetAttributeValue(store_ctx->session, obj,
-                                           tmpl_key,
-                                           OSSL_NELEM(tmpl_key));
-    if (rv != CKR_OK) {
-        PKCS11_trace("C_GetAttributeValue: \
-                      rv = 0x%.8lX\n", rv);
-        goto end;
+    RSA* rsa = NULL;
+    int i, ret = 1;
+
+    tmpl_key[0] = modulus;
+    tmpl_key[1] = exponent;
+    for (i = 0; i < 2; i++) {
+        if (tmpl_key[i]->ulValueLen != CK_UNAVAILABLE_INFORMATION)
+            continue;
+        if (!pkcs11_get_attribute_alloc(store_ctx->session, obj, tmpl_key[i]))
+            goto end;
+        alloc[i] = tmpl_key[i]->pValue;
     }
 
     pRsaKey = EVP_PKEY_new();
-    if (pRsaKey == NULL)
+    rsa = RSA_new();
+    if (pRsaKey == NULL || rsa == NULL)
         goto end;
 
-    rsa = RSA_new();
     RSA_set0_key(rsa,
-                 BN_bin2bn(tmpl_key[1].pValue,
-                           tmpl_key[1].ulValueLen, NULL),
-                 BN_bin2bn(tmpl_key[2].pValue,
-                           tmpl_key[2].ulValueLen, NULL),
+                 BN_bin2bn(modulus->pValue, modulus->ulValueLen, NULL),
+                 BN_bin2bn(exponent->pValue, exponent->ulValueLen, NULL),
                  NULL);
 
-    EVP_PKEY_set1_RSA(pRsaKey, rsa);
-
-    if (pRsaKey != NULL) {
+    if (EVP_PKEY_set1_RSA(pRsaKey, rsa)) {
         store_ctx->key = pRsaKey;
-        return 0;
+        pRsaKey = NULL;
+        ret = 0;
     } else {
         PKCS11_trace("Public Key is empty\n");
-        OPENSSL_free(pMod);
-        OPENSSL_free(pExp);
     }
 
  end:
-    return 1;
+    RSA_free(rsa);
+    EVP_PKEY_free(pRsaKey);
+    OPENSSL_free(alloc[0]);
+    OPENSSL_free(alloc[1]);
+    return ret;
 }
 
 /*
@@ -1039,8 +2359,8 @@ static int pkcs11_get_key(OSSL_STORE_LOADER_CTX *store_ctx,
  * |*out| with |OPENSSL_free|. Otherwise, it returns zero.
  */
 
-static int pkcs11_rsa_encode_pkcs1(unsigned char **out, int *out_len, int type,
-                                   const unsigned char *m, unsigned int m_len)
+int pkcs11_rsa_encode_pkcs1(unsigned char **out, int *out_len, int type,
+                            const unsigned char *m, unsigned int m_len)
 {
     X509_SIG sig;
     X509_ALGOR algor;
@@ -1074,62 +2394,86 @@ static int pkcs11_rsa_encode_pkcs1(unsigned char **out, int *out_len, int type,
     return 1;
 }
 
-int pkcs11_search_start(OSSL_STORE_LOADER_CTX *store_ctx,
-                        PKCS11_CTX *pkcs11_ctx)
+/**
+ * The search template of the URI in |ctx|: its object class, and its id
+ * or else its label.  The values stay in |ctx| and |key_class|.
+ * @param ctx
+ * @param key_class
+ * @param tmpl room for two attributes
+ * @return the number of attributes set
+ */
+CK_ULONG pkcs11_search_template(PKCS11_CTX *ctx, CK_OBJECT_CLASS *key_class,
+                                CK_ATTRIBUTE *tmpl)
 {
-    CK_RV rv;
-    CK_ATTRIBUTE tmpl[2];
-    CK_SESSION_HANDLE session;
-    CK_OBJECT_CLASS key_class;
-    int idx = 0;
-
-    session = store_ctx->session;
-
-    if (pkcs11_ctx->type != NULL) {
-        if (strncmp(pkcs11_ctx->type, "public", 6) == 0)
-           key_class = CKO_PUBLIC_KEY;
-        else if (strncmp(pkcs11_ctx->type, "cert", 4) == 0)
-           key_class = CKO_CERTIFICATE;
-        else if (strncmp(pkcs11_ctx->type, "private", 7) == 0)
-           key_class = CKO_PRIVATE_KEY;
-        else
-           pkcs11_ctx->type = NULL;
+    CK_ULONG idx = 0;
+
+    if (ctx->type != NULL) {
+        if (strncmp(ctx->type, "public", 6) == 0)
+           *key_class = CKO_PUBLIC_KEY;
+        else if (strncmp(ctx->type, "cert", 4) == 0)
+           *key_class = CKO_CERTIFICATE;
+        else if (strncmp(ctx->type, "private", 7) == 0)
+           *key_class = CKO_PRIVATE_KEY;
+        else {
+           OPENSSL_free(ctx->type);
+           ctx->type = NULL;
+        }
     }
 
-    if (pkcs11_ctx->type != NULL) {
-        tmpl[0].type = CKA_CLASS;
-        tmpl[0].pValue = &key_class;
-        tmpl[0].ulValueLen = sizeof(key_class);
+    if (ctx->type != NULL) {
+        tmpl[idx].type = CKA_CLASS;
+        tmpl[idx].pValue = key_class;
+        tmpl[idx].ulValueLen = sizeof(*key_class);
+        idx++;
     }
 
-    if (pkcs11_ctx->id != NULL) {
-        idx++;
+    if (ctx->id != NULL) {
         tmpl[idx].type = CKA_ID;
-        tmpl[idx].pValue = pkcs11_ctx->id;
-        tmpl[idx].ulValueLen = pkcs11_ctx->idlen;
-    } else if (pkcs11_ctx->label != NULL) {
+        tmpl[idx].pValue = ctx->id;
+        tmpl[idx].ulValueLen = ctx->idlen;
         idx++;
+    } else if (ctx->label != NULL) {
         tmpl[idx].type = CKA_LABEL;
-        tmpl[idx].pValue = pkcs11_ctx->label;
-        tmpl[idx].ulValueLen = (CK_ULONG)strlen((char *)pkcs11_ctx->label);
+        tmpl[idx].pValue = ctx->label;
+        tmpl[idx].ulValueLen = (CK_ULONG)strlen((char *)ctx->label);
+        idx++;
     }
+    return idx;
+}
 
-    if (pkcs11_ctx->pin != NULL) {
-        if (!pkcs11_login(session, pkcs11_ctx, CKU_USER))
-            goto err;
-    }
+/**
+ * Start a search for the objects of a template on the session of a store.
+ * @param store_ctx
+ * @param tmpl
+ * @param count
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_search_init(OSSL_STORE_LOADER_CTX *store_ctx, CK_ATTRIBUTE *tmpl,
+                       CK_ULONG count)
+{
+    CK_RV rv;
 
-    if (pkcs11_ctx->type == NULL && pkcs11_ctx->id == NULL
-        && pkcs11_ctx->label == NULL)
-        rv = pkcs11_funcs->C_FindObjectsInit(session, NULL_PTR, 0);
-    else
-        rv = pkcs11_funcs->C_FindObjectsInit(session, tmpl, idx + 1);
+    store_ctx->nfound = store_ctx->pos = 0;
+    store_ctx->found_all = 0;
+
+    /* sessions from pkcs11_session_get() are logged in already */
+    rv = PKCS11_CALL(C_FindObjectsInit, store_ctx->session,
+                     count > 0 ? tmpl : NULL_PTR, count);
 
     if (rv != CKR_OK) {
         PKCS11_trace("C_FindObjectsInit: Error = 0x%.8lX\n", rv);
-        goto err;
+        return 0;
     }
     return 1;
- err:
-    return 0;
+}
+
+int pkcs11_search_start(OSSL_STORE_LOADER_CTX *store_ctx,
+                        PKCS11_CTX *pkcs11_ctx)
+{
+    CK_ATTRIBUTE tmpl[2];
+    CK_OBJECT_CLASS key_class;
+    CK_ULONG idx;
+
+    idx = pkcs11_search_template(pkcs11_ctx, &key_class, tmpl);
+    return pkcs11_search_init(store_ctx, tmpl, idx);
 }
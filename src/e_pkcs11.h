@@ -8,12 +8,23 @@
  */
 
 #include <string.h>
+#include <pthread.h>
 #include <openssl/err.h>
 #include <openssl/engine.h>
 #include <openssl/store.h>
 #include <openssl/rsa.h>
 
 #define MAX 32
+#define PKCS11_FIND_BATCH 32        /* handles asked for per C_FindObjects */
+#define PKCS11_FIND_BATCH_MAX 256   /* the most a profile may ask for */
+#define PKCS11_VALUE_MAX 8192       /* CKA_VALUE read without a size query */
+#define PKCS11_SIGN_CHUNK (1 << 20) /* least data per C_SignUpdate */
+#define PKCS11_PIN_MAX 128          /* longest PIN the vault keeps */
+#define PKCS11_PIN_TOKENS 16        /* tokens the vault keeps a PIN for */
+#define PKCS11_HOT_KEYS 1024        /* cached keys with their public half */
+#define PKCS11_RELOAD_WAIT_MS 5000  /* longest a reload waits for operations */
+#define PKCS11_KEY_STRIPES 64       /* counters of operations under way per key */
+#define PKCS11_SYNC_MS 1000         /* CACHE_CHECK interval without ms= */
 #define CK_PTR *
 
 #ifdef _WIN32
@@ -45,6 +56,19 @@
 #define PKCS11_CMD_MODULE_PATH            ENGINE_CMD_BASE
 #define PKCS11_CMD_PIN                    (ENGINE_CMD_BASE + 1)
 #define PKCS11_CMD_LOAD_CERT_CTRL         (ENGINE_CMD_BASE + 2)
+#define PKCS11_CMD_TRACE_FILE             (ENGINE_CMD_BASE + 3)
+#define PKCS11_CMD_SELFTEST               (ENGINE_CMD_BASE + 4)
+#define PKCS11_CMD_SELFTEST_CTRL          (ENGINE_CMD_BASE + 5)
+#define PKCS11_CMD_TOKEN_DIGEST           (ENGINE_CMD_BASE + 6)
+#define PKCS11_CMD_ROTATE_KEY             (ENGINE_CMD_BASE + 7)
+#define PKCS11_CMD_HOT_KEYS               (ENGINE_CMD_BASE + 8)
+#define PKCS11_CMD_RELOAD_MODULE          (ENGINE_CMD_BASE + 9)
+#define PKCS11_CMD_PROFILE_FILE           (ENGINE_CMD_BASE + 10)
+#define PKCS11_CMD_PROFILE                (ENGINE_CMD_BASE + 11)
+#define PKCS11_CMD_CALLS                  (ENGINE_CMD_BASE + 12)
+#define PKCS11_CMD_CALL_STATS             (ENGINE_CMD_BASE + 13)
+#define PKCS11_CMD_CALL_STATS_CTRL        (ENGINE_CMD_BASE + 14)
+#define PKCS11_CMD_CACHE_CHECK            (ENGINE_CMD_BASE + 15)
 
 static const ENGINE_CMD_DEFN pkcs11_cmd_defns[] = {
     {PKCS11_CMD_MODULE_PATH,
@@ -59,57 +83,430 @@ static const ENGINE_CMD_DEFN pkcs11_cmd_defns[] = {
      "LOAD_CERT_CTRL",
      "Get certificate",
      ENGINE_CMD_FLAG_INTERNAL},
+    {PKCS11_CMD_TRACE_FILE,
+     "TRACE_FILE",
+     "Record PKCS#11 calls into a trace file",
+     ENGINE_CMD_FLAG_STRING},
+    {PKCS11_CMD_SELFTEST,
+     "SELFTEST",
+     "Timed signing burst: key=<uri> [threads=n] [ms=n] [min-ops=x] "
+     "[max-p99-us=x] [min-parallel=x]",
+     ENGINE_CMD_FLAG_STRING},
+    {PKCS11_CMD_SELFTEST_CTRL,
+     "SELFTEST_CTRL",
+     "Timed signing burst, PKCS11_SELFTEST argument",
+     ENGINE_CMD_FLAG_INTERNAL},
+    {PKCS11_CMD_TOKEN_DIGEST,
+     "TOKEN_DIGEST",
+     "Have the token hash what it signs with PKCS#1 v1.5 (0/1)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {PKCS11_CMD_ROTATE_KEY,
+     "ROTATE_KEY",
+     "Point the key loaded as key-name:<name> at a key: <name>=<uri>",
+     ENGINE_CMD_FLAG_STRING},
+    {PKCS11_CMD_HOT_KEYS,
+     "HOT_KEYS",
+     "Loaded keys that keep their public half in memory (0: 1024)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {PKCS11_CMD_RELOAD_MODULE,
+     "RELOAD_MODULE",
+     "Switch to another build of the module without a restart: its path",
+     ENGINE_CMD_FLAG_STRING},
+    {PKCS11_CMD_PROFILE_FILE,
+     "PROFILE_FILE",
+     "Module profiles tried before the built-in ones",
+     ENGINE_CMD_FLAG_STRING},
+    {PKCS11_CMD_PROFILE,
+     "PROFILE",
+     "Use this module profile instead of the one matching the module",
+     ENGINE_CMD_FLAG_STRING},
+    {PKCS11_CMD_CALLS,
+     "CALLS",
+     "PKCS#11 call layer: [metrics] [retries=n] [fail=C_Xxx:rv:n] [probes] "
+     "[trace] [reset] [off]",
+     ENGINE_CMD_FLAG_STRING},
+    {PKCS11_CMD_CALL_STATS,
+     "CALL_STATS",
+     "Print the PKCS#11 calls counted since CALLS metrics",
+     ENGINE_CMD_FLAG_NO_INPUT},
+    {PKCS11_CMD_CALL_STATS_CTRL,
+     "CALL_STATS_CTRL",
+     "Counters of a PKCS#11 function, PKCS11_CALL_STATS argument",
+     ENGINE_CMD_FLAG_INTERNAL},
+    {PKCS11_CMD_CACHE_CHECK,
+     "CACHE_CHECK",
+     "Check tokens for objects changed by other hosts: [ms=n] "
+     "[object=<label>] [off]",
+     ENGINE_CMD_FLAG_STRING},
     {0, NULL, NULL, 0}
 };
 
+/* Idle sessions of one slot, handed out one per operation */
+typedef struct PKCS11_POOL_st {
+    CK_SLOT_ID slotid;
+    CK_SESSION_HANDLE *idle;
+    long *idle_since;           /* when each was given back, in ms */
+    size_t nidle;
+    size_t size;
+    int logged_in;              /* a session of the pool has logged in */
+    struct PKCS11_POOL_st *next;
+} PKCS11_POOL;
+
+/* What an RSA key of the engine keeps in its ex_data */
+typedef struct PKCS11_KEY_st {
+    CK_OBJECT_HANDLE handle;
+    CK_SLOT_ID slotid;
+    CK_BBOOL always_auth;
+    int sign_only;              /* C_EncryptInit not permitted, use C_Sign */
+    unsigned int module;        /* generation of the module of |handle| */
+    /* if not NULL, the rest is unused: sign with the name's current key */
+    struct PKCS11_KEY_NAME_st *name;
+} PKCS11_KEY;
+
+/*
+ * A key pair of the token as the provider holds it: the private key
+ * object, and the public half read along with it.
+ */
+typedef struct PKCS11_KEY_PAIR_st {
+    CK_KEY_TYPE type;           /* CKK_RSA or CKK_EC */
+    PKCS11_KEY key;
+    BIGNUM *n;                  /* CKK_RSA */
+    BIGNUM *e;
+    unsigned char *ec_params;   /* CKK_EC, the DER of the curve */
+    size_t ec_params_len;
+    unsigned char *ec_point;    /* out of its DER OCTET STRING */
+    size_t ec_point_len;
+} PKCS11_KEY_PAIR;
+
+/*
+ * A key loaded as key-name:<name>, which ROTATE_KEY points at another
+ * token object of the same key pair while it signs.  The signing threads
+ * copy the current version without a lock; a version replaced is freed
+ * once the readers that may have seen it are gone.
+ */
+typedef struct PKCS11_KEY_NAME_st {
+    char *name;
+    BIGNUM *n;                  /* the key pair of every version */
+    BIGNUM *e;
+    PKCS11_KEY *current;
+    /* ROTATE_KEY before the module was loaded, |current| is then NULL */
+    char *uri;
+    unsigned int epoch;         /* its low bit picks the readers to join */
+    unsigned int readers[2];
+    int waiting;                /* a rotation waits for the old readers */
+    struct PKCS11_KEY_NAME_st *next;
+} PKCS11_KEY_NAME;
+
+/* The PIN of a token, or with |any| the PIN ctrl for every token */
+typedef struct PKCS11_PIN_st {
+    int used;
+    int any;
+    CK_CHAR serial[16];         /* of the token, the key of the entry */
+    CK_SLOT_ID slotid;          /* where the token was seen last */
+    int bound;                  /* and is still, as far as known */
+    CK_ULONG len;
+    CK_UTF8CHAR pin[PKCS11_PIN_MAX];
+} PKCS11_PIN;
+
+/* The PINs of the tokens, in locked memory wiped when it is freed */
+typedef struct PKCS11_PIN_VAULT_st {
+    PKCS11_PIN *pins;           /* PKCS11_PIN_TOKENS of them */
+    size_t size;
+    int mapped;                 /* locked pages, else the heap */
+    /* only guards |pins|, never held across a module call */
+    CRYPTO_RWLOCK *lock;
+    /* held while a PIN is read or asked for, so each is asked once */
+    CRYPTO_RWLOCK *fill_lock;
+} PKCS11_PIN_VAULT;
+
+/*
+ * A loaded key, so that loading the same URI again needs no search.  Only
+ * the hot entries keep the public half, to load again with no token call;
+ * the others read it again from the object they still know.
+ */
+typedef struct PKCS11_KEY_CACHE_st {
+    char *uri;                  /* no PIN, NULL for a free or deleted entry */
+    unsigned long hash;
+    int deleted;                /* keeps the probe sequences going */
+    CK_OBJECT_CLASS class;
+    PKCS11_KEY key;
+    BIGNUM *n;                  /* NULL unless hot */
+    BIGNUM *e;
+    size_t prev;                /* least recently used list of the hot */
+    size_t next;
+} PKCS11_KEY_CACHE;
+
+/*
+ * What CACHE_CHECK last read of the token in a slot: the value of its
+ * generation object, or its free memory.
+ */
+typedef struct PKCS11_SYNC_st {
+    CK_SLOT_ID slotid;
+    long checked_ms;            /* when it was read, 0 to read it again */
+    unsigned long state;        /* a hash of what was read */
+    CK_OBJECT_HANDLE object;    /* of the generation object, 0 unknown */
+    struct PKCS11_SYNC_st *next;
+} PKCS11_SYNC;
+
+/* The loaded keys, open addressing with linear probing */
+typedef struct PKCS11_KEY_TABLE_st {
+    PKCS11_KEY_CACHE *entries;
+    size_t size;                /* a power of 2, or 0 */
+    size_t used;                /* entries with a URI or deleted */
+    size_t hot;
+    size_t max_hot;             /* 0 for PKCS11_HOT_KEYS */
+    size_t head;                /* most recently used, or PKCS11_KEY_NONE */
+    size_t tail;
+} PKCS11_KEY_TABLE;
+
+#define PKCS11_KEY_NONE ((size_t)-1)
+
+/* A hot key found again on the module a reload switches to */
+typedef struct PKCS11_REBIND_st {
+    CK_SLOT_ID slotid;
+    CK_OBJECT_CLASS class;
+    CK_OBJECT_HANDLE from;
+    CK_OBJECT_HANDLE to;        /* CK_INVALID_HANDLE if not found */
+    BIGNUM *n;
+} PKCS11_REBIND;
+
+#define PKCS11_AUTH_READ   0        /* CKA_ALWAYS_AUTHENTICATE as the key says */
+#define PKCS11_AUTH_NEVER  1
+#define PKCS11_AUTH_ALWAYS 2
+
+/*
+ * How to drive a module, or a kind of token.  The first profile whose
+ * patterns are all prefixes of the module's CK_INFO and of the token's
+ * CK_TOKEN_INFO is used; a NULL pattern matches anything.
+ */
+typedef struct PKCS11_PROFILE_st {
+    const char *name;
+    const char *manufacturer;   /* CK_INFO.manufacturerID */
+    const char *library;        /* CK_INFO.libraryDescription */
+    const char *model;          /* CK_TOKEN_INFO.model */
+    int os_locking;             /* else the module locks with our mutexes */
+    int raw_rsa;                /* PKCS#1 v1.5 padding here, CKM_RSA_X_509 */
+    int always_auth;            /* PKCS11_AUTH_* */
+    unsigned int key_ops;       /* operations at once on a key, 0 for any */
+    unsigned int find_batch;    /* handles per C_FindObjects */
+    long keepalive_ms;          /* check sessions idle longer, 0 never */
+} PKCS11_PROFILE;
+
+/* Operations under way on the keys of a stripe, for PKCS11_PROFILE.key_ops */
+typedef struct PKCS11_KEY_OPS_st {
+    pthread_mutex_t lock;
+    pthread_cond_t done;        /* an operation ended */
+    unsigned int n;
+} PKCS11_KEY_OPS;
+
 typedef struct PKCS11_CTX_st {
     CK_BYTE *id;
     CK_ULONG idlen;
     CK_BYTE *label;
-    CK_BYTE *pin;
+    CK_BYTE *pin;               /* pin-value of the URI */
     CK_ULONG pinlen;
+    char *pin_source;           /* pin-source of the URI */
+    int need_pin;               /* the URI is for a private object */
     CK_UTF8CHAR token[32];
     CK_CHAR serial[16];
     CK_UTF8CHAR model[16];
     CK_UTF8CHAR manufacturer[32];
     char *type;
     CK_SLOT_ID slotid;
-    CK_SESSION_HANDLE session;
     char *module_path;
+    /* only guards |pools| and |keys|, never held across a module call */
     CRYPTO_RWLOCK *lock;
+    PKCS11_POOL *pools;
+    PKCS11_KEY_TABLE keys;
+    /* held while a URI or a client certificate search sets the object */
+    CRYPTO_RWLOCK *load_lock;
     const UI_METHOD *ui_method;
     void *callback_data;
+    ENGINE *engine;             /* not a reference, the engine owns us */
+    int token_digest;           /* EVP_DigestSign() hashes on the token */
+    PKCS11_PIN_VAULT vault;
+    /* only guards |names| and rotations, signing does not take it */
+    CRYPTO_RWLOCK *names_lock;
+    PKCS11_KEY_NAME *names;
+    PKCS11_PROFILE profile;     /* the settings in use */
+    int profile_chosen;         /* else chosen at the next slot lookup */
+    char *profile_name;         /* PROFILE, instead of matching */
+    PKCS11_PROFILE *profiles;   /* of PROFILE_FILE, tried first */
+    size_t nprofiles;
+    char *profile_text;         /* the file, which |profiles| point into */
+    PKCS11_KEY_OPS key_ops[PKCS11_KEY_STRIPES];
+    long sync_ms;               /* CACHE_CHECK interval, 0 never */
+    char *sync_object;          /* label of the generation object */
+    PKCS11_SYNC *syncs;         /* guarded by |lock| */
 } PKCS11_CTX;
 
+/* SELFTEST_CTRL argument: the test to run, then what it measured */
+typedef struct PKCS11_SELFTEST_st {
+    const char *key;            /* private key URI */
+    int threads;                /* 0 for 8 */
+    long duration_ms;           /* 0 for 1000 */
+    double min_ops_per_sec;     /* thresholds, 0 for none */
+    double max_p99_us;
+    double min_parallelism;
+    int measured;
+    unsigned long ops;
+    unsigned long errors;
+    double ops_per_sec;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    double min_us;
+    double max_us;
+    double in_flight;           /* signatures under way on average */
+    double parallelism;         /* signatures the module serves at once */
+    size_t sessions;            /* pooled sessions of the key's slot */
+} PKCS11_SELFTEST;
+
+/* CALL_STATS_CTRL argument: a function, then its counters */
+typedef struct PKCS11_CALL_STATS_st {
+    const char *name;           /* "C_Sign" */
+    unsigned long calls;
+    unsigned long errors;       /* calls that failed, after any retries */
+    unsigned long retries;
+    unsigned long injected;     /* failures of CALLS fail= */
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+} PKCS11_CALL_STATS;
+
+/* A store listing over several tokens, e_pkcs11_list.c */
+typedef struct PKCS11_LIST_st PKCS11_LIST;
+
 struct ossl_store_loader_ctx_st {
     int error;
     int eof;
     int listflag;
     X509 *cert;
     EVP_PKEY *key;
+    PKCS11_CTX *pkcs11_ctx;
+    CK_SLOT_ID slotid;
     CK_SESSION_HANDLE session;
+    CK_OBJECT_HANDLE found[PKCS11_FIND_BATCH_MAX];
+    CK_ULONG nfound;
+    CK_ULONG pos;
+    int found_all;
+    CK_BYTE value[PKCS11_VALUE_MAX];
+    PKCS11_LIST *list;          /* else the search is on |session| */
 };
 
+struct dso_st;
+
 CK_RV pkcs11_initialize(const char *library_path);
+CK_RV pkcs11_module_open(const char *library_path, struct dso_st **dso,
+                         CK_FUNCTION_LIST **funcs);
+CK_FUNCTION_LIST *pkcs11_module_current(void);
+int pkcs11_module_hold(long wait_ms);
+void pkcs11_module_release(void);
+int pkcs11_module_swap(const char *library_path, struct dso_st **dso,
+                       CK_FUNCTION_LIST **funcs);
+unsigned int pkcs11_module_generation(void);
+int pkcs11_module_relock(int os_locking);
+CK_RV pkcs11_get_info(CK_INFO *info);
+void pkcs11_profile_default(PKCS11_PROFILE *profile);
+int pkcs11_profile_select(PKCS11_CTX *ctx);
+int pkcs11_profile_load(PKCS11_CTX *ctx, const char *path);
+int pkcs11_profile_set(PKCS11_CTX *ctx, const char *name);
+void pkcs11_profiles_free(PKCS11_CTX *ctx);
+void pkcs11_key_ops_init(PKCS11_CTX *ctx);
+void pkcs11_key_ops_free(PKCS11_CTX *ctx);
+int pkcs11_key_ops_enter(PKCS11_CTX *ctx, const PKCS11_KEY *key);
+void pkcs11_key_ops_leave(PKCS11_CTX *ctx, int ops);
+int pkcs11_reload_module(PKCS11_CTX *ctx, const char *library_path);
+CK_OBJECT_HANDLE pkcs11_find_key_by_modulus(CK_FUNCTION_LIST *funcs,
+                                            CK_SESSION_HANDLE session,
+                                            const BIGNUM *n);
 int pkcs11_start_session(PKCS11_CTX *ctx, CK_SESSION_HANDLE *session);
+int pkcs11_session_get(PKCS11_CTX *ctx, CK_SLOT_ID slotid,
+                       CK_SESSION_HANDLE *session);
+void pkcs11_session_put(PKCS11_CTX *ctx, CK_SLOT_ID slotid,
+                        CK_SESSION_HANDLE session, int reuse);
+void pkcs11_session_pool_free(PKCS11_CTX *ctx);
+size_t pkcs11_session_idle(PKCS11_CTX *ctx, CK_SLOT_ID slotid);
+EVP_PKEY *pkcs11_key_cache_get(PKCS11_CTX *ctx, const char *uri,
+                               CK_OBJECT_CLASS class);
+void pkcs11_key_cache_add(PKCS11_CTX *ctx, const char *uri,
+                          CK_OBJECT_CLASS class, EVP_PKEY *pkey);
+void pkcs11_key_cache_free(PKCS11_CTX *ctx);
+void pkcs11_key_cache_drop(PKCS11_CTX *ctx, const PKCS11_KEY *key);
+void pkcs11_key_cache_drop_slot(PKCS11_CTX *ctx, CK_SLOT_ID slotid);
+int pkcs11_sync_set(PKCS11_CTX *ctx, const char *args);
+int pkcs11_sync_check(PKCS11_CTX *ctx, CK_SLOT_ID slotid);
+void pkcs11_sync_stale(PKCS11_CTX *ctx, CK_SLOT_ID slotid);
+void pkcs11_sync_free(PKCS11_CTX *ctx);
+void pkcs11_key_cache_set_hot(PKCS11_CTX *ctx, size_t max_hot);
+EVP_PKEY *pkcs11_reload_pkey(PKCS11_CTX *ctx, const PKCS11_KEY *key);
+size_t pkcs11_key_cache_hot_keys(PKCS11_CTX *ctx, PKCS11_REBIND **keys);
+void pkcs11_key_cache_rebind(PKCS11_CTX *ctx, const PKCS11_REBIND *keys,
+                             size_t n, unsigned int module);
+int pkcs11_key_get(const RSA *rsa, PKCS11_KEY *key);
+void pkcs11_key_sign_only(const RSA *rsa, const PKCS11_KEY *key);
+void pkcs11_key_rebound(const RSA *rsa, const PKCS11_KEY *key,
+                        CK_OBJECT_HANDLE handle, unsigned int module);
+int pkcs11_key_name_set(PKCS11_CTX *ctx, const char *name, EVP_PKEY *pkey);
+EVP_PKEY *pkcs11_key_name_get(PKCS11_CTX *ctx, const char *name);
+int pkcs11_key_name_defer(PKCS11_CTX *ctx, const char *name, const char *uri);
+char *pkcs11_key_name_uri(PKCS11_CTX *ctx, const char *name);
+void pkcs11_key_names_free(PKCS11_CTX *ctx);
+EVP_PKEY *pkcs11_new_pkey(PKCS11_CTX *ctx, const PKCS11_KEY *key,
+                          BIGNUM *n, BIGNUM *e);
 int pkcs11_login(CK_SESSION_HANDLE session, PKCS11_CTX *ctx,
-                 CK_USER_TYPE userType);
+                 CK_SLOT_ID slotid, CK_USER_TYPE userType);
+int pkcs11_pin_vault_init(PKCS11_PIN_VAULT *vault);
+void pkcs11_pin_vault_free(PKCS11_PIN_VAULT *vault);
+int pkcs11_pin_set_default(PKCS11_CTX *ctx, const char *pin);
+int pkcs11_pin_fill(PKCS11_CTX *ctx);
+int pkcs11_pin_known(PKCS11_CTX *ctx, CK_SLOT_ID slotid);
+int pkcs11_pin_get(PKCS11_CTX *ctx, CK_SLOT_ID slotid, CK_UTF8CHAR *pin,
+                   CK_ULONG *len);
+void pkcs11_pin_forget(PKCS11_CTX *ctx, CK_SLOT_ID slotid);
 EVP_PKEY *pkcs11_load_pkey(CK_SESSION_HANDLE session, PKCS11_CTX *ctx,
                            CK_OBJECT_HANDLE key);
+int pkcs11_key_pair_read(CK_SESSION_HANDLE session, PKCS11_CTX *ctx,
+                         PKCS11_KEY_PAIR *kp);
+void pkcs11_key_pair_free(PKCS11_KEY_PAIR *kp);
+int pkcs11_key_op(PKCS11_CTX *ctx, PKCS11_KEY_PAIR *kp, int decrypt,
+                  CK_MECHANISM *mech, const unsigned char *in, size_t inlen,
+                  unsigned char *out, size_t *outlen);
 int pkcs11_rsa_sign(int alg, const unsigned char *md,
                     unsigned int md_len, unsigned char *sigret,
                     unsigned int *siglen, const RSA *rsa);
+int pkcs11_digest_sign_init(PKCS11_CTX *ctx, const RSA *rsa,
+                            PKCS11_KEY *key, CK_MECHANISM_TYPE mechanism,
+                            CK_SESSION_HANDLE *session, int *ops);
+int pkcs11_digest_sign_update(CK_SESSION_HANDLE session,
+                              const unsigned char *data, size_t len);
+int pkcs11_digest_sign_final(PKCS11_CTX *ctx, const PKCS11_KEY *key,
+                             CK_SESSION_HANDLE session, int ops,
+                             unsigned char *sig, size_t *siglen);
 int pkcs11_rsa_priv_enc(int flen, const unsigned char *from,
                         unsigned char *to, RSA *rsa, int padding);
 int pkcs11_rsa_priv_dec(int flen, const unsigned char *from,
                         unsigned char *to, RSA *rsa, int padding);
 int pkcs11_get_slot(PKCS11_CTX *ctx);
+int pkcs11_get_slots(PKCS11_CTX *ctx, CK_SLOT_ID **slots, size_t *count);
+CK_RV pkcs11_get_token_info(CK_SLOT_ID slotid, CK_TOKEN_INFO *info);
+CK_OBJECT_HANDLE pkcs11_find_data(CK_SESSION_HANDLE session,
+                                  const char *label);
+CK_RV pkcs11_get_value(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj,
+                       CK_BYTE *value, CK_ULONG *len);
+CK_OBJECT_HANDLE pkcs11_find_key(CK_SESSION_HANDLE session, PKCS11_CTX *ctx,
+                                 CK_OBJECT_CLASS key_class,
+                                 CK_KEY_TYPE key_type);
 CK_OBJECT_HANDLE pkcs11_find_private_key(CK_SESSION_HANDLE session,
                                          PKCS11_CTX *ctx);
 CK_OBJECT_HANDLE pkcs11_find_public_key(CK_SESSION_HANDLE session,
                                         PKCS11_CTX *ctx);
+int pkcs11_parse(PKCS11_CTX *ctx, const char *path, int store);
+int pkcs11_rsa_encode_pkcs1(unsigned char **out, int *out_len, int type,
+                            const unsigned char *m, unsigned int m_len);
 void PKCS11_trace(char *format, ...);
 void printf_stderr(char *format, ...);
+PKCS11_CTX *pkcs11_ctx_new(void);
+void pkcs11_ctx_free(PKCS11_CTX *ctx);
 PKCS11_CTX *pkcs11_get_ctx(const RSA *rsa);
 int pkcs11_search_next_ids(OSSL_STORE_LOADER_CTX *ctx, char **name,
                            char **description);
@@ -117,10 +514,32 @@ int pkcs11_search_next_object(OSSL_STORE_LOADER_CTX *ctx,
                               CK_OBJECT_CLASS *class);
 int pkcs11_search_next_cert(OSSL_STORE_LOADER_CTX *ctx,
                             CK_BYTE **id, CK_ULONG *idlen);
+CK_ULONG pkcs11_search_template(PKCS11_CTX *ctx, CK_OBJECT_CLASS *key_class,
+                                CK_ATTRIBUTE *tmpl);
+int pkcs11_search_init(OSSL_STORE_LOADER_CTX *store_ctx, CK_ATTRIBUTE *tmpl,
+                       CK_ULONG count);
 int pkcs11_search_start(OSSL_STORE_LOADER_CTX *store_ctx,
                         PKCS11_CTX *pkcs11_ctx);
 void pkcs11_finalize(void);
 void pkcs11_end_session(CK_SESSION_HANDLE session);
 int pkcs11_logout(CK_SESSION_HANDLE session);
-void pkcs11_close_operation(CK_SESSION_HANDLE session);
+int pkcs11_close_operation(CK_SESSION_HANDLE session);
+PKCS11_LIST *pkcs11_list_start(PKCS11_CTX *ctx, CK_SLOT_ID *slots,
+                               size_t nslots, int names);
+OSSL_STORE_INFO *pkcs11_list_next(PKCS11_LIST *list, int *eof);
+int pkcs11_list_eof(PKCS11_LIST *list);
+void pkcs11_list_free(PKCS11_LIST *list);
+int pkcs11_rec_open(const char *path);
+void pkcs11_rec_close(void);
+void pkcs11_rec_op(int op);
+CK_FUNCTION_LIST *pkcs11_rec_wrap(CK_FUNCTION_LIST *funcs);
+int pkcs11_call_set(const char *args);
+int pkcs11_call_stats(PKCS11_CALL_STATS *st);
+void pkcs11_call_stats_print(void);
+int pkcs11_selftest(ENGINE *e, PKCS11_SELFTEST *st);
+int pkcs11_selftest_str(ENGINE *e, const char *args);
+int pkcs11_pmeth_init(void);
+void pkcs11_pmeth_free(void);
+int pkcs11_pkey_meths(ENGINE *e, EVP_PKEY_METHOD **pmeth, const int **nids,
+                      int nid);
 extern int rsa_pkcs11_idx;
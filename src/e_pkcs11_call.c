@@ -0,0 +1,375 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * PKCS#11 call layer, the slow path of PKCS11_CALL_VIA.  The CALLS ctrl
+ * turns its features on, all of them per process like the module itself:
+ *
+ *   metrics           count the calls, failures, retries and time of
+ *                     every function, read with CALL_STATS
+ *   retries=n         call again, up to n times, a function that starts
+ *                     nothing on the token when it fails transiently
+ *   fail=C_Xxx:rv:n   fail the next n calls of C_Xxx with rv, without
+ *                     calling the module
+ *   probes            fire the pkcs11engine:call and pkcs11engine:retry
+ *                     USDT probes, when built with <sys/sdt.h>
+ *   trace             write every failed call to stderr
+ *
+ * Each CALLS replaces the settings of the previous one; "off" turns the
+ * layer off and "reset" zeroes the counters.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+#include "e_pkcs11_call.h"
+#ifdef PKCS11_USDT
+# include <sys/sdt.h>
+#endif
+
+#define CALL_RETRY_MAX      16
+#define CALL_BACKOFF_MS     1       /* first wait before a retry, doubled */
+#define CALL_BACKOFF_MAX_MS 64
+
+#ifdef DEBUG
+unsigned int pkcs11_call_flags = PKCS11_CALL_TRACE;
+#else
+unsigned int pkcs11_call_flags = 0;
+#endif
+
+static const char *const call_names[] = {
+#define CK_PKCS11_FUNCTION_INFO(name) #name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+};
+
+/* The functions a transient failure leaves as if they were never called */
+static const unsigned char call_idempotent[PKCS11_FN_NUM] = {
+    [PKCS11_FN_C_GetInfo] = 1,
+    [PKCS11_FN_C_GetSlotList] = 1,
+    [PKCS11_FN_C_GetSlotInfo] = 1,
+    [PKCS11_FN_C_GetTokenInfo] = 1,
+    [PKCS11_FN_C_GetMechanismList] = 1,
+    [PKCS11_FN_C_GetMechanismInfo] = 1,
+    [PKCS11_FN_C_OpenSession] = 1,
+    [PKCS11_FN_C_GetSessionInfo] = 1,
+    [PKCS11_FN_C_GetAttributeValue] = 1,
+    [PKCS11_FN_C_FindObjectsInit] = 1,
+    [PKCS11_FN_C_EncryptInit] = 1,
+    [PKCS11_FN_C_DecryptInit] = 1,
+    [PKCS11_FN_C_DigestInit] = 1,
+    [PKCS11_FN_C_SignInit] = 1,
+    [PKCS11_FN_C_VerifyInit] = 1,
+};
+
+static PKCS11_CALL_STATS call_stats[PKCS11_FN_NUM];
+static unsigned int call_retries = 0;
+static CK_RV call_inject_rv[PKCS11_FN_NUM];
+static unsigned long call_inject_left[PKCS11_FN_NUM];
+
+static unsigned long long call_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * The name of a function of pkcs11f.h.
+ * @param fn
+ * @return
+ */
+const char *pkcs11_call_name(PKCS11_FN fn)
+{
+    return fn < PKCS11_FN_NUM ? call_names[fn] : "?";
+}
+
+/**
+ * Classify the result of a call.
+ * @param rv
+ * @return one of PKCS11_RV_*
+ */
+int pkcs11_rv_class(CK_RV rv)
+{
+    switch (rv) {
+    case CKR_OK:
+        return PKCS11_RV_OK;
+    case CKR_DEVICE_ERROR:
+    case CKR_DEVICE_MEMORY:
+    case CKR_FUNCTION_FAILED:
+    case CKR_SESSION_COUNT:
+        return PKCS11_RV_TRANSIENT;
+    case CKR_SESSION_HANDLE_INVALID:
+    case CKR_SESSION_CLOSED:
+    case CKR_DEVICE_REMOVED:
+    case CKR_TOKEN_NOT_PRESENT:
+    case CKR_CRYPTOKI_NOT_INITIALIZED:
+        return PKCS11_RV_SESSION;
+    case CKR_USER_NOT_LOGGED_IN:
+    case CKR_PIN_INCORRECT:
+    case CKR_PIN_LOCKED:
+    case CKR_PIN_EXPIRED:
+        return PKCS11_RV_AUTH;
+    case CKR_KEY_HANDLE_INVALID:
+    case CKR_OBJECT_HANDLE_INVALID:
+        return PKCS11_RV_OBJECT;
+    default:
+        return PKCS11_RV_OTHER;
+    }
+}
+
+void pkcs11_call_begin(PKCS11_CALL_STATE *cs, PKCS11_FN fn)
+{
+    unsigned int flags = __atomic_load_n(&pkcs11_call_flags, __ATOMIC_ACQUIRE);
+
+    cs->fn = fn;
+    cs->tries = 0;
+    cs->start = flags & (PKCS11_CALL_METRICS | PKCS11_CALL_PROBES)
+                ? call_clock() : 0;
+}
+
+/**
+ * Fail the call on purpose, if a CALLS fail= setting is left for it.
+ * @param cs
+ * @param rv receives the failure
+ * @return 1 if the module is not to be called
+ */
+int pkcs11_call_injected(PKCS11_CALL_STATE *cs, CK_RV *rv)
+{
+    unsigned int flags = __atomic_load_n(&pkcs11_call_flags, __ATOMIC_ACQUIRE);
+    unsigned long n;
+
+    if (!(flags & PKCS11_CALL_INJECT))
+        return 0;
+    n = __atomic_load_n(&call_inject_left[cs->fn], __ATOMIC_RELAXED);
+    do {
+        if (n == 0)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&call_inject_left[cs->fn], &n,
+                                          n - 1, 0, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    *rv = call_inject_rv[cs->fn];
+    if (flags & PKCS11_CALL_METRICS)
+        __atomic_add_fetch(&call_stats[cs->fn].injected, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+static void call_backoff(unsigned int tries)
+{
+    struct timespec ts;
+    long ms = CALL_BACKOFF_MS << (tries < 6 ? tries : 6);
+
+    if (ms > CALL_BACKOFF_MAX_MS)
+        ms = CALL_BACKOFF_MAX_MS;
+    ts.tv_sec = 0;
+    ts.tv_nsec = ms * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Account for a call that returned |rv|.
+ * @param cs
+ * @param rv
+ * @return 1 if the call is to be made again
+ */
+int pkcs11_call_end(PKCS11_CALL_STATE *cs, CK_RV rv)
+{
+    PKCS11_CALL_STATS *st = &call_stats[cs->fn];
+    unsigned int flags = __atomic_load_n(&pkcs11_call_flags, __ATOMIC_ACQUIRE);
+    unsigned long long ns = 0, max;
+    int retry;
+
+    retry = rv != CKR_OK && (flags & PKCS11_CALL_RETRY)
+            && cs->tries < __atomic_load_n(&call_retries, __ATOMIC_RELAXED)
+            && call_idempotent[cs->fn]
+            && pkcs11_rv_class(rv) == PKCS11_RV_TRANSIENT;
+    if (cs->start != 0)
+        ns = call_clock() - cs->start;
+
+    if (flags & PKCS11_CALL_METRICS) {
+        __atomic_add_fetch(retry ? &st->retries : &st->calls, 1,
+                           __ATOMIC_RELAXED);
+        if (rv != CKR_OK && !retry)
+            __atomic_add_fetch(&st->errors, 1, __ATOMIC_RELAXED);
+        if (!retry) {
+            /* the time of a call includes its retries */
+            __atomic_add_fetch(&st->total_ns, ns, __ATOMIC_RELAXED);
+            max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+            while (ns > max
+                   && !__atomic_compare_exchange_n(&st->max_ns, &max, ns, 0,
+                                                   __ATOMIC_RELAXED,
+                                                   __ATOMIC_RELAXED))
+                ;
+        }
+    }
+#ifdef PKCS11_USDT
+    if (flags & PKCS11_CALL_PROBES) {
+        if (retry)
+            DTRACE_PROBE3(pkcs11engine, retry, call_names[cs->fn], rv,
+                          cs->tries + 1);
+        else
+            DTRACE_PROBE3(pkcs11engine, call, call_names[cs->fn], rv, ns);
+    }
+#endif
+    if ((flags & PKCS11_CALL_TRACE) && rv != CKR_OK)
+        printf_stderr("%s failed, error: %#08lX%s\n", call_names[cs->fn],
+                      (unsigned long)rv, retry ? ", retrying" : "");
+    if (retry)
+        call_backoff(cs->tries++);
+    return retry;
+}
+
+static int call_fail(const char *arg)
+{
+    char *end;
+    const char *colon;
+    unsigned long rv, n;
+    size_t len, i;
+
+    if ((colon = strchr(arg, ':')) == NULL)
+        return 0;
+    len = colon - arg;
+    rv = strtoul(colon + 1, &end, 0);
+    if (*end != ':' || rv == CKR_OK)
+        return 0;
+    n = strtoul(end + 1, &end, 10);
+    if (*end != '\0')
+        return 0;
+    for (i = 0; i < PKCS11_FN_NUM; i++) {
+        if (strlen(call_names[i]) == len
+            && strncmp(call_names[i], arg, len) == 0) {
+            call_inject_rv[i] = rv;
+            __atomic_store_n(&call_inject_left[i], n, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Zero the counters, which calls under way may be adding to */
+static void call_stats_reset(void)
+{
+    PKCS11_CALL_STATS *st;
+    size_t i;
+
+    for (i = 0; i < PKCS11_FN_NUM; i++) {
+        st = &call_stats[i];
+        __atomic_store_n(&st->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->errors, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->retries, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->injected, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->max_ns, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * CALLS: the features of the call layer, as space separated settings.
+ * @param args
+ * @return 1 on success, 0 on error, the settings are then unchanged
+ */
+int pkcs11_call_set(const char *args)
+{
+    char *copy, *tok, *save = NULL, *end;
+    unsigned int flags = 0;
+    unsigned long n;
+    int ret = 0;
+
+    if (args == NULL || (copy = OPENSSL_strdup(args)) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_CALL_SET, PKCS11_R_CALLS_INVALID);
+        return 0;
+    }
+    for (tok = strtok_r(copy, " \t,", &save); tok != NULL;
+         tok = strtok_r(NULL, " \t,", &save)) {
+        if (strcmp(tok, "off") == 0) {
+            flags = 0;
+        } else if (strcmp(tok, "metrics") == 0) {
+            flags |= PKCS11_CALL_METRICS;
+        } else if (strcmp(tok, "probes") == 0) {
+            flags |= PKCS11_CALL_PROBES;
+        } else if (strcmp(tok, "trace") == 0) {
+            flags |= PKCS11_CALL_TRACE;
+        } else if (strcmp(tok, "reset") == 0) {
+            call_stats_reset();
+        } else if (strncmp(tok, "retries=", 8) == 0) {
+            n = strtoul(tok + 8, &end, 10);
+            if (*end != '\0' || n > CALL_RETRY_MAX)
+                goto bad;
+            __atomic_store_n(&call_retries, (unsigned int)n,
+                             __ATOMIC_RELAXED);
+            if (n > 0)
+                flags |= PKCS11_CALL_RETRY;
+        } else if (strncmp(tok, "fail=", 5) == 0) {
+            if (!call_fail(tok + 5))
+                goto bad;
+            flags |= PKCS11_CALL_INJECT;
+        } else {
+            goto bad;
+        }
+    }
+    __atomic_store_n(&pkcs11_call_flags, flags, __ATOMIC_RELEASE);
+    ret = 1;
+    goto end;
+
+ bad:
+    ERR_raise_data(ERR_LIB_PKCS11, PKCS11_R_CALLS_INVALID, "%s", tok);
+ end:
+    OPENSSL_free(copy);
+    return ret;
+}
+
+/**
+ * CALL_STATS_CTRL: the counters of the function named in |st|.
+ * @param st
+ * @return 1 on success, 0 if there is no such function
+ */
+int pkcs11_call_stats(PKCS11_CALL_STATS *st)
+{
+    size_t i;
+
+    for (i = 0; i < PKCS11_FN_NUM; i++) {
+        if (st->name != NULL && strcmp(call_names[i], st->name) == 0) {
+            st->calls = __atomic_load_n(&call_stats[i].calls,
+                                        __ATOMIC_RELAXED);
+            st->errors = __atomic_load_n(&call_stats[i].errors,
+                                         __ATOMIC_RELAXED);
+            st->retries = __atomic_load_n(&call_stats[i].retries,
+                                          __ATOMIC_RELAXED);
+            st->injected = __atomic_load_n(&call_stats[i].injected,
+                                           __ATOMIC_RELAXED);
+            st->total_ns = __atomic_load_n(&call_stats[i].total_ns,
+                                           __ATOMIC_RELAXED);
+            st->max_ns = __atomic_load_n(&call_stats[i].max_ns,
+                                         __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    PKCS11err(PKCS11_F_PKCS11_CALL_SET, PKCS11_R_CALLS_INVALID);
+    return 0;
+}
+
+/* CALL_STATS: a line on stderr per function called */
+void pkcs11_call_stats_print(void)
+{
+    PKCS11_CALL_STATS st;
+    size_t i;
+
+    for (i = 0; i < PKCS11_FN_NUM; i++) {
+        st.name = call_names[i];
+        if (!pkcs11_call_stats(&st) || st.calls == 0)
+            continue;
+        printf_stderr("CALL %s: calls=%lu errors=%lu retries=%lu "
+                      "injected=%lu avg_us=%.1f max_us=%.1f\n",
+                      st.name, st.calls, st.errors, st.retries, st.injected,
+                      st.total_ns / 1000.0 / st.calls, st.max_ns / 1000.0);
+    }
+}
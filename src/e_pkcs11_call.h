@@ -0,0 +1,81 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+#ifndef HEADER_PKCS11CALL_H
+# define HEADER_PKCS11CALL_H
+
+/*
+ * PKCS#11 call layer.  Every call of the engine into a module is made with
+ * PKCS11_CALL_ON(funcs, C_Xxx, args...), or PKCS11_CALL in e_pkcs11.c for
+ * the module in use.  While no feature of the layer is on, that is the
+ * plain call through the function list behind one well predicted test of
+ * |pkcs11_call_flags|, which is only read and written atomically.  Otherwise the call is timed, counted per function,
+ * failed on purpose, retried or reported to a USDT probe, as the CALLS
+ * ctrl asked for, see e_pkcs11_call.c.
+ *
+ * Functions are numbered by their position in pkcs11f.h, as in the call
+ * traces.  A retried call evaluates its arguments again.
+ */
+
+# define PKCS11_CALL_METRICS    0x01    /* count and time the calls */
+# define PKCS11_CALL_RETRY      0x02    /* retry transient failures */
+# define PKCS11_CALL_INJECT     0x04    /* fail calls on purpose */
+# define PKCS11_CALL_PROBES     0x08    /* fire the USDT probes */
+# define PKCS11_CALL_TRACE      0x10    /* PKCS11_trace every failure */
+
+/* What a CK_RV says about the call, and about calling again */
+# define PKCS11_RV_OK           0
+# define PKCS11_RV_TRANSIENT    1       /* the device may do it next time */
+# define PKCS11_RV_SESSION      2       /* the session or token is gone */
+# define PKCS11_RV_AUTH         3       /* a login is missing or refused */
+# define PKCS11_RV_OBJECT       4       /* the object handle is stale */
+# define PKCS11_RV_OTHER        5
+
+typedef enum {
+# define CK_PKCS11_FUNCTION_INFO(name) PKCS11_FN_##name,
+# include "pkcs11f.h"
+# undef CK_PKCS11_FUNCTION_INFO
+    PKCS11_FN_NUM
+} PKCS11_FN;
+
+/* One call under way with some feature on */
+typedef struct {
+    PKCS11_FN fn;
+    unsigned int tries;
+    unsigned long long start;   /* ns, when timed */
+} PKCS11_CALL_STATE;
+
+extern unsigned int pkcs11_call_flags;
+
+void pkcs11_call_begin(PKCS11_CALL_STATE *cs, PKCS11_FN fn);
+int pkcs11_call_injected(PKCS11_CALL_STATE *cs, CK_RV *rv);
+int pkcs11_call_end(PKCS11_CALL_STATE *cs, CK_RV rv);
+int pkcs11_rv_class(CK_RV rv);
+const char *pkcs11_call_name(PKCS11_FN fn);
+
+# define PKCS11_CALL_VIA(f, call)                                       \
+    (__builtin_expect(__atomic_load_n(&pkcs11_call_flags,               \
+                                      __ATOMIC_RELAXED) == 0, 1)        \
+     ? (call) : ({                                                      \
+        PKCS11_CALL_STATE cs_;                                          \
+        CK_RV rv_;                                                      \
+                                                                        \
+        pkcs11_call_begin(&cs_, PKCS11_FN_##f);                         \
+        do {                                                            \
+            if (!pkcs11_call_injected(&cs_, &rv_))                      \
+                rv_ = (call);                                           \
+        } while (pkcs11_call_end(&cs_, rv_));                           \
+        rv_;                                                            \
+    }))
+
+# define PKCS11_CALL_ON(funcs, f, ...) \
+    PKCS11_CALL_VIA(f, (funcs)->f(__VA_ARGS__))
+
+#endif
@@ -14,15 +14,14 @@
 #endif
 
 #include "e_pkcs11.h"
-#include "e_pkcs11_err.c"
+#include "e_pkcs11_err.h"
+#include "e_pkcs11_rec.h"
 #include <openssl/x509v3.h>
 #include <openssl/ui.h>
 #include <ctype.h>
 
 static int pkcs11_parse_items(PKCS11_CTX *ctx, const char *uri, int store);
-static int pkcs11_parse(PKCS11_CTX *ctx, const char *path, int store);
-static PKCS11_CTX *pkcs11_ctx_new(void);
-static void pkcs11_ctx_free(PKCS11_CTX *ctx);
+static void pkcs11_ctx_reset_object(PKCS11_CTX *ctx);
 static int bind_pkcs11(ENGINE *e);
 static int pkcs11_init(ENGINE *e);
 static int pkcs11_destroy(ENGINE *e);
@@ -39,8 +38,6 @@ void engine_load_pkcs11_int(void);
 static int pkcs11_rsa_free(RSA *rsa);
 static unsigned char *pkcs11_pad(char *field, int len);
 static int cert_issuer_match(STACK_OF(X509_NAME) *ca_dn, X509 *x);
-static char *pkcs11_get_console_pin(PKCS11_CTX *ctx);
-CK_BYTE *pin_from_file(const char *filename);
 
 static RSA_METHOD *pkcs11_rsa = NULL;
 static const char *engine_id = "pkcs11";
@@ -121,8 +118,20 @@ static int pkcs11_init(ENGINE *e)
         if (ctx == NULL)
             goto memerr;
 
+        ctx->engine = e;
         ENGINE_set_ex_data(e, pkcs11_idx, ctx);
     }
+    /* initialized again after pkcs11_finish() */
+    if (ctx->lock == NULL && (ctx->lock = CRYPTO_THREAD_lock_new()) == NULL)
+        goto memerr;
+    if (ctx->load_lock == NULL
+        && (ctx->load_lock = CRYPTO_THREAD_lock_new()) == NULL)
+        goto memerr;
+    if (ctx->names_lock == NULL
+        && (ctx->names_lock = CRYPTO_THREAD_lock_new()) == NULL)
+        goto memerr;
+    if (!pkcs11_pin_vault_init(&ctx->vault))
+        goto memerr;
 
     return 1;
 
@@ -131,6 +140,73 @@ static int pkcs11_init(ENGINE *e)
     return 0;
 }
 
+/**
+ * ROTATE_KEY: load the key of a URI and make it the current version of a
+ * key name.
+ * @param e
+ * @param ctx
+ * @param arg <name>=<uri>
+ * @return 1 on success, 0 on error
+ */
+static int pkcs11_rotate_key(ENGINE *e, PKCS11_CTX *ctx, const char *arg)
+{
+    EVP_PKEY *pkey = NULL;
+    char *name, *uri;
+    int ret = 0;
+
+    if (arg == NULL || (uri = strchr(arg, '=')) == NULL || uri == arg) {
+        PKCS11err(PKCS11_F_PKCS11_CTRL, PKCS11_R_KEY_NAME_INVALID);
+        return 0;
+    }
+    if ((name = OPENSSL_strndup(arg, uri - arg)) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_CTRL, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    /* from a config file, before anything needs the token */
+    if (pkcs11_module_current() == NULL) {
+        ret = pkcs11_key_name_defer(ctx, name, uri + 1);
+        OPENSSL_free(name);
+        return ret;
+    }
+    pkey = pkcs11_engine_load_private_key(e, uri + 1, NULL, NULL);
+    if (pkey != NULL)
+        ret = pkcs11_key_name_set(ctx, name, pkey);
+    EVP_PKEY_free(pkey);
+    OPENSSL_free(name);
+    return ret;
+}
+
+/**
+ * A key loaded as key-name:<name>, loading first the URI ROTATE_KEY
+ * deferred for the name, if any.
+ * @param e
+ * @param ctx
+ * @param name
+ * @param ui_method for the PIN of the deferred URI
+ * @param callback_data
+ * @return the key or NULL on error
+ */
+static EVP_PKEY *pkcs11_key_name_load(ENGINE *e, PKCS11_CTX *ctx,
+                                      const char *name,
+                                      UI_METHOD *ui_method,
+                                      void *callback_data)
+{
+    EVP_PKEY *pkey;
+    char *uri;
+    int ok;
+
+    if ((uri = pkcs11_key_name_uri(ctx, name)) != NULL) {
+        pkey = pkcs11_engine_load_private_key(e, uri, ui_method,
+                                              callback_data);
+        ok = pkey != NULL && pkcs11_key_name_set(ctx, name, pkey);
+        EVP_PKEY_free(pkey);
+        OPENSSL_free(uri);
+        if (!ok)
+            return NULL;
+    }
+    return pkcs11_key_name_get(ctx, name);
+}
+
 static int pkcs11_ctrl(ENGINE *e, int cmd, long i, void *p, void (*f) (void))
 {
     int ret = 1;
@@ -157,10 +233,7 @@ static int pkcs11_ctrl(ENGINE *e, int cmd, long i, void *p, void (*f) (void))
 
     /* TODO binary pin support */
     case PKCS11_CMD_PIN:
-        tmpstr = OPENSSL_strdup(p);
-        if (tmpstr != NULL) {
-            ctx->pin = (CK_BYTE *) tmpstr;
-            ctx->pinlen = (CK_ULONG) strlen((char *) ctx->pin);
+        if (pkcs11_pin_set_default(ctx, p)) {
             PKCS11_trace("Setting pin\n");
         } else {
             PKCS11err(PKCS11_F_PKCS11_CTRL, ERR_R_MALLOC_FAILURE);
@@ -169,6 +242,66 @@ static int pkcs11_ctrl(ENGINE *e, int cmd, long i, void *p, void (*f) (void))
         break;
     case PKCS11_CMD_LOAD_CERT_CTRL:
         return pkcs11_engine_load_cert(e, cmd, i, p, f);
+    case PKCS11_CMD_TRACE_FILE:
+        ret = pkcs11_rec_open(p);
+        if (ret)
+            PKCS11_trace("Recording PKCS#11 calls to %s\n", (char *)p);
+        break;
+    case PKCS11_CMD_SELFTEST:
+        ret = pkcs11_selftest_str(e, p);
+        break;
+    case PKCS11_CMD_SELFTEST_CTRL:
+        if (p == NULL) {
+            PKCS11err(PKCS11_F_PKCS11_CTRL,
+                      PKCS11_R_SELFTEST_INVALID_ARGUMENT);
+            return 0;
+        }
+        ret = pkcs11_selftest(e, p);
+        break;
+    case PKCS11_CMD_TOKEN_DIGEST:
+        ctx->token_digest = i != 0;
+        PKCS11_trace("Hashing on the token %s\n",
+                     ctx->token_digest ? "on" : "off");
+        break;
+    case PKCS11_CMD_ROTATE_KEY:
+        ret = pkcs11_rotate_key(e, ctx, p);
+        break;
+    case PKCS11_CMD_RELOAD_MODULE:
+        if (p == NULL) {
+            PKCS11err(PKCS11_F_PKCS11_CTRL, PKCS11_R_LIBRARY_PATH_NOT_FOUND);
+            return 0;
+        }
+        ret = pkcs11_reload_module(ctx, p);
+        break;
+    case PKCS11_CMD_PROFILE_FILE:
+        ret = pkcs11_profile_load(ctx, p);
+        if (ret)
+            PKCS11_trace("Module profiles read from %s\n", (char *)p);
+        break;
+    case PKCS11_CMD_PROFILE:
+        ret = pkcs11_profile_set(ctx, p);
+        break;
+    case PKCS11_CMD_CALLS:
+        ret = pkcs11_call_set(p);
+        break;
+    case PKCS11_CMD_CALL_STATS:
+        pkcs11_call_stats_print();
+        break;
+    case PKCS11_CMD_CALL_STATS_CTRL:
+        if (p == NULL) {
+            PKCS11err(PKCS11_F_PKCS11_CTRL, PKCS11_R_CALLS_INVALID);
+            return 0;
+        }
+        ret = pkcs11_call_stats(p);
+        break;
+    case PKCS11_CMD_CACHE_CHECK:
+        ret = pkcs11_sync_set(ctx, p);
+        break;
+    case PKCS11_CMD_HOT_KEYS:
+        pkcs11_key_cache_set_hot(ctx, i > 0 ? (size_t)i : 0);
+        PKCS11_trace("Keeping %ld loaded keys hot\n",
+                     i > 0 ? i : (long)PKCS11_HOT_KEYS);
+        break;
     }
 
     return ret;
@@ -190,42 +323,18 @@ static unsigned char *pkcs11_pad(char *field, int len)
     return ret;
 }
 
-CK_BYTE *pin_from_file(const char *filename)
-{
-    BIO *in = NULL;
-    int i;
-    static char buf[255];
-    char *c;
-
-    in = BIO_new_file(filename, "r");
-    if (in == NULL) {
-        BIO_free(in);
-        goto err;
-    }
-    i = BIO_gets(in, buf, sizeof(buf));
-    BIO_free(in);
-    in = NULL;
-    if (i <= 0)
-        goto err;
-    if ((c = strchr(buf, '\n')) != NULL) {
-        *c = 0;     /* truncate at newline */
-    }
-    return (CK_BYTE *) buf;
-
- err:
-    PKCS11_trace("Can't read PIN from %s\n", filename);
-    return NULL;
-}
-
 static int pkcs11_parse_items(PKCS11_CTX *ctx, const char *uri, int store)
 {
-    char *p, *q, *tmpstr;
+    char *p, *q, *tmpstr, *items;
     int len = 0;
 
-    p = q = (char *) uri;
+    /* tokenised in place, the caller's URI may be read-only */
+    if ((items = OPENSSL_strdup(uri)) == NULL)
+        goto memerr;
+    p = q = items;
 
-    len = strlen(uri);
-    while (q - uri <= len) {
+    len = strlen(items);
+    while (q - items <= len) {
         if (*q != ';' && *q != '\0') {
             q++;
             continue;
@@ -240,20 +349,17 @@ static int pkcs11_parse_items(PKCS11_CTX *ctx, const char *uri, int store)
                     goto memerr;
                 ctx->pin = (CK_BYTE *) tmpstr;
                 ctx->pinlen = (CK_ULONG) strlen((char *) ctx->pin);
-            } else if (strncmp(p, "pin-source=", 11) == 0 && ctx->pin == NULL) {
+            } else if (strncmp(p, "pin-source=", 11) == 0
+                       && ctx->pin_source == NULL) {
+                /* only read if the vault has no PIN for the token */
                 p += 11;
-                if (strncmp(p, "file:", 5) == 0) {
-                    p += 5;
-                    tmpstr = OPENSSL_strdup(p);
-                        if (tmpstr == NULL)
-                            goto memerr;
-                        if ((ctx->pin = pin_from_file(tmpstr)) == NULL)
-                            goto err;
-                        ctx->pinlen = (CK_ULONG) strlen((char *) ctx->pin);
-                } else {
-                    PKCS11_trace("file source only supported\n");
+                if (strncmp(p, "file:", 5) != 0 && strncmp(p, "env:", 4) != 0
+                    && strncmp(p, "fd:", 3) != 0) {
+                    PKCS11_trace("file:, env: and fd: sources only supported\n");
                     goto err;
                 }
+                if ((ctx->pin_source = (char *) urldecode(p)) == NULL)
+                    goto memerr;
             } else if (strncmp(p, "object=", 7) == 0 && ctx->label == NULL) {
                 p += 7;
                 ctx->label = (CK_BYTE *) urldecode(p);
@@ -293,75 +399,19 @@ static int pkcs11_parse_items(PKCS11_CTX *ctx, const char *uri, int store)
         }
         p = ++q;
     }
+    OPENSSL_free(items);
     return 1;
 
  memerr:
     PKCS11err(PKCS11_F_PKCS11_PARSE_ITEMS, ERR_R_MALLOC_FAILURE);
  err:
+    OPENSSL_free(items);
     return 0;
 
 }
 
-/*-
- *  Password prompting
- *  ------------------
- */
-
-static char *pkcs11_get_console_pin(PKCS11_CTX *ctx)
+int pkcs11_parse(PKCS11_CTX *ctx, const char *path, int store)
 {
-    UI *ui = UI_new();
-    char *prompt = NULL;
-    size_t maxsize = 512;
-    const int buflen = 512;
-    char *pass = NULL;
-    char *prompt_info = "Token";
-
-    pass = OPENSSL_malloc(buflen);
-    if (pass == NULL) {
-        PKCS11err(PKCS11_F_PKCS11_GET_CONSOLE_PIN, ERR_R_MALLOC_FAILURE);
-        return NULL;
-    }
-
-    if (ui == NULL) {
-        PKCS11err(PKCS11_F_PKCS11_GET_CONSOLE_PIN, ERR_R_MALLOC_FAILURE);
-        return NULL;
-    }
-
-    if (ctx->ui_method != NULL)
-        UI_set_method(ui, ctx->ui_method);
-    UI_add_user_data(ui, ctx->callback_data);
-
-    if ((prompt = UI_construct_prompt(ui, "PIN",
-                                      prompt_info)) == NULL) {
-        PKCS11err(PKCS11_F_PKCS11_GET_CONSOLE_PIN, ERR_R_MALLOC_FAILURE);
-        pass = NULL;
-    } else if (!UI_add_input_string(ui, prompt, UI_INPUT_FLAG_DEFAULT_PWD,
-                                    pass, 0, maxsize - 1)) {
-        PKCS11_trace("ERR UI_LIB\n");
-        pass = NULL;
-    } else {
-        switch (UI_process(ui)) {
-        case -2:
-            PKCS11_trace("PROCESS INTERRUPTED \n");
-            pass = NULL;
-            break;
-        case -1:
-            PKCS11_trace("ERR UI_LIB\n");
-            pass = NULL;
-            break;
-        default:
-            break;
-        }
-    }
-
-    OPENSSL_free(prompt);
-    UI_free(ui);
-    return pass;
-}
-
-static int pkcs11_parse(PKCS11_CTX *ctx, const char *path, int store)
-{
-    char *pin = NULL;
     char *id = NULL;
 
     if (path == NULL) {
@@ -369,6 +419,9 @@ static int pkcs11_parse(PKCS11_CTX *ctx, const char *path, int store)
         return 0;
     }
 
+    /* every URI names its own object, forget the previous one */
+    pkcs11_ctx_reset_object(ctx);
+
     if (strncmp(path, "pkcs11:", 7) == 0) {
         path += 7;
         if (!pkcs11_parse_items(ctx, path, store))
@@ -399,26 +452,22 @@ static int pkcs11_parse(PKCS11_CTX *ctx, const char *path, int store)
 #else
             getenv("PKCS11_MODULE_PATH")) == NULL) {
 #endif
+#ifdef PKCS11_STATIC_MODULE
+            /* the module linked into the engine */
+            ctx->module_path = (char *)PKCS11_STATIC_MODULE;
+#else
             PKCS11_trace("Module path is null\n");
             goto err;
+#endif
         }
     }
 
-    if (ctx->pin == NULL && (!store || (store
-        && ctx->type != NULL && strncmp(ctx->type, "private", 7) == 0))) {
-        pin = pkcs11_get_console_pin(ctx);
-        if (pin == NULL) {
-            PKCS11_trace("PIN is invalid\n");
-            OPENSSL_free(id);
-            return 0;
-        }
-        ctx->pin = (CK_BYTE *) pin;
-        ctx->pinlen = (CK_ULONG) strlen((char *) ctx->pin);
-    }
+    /* asked for by pkcs11_pin_fill(), once the token is known */
+    ctx->need_pin = !store || (ctx->type != NULL
+                               && strncmp(ctx->type, "private", 7) == 0);
     return 1;
 
  err:
-    OPENSSL_free(pin);
     OPENSSL_free(id);
     return 0;
 }
@@ -445,16 +494,19 @@ static int pkcs11_engine_load_cert(ENGINE *e, int cmd, long i,
     OSSL_STORE_LOADER_CTX *store_ctx = NULL;
     CK_SESSION_HANDLE session = 0;
     CK_OBJECT_CLASS class;
-    int ret = 0;
+    int ret = 0, locked = 0;
     struct {
         const char *uri_string;
         X509 *cert;
     } *params = p;
 
+    pkcs11_rec_op(PKCS11_REC_OP_STORE);
     store_ctx = OSSL_STORE_LOADER_CTX_new();
     pkcs11_ctx = ENGINE_get_ex_data(e, pkcs11_idx);
-    if (pkcs11_ctx == NULL)
+    if (store_ctx == NULL || pkcs11_ctx == NULL
+        || !CRYPTO_THREAD_write_lock(pkcs11_ctx->load_lock))
         goto err;
+    locked = 1;
 
     if (!pkcs11_parse(pkcs11_ctx, params->uri_string, 1))
         goto err;
@@ -462,32 +514,37 @@ static int pkcs11_engine_load_cert(ENGINE *e, int cmd, long i,
     if (pkcs11_initialize(pkcs11_ctx->module_path) != CKR_OK)
         goto err;
 
-    if (!pkcs11_get_slot(pkcs11_ctx)) {
-        pkcs11_finalize();
+    if (!pkcs11_get_slot(pkcs11_ctx) || !pkcs11_pin_fill(pkcs11_ctx))
         goto err;
-     }
 
-    if (!pkcs11_start_session(pkcs11_ctx, &session))
-        goto end;
+    /*
+     * No C_Finalize when done: the keys and the session pool of the engine
+     * live on in this module.
+     */
+    if (!pkcs11_session_get(pkcs11_ctx, pkcs11_ctx->slotid, &session))
+        goto err;
 
+    store_ctx->pkcs11_ctx = pkcs11_ctx;
+    store_ctx->slotid = pkcs11_ctx->slotid;
     store_ctx->session = session;
-    pkcs11_ctx->type = "cert";
+    OPENSSL_free(pkcs11_ctx->type);
+    if ((pkcs11_ctx->type = OPENSSL_strdup("cert")) == NULL)
+        goto err;
 
     if (!pkcs11_search_start(store_ctx, pkcs11_ctx))
-        goto end;
-
-    pkcs11_search_next_object(store_ctx, &class);
+        goto err;
 
-    if (class == CKO_CERTIFICATE) {
+    if (pkcs11_search_next_object(store_ctx, &class) == 0
+        && class == CKO_CERTIFICATE) {
         params->cert = store_ctx->cert;
+        store_ctx->cert = NULL;
         ret = 1;
     }
 
- end:
-    pkcs11_end_session(session);
-    pkcs11_finalize();
  err:
     OSSL_STORE_LOADER_CTX_free(store_ctx);
+    if (locked)
+        CRYPTO_THREAD_unlock(pkcs11_ctx->load_lock);
     return ret;
 }
 
@@ -499,11 +556,34 @@ static EVP_PKEY *pkcs11_engine_load_private_key(ENGINE * e, const char *path,
     PKCS11_CTX *ctx;
     CK_SESSION_HANDLE session = 0;
     CK_OBJECT_HANDLE key = 0;
+    EVP_PKEY *pkey = NULL;
+    char *uri = NULL;
+    int locked = 0;
 
+    pkcs11_rec_op(PKCS11_REC_OP_LOAD_KEY);
     ctx = ENGINE_get_ex_data(e, pkcs11_idx);
 
-    if (ctx == NULL)
+    if (ctx == NULL || path == NULL)
+        goto err;
+
+    /* a key that ROTATE_KEY can move while it is used */
+    if (strncmp(path, "key-name:", 9) == 0)
+        return pkcs11_key_name_load(e, ctx, path + 9, ui_method,
+                                    callback_data);
+    /* the same URI again costs no round trip to the token */
+    if ((pkey = pkcs11_key_cache_get(ctx, path, CKO_PRIVATE_KEY)) != NULL)
+        return pkey;
+    /* pkcs11_parse() takes the URI apart in place */
+    if ((uri = OPENSSL_strdup(path)) == NULL)
+        goto err;
+
+    /* the URI goes into the context shared by every thread */
+    if (!CRYPTO_THREAD_write_lock(ctx->load_lock))
         goto err;
+    locked = 1;
+    /* loaded by another thread while this one waited */
+    if ((pkey = pkcs11_key_cache_get(ctx, uri, CKO_PRIVATE_KEY)) != NULL)
+        goto end;
 
     ctx->ui_method = ui_method;
     ctx->callback_data = callback_data;
@@ -514,19 +594,29 @@ static EVP_PKEY *pkcs11_engine_load_private_key(ENGINE * e, const char *path,
     rv = pkcs11_initialize(ctx->module_path);
     if (rv != CKR_OK)
         goto err;
-    if (!pkcs11_get_slot(ctx))
+    if (!pkcs11_get_slot(ctx) || !pkcs11_pin_fill(ctx))
         goto err;
-    if (!pkcs11_start_session(ctx, &session))
-        goto err;
-    if (!pkcs11_login(session, ctx, CKU_USER))
+    if (!pkcs11_session_get(ctx, ctx->slotid, &session))
         goto err;
     key = pkcs11_find_private_key(session, ctx);
     if (!key)
         goto err;
+    pkey = pkcs11_load_pkey(session, ctx, key);
+    pkcs11_session_put(ctx, ctx->slotid, session, pkey != NULL);
+    if (pkey != NULL)
+        pkcs11_key_cache_add(ctx, uri, CKO_PRIVATE_KEY, pkey);
 
-    return pkcs11_load_pkey(session, ctx, key);
+ end:
+    CRYPTO_THREAD_unlock(ctx->load_lock);
+    OPENSSL_free(uri);
+    return pkey;
 
  err:
+    if (session != 0)
+        pkcs11_session_put(ctx, ctx->slotid, session, 0);
+    if (locked)
+        CRYPTO_THREAD_unlock(ctx->load_lock);
+    OPENSSL_free(uri);
     PKCS11_trace("pkcs11_engine_load_private_key failed\n");
     return NULL;
 }
@@ -539,12 +629,31 @@ static EVP_PKEY *pkcs11_engine_load_public_key(ENGINE * e, const char *path,
     PKCS11_CTX *ctx;
     CK_SESSION_HANDLE session = 0;
     CK_OBJECT_HANDLE key = 0;
+    EVP_PKEY *pkey = NULL;
+    char *uri = NULL;
+    int locked = 0;
 
+    pkcs11_rec_op(PKCS11_REC_OP_LOAD_KEY);
     ctx = ENGINE_get_ex_data(e, pkcs11_idx);
 
-    if (ctx == NULL)
+    if (ctx == NULL || path == NULL)
+        goto err;
+
+    /* the same URI again costs no round trip to the token */
+    if ((pkey = pkcs11_key_cache_get(ctx, path, CKO_PUBLIC_KEY)) != NULL)
+        return pkey;
+    /* pkcs11_parse() takes the URI apart in place */
+    if ((uri = OPENSSL_strdup(path)) == NULL)
         goto err;
 
+    /* the URI goes into the context shared by every thread */
+    if (!CRYPTO_THREAD_write_lock(ctx->load_lock))
+        goto err;
+    locked = 1;
+    /* loaded by another thread while this one waited */
+    if ((pkey = pkcs11_key_cache_get(ctx, uri, CKO_PUBLIC_KEY)) != NULL)
+        goto end;
+
     ctx->ui_method = ui_method;
     ctx->callback_data = callback_data;
 
@@ -554,20 +663,31 @@ static EVP_PKEY *pkcs11_engine_load_public_key(ENGINE * e, const char *path,
     rv = pkcs11_initialize(ctx->module_path);
     if (rv != CKR_OK)
         goto err;
-    if (!pkcs11_get_slot(ctx))
-        goto err;
-    if (!pkcs11_start_session(ctx, &session))
+    if (!pkcs11_get_slot(ctx) || !pkcs11_pin_fill(ctx))
         goto err;
-    if (!pkcs11_login(session, ctx, CKU_USER))
+    if (!pkcs11_session_get(ctx, ctx->slotid, &session))
         goto err;
     key = pkcs11_find_public_key(session, ctx);
     if (!key)
         goto err;
-    return pkcs11_load_pkey(session, ctx, key);
+    pkey = pkcs11_load_pkey(session, ctx, key);
+    pkcs11_session_put(ctx, ctx->slotid, session, pkey != NULL);
+    if (pkey != NULL)
+        pkcs11_key_cache_add(ctx, uri, CKO_PUBLIC_KEY, pkey);
+
+ end:
+    CRYPTO_THREAD_unlock(ctx->load_lock);
+    OPENSSL_free(uri);
+    return pkey;
 
  err:
+    if (session != 0)
+        pkcs11_session_put(ctx, ctx->slotid, session, 0);
+    if (locked)
+        CRYPTO_THREAD_unlock(ctx->load_lock);
+    OPENSSL_free(uri);
     PKCS11_trace("pkcs11_engine_load_public_key failed\n");
-    return 0;
+    return NULL;
 }
 
 static OSSL_STORE_LOADER_CTX* pkcs11_store_open(
@@ -578,17 +698,23 @@ static OSSL_STORE_LOADER_CTX* pkcs11_store_open(
     PKCS11_CTX *pkcs11_ctx;
     OSSL_STORE_LOADER_CTX *store_ctx = NULL;
     CK_SESSION_HANDLE session = 0;
+    CK_SLOT_ID *slots = NULL;
+    size_t nslots = 0, i;
+    int locked = 0;
 
+    pkcs11_rec_op(PKCS11_REC_OP_STORE);
     store_ctx = OSSL_STORE_LOADER_CTX_new();
 
     e = (ENGINE *) OSSL_STORE_LOADER_get0_engine(loader);
-    if (e == NULL)
+    if (store_ctx == NULL || e == NULL)
         goto err;
 
     pkcs11_ctx = ENGINE_get_ex_data(e, pkcs11_idx);
 
-    if (pkcs11_ctx == NULL)
+    /* the searches are set up from the URI, then only read the store */
+    if (pkcs11_ctx == NULL || !CRYPTO_THREAD_write_lock(pkcs11_ctx->load_lock))
         goto err;
+    locked = 1;
 
     pkcs11_ctx->ui_method = ui_method;
     pkcs11_ctx->callback_data = ui_data;
@@ -599,13 +725,38 @@ static OSSL_STORE_LOADER_CTX* pkcs11_store_open(
     if (pkcs11_initialize(pkcs11_ctx->module_path) != CKR_OK)
         goto err;
 
-    if (!pkcs11_get_slot(pkcs11_ctx))
+    if (!pkcs11_get_slots(pkcs11_ctx, &slots, &nslots))
+        goto err;
+
+    if (nslots > 1) {
+        /* every token at once, those without a PIN listed logged out */
+        for (i = 0; i < nslots; i++) {
+            pkcs11_ctx->slotid = slots[i];
+            ERR_set_mark();
+            pkcs11_pin_fill(pkcs11_ctx);
+            ERR_pop_to_mark();
+        }
+        pkcs11_ctx->slotid = slots[0];
+        store_ctx->pkcs11_ctx = pkcs11_ctx;
+        store_ctx->list = pkcs11_list_start(pkcs11_ctx, slots, nslots,
+                                            pkcs11_ctx->label == NULL
+                                            && pkcs11_ctx->id == NULL);
+        if (store_ctx->list == NULL)
+            goto err;
+        CRYPTO_THREAD_unlock(pkcs11_ctx->load_lock);
+        return store_ctx;
+    }
+    OPENSSL_free(slots);
+
+    if (!pkcs11_pin_fill(pkcs11_ctx))
         goto err;
 
-    if (!pkcs11_start_session(pkcs11_ctx, &session))
+    if (!pkcs11_session_get(pkcs11_ctx, pkcs11_ctx->slotid, &session))
         goto err;
 
-    /* NEW store-ctx->session, not a copy of pkcs11_ctx->session */
+    /* a session of its own, back to the pool when the store is closed */
+    store_ctx->pkcs11_ctx = pkcs11_ctx;
+    store_ctx->slotid = pkcs11_ctx->slotid;
     store_ctx->session = session;
 
     if (!pkcs11_search_start(store_ctx, pkcs11_ctx))
@@ -614,10 +765,13 @@ static OSSL_STORE_LOADER_CTX* pkcs11_store_open(
     if (pkcs11_ctx->label == NULL && pkcs11_ctx->id == NULL)
         store_ctx->listflag = 1;    /* we want names */
 
+    CRYPTO_THREAD_unlock(pkcs11_ctx->load_lock);
     return store_ctx;
 
  err:
     OSSL_STORE_LOADER_CTX_free(store_ctx);
+    if (locked)
+        CRYPTO_THREAD_unlock(pkcs11_ctx->load_lock);
     return NULL;
 }
 
@@ -627,6 +781,9 @@ static OSSL_STORE_INFO* pkcs11_store_load(OSSL_STORE_LOADER_CTX *ctx,
 {
     OSSL_STORE_INFO *ret = NULL;
 
+    if (ctx->list != NULL)
+        return pkcs11_list_next(ctx->list, &ctx->eof);
+
     if (ctx->listflag) {
         char *name = NULL;
         char *description = NULL;
@@ -652,12 +809,13 @@ static OSSL_STORE_INFO* pkcs11_store_load(OSSL_STORE_LOADER_CTX *ctx,
 
 static int pkcs11_store_eof(OSSL_STORE_LOADER_CTX *ctx)
 {
+    if (ctx->list != NULL)
+        return pkcs11_list_eof(ctx->list);
     return ctx->eof;
 }
 
 static int pkcs11_store_close(OSSL_STORE_LOADER_CTX *ctx)
 {
-    pkcs11_end_session(ctx->session);
     OSSL_STORE_LOADER_CTX_free(ctx);
     return 1;
 }
@@ -687,9 +845,13 @@ static void OSSL_STORE_LOADER_CTX_free(OSSL_STORE_LOADER_CTX* ctx)
 {
     if (ctx == NULL)
         return;
+    pkcs11_list_free(ctx->list);
+    /* a search still open would fail the next user of the session */
+    if (ctx->pkcs11_ctx != NULL && ctx->session != 0)
+        pkcs11_session_put(ctx->pkcs11_ctx, ctx->slotid, ctx->session,
+                           pkcs11_close_operation(ctx->session));
     EVP_PKEY_free(ctx->key);
     OPENSSL_free(ctx);
-    OSSL_STORE_unregister_loader(pkcs11_scheme);
 }
 
 static OSSL_STORE_INFO* pkcs11_store_load_cert(OSSL_STORE_LOADER_CTX *ctx,
@@ -738,7 +900,8 @@ static int bind_pkcs11(ENGINE *e)
         || !RSA_meth_set_mod_exp(pkcs11_rsa,
                                  RSA_meth_get_mod_exp(ossl_rsa_meth))
         || !RSA_meth_set_bn_mod_exp(pkcs11_rsa,
-                                    RSA_meth_get_bn_mod_exp(ossl_rsa_meth))) {
+                                    RSA_meth_get_bn_mod_exp(ossl_rsa_meth))
+        || !pkcs11_pmeth_init()) {
         PKCS11err(PKCS11_F_BIND_PKCS11, PKCS11_R_RSA_INIT_FAILED);
         return 0;
     }
@@ -746,6 +909,7 @@ static int bind_pkcs11(ENGINE *e)
     if (!ENGINE_set_id(e, engine_id)
         || !ENGINE_set_name(e, engine_name)
         || !ENGINE_set_RSA(e, pkcs11_rsa)
+        || !ENGINE_set_pkey_meths(e, pkcs11_pkey_meths)
         || !ENGINE_set_load_privkey_function(e, pkcs11_engine_load_private_key)
         || !ENGINE_set_load_pubkey_function(e, pkcs11_engine_load_public_key)
         || !ENGINE_set_destroy_function(e, pkcs11_destroy)
@@ -791,7 +955,7 @@ void PKCS11_trace(char *fmt, ...)
 #endif
 }
 
-static PKCS11_CTX *pkcs11_ctx_new(void)
+PKCS11_CTX *pkcs11_ctx_new(void)
 {
     PKCS11_CTX *ctx = OPENSSL_zalloc(sizeof(*ctx));
     if (ctx == NULL) {
@@ -799,6 +963,10 @@ static PKCS11_CTX *pkcs11_ctx_new(void)
         return NULL;
     }
     ctx->lock = CRYPTO_THREAD_lock_new();
+    ctx->load_lock = CRYPTO_THREAD_lock_new();
+    ctx->keys.head = ctx->keys.tail = PKCS11_KEY_NONE;
+    pkcs11_profile_default(&ctx->profile);
+    pkcs11_key_ops_init(ctx);
     return ctx;
 }
 
@@ -812,26 +980,84 @@ static int pkcs11_finish(ENGINE *e)
 
 static int pkcs11_destroy(ENGINE *e)
 {
+    PKCS11_CTX *ctx;
+
     RSA_meth_free(pkcs11_rsa);
     pkcs11_rsa = NULL;
+    pkcs11_pmeth_free();
     PKCS11_trace("Calling pkcs11_destroy with engine: %p\n", e);
-    OSSL_STORE_unregister_loader(pkcs11_scheme);
+    /* kept across ENGINE_finish(), for the next init */
+    if (pkcs11_idx >= 0
+        && (ctx = ENGINE_get_ex_data(e, pkcs11_idx)) != NULL) {
+        pkcs11_pin_vault_free(&ctx->vault);
+        pkcs11_profiles_free(ctx);
+        OPENSSL_free(ctx->profile_name);
+        ctx->profile_name = NULL;
+        OPENSSL_free(ctx->sync_object);
+        ctx->sync_object = NULL;
+    }
+    OSSL_STORE_LOADER_free(OSSL_STORE_unregister_loader(pkcs11_scheme));
     ERR_unload_PKCS11_strings();
+    pkcs11_rec_close();
     return 1;
 }
 
 static int pkcs11_rsa_free(RSA *rsa)
 {
-    RSA_set_ex_data(rsa, rsa_pkcs11_idx, 0);
+    OPENSSL_free(RSA_get_ex_data(rsa, rsa_pkcs11_idx));
+    RSA_set_ex_data(rsa, rsa_pkcs11_idx, NULL);
     return 1;
 }
 
-static void pkcs11_ctx_free(PKCS11_CTX *ctx)
+void pkcs11_ctx_free(PKCS11_CTX *ctx)
 {
     PKCS11_trace("Calling pkcs11_ctx_free with %p\n", ctx);
+    pkcs11_session_pool_free(ctx);
+    pkcs11_key_cache_free(ctx);
+    pkcs11_sync_free(ctx);
+    pkcs11_key_names_free(ctx);
+    /* the next init picks a profile again */
+    pkcs11_profile_default(&ctx->profile);
+    if (CRYPTO_THREAD_write_lock(ctx->lock)) {
+        ctx->profile_chosen = 0;
+        CRYPTO_THREAD_unlock(ctx->lock);
+    }
     CRYPTO_THREAD_lock_free(ctx->lock);
-    free(ctx->id);
-    free(ctx->label);
+    ctx->lock = NULL;
+    CRYPTO_THREAD_lock_free(ctx->load_lock);
+    ctx->load_lock = NULL;
+    CRYPTO_THREAD_lock_free(ctx->names_lock);
+    ctx->names_lock = NULL;
+    pkcs11_ctx_reset_object(ctx);
+}
+
+/**
+ * Drop the object selectors (id, object, type and slot-id), the token
+ * selectors (token, serial, model and manufacturer) and the PIN attributes
+ * of the last URI; the PIN itself stays in the vault.
+ * @param ctx
+ */
+static void pkcs11_ctx_reset_object(PKCS11_CTX *ctx)
+{
+    ctx->slotid = 0;
+    memset(ctx->token, 0, sizeof(ctx->token));
+    memset(ctx->serial, 0, sizeof(ctx->serial));
+    memset(ctx->model, 0, sizeof(ctx->model));
+    memset(ctx->manufacturer, 0, sizeof(ctx->manufacturer));
+    if (ctx->pin != NULL)
+        OPENSSL_clear_free(ctx->pin, ctx->pinlen);
+    ctx->pin = NULL;
+    ctx->pinlen = 0;
+    OPENSSL_free(ctx->pin_source);
+    ctx->pin_source = NULL;
+    ctx->need_pin = 0;
+    OPENSSL_free(ctx->id);
+    ctx->id = NULL;
+    ctx->idlen = 0;
+    OPENSSL_free(ctx->label);
+    ctx->label = NULL;
+    OPENSSL_free(ctx->type);
+    ctx->type = NULL;
 }
 
 PKCS11_CTX *pkcs11_get_ctx(const RSA *rsa)
@@ -850,44 +1076,45 @@ static int pkcs11_load_ssl_client_cert(ENGINE *e, SSL *ssl,
     CK_SESSION_HANDLE session = 0;
     CK_BYTE *id;
     CK_ULONG idlen;
-    char *pin = NULL;
     CK_OBJECT_HANDLE key = 0;
-    int ret = 0;
+    int ret = 0, locked = 0;
     int i;
 
     *pcert = NULL;
     *pkey = NULL;
+    pkcs11_rec_op(PKCS11_REC_OP_STORE);
     store_ctx = OSSL_STORE_LOADER_CTX_new();
     pkcs11_ctx = ENGINE_get_ex_data(e, pkcs11_idx);
-    if (pkcs11_ctx == NULL)
+    if (store_ctx == NULL || pkcs11_ctx == NULL)
         goto err;
 
+    /* the search goes into the context shared by every thread */
+    if (!CRYPTO_THREAD_write_lock(pkcs11_ctx->load_lock))
+        goto err;
+    locked = 1;
     pkcs11_ctx->ui_method = ui_method;
     pkcs11_ctx->callback_data = callback_data;
 
     if (pkcs11_initialize(pkcs11_ctx->module_path) != CKR_OK)
         goto err;
 
-    if (!pkcs11_get_slot(pkcs11_ctx)) {
-        pkcs11_finalize();
+    if (!pkcs11_get_slot(pkcs11_ctx))
         goto err;
-     }
 
-    if (!pkcs11_start_session(pkcs11_ctx, &session))
+    /* before the session, which logs in with it */
+    pkcs11_ctx->need_pin = 1;
+    if (!pkcs11_pin_fill(pkcs11_ctx))
         goto err;
 
-    if (pkcs11_ctx->pin == NULL) {
-        pin = pkcs11_get_console_pin(pkcs11_ctx);
-        if (pin == NULL) {
-            PKCS11_trace("PIN is invalid\n");
-            goto err;
-        }
-        pkcs11_ctx->pin = (CK_BYTE *) pin;
-        pkcs11_ctx->pinlen = (CK_ULONG) strlen((char *) pkcs11_ctx->pin);
-    }
+    if (!pkcs11_session_get(pkcs11_ctx, pkcs11_ctx->slotid, &session))
+        goto err;
 
+    store_ctx->pkcs11_ctx = pkcs11_ctx;
+    store_ctx->slotid = pkcs11_ctx->slotid;
     store_ctx->session = session;
-    pkcs11_ctx->type = "cert";
+    OPENSSL_free(pkcs11_ctx->type);
+    if ((pkcs11_ctx->type = OPENSSL_strdup("cert")) == NULL)
+        goto err;
 
     if (!pkcs11_search_start(store_ctx, pkcs11_ctx))
         goto err;
@@ -899,6 +1126,8 @@ static int pkcs11_load_ssl_client_cert(ENGINE *e, SSL *ssl,
             && X509_check_purpose(store_ctx->cert,
             X509_PURPOSE_SSL_CLIENT, 0)) {
             *pcert = store_ctx->cert;
+            store_ctx->cert = NULL;
+            OPENSSL_free(pkcs11_ctx->id);
             pkcs11_ctx->id = id;
             pkcs11_ctx->idlen = idlen;
             pkcs11_close_operation(session);
@@ -909,10 +1138,15 @@ static int pkcs11_load_ssl_client_cert(ENGINE *e, SSL *ssl,
             ret = 1;
             break;
         }
+        X509_free(store_ctx->cert);
+        store_ctx->cert = NULL;
+        OPENSSL_free(id);
     }
 
  err:
     OSSL_STORE_LOADER_CTX_free(store_ctx);
+    if (locked)
+        CRYPTO_THREAD_unlock(pkcs11_ctx->load_lock);
     return ret;
 }
 
@@ -15,34 +15,47 @@
 
 static ERR_STRING_DATA PKCS11_str_functs[] = {
     {ERR_PACK(0, PKCS11_F_BIND_PKCS11, 0), "bind_pkcs11"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_CALL_SET, 0), "pkcs11_call_set"},
     {ERR_PACK(0, PKCS11_F_PKCS11_CTRL, 0), "pkcs11_ctrl"},
     {ERR_PACK(0, PKCS11_F_PKCS11_CTX_NEW, 0), "pkcs11_ctx_new"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_DIGEST_SIGN, 0), "pkcs11_digest_sign"},
     {ERR_PACK(0, PKCS11_F_PKCS11_ENGINE_LOAD_PRIVATE_KEY, 0),
      "pkcs11_engine_load_private_key"},
-    {ERR_PACK(0, PKCS11_F_PKCS11_FIND_PRIVATE_KEY, 0),
-     "pkcs11_find_private_key"},
-    {ERR_PACK(0, PKCS11_F_PKCS11_FIND_PUBLIC_KEY, 0), "pkcs11_find_public_key"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_FIND_KEY, 0), "pkcs11_find_key"},
     {ERR_PACK(0, PKCS11_F_PKCS11_GET_CONSOLE_PIN, 0), "pkcs11_get_console_pin"},
     {ERR_PACK(0, PKCS11_F_PKCS11_GET_SLOT, 0), "pkcs11_get_slot"},
     {ERR_PACK(0, PKCS11_F_PKCS11_INIT, 0), "pkcs11_init"},
     {ERR_PACK(0, PKCS11_F_PKCS11_INITIALIZE, 0), "pkcs11_initialize"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_KEY_NAME_SET, 0), "pkcs11_key_name_set"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_KEY_OP, 0), "pkcs11_key_op"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_KEY_PAIR_READ, 0), "pkcs11_key_pair_read"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_LIST_START, 0), "pkcs11_list_start"},
     {ERR_PACK(0, PKCS11_F_PKCS11_LOAD_FUNCTIONS, 0), "pkcs11_load_functions"},
     {ERR_PACK(0, PKCS11_F_PKCS11_LOAD_PKEY, 0), "pkcs11_load_pkey"},
     {ERR_PACK(0, PKCS11_F_PKCS11_LOGIN, 0), "pkcs11_login"},
     {ERR_PACK(0, PKCS11_F_PKCS11_LOGOUT, 0), "pkcs11_logout"},
     {ERR_PACK(0, PKCS11_F_PKCS11_PARSE, 0), "pkcs11_parse"},
     {ERR_PACK(0, PKCS11_F_PKCS11_PARSE_ITEMS, 0), "pkcs11_parse_items"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_PIN_FILL, 0), "pkcs11_pin_fill"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_PROFILE, 0), "pkcs11_profile"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_PROV_INIT, 0), "pkcs11_prov_init"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_REC_OPEN, 0), "pkcs11_rec_open"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_RELOAD_MODULE, 0), "pkcs11_reload_module"},
     {ERR_PACK(0, PKCS11_F_PKCS11_RSA_ENC, 0), "pkcs11_rsa_enc"},
     {ERR_PACK(0, PKCS11_F_PKCS11_RSA_INIT, 0), "pkcs11_rsa_init"},
     {ERR_PACK(0, PKCS11_F_PKCS11_RSA_PRIV_DEC, 0), "pkcs11_rsa_priv_dec"},
     {ERR_PACK(0, PKCS11_F_PKCS11_RSA_PRIV_ENC, 0), "pkcs11_rsa_priv_enc"},
     {ERR_PACK(0, PKCS11_F_PKCS11_RSA_SIGN, 0), "pkcs11_rsa_sign"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_SELFTEST, 0), "pkcs11_selftest"},
     {ERR_PACK(0, PKCS11_F_PKCS11_START_SESSION, 0), "pkcs11_start_session"},
+    {ERR_PACK(0, PKCS11_F_PKCS11_SYNC_SET, 0), "pkcs11_sync_set"},
     {ERR_PACK(0, PKCS11_F_PKCS11_TRACE, 0), "PKCS11_trace"},
     {0, NULL}
 };
 
 static ERR_STRING_DATA PKCS11_str_reasons[] = {
+    {ERR_PACK(0, 0, PKCS11_R_CACHE_CHECK_INVALID), "cache check invalid"},
+    {ERR_PACK(0, 0, PKCS11_R_CALLS_INVALID), "calls invalid"},
     {ERR_PACK(0, 0, PKCS11_R_DECRYPT_FAILED), "encrypt failed"},
     {ERR_PACK(0, 0, PKCS11_R_DECRYPT_INIT_FAILED), "encrypt init failed"},
     {ERR_PACK(0, 0, PKCS11_R_DIGEST_TOO_BIG_FOR_RSA_KEY),
@@ -65,21 +78,37 @@ static ERR_STRING_DATA PKCS11_str_reasons[] = {
     {ERR_PACK(0, 0, PKCS11_R_GET_SLOTINFO_FAILED), "get slotinfo failed"},
     {ERR_PACK(0, 0, PKCS11_R_GET_SLOTLIST_FAILED), "get slotlist failed"},
     {ERR_PACK(0, 0, PKCS11_R_INITIALIZE_FAILED), "initialize failed"},
+    {ERR_PACK(0, 0, PKCS11_R_KEY_MISMATCH), "key mismatch"},
+    {ERR_PACK(0, 0, PKCS11_R_KEY_NAME_INVALID), "key name invalid"},
+    {ERR_PACK(0, 0, PKCS11_R_KEY_NAME_NOT_FOUND), "key name not found"},
+    {ERR_PACK(0, 0, PKCS11_R_KEY_OBJECT_NOT_FOUND), "key object not found"},
     {ERR_PACK(0, 0, PKCS11_R_LIBRARY_PATH_NOT_FOUND), "library path not found"},
     {ERR_PACK(0, 0, PKCS11_R_LOGIN_FAILED), "login failed"},
     {ERR_PACK(0, 0, PKCS11_R_LOGOUT_FAILED), "logout failed"},
     {ERR_PACK(0, 0, PKCS11_R_MEMORY_ALLOCATION_FAILED),
     "memory allocation failed"},
+    {ERR_PACK(0, 0, PKCS11_R_MODULE_ALREADY_LOADED), "module already loaded"},
+    {ERR_PACK(0, 0, PKCS11_R_MODULE_BUSY), "module busy"},
     {ERR_PACK(0, 0, PKCS11_R_OPEN_SESSION_ERROR), "open session error"},
     {ERR_PACK(0, 0, PKCS11_R_PADDING_ADD_FAILED), "padding add failed"},
+    {ERR_PACK(0, 0, PKCS11_R_PIN_UNAVAILABLE), "pin unavailable"},
+    {ERR_PACK(0, 0, PKCS11_R_PROFILE_INVALID), "profile invalid"},
+    {ERR_PACK(0, 0, PKCS11_R_PROFILE_NOT_FOUND), "profile not found"},
     {ERR_PACK(0, 0, PKCS11_R_RSA_INIT_FAILED), "rsa init failed"},
     {ERR_PACK(0, 0, PKCS11_R_RSA_NOT_FOUND), "rsa not found"},
+    {ERR_PACK(0, 0, PKCS11_R_SELFTEST_BELOW_THRESHOLD),
+    "selftest below threshold"},
+    {ERR_PACK(0, 0, PKCS11_R_SELFTEST_FAILED), "selftest failed"},
+    {ERR_PACK(0, 0, PKCS11_R_SELFTEST_INVALID_ARGUMENT),
+    "selftest invalid argument"},
     {ERR_PACK(0, 0, PKCS11_R_SIGN_FAILED), "sign failed"},
     {ERR_PACK(0, 0, PKCS11_R_SIGN_INIT_FAILED), "sign init failed"},
+    {ERR_PACK(0, 0, PKCS11_R_SIGN_UPDATE_FAILED), "sign update failed"},
     {ERR_PACK(0, 0, PKCS11_R_SLOT_NOT_FOUND), "slot not found"},
     {ERR_PACK(0, 0, PKCS11_R_THE_ASN1_OBJECT_IDENTIFIER_IS_NOT_KNOWN_FOR_THIS_MD),
     "the asn1 object identifier is not known for this md"},
     {ERR_PACK(0, 0, PKCS11_R_UNKNOWN_ALGORITHM_TYPE), "unknown algorithm type"},
+    {ERR_PACK(0, 0, PKCS11_R_UNSUPPORTED_PADDING), "unsupported padding"},
     {ERR_PACK(0, 0, PKCS11_R_VERIFY_FAILED), "sign failed"},
     {ERR_PACK(0, 0, PKCS11_R_VERIFY_INIT_FAILED), "sign init failed"},
     {0, NULL}
@@ -90,7 +119,7 @@ static ERR_STRING_DATA PKCS11_str_reasons[] = {
 static int lib_code = 0;
 static int error_loaded = 0;
 
-static int ERR_load_PKCS11_strings(void)
+int ERR_load_PKCS11_strings(void)
 {
     if (lib_code == 0)
         lib_code = ERR_get_next_error_library();
@@ -105,7 +134,7 @@ static int ERR_load_PKCS11_strings(void)
     return 1;
 }
 
-static void ERR_unload_PKCS11_strings(void)
+void ERR_unload_PKCS11_strings(void)
 {
     if (error_loaded) {
 #ifndef OPENSSL_NO_ERR
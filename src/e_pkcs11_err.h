@@ -17,37 +17,56 @@
 
 # define ERR_LIB_PKCS11 58
 # define PKCS11err(f, r) ERR_raise_data(ERR_LIB_PKCS11, (r), NULL)
+# define PKCS11err_rv(f, r, rv) \
+    ERR_raise_data(ERR_LIB_PKCS11, (r), "rv=%#lx", (unsigned long)(rv))
+
+int ERR_load_PKCS11_strings(void);
+void ERR_unload_PKCS11_strings(void);
 
 /*
  * PKCS11 function codes.
  */
 # define PKCS11_F_BIND_PKCS11                             121
+# define PKCS11_F_PKCS11_CALL_SET                         132
 # define PKCS11_F_PKCS11_CTRL                             110
 # define PKCS11_F_PKCS11_CTX_NEW                          111
+# define PKCS11_F_PKCS11_DIGEST_SIGN                      126
 # define PKCS11_F_PKCS11_ENGINE_LOAD_PRIVATE_KEY          100
-# define PKCS11_F_PKCS11_FIND_PRIVATE_KEY                 120
-# define PKCS11_F_PKCS11_FIND_PUBLIC_KEY                  127
+# define PKCS11_F_PKCS11_FIND_KEY                        120
 # define PKCS11_F_PKCS11_GET_CONSOLE_PIN                  113
 # define PKCS11_F_PKCS11_GET_SLOT                         102
 # define PKCS11_F_PKCS11_INIT                             112
 # define PKCS11_F_PKCS11_INITIALIZE                       107
+# define PKCS11_F_PKCS11_KEY_NAME_SET                     129
+# define PKCS11_F_PKCS11_KEY_OP                           133
+# define PKCS11_F_PKCS11_KEY_PAIR_READ                    134
+# define PKCS11_F_PKCS11_LIST_START                       136
 # define PKCS11_F_PKCS11_LOAD_FUNCTIONS                   108
 # define PKCS11_F_PKCS11_LOAD_PKEY                        114
 # define PKCS11_F_PKCS11_LOGIN                            103
 # define PKCS11_F_PKCS11_LOGOUT                           104
 # define PKCS11_F_PKCS11_PARSE                            115
 # define PKCS11_F_PKCS11_PARSE_ITEMS                      119
+# define PKCS11_F_PKCS11_PIN_FILL                         128
+# define PKCS11_F_PKCS11_PROFILE                          131
+# define PKCS11_F_PKCS11_PROV_INIT                        135
+# define PKCS11_F_PKCS11_REC_OPEN                         124
+# define PKCS11_F_PKCS11_RELOAD_MODULE                    130
 # define PKCS11_F_PKCS11_RSA_ENC                          105
 # define PKCS11_F_PKCS11_RSA_INIT                         117
 # define PKCS11_F_PKCS11_RSA_PRIV_DEC                     123
 # define PKCS11_F_PKCS11_RSA_PRIV_ENC                     122
 # define PKCS11_F_PKCS11_RSA_SIGN                         118
+# define PKCS11_F_PKCS11_SELFTEST                         125
 # define PKCS11_F_PKCS11_START_SESSION                    106
+# define PKCS11_F_PKCS11_SYNC_SET                         137
 # define PKCS11_F_PKCS11_TRACE                            109
 
 /*
  * PKCS11 reason codes.
  */
+# define PKCS11_R_CACHE_CHECK_INVALID                     146
+# define PKCS11_R_CALLS_INVALID                           145
 # define PKCS11_R_DECRYPT_FAILED                          129
 # define PKCS11_R_DECRYPT_INIT_FAILED                     130
 # define PKCS11_R_DIGEST_TOO_BIG_FOR_RSA_KEY              121
@@ -64,19 +83,33 @@
 # define PKCS11_R_GET_SLOTINFO_FAILED                     116
 # define PKCS11_R_GET_SLOTLIST_FAILED                     107
 # define PKCS11_R_INITIALIZE_FAILED                       108
+# define PKCS11_R_KEY_MISMATCH                            137
+# define PKCS11_R_KEY_NAME_INVALID                        139
+# define PKCS11_R_KEY_NAME_NOT_FOUND                      138
+# define PKCS11_R_KEY_OBJECT_NOT_FOUND                    142
 # define PKCS11_R_LIBRARY_PATH_NOT_FOUND                  109
 # define PKCS11_R_LOGIN_FAILED                            110
 # define PKCS11_R_LOGOUT_FAILED                           111
 # define PKCS11_R_MEMORY_ALLOCATION_FAILED                115
+# define PKCS11_R_MODULE_ALREADY_LOADED                   140
+# define PKCS11_R_MODULE_BUSY                             141
 # define PKCS11_R_OPEN_SESSION_ERROR                      112
 # define PKCS11_R_PADDING_ADD_FAILED                      126
+# define PKCS11_R_PIN_UNAVAILABLE                         136
+# define PKCS11_R_PROFILE_INVALID                         143
+# define PKCS11_R_PROFILE_NOT_FOUND                       144
 # define PKCS11_R_RSA_INIT_FAILED                         120
 # define PKCS11_R_RSA_NOT_FOUND                           118
+# define PKCS11_R_SELFTEST_BELOW_THRESHOLD                133
+# define PKCS11_R_SELFTEST_FAILED                         132
+# define PKCS11_R_SELFTEST_INVALID_ARGUMENT               134
 # define PKCS11_R_SIGN_FAILED                             100
 # define PKCS11_R_SIGN_INIT_FAILED                        101
+# define PKCS11_R_SIGN_UPDATE_FAILED                      135
 # define PKCS11_R_SLOT_NOT_FOUND                          113
 # define PKCS11_R_THE_ASN1_OBJECT_IDENTIFIER_IS_NOT_KNOWN_FOR_THIS_MD 122
 # define PKCS11_R_UNKNOWN_ALGORITHM_TYPE                  123
+# define PKCS11_R_UNSUPPORTED_PADDING                     131
 # define PKCS11_R_VERIFY_FAILED                           127
 # define PKCS11_R_VERIFY_INIT_FAILED                      128
 
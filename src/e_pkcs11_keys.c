@@ -0,0 +1,503 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Loaded keys.  A server with thousands of keys on its token loads each
+ * one when it is first needed, e.g. from its SNI callback, and again on
+ * every handshake for it.  The engine remembers every URI it loaded in an
+ * open addressing table: the object of the key (slot and handle), which
+ * spares a search the next time, takes a few dozen bytes; the public half
+ * (the BIGNUMs an EVP_PKEY is built from) is only kept for the HOT_KEYS
+ * keys used last.  Loading a hot key again costs no token call, loading a
+ * cold one a single attribute read, and the memory grows with the keys in
+ * use rather than with the keys configured.  Only the search is deferred:
+ * each load returns a whole EVP_PKEY, the modulus and exponent included,
+ * since OpenSSL sizes the key from them.  Keys another host deleted or
+ * replaced on the token are told by CACHE_CHECK, e_pkcs11_sync.c.  The
+ * URIs are kept without their pin-value and pin-source: PINs only live in
+ * the vault, e_pkcs11_pin.c.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+
+#define NONE PKCS11_KEY_NONE
+#define KEY_URI_BUF 256         /* URIs looked up without an allocation */
+
+/*
+ * |uri| without its pin-value and pin-source attributes: in |buf| if it
+ * fits in |size|, else in memory to free.  NULL on error.
+ */
+static char *key_uri(const char *uri, char *buf, size_t size)
+{
+    size_t len = strlen(uri), n = 0;
+    char *out = len < size ? buf : OPENSSL_malloc(len + 1);
+    int start = 1, scheme = 1;
+
+    if (out == NULL)
+        return NULL;
+    while (*uri != '\0') {
+        if (start && (strncmp(uri, "pin-value=", 10) == 0
+                      || strncmp(uri, "pin-source=", 11) == 0)) {
+            /* the attribute and the separator before it */
+            uri += strcspn(uri, ";?&");
+            if (n > 0 && (out[n - 1] == ';' || out[n - 1] == '&'))
+                n--;
+            start = 0;
+            continue;
+        }
+        start = *uri == ';' || *uri == '?' || *uri == '&'
+                || (*uri == ':' && scheme);
+        if (*uri == ':')
+            scheme = 0;
+        out[n++] = *uri++;
+    }
+    out[n] = '\0';
+    return out;
+}
+
+static unsigned long key_hash(const char *uri, CK_OBJECT_CLASS class)
+{
+    unsigned long h = 2166136261UL ^ class;
+
+    /* FNV-1a */
+    while (*uri != '\0')
+        h = (h ^ (unsigned char)*uri++) * 16777619UL;
+    return h;
+}
+
+/* The entry of |uri|, or NONE; lock held */
+static size_t key_find(PKCS11_KEY_TABLE *t, const char *uri,
+                       CK_OBJECT_CLASS class, unsigned long hash)
+{
+    PKCS11_KEY_CACHE *c;
+    size_t i;
+
+    if (t->size == 0)
+        return NONE;
+    for (i = hash & (t->size - 1);; i = (i + 1) & (t->size - 1)) {
+        c = &t->entries[i];
+        if (c->uri == NULL && !c->deleted)
+            return NONE;
+        if (c->uri != NULL && c->hash == hash && c->class == class
+            && strcmp(c->uri, uri) == 0)
+            return i;
+    }
+}
+
+static void lru_unlink(PKCS11_KEY_TABLE *t, size_t i)
+{
+    PKCS11_KEY_CACHE *c = &t->entries[i];
+
+    if (c->prev != NONE)
+        t->entries[c->prev].next = c->next;
+    else
+        t->head = c->next;
+    if (c->next != NONE)
+        t->entries[c->next].prev = c->prev;
+    else
+        t->tail = c->prev;
+    c->prev = c->next = NONE;
+}
+
+static void lru_push(PKCS11_KEY_TABLE *t, size_t i)
+{
+    PKCS11_KEY_CACHE *c = &t->entries[i];
+
+    c->prev = NONE;
+    c->next = t->head;
+    if (t->head != NONE)
+        t->entries[t->head].prev = i;
+    t->head = i;
+    if (t->tail == NONE)
+        t->tail = i;
+}
+
+/* Drop the public half of the least recently used keys beyond max_hot */
+static void key_cool(PKCS11_KEY_TABLE *t)
+{
+    size_t max = t->max_hot != 0 ? t->max_hot : PKCS11_HOT_KEYS;
+    PKCS11_KEY_CACHE *c;
+    size_t i;
+
+    while (t->hot > max && (i = t->tail) != NONE) {
+        c = &t->entries[i];
+        lru_unlink(t, i);
+        BN_free(c->n);
+        BN_free(c->e);
+        c->n = c->e = NULL;
+        t->hot--;
+    }
+}
+
+/* Keep the public half of entry |i|, taking |n| and |e| */
+static void key_heat(PKCS11_KEY_TABLE *t, size_t i, BIGNUM *n, BIGNUM *e)
+{
+    PKCS11_KEY_CACHE *c = &t->entries[i];
+
+    if (c->n != NULL) {
+        lru_unlink(t, i);
+        BN_free(c->n);
+        BN_free(c->e);
+        t->hot--;
+    }
+    c->n = n;
+    c->e = e;
+    lru_push(t, i);
+    t->hot++;
+    key_cool(t);
+}
+
+static void key_delete(PKCS11_KEY_TABLE *t, size_t i)
+{
+    PKCS11_KEY_CACHE *c = &t->entries[i];
+
+    if (c->n != NULL) {
+        lru_unlink(t, i);
+        t->hot--;
+    }
+    OPENSSL_free(c->uri);
+    BN_free(c->n);
+    BN_free(c->e);
+    memset(c, 0, sizeof(*c));
+    c->deleted = 1;
+}
+
+/*
+ * Make room for one more entry: twice the size, or the same size without
+ * the deleted entries.  The hot keys keep their order.
+ */
+static int key_grow(PKCS11_KEY_TABLE *t)
+{
+    PKCS11_KEY_TABLE nt = *t;
+    PKCS11_KEY_CACHE *c;
+    size_t i, j, live = 0, *moved = NULL;
+
+    for (i = 0; i < t->size; i++)
+        live += t->entries[i].uri != NULL;
+    nt.size = t->size == 0 ? 64 : live * 2 >= t->size ? t->size * 2 : t->size;
+    nt.used = live;
+    nt.head = nt.tail = NONE;
+    if ((nt.entries = OPENSSL_zalloc(nt.size * sizeof(*nt.entries))) == NULL
+        || (t->size > 0
+            && (moved = OPENSSL_malloc(t->size * sizeof(*moved))) == NULL)) {
+        OPENSSL_free(nt.entries);
+        return 0;
+    }
+    for (i = 0; i < t->size; i++) {
+        c = &t->entries[i];
+        if (c->uri == NULL)
+            continue;
+        for (j = c->hash & (nt.size - 1); nt.entries[j].uri != NULL;
+             j = (j + 1) & (nt.size - 1))
+            continue;
+        nt.entries[j] = *c;
+        nt.entries[j].prev = nt.entries[j].next = NONE;
+        moved[i] = j;
+    }
+    /* oldest first, so that the most recently used ends up at the head */
+    for (i = t->tail; i != NONE; i = t->entries[i].prev)
+        lru_push(&nt, moved[i]);
+    OPENSSL_free(moved);
+    OPENSSL_free(t->entries);
+    *t = nt;
+    return 1;
+}
+
+/**
+ * Look up a key loaded before from the same URI.  A cold key is read
+ * again from its object, and dropped if the object is gone.
+ * @param ctx
+ * @param uri
+ * @param class CKO_PRIVATE_KEY or CKO_PUBLIC_KEY
+ * @return a new EVP_PKEY for the key, or NULL if it is not cached
+ */
+EVP_PKEY *pkcs11_key_cache_get(PKCS11_CTX *ctx, const char *uri,
+                               CK_OBJECT_CLASS class)
+{
+    PKCS11_KEY_TABLE *t = &ctx->keys;
+    PKCS11_KEY key;
+    BIGNUM *n = NULL, *e = NULL;
+    EVP_PKEY *k = NULL;
+    char buf[KEY_URI_BUF], *name;
+    unsigned long hash;
+    size_t i;
+    int found = 0;
+
+    if ((name = key_uri(uri, buf, sizeof(buf))) == NULL)
+        return NULL;
+    hash = key_hash(name, class);
+    if (!CRYPTO_THREAD_write_lock(ctx->lock)) {
+        if (name != buf)
+            OPENSSL_free(name);
+        return NULL;
+    }
+    if ((i = key_find(t, name, class, hash)) != NONE) {
+        found = 1;
+        key = t->entries[i].key;
+        if (t->entries[i].n != NULL) {
+            n = BN_dup(t->entries[i].n);
+            e = BN_dup(t->entries[i].e);
+            lru_unlink(t, i);
+            lru_push(t, i);
+        }
+    }
+    CRYPTO_THREAD_unlock(ctx->lock);
+    if (name != buf)
+        OPENSSL_free(name);
+    if (!found)
+        return NULL;
+    /* another host may have changed the token since */
+    if (pkcs11_sync_check(ctx, key.slotid)) {
+        BN_free(n);
+        BN_free(e);
+        return NULL;
+    }
+
+    if (n != NULL && e != NULL
+        && (k = pkcs11_new_pkey(ctx, &key, n, e)) != NULL)
+        return k;
+    BN_free(n);
+    BN_free(e);
+
+    /* cold, or out of memory: what the object holds now */
+    ERR_set_mark();
+    k = pkcs11_reload_pkey(ctx, &key);
+    if (k == NULL) {
+        ERR_pop_to_mark();
+        pkcs11_key_cache_drop(ctx, &key);
+        return NULL;
+    }
+    ERR_clear_last_mark();
+    pkcs11_key_cache_add(ctx, uri, class, k);
+    return k;
+}
+
+/**
+ * Remember a key just loaded from |uri|, as the most recently used.
+ * Failures only cost a later load its round trips, so they are not
+ * reported.
+ * @param ctx
+ * @param uri
+ * @param class
+ * @param pkey
+ */
+void pkcs11_key_cache_add(PKCS11_CTX *ctx, const char *uri,
+                          CK_OBJECT_CLASS class, EVP_PKEY *pkey)
+{
+    PKCS11_KEY_TABLE *t = &ctx->keys;
+    PKCS11_KEY_CACHE *c;
+    const RSA *rsa = EVP_PKEY_get0_RSA(pkey);
+    const PKCS11_KEY *key;
+    const BIGNUM *rn, *re;
+    unsigned long hash;
+    BIGNUM *n, *e;
+    char *name;
+    size_t i;
+
+    if (rsa == NULL || (key = RSA_get_ex_data(rsa, rsa_pkcs11_idx)) == NULL
+        || key->name != NULL || (name = key_uri(uri, NULL, 0)) == NULL)
+        return;
+    hash = key_hash(name, class);
+    /* the first key of a token reads its state, for the next checks */
+    pkcs11_sync_check(ctx, key->slotid);
+    RSA_get0_key(rsa, &rn, &re, NULL);
+    n = BN_dup(rn);
+    e = BN_dup(re);
+    if (n == NULL || e == NULL || !CRYPTO_THREAD_write_lock(ctx->lock)) {
+        BN_free(n);
+        BN_free(e);
+        OPENSSL_free(name);
+        return;
+    }
+    if ((i = key_find(t, name, class, hash)) == NONE) {
+        if ((t->used + 1) * 4 > t->size * 3 && !key_grow(t)) {
+            CRYPTO_THREAD_unlock(ctx->lock);
+            BN_free(n);
+            BN_free(e);
+            OPENSSL_free(name);
+            return;
+        }
+        for (i = hash & (t->size - 1); t->entries[i].uri != NULL;
+             i = (i + 1) & (t->size - 1))
+            continue;
+        c = &t->entries[i];
+        if (!c->deleted)
+            t->used++;
+        c->deleted = 0;
+        c->uri = name;
+        name = NULL;
+        c->hash = hash;
+        c->class = class;
+        c->prev = c->next = NONE;
+    }
+    t->entries[i].key = *key;
+    key_heat(t, i, n, e);
+    CRYPTO_THREAD_unlock(ctx->lock);
+    OPENSSL_free(name);
+}
+
+/**
+ * Forget the loads of a key the token no longer knows.
+ * @param ctx
+ * @param key
+ */
+void pkcs11_key_cache_drop(PKCS11_CTX *ctx, const PKCS11_KEY *key)
+{
+    PKCS11_KEY_TABLE *t = &ctx->keys;
+    size_t i;
+
+    if (!CRYPTO_THREAD_write_lock(ctx->lock))
+        return;
+    for (i = 0; i < t->size; i++) {
+        if (t->entries[i].uri != NULL
+            && t->entries[i].key.handle == key->handle
+            && t->entries[i].key.slotid == key->slotid
+            && t->entries[i].key.module == key->module)
+            key_delete(t, i);
+    }
+    CRYPTO_THREAD_unlock(ctx->lock);
+}
+
+/**
+ * Forget every key loaded from a slot, whose token another host changed.
+ * @param ctx
+ * @param slotid
+ */
+void pkcs11_key_cache_drop_slot(PKCS11_CTX *ctx, CK_SLOT_ID slotid)
+{
+    PKCS11_KEY_TABLE *t = &ctx->keys;
+    size_t i;
+
+    if (!CRYPTO_THREAD_write_lock(ctx->lock))
+        return;
+    for (i = 0; i < t->size; i++) {
+        if (t->entries[i].uri != NULL && t->entries[i].key.slotid == slotid)
+            key_delete(t, i);
+    }
+    CRYPTO_THREAD_unlock(ctx->lock);
+}
+
+static int rebind_cmp(const void *a, const void *b)
+{
+    const PKCS11_REBIND *x = a, *y = b;
+
+    if (x->slotid != y->slotid)
+        return x->slotid < y->slotid ? -1 : 1;
+    if (x->from != y->from)
+        return x->from < y->from ? -1 : 1;
+    return 0;
+}
+
+/**
+ * The hot private keys, to find again on the module a reload switches to.
+ * @param ctx
+ * @param keys an array to free with its moduli, NULL if there are none,
+ *        in the order of their slots and handles
+ * @return the number of keys
+ */
+size_t pkcs11_key_cache_hot_keys(PKCS11_CTX *ctx, PKCS11_REBIND **keys)
+{
+    PKCS11_KEY_TABLE *t = &ctx->keys;
+    PKCS11_KEY_CACHE *c;
+    size_t i, n = 0;
+
+    *keys = NULL;
+    if (!CRYPTO_THREAD_read_lock(ctx->lock))
+        return 0;
+    if (t->hot > 0 && (*keys = OPENSSL_zalloc(t->hot * sizeof(**keys)))
+                      != NULL) {
+        for (i = t->head; i != NONE; i = c->next) {
+            c = &t->entries[i];
+            if (c->class != CKO_PRIVATE_KEY
+                || ((*keys)[n].n = BN_dup(c->n)) == NULL)
+                continue;
+            (*keys)[n].slotid = c->key.slotid;
+            (*keys)[n].class = c->class;
+            (*keys)[n].from = c->key.handle;
+            (*keys)[n].to = CK_INVALID_HANDLE;
+            n++;
+        }
+    }
+    CRYPTO_THREAD_unlock(ctx->lock);
+    if (n > 1)
+        qsort(*keys, n, sizeof(**keys), rebind_cmp);
+    return n;
+}
+
+/**
+ * Switch the loaded keys to the module a reload switched to: the keys
+ * found again on it keep their entries, the others are forgotten and
+ * will be searched for.
+ * @param ctx
+ * @param keys as filled by pkcs11_key_cache_hot_keys()
+ * @param n
+ * @param module the generation of the new module
+ */
+void pkcs11_key_cache_rebind(PKCS11_CTX *ctx, const PKCS11_REBIND *keys,
+                             size_t n, unsigned int module)
+{
+    PKCS11_KEY_TABLE *t = &ctx->keys;
+    PKCS11_KEY_CACHE *c;
+    PKCS11_REBIND k;
+    const PKCS11_REBIND *found;
+    size_t i;
+
+    if (!CRYPTO_THREAD_write_lock(ctx->lock))
+        return;
+    for (i = 0; i < t->size; i++) {
+        c = &t->entries[i];
+        if (c->uri == NULL || c->key.module == module)
+            continue;
+        k.slotid = c->key.slotid;
+        k.from = c->key.handle;
+        found = n == 0 ? NULL : bsearch(&k, keys, n, sizeof(*keys), rebind_cmp);
+        if (found == NULL || found->to == CK_INVALID_HANDLE
+            || found->class != c->class) {
+            key_delete(t, i);
+            continue;
+        }
+        c->key.handle = found->to;
+        c->key.module = module;
+    }
+    CRYPTO_THREAD_unlock(ctx->lock);
+}
+
+/**
+ * HOT_KEYS: how many keys keep their public half.
+ * @param ctx
+ * @param max_hot 0 for PKCS11_HOT_KEYS
+ */
+void pkcs11_key_cache_set_hot(PKCS11_CTX *ctx, size_t max_hot)
+{
+    if (!CRYPTO_THREAD_write_lock(ctx->lock))
+        return;
+    ctx->keys.max_hot = max_hot;
+    key_cool(&ctx->keys);
+    CRYPTO_THREAD_unlock(ctx->lock);
+}
+
+void pkcs11_key_cache_free(PKCS11_CTX *ctx)
+{
+    PKCS11_KEY_TABLE *t = &ctx->keys;
+    size_t i;
+
+    for (i = 0; i < t->size; i++) {
+        OPENSSL_free(t->entries[i].uri);
+        BN_free(t->entries[i].n);
+        BN_free(t->entries[i].e);
+    }
+    OPENSSL_free(t->entries);
+    t->entries = NULL;
+    t->size = t->used = t->hot = 0;
+    t->head = t->tail = NONE;
+}
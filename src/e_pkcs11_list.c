@@ -0,0 +1,329 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Store listings over several tokens.  A store URI that does not pick one
+ * token lists every token it selects: each is searched on a session of
+ * its own by one of up to PKCS11_LIST_THREADS threads, and what they find
+ * goes into one queue that pkcs11_store_load() takes from, in the order
+ * it was found.  The queue is bounded, so a reader that stops reading
+ * stops the searches too, and closing the store before its end makes
+ * them give up at their next object.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+
+#define PKCS11_LIST_THREADS     16      /* tokens searched at once */
+#define PKCS11_LIST_QUEUE       256     /* objects found but not loaded */
+
+typedef struct PKCS11_LIST_ITEM_st {
+    OSSL_STORE_INFO *info;
+    struct PKCS11_LIST_ITEM_st *next;
+} PKCS11_LIST_ITEM;
+
+struct PKCS11_LIST_st {
+    PKCS11_CTX *ctx;
+    int names;                  /* list names, not certificates and keys */
+    /* the search of the URI, its values copied out of |ctx| */
+    CK_ATTRIBUTE tmpl[2];
+    CK_ULONG ntmpl;
+    CK_OBJECT_CLASS key_class;
+    CK_SLOT_ID *slots;
+    size_t nslots;
+    pthread_t threads[PKCS11_LIST_THREADS];
+    size_t nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t found;       /* an object was queued or a token is done */
+    pthread_cond_t taken;       /* an object was taken off the queue */
+    size_t next_slot;           /* the next token to search */
+    size_t running;             /* threads still searching */
+    int closing;
+    PKCS11_LIST_ITEM *head, *tail;
+    size_t queued;
+};
+
+/*
+ * Queue what a thread found; returns 0, having freed |info|, once the
+ * store is being closed.
+ */
+static int list_put(PKCS11_LIST *list, OSSL_STORE_INFO *info)
+{
+    PKCS11_LIST_ITEM *item;
+
+    if ((item = OPENSSL_malloc(sizeof(*item))) == NULL) {
+        OSSL_STORE_INFO_free(info);
+        return 1;
+    }
+    item->info = info;
+    item->next = NULL;
+
+    pthread_mutex_lock(&list->lock);
+    while (list->queued >= PKCS11_LIST_QUEUE && !list->closing)
+        pthread_cond_wait(&list->taken, &list->lock);
+    if (list->closing) {
+        pthread_mutex_unlock(&list->lock);
+        OSSL_STORE_INFO_free(info);
+        OPENSSL_free(item);
+        return 0;
+    }
+    if (list->tail != NULL)
+        list->tail->next = item;
+    else
+        list->head = item;
+    list->tail = item;
+    list->queued++;
+    pthread_cond_signal(&list->found);
+    pthread_mutex_unlock(&list->lock);
+    return 1;
+}
+
+/* A name of a token, the slot it is in first in its description */
+static OSSL_STORE_INFO *list_name(CK_SLOT_ID slotid, char *name,
+                                  char *description)
+{
+    OSSL_STORE_INFO *info;
+    char *desc = NULL;
+    size_t len;
+
+    if (description != NULL) {
+        len = strlen(description) + 32;
+        if ((desc = OPENSSL_malloc(len)) != NULL)
+            BIO_snprintf(desc, len, "Slot %lu, %s", (unsigned long)slotid,
+                         description);
+        OPENSSL_free(description);
+    }
+    if ((info = OSSL_STORE_INFO_new_NAME(name)) == NULL) {
+        OPENSSL_free(name);
+        OPENSSL_free(desc);
+        return NULL;
+    }
+    if (desc != NULL)
+        OSSL_STORE_INFO_set0_NAME_description(info, desc);
+    return info;
+}
+
+/* Search the token in one slot, on a session of its own */
+static void list_slot(PKCS11_LIST *list, CK_SLOT_ID slotid)
+{
+    OSSL_STORE_LOADER_CTX *sub;
+    OSSL_STORE_INFO *info;
+    CK_OBJECT_CLASS class;
+    char *name, *description;
+
+    if ((sub = OPENSSL_zalloc(sizeof(*sub))) == NULL)
+        return;
+    sub->pkcs11_ctx = list->ctx;
+    sub->slotid = slotid;
+    if (!pkcs11_session_get(list->ctx, slotid, &sub->session)) {
+        sub->session = 0;
+        goto end;
+    }
+    if (!pkcs11_search_init(sub, list->tmpl, list->ntmpl))
+        goto end;
+
+    for (;;) {
+        info = NULL;
+        if (list->names) {
+            if (pkcs11_search_next_ids(sub, &name, &description))
+                break;
+            if (name == NULL)
+                continue;
+            info = list_name(slotid, name, description);
+        } else {
+            if (pkcs11_search_next_object(sub, &class))
+                break;
+            if (class == CKO_CERTIFICATE
+                && (info = OSSL_STORE_INFO_new_CERT(sub->cert)) != NULL)
+                sub->cert = NULL;
+            else if (class == CKO_PUBLIC_KEY
+                     && (info = OSSL_STORE_INFO_new_PKEY(sub->key)) != NULL)
+                sub->key = NULL;
+        }
+        if (info != NULL && !list_put(list, info))
+            break;
+    }
+
+ end:
+    if (sub->session != 0)
+        pkcs11_session_put(list->ctx, slotid, sub->session,
+                           pkcs11_close_operation(sub->session));
+    X509_free(sub->cert);
+    EVP_PKEY_free(sub->key);
+    OPENSSL_free(sub);
+}
+
+static void *list_thread(void *arg)
+{
+    PKCS11_LIST *list = arg;
+    size_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&list->lock);
+        i = list->closing ? list->nslots : list->next_slot++;
+        pthread_mutex_unlock(&list->lock);
+        if (i >= list->nslots)
+            break;
+        list_slot(list, list->slots[i]);
+    }
+
+    pthread_mutex_lock(&list->lock);
+    list->running--;
+    pthread_cond_broadcast(&list->found);
+    pthread_mutex_unlock(&list->lock);
+    OPENSSL_thread_stop();
+    return NULL;
+}
+
+/**
+ * Start listing the tokens in several slots, with the search of the URI
+ * in |ctx|.  Their PINs, if needed, are in the vault already.
+ * @param ctx
+ * @param slots taken over, freed with the listing
+ * @param nslots
+ * @param names whether to list names rather than certificates and keys
+ * @return the listing, or NULL on error
+ */
+PKCS11_LIST *pkcs11_list_start(PKCS11_CTX *ctx, CK_SLOT_ID *slots,
+                               size_t nslots, int names)
+{
+    PKCS11_LIST *list;
+    CK_ULONG i;
+
+    if ((list = OPENSSL_zalloc(sizeof(*list))) == NULL)
+        goto memerr;
+    list->ctx = ctx;
+    list->names = names;
+    list->slots = slots;
+    list->nslots = nslots;
+    pthread_mutex_init(&list->lock, NULL);
+    pthread_cond_init(&list->found, NULL);
+    pthread_cond_init(&list->taken, NULL);
+
+    /* the next URI parsed replaces the values in |ctx| */
+    list->ntmpl = pkcs11_search_template(ctx, &list->key_class, list->tmpl);
+    for (i = 0; i < list->ntmpl; i++) {
+        if (list->tmpl[i].type == CKA_CLASS) {
+            list->tmpl[i].pValue = &list->key_class;
+        } else if ((list->tmpl[i].pValue =
+                    OPENSSL_memdup(list->tmpl[i].pValue,
+                                   list->tmpl[i].ulValueLen)) == NULL) {
+            list->ntmpl = i;    /* the values copied so far */
+            goto memerr;
+        }
+    }
+
+    pthread_mutex_lock(&list->lock);
+    while (list->nthreads < PKCS11_LIST_THREADS
+           && list->nthreads < nslots
+           && pthread_create(&list->threads[list->nthreads], NULL,
+                             list_thread, list) == 0) {
+        list->nthreads++;
+        list->running++;
+    }
+    pthread_mutex_unlock(&list->lock);
+    if (list->nthreads == 0) {
+        pkcs11_list_free(list);
+        return NULL;
+    }
+    PKCS11_trace("Listing %lu slots with %lu threads\n",
+                 (unsigned long)nslots, (unsigned long)list->nthreads);
+    return list;
+
+ memerr:
+    PKCS11err(PKCS11_F_PKCS11_LIST_START, ERR_R_MALLOC_FAILURE);
+    if (list != NULL)
+        pkcs11_list_free(list);
+    else
+        OPENSSL_free(slots);
+    return NULL;
+}
+
+/**
+ * The next object found on any of the tokens, waiting for one if none is
+ * and some token is still being searched.
+ * @param list
+ * @param eof set once every token was searched and everything loaded
+ * @return the object, or NULL at the end
+ */
+OSSL_STORE_INFO *pkcs11_list_next(PKCS11_LIST *list, int *eof)
+{
+    PKCS11_LIST_ITEM *item;
+    OSSL_STORE_INFO *info = NULL;
+
+    pthread_mutex_lock(&list->lock);
+    while (list->head == NULL && list->running > 0)
+        pthread_cond_wait(&list->found, &list->lock);
+    if ((item = list->head) != NULL) {
+        if ((list->head = item->next) == NULL)
+            list->tail = NULL;
+        list->queued--;
+        pthread_cond_signal(&list->taken);
+    }
+    *eof = list->head == NULL && list->running == 0;
+    pthread_mutex_unlock(&list->lock);
+
+    if (item != NULL) {
+        info = item->info;
+        OPENSSL_free(item);
+    }
+    return info;
+}
+
+/**
+ * Whether every token was searched and everything found loaded.
+ * @param list
+ * @return 1 at the end, 0 otherwise
+ */
+int pkcs11_list_eof(PKCS11_LIST *list)
+{
+    int eof;
+
+    pthread_mutex_lock(&list->lock);
+    eof = list->head == NULL && list->running == 0;
+    pthread_mutex_unlock(&list->lock);
+    return eof;
+}
+
+/**
+ * Stop the searches still under way, wait for their threads to give their
+ * sessions back, and free what was found but not loaded.
+ * @param list
+ */
+void pkcs11_list_free(PKCS11_LIST *list)
+{
+    PKCS11_LIST_ITEM *item;
+    size_t i;
+
+    if (list == NULL)
+        return;
+    pthread_mutex_lock(&list->lock);
+    list->closing = 1;
+    pthread_cond_broadcast(&list->taken);
+    pthread_mutex_unlock(&list->lock);
+    for (i = 0; i < list->nthreads; i++)
+        pthread_join(list->threads[i], NULL);
+
+    while ((item = list->head) != NULL) {
+        list->head = item->next;
+        OSSL_STORE_INFO_free(item->info);
+        OPENSSL_free(item);
+    }
+    for (i = 0; i < list->ntmpl; i++)
+        if (list->tmpl[i].type != CKA_CLASS)
+            OPENSSL_free(list->tmpl[i].pValue);
+    OPENSSL_free(list->slots);
+    pthread_cond_destroy(&list->taken);
+    pthread_cond_destroy(&list->found);
+    pthread_mutex_destroy(&list->lock);
+    OPENSSL_free(list);
+}
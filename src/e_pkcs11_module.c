@@ -0,0 +1,282 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Module reloads.  RELOAD_MODULE switches the engine to another build of
+ * its PKCS#11 module, such as the one an HSM client upgrade installed
+ * next to the old one, without restarting the process:
+ *
+ *  - the new module is loaded and initialized beside the one in use;
+ *  - sessions are opened on it for every slot with a session pool, logged
+ *    in with the PINs of the vault, and the hot keys are found on it by
+ *    their modulus, while the old module goes on serving;
+ *  - new operations are held back until those under way are done, then
+ *    the function list, the pools and the key handles are swapped;
+ *  - the sessions of the old module are closed, and it is finalized and
+ *    unloaded.
+ *
+ * Only the swap holds operations back, for as long as the slowest one
+ * under way takes; an operation that keeps its session long, such as a
+ * store listing, makes the reload give up after PKCS11_RELOAD_WAIT_MS and
+ * leaves the old module in use.  Keys loaded before the reload that were
+ * not hot find their object on the new module, again by modulus, on their
+ * next operation.  The new module must show the tokens in the same slots.
+ */
+
+#include <string.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+#include "e_pkcs11_call.h"
+#include "dso.h"
+
+/**
+ * The RSA private key object with modulus |n|.
+ * @param funcs the module of |session|
+ * @param session
+ * @param n
+ * @return its handle, or CK_INVALID_HANDLE if there is none
+ */
+CK_OBJECT_HANDLE pkcs11_find_key_by_modulus(CK_FUNCTION_LIST *funcs,
+                                            CK_SESSION_HANDLE session,
+                                            const BIGNUM *n)
+{
+    CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+    CK_KEY_TYPE type = CKK_RSA;
+    CK_ATTRIBUTE tmpl[3];
+    CK_OBJECT_HANDLE handle = CK_INVALID_HANDLE;
+    CK_ULONG found = 0;
+    unsigned char *modulus;
+    int len = BN_num_bytes(n);
+
+    if ((modulus = OPENSSL_malloc(len)) == NULL)
+        return CK_INVALID_HANDLE;
+    BN_bn2bin(n, modulus);
+    tmpl[0].type = CKA_CLASS;
+    tmpl[0].pValue = &class;
+    tmpl[0].ulValueLen = sizeof(class);
+    tmpl[1].type = CKA_KEY_TYPE;
+    tmpl[1].pValue = &type;
+    tmpl[1].ulValueLen = sizeof(type);
+    tmpl[2].type = CKA_MODULUS;
+    tmpl[2].pValue = modulus;
+    tmpl[2].ulValueLen = len;
+
+    if (PKCS11_CALL_ON(funcs, C_FindObjectsInit, session, tmpl, 3) == CKR_OK) {
+        if (PKCS11_CALL_ON(funcs, C_FindObjects, session, &handle, 1,
+                           &found) != CKR_OK
+            || found != 1)
+            handle = CK_INVALID_HANDLE;
+        PKCS11_CALL_ON(funcs, C_FindObjectsFinal, session);
+    }
+    OPENSSL_free(modulus);
+    return handle;
+}
+
+/* Close the sessions of |pools|, on module |funcs|, and free them */
+static void reload_pools_free(CK_FUNCTION_LIST *funcs, PKCS11_POOL *pools)
+{
+    PKCS11_POOL *pool;
+
+    while ((pool = pools) != NULL) {
+        pools = pool->next;
+        while (pool->nidle > 0)
+            PKCS11_CALL_ON(funcs, C_CloseSession,
+                           pool->idle[--pool->nidle]);
+        OPENSSL_free(pool->idle);
+        OPENSSL_free(pool->idle_since);
+        OPENSSL_free(pool);
+    }
+}
+
+/*
+ * Sessions on module |funcs| for the slots the engine has pools for, as
+ * many as they have idle, logged in if the vault has the slot's PIN.
+ */
+static int reload_pools(PKCS11_CTX *ctx, CK_FUNCTION_LIST *funcs,
+                        PKCS11_POOL **pools)
+{
+    CK_SLOT_ID *slots = NULL;
+    size_t *idle = NULL, nslots = 0, i;
+    CK_UTF8CHAR pin[PKCS11_PIN_MAX];
+    CK_ULONG pinlen;
+    PKCS11_POOL *pool;
+    CK_RV rv;
+    int ret = 0;
+
+    *pools = NULL;
+    if (!CRYPTO_THREAD_read_lock(ctx->lock))
+        return 0;
+    for (pool = ctx->pools; pool != NULL; pool = pool->next)
+        nslots++;
+    if (nslots > 0
+        && ((slots = OPENSSL_malloc(nslots * sizeof(*slots))) == NULL
+            || (idle = OPENSSL_malloc(nslots * sizeof(*idle))) == NULL)) {
+        CRYPTO_THREAD_unlock(ctx->lock);
+        PKCS11err(PKCS11_F_PKCS11_RELOAD_MODULE, ERR_R_MALLOC_FAILURE);
+        goto end;
+    }
+    for (pool = ctx->pools, i = 0; pool != NULL; pool = pool->next, i++) {
+        slots[i] = pool->slotid;
+        idle[i] = pool->nidle > 0 ? pool->nidle : 1;
+    }
+    CRYPTO_THREAD_unlock(ctx->lock);
+
+    for (i = 0; i < nslots; i++) {
+        if ((pool = OPENSSL_zalloc(sizeof(*pool))) == NULL
+            || (pool->idle = OPENSSL_malloc(idle[i] * sizeof(*pool->idle)))
+               == NULL
+            || (pool->idle_since =
+                    OPENSSL_zalloc(idle[i] * sizeof(*pool->idle_since)))
+               == NULL) {
+            if (pool != NULL)
+                OPENSSL_free(pool->idle);
+            OPENSSL_free(pool);
+            PKCS11err(PKCS11_F_PKCS11_RELOAD_MODULE, ERR_R_MALLOC_FAILURE);
+            goto end;
+        }
+        pool->slotid = slots[i];
+        pool->size = idle[i];
+        pool->next = *pools;
+        *pools = pool;
+        for (; pool->nidle < pool->size; pool->nidle++) {
+            rv = PKCS11_CALL_ON(funcs, C_OpenSession, slots[i],
+                                CKF_SERIAL_SESSION, NULL, NULL,
+                                &pool->idle[pool->nidle]);
+            if (rv != CKR_OK) {
+                PKCS11err_rv(PKCS11_F_PKCS11_RELOAD_MODULE,
+                             PKCS11_R_OPEN_SESSION_ERROR, rv);
+                goto end;
+            }
+        }
+        if (!pkcs11_pin_known(ctx, slots[i]))
+            continue;
+        if (!pkcs11_pin_get(ctx, slots[i], pin, &pinlen)) {
+            PKCS11err(PKCS11_F_PKCS11_RELOAD_MODULE, PKCS11_R_LOGIN_FAILED);
+            goto end;
+        }
+        rv = PKCS11_CALL_ON(funcs, C_Login, pool->idle[0], CKU_USER, pin,
+                            pinlen);
+        OPENSSL_cleanse(pin, sizeof(pin));
+        if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+            PKCS11err_rv(PKCS11_F_PKCS11_RELOAD_MODULE,
+                         PKCS11_R_LOGIN_FAILED, rv);
+            goto end;
+        }
+        pool->logged_in = 1;
+    }
+    ret = 1;
+
+ end:
+    OPENSSL_free(slots);
+    OPENSSL_free(idle);
+    return ret;
+}
+
+/* Find the hot keys on module |funcs|, with the sessions of |pools| */
+static void reload_keys(CK_FUNCTION_LIST *funcs, PKCS11_POOL *pools,
+                        PKCS11_REBIND *keys, size_t n)
+{
+    PKCS11_POOL *pool;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        for (pool = pools; pool != NULL; pool = pool->next)
+            if (pool->slotid == keys[i].slotid && pool->nidle > 0)
+                break;
+        if (pool != NULL)
+            keys[i].to = pkcs11_find_key_by_modulus(funcs, pool->idle[0],
+                                                    keys[i].n);
+    }
+}
+
+/**
+ * RELOAD_MODULE: switch to the module at |library_path|.
+ * @param ctx
+ * @param library_path
+ * @return 1 on success, 0 on error, the module in use is then unchanged
+ */
+int pkcs11_reload_module(PKCS11_CTX *ctx, const char *library_path)
+{
+    CK_FUNCTION_LIST *funcs = NULL, *cur = pkcs11_module_current();
+    PKCS11_POOL *pools = NULL, *old;
+    PKCS11_REBIND *keys = NULL;
+    DSO *dso = NULL;
+    size_t nkeys = 0, i;
+    char *path;
+    CK_RV rv;
+    int ret = 0;
+
+    if ((path = OPENSSL_strdup(library_path)) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_RELOAD_MODULE, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    if (cur == NULL) {
+        /* nothing loaded yet, the first key load loads this one */
+        ctx->module_path = path;
+        return 1;
+    }
+
+    rv = pkcs11_module_open(library_path, &dso, &funcs);
+    if (rv == CKR_CRYPTOKI_ALREADY_INITIALIZED || funcs == cur) {
+        /* the same file, or a module someone else initialized: not ours */
+        PKCS11err(PKCS11_F_PKCS11_RELOAD_MODULE,
+                  PKCS11_R_MODULE_ALREADY_LOADED);
+        DSO_free(dso);
+        OPENSSL_free(path);
+        return 0;
+    }
+    if (rv != CKR_OK) {
+        OPENSSL_free(path);
+        return 0;
+    }
+
+    /* the slow part, while the old module serves */
+    if (!reload_pools(ctx, funcs, &pools))
+        goto err;
+    nkeys = pkcs11_key_cache_hot_keys(ctx, &keys);
+    reload_keys(funcs, pools, keys, nkeys);
+
+    if (!pkcs11_module_hold(PKCS11_RELOAD_WAIT_MS)) {
+        PKCS11err(PKCS11_F_PKCS11_RELOAD_MODULE, PKCS11_R_MODULE_BUSY);
+        goto err;
+    }
+    if (!pkcs11_module_swap(library_path, &dso, &funcs)) {
+        pkcs11_module_release();
+        PKCS11err(PKCS11_F_PKCS11_RELOAD_MODULE, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    /* from here on |dso| and |funcs| are the old module */
+    if (CRYPTO_THREAD_write_lock(ctx->lock)) {
+        old = ctx->pools;
+        ctx->pools = pools;
+        pools = old;
+        /* the new module may want other settings */
+        ctx->profile_chosen = 0;
+        CRYPTO_THREAD_unlock(ctx->lock);
+    }
+    pkcs11_key_cache_rebind(ctx, keys, nkeys, pkcs11_module_generation());
+    /* the previous path may be the environment's, it is not freed */
+    ctx->module_path = path;
+    path = NULL;
+    pkcs11_module_release();
+    PKCS11_trace("Switched to module %s\n", library_path);
+    ret = 1;
+
+ err:
+    /* the module not in use: the new one on error, else the old one */
+    reload_pools_free(funcs, pools);
+    PKCS11_CALL_ON(funcs, C_Finalize, NULL);
+    DSO_free(dso);
+    for (i = 0; i < nkeys; i++)
+        BN_free(keys[i].n);
+    OPENSSL_free(keys);
+    OPENSSL_free(path);
+    return ret;
+}
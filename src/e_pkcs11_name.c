@@ -0,0 +1,426 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Named keys.  ENGINE_load_private_key(e, "key-name:tls") gives a key
+ * whose token object is the current version of the name "tls", set by the
+ * ROTATE_KEY ctrl: "tls=pkcs11:object=tls-2024;type=private" loads the
+ * key of the URI and swaps it in, while the SSL_CTXs holding the key go
+ * on signing.  A version is where the key is (slot and handle) and what
+ * it can do (always authenticate, sign only); every version is of the
+ * same key pair, since the public key of the EVP_PKEY cannot change.
+ *
+ * Signing reads the current version without a lock, as a grace period
+ * scheme: a reader joins the count of the epoch it started in, copies the
+ * version and leaves.  A rotation publishes the new version, moves the
+ * epoch on and waits for the readers of the old epoch, which may still
+ * be copying the old version, before freeing it.  A copy takes a few
+ * nanoseconds, so the wait is as short, and a token call made with the
+ * old handle after the swap still works: the object is not destroyed.
+ * The rotation sleeps on |name_drained| meanwhile, which the last reader
+ * of the old epoch signals, and does not hold names_lock: lookups go on.
+ * |name_rotate_lock| keeps rotations one at a time, as the old epoch must
+ * be empty before the next one reuses its count.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+
+static pthread_mutex_t name_rotate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t name_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t name_drained = PTHREAD_COND_INITIALIZER;
+
+static void name_read_unlock(PKCS11_KEY_NAME *kn, unsigned int idx);
+
+/* Enter the read side of |kn|, returns the reader count to leave */
+static unsigned int name_read_lock(PKCS11_KEY_NAME *kn)
+{
+    unsigned int idx;
+
+    for (;;) {
+        idx = __atomic_load_n(&kn->epoch, __ATOMIC_ACQUIRE) & 1;
+        __atomic_add_fetch(&kn->readers[idx], 1, __ATOMIC_SEQ_CST);
+        /* a rotation in between may not have seen us, join the new epoch */
+        if ((__atomic_load_n(&kn->epoch, __ATOMIC_SEQ_CST) & 1) == idx)
+            return idx;
+        name_read_unlock(kn, idx);
+    }
+}
+
+static void name_read_unlock(PKCS11_KEY_NAME *kn, unsigned int idx)
+{
+    /* the last reader of an epoch a rotation waits on wakes it */
+    if (__atomic_sub_fetch(&kn->readers[idx], 1, __ATOMIC_SEQ_CST) == 0
+        && __atomic_load_n(&kn->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&name_wait_lock);
+        pthread_cond_broadcast(&name_drained);
+        pthread_mutex_unlock(&name_wait_lock);
+    }
+}
+
+/* Called with names_lock held */
+static PKCS11_KEY_NAME *name_find(PKCS11_CTX *ctx, const char *name)
+{
+    PKCS11_KEY_NAME *kn;
+
+    for (kn = ctx->names; kn != NULL; kn = kn->next) {
+        if (strcmp(kn->name, name) == 0)
+            return kn;
+    }
+    return NULL;
+}
+
+/*
+ * Make |v| the current version of |kn|; called with name_rotate_lock and
+ * names_lock held.  Returns the previous version, to give to name_retire()
+ * with |*idx| once names_lock is released.
+ */
+static PKCS11_KEY *name_publish(PKCS11_KEY_NAME *kn, PKCS11_KEY *v,
+                                unsigned int *idx)
+{
+    PKCS11_KEY *old = kn->current;
+
+    __atomic_store_n(&kn->current, v, __ATOMIC_RELEASE);
+    /* new readers join the other count and can only see |v| */
+    *idx = __atomic_fetch_add(&kn->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    return old;
+}
+
+/*
+ * Free the version name_publish() replaced once no reader of the epoch
+ * |idx| can be copying it; called with name_rotate_lock held.
+ */
+static void name_retire(PKCS11_KEY_NAME *kn, PKCS11_KEY *old,
+                        unsigned int idx)
+{
+    if (old == NULL)
+        return;
+    pthread_mutex_lock(&name_wait_lock);
+    __atomic_store_n(&kn->waiting, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&kn->readers[idx], __ATOMIC_SEQ_CST) != 0)
+        pthread_cond_wait(&name_drained, &name_wait_lock);
+    __atomic_store_n(&kn->waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&name_wait_lock);
+    OPENSSL_free(old);
+}
+
+static void name_free(PKCS11_KEY_NAME *kn)
+{
+    OPENSSL_free(kn->name);
+    BN_free(kn->n);
+    BN_free(kn->e);
+    OPENSSL_free(kn->current);
+    OPENSSL_free(kn->uri);
+    OPENSSL_free(kn);
+}
+
+/**
+ * The token key an RSA key of the engine signs with now: the key it was
+ * loaded with, or the current version of its name.
+ * @param rsa
+ * @param key a copy, to use for one operation
+ * @return 1 on success, 0 if |rsa| is not a token key
+ */
+int pkcs11_key_get(const RSA *rsa, PKCS11_KEY *key)
+{
+    const PKCS11_KEY *k = RSA_get_ex_data(rsa, rsa_pkcs11_idx);
+    unsigned int idx, module;
+
+    if (k == NULL)
+        return 0;
+    if (k->name == NULL) {
+        /* the handle is stored before its module, pkcs11_key_rebound() */
+        module = __atomic_load_n(&k->module, __ATOMIC_ACQUIRE);
+        *key = *k;
+        key->module = module;
+        return 1;
+    }
+    idx = name_read_lock(k->name);
+    *key = *__atomic_load_n(&k->name->current, __ATOMIC_ACQUIRE);
+    name_read_unlock(k->name, idx);
+    return 1;
+}
+
+/**
+ * Remember that a key refuses C_EncryptInit, so that the next operations
+ * go straight to C_SignInit.  For a named key only the version |key| was
+ * copied from learns it, a newer one may accept it.
+ * @param rsa
+ * @param key as got with pkcs11_key_get()
+ */
+void pkcs11_key_sign_only(const RSA *rsa, const PKCS11_KEY *key)
+{
+    PKCS11_KEY *k = RSA_get_ex_data(rsa, rsa_pkcs11_idx), *cur;
+    unsigned int idx;
+
+    if (k == NULL)
+        return;
+    if (k->name == NULL) {
+        k->sign_only = 1;
+        return;
+    }
+    idx = name_read_lock(k->name);
+    cur = __atomic_load_n(&k->name->current, __ATOMIC_ACQUIRE);
+    if (cur->handle == key->handle && cur->slotid == key->slotid)
+        __atomic_store_n(&cur->sign_only, 1, __ATOMIC_RELAXED);
+    name_read_unlock(k->name, idx);
+}
+
+/**
+ * Keep the object a key was found at on a reloaded module, so that its
+ * next operations need not search for it again.  For a named key the
+ * version |key| was copied from is replaced, unless rotated meanwhile.
+ * @param rsa
+ * @param key as got with pkcs11_key_get(), before the search
+ * @param handle the object on the module in use
+ * @param module its generation
+ */
+void pkcs11_key_rebound(const RSA *rsa, const PKCS11_KEY *key,
+                        CK_OBJECT_HANDLE handle, unsigned int module)
+{
+    PKCS11_KEY *k = RSA_get_ex_data(rsa, rsa_pkcs11_idx), *cur, *v;
+    PKCS11_KEY *old = NULL;
+    PKCS11_CTX *ctx = pkcs11_get_ctx(rsa);
+    unsigned int idx = 0;
+
+    if (k == NULL)
+        return;
+    if (k->name == NULL) {
+        /* readers that see |module| see |handle| */
+        __atomic_store_n(&k->handle, handle, __ATOMIC_RELAXED);
+        __atomic_store_n(&k->module, module, __ATOMIC_RELEASE);
+        return;
+    }
+    if (ctx == NULL || (v = OPENSSL_malloc(sizeof(*v))) == NULL)
+        return;
+    pthread_mutex_lock(&name_rotate_lock);
+    if (!CRYPTO_THREAD_write_lock(ctx->names_lock)) {
+        pthread_mutex_unlock(&name_rotate_lock);
+        OPENSSL_free(v);
+        return;
+    }
+    cur = k->name->current;
+    if (cur->handle == key->handle && cur->slotid == key->slotid
+        && cur->module == key->module) {
+        *v = *cur;
+        v->handle = handle;
+        v->module = module;
+        old = name_publish(k->name, v, &idx);
+        v = NULL;
+    }
+    CRYPTO_THREAD_unlock(ctx->names_lock);
+    name_retire(k->name, old, idx);
+    pthread_mutex_unlock(&name_rotate_lock);
+    OPENSSL_free(v);
+}
+
+/**
+ * Point a name at the token key of |pkey|, creating the name the first
+ * time.  The keys loaded as key-name:<name> sign with it from their next
+ * operation on; the operations under way finish with the previous one.
+ * @param ctx
+ * @param name
+ * @param pkey a token key of the engine, of the same key pair as the
+ *        name's previous versions
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_key_name_set(PKCS11_CTX *ctx, const char *name, EVP_PKEY *pkey)
+{
+    PKCS11_KEY_NAME *kn;
+    PKCS11_KEY *v = NULL, *old = NULL;
+    const RSA *rsa = EVP_PKEY_get0_RSA(pkey);
+    const BIGNUM *n, *e;
+    const char *done;
+    unsigned int idx = 0;
+
+    if ((v = OPENSSL_zalloc(sizeof(*v))) == NULL)
+        goto memerr;
+    if (rsa == NULL || !pkcs11_key_get(rsa, v)) {
+        PKCS11err(PKCS11_F_PKCS11_KEY_NAME_SET, PKCS11_R_RSA_NOT_FOUND);
+        OPENSSL_free(v);
+        return 0;
+    }
+    v->name = NULL;
+    RSA_get0_key(rsa, &n, &e, NULL);
+
+    pthread_mutex_lock(&name_rotate_lock);
+    if (!CRYPTO_THREAD_write_lock(ctx->names_lock)) {
+        pthread_mutex_unlock(&name_rotate_lock);
+        OPENSSL_free(v);
+        return 0;
+    }
+    if ((kn = name_find(ctx, name)) == NULL) {
+        if ((kn = OPENSSL_zalloc(sizeof(*kn))) == NULL
+            || (kn->name = OPENSSL_strdup(name)) == NULL
+            || (kn->n = BN_dup(n)) == NULL || (kn->e = BN_dup(e)) == NULL) {
+            if (kn != NULL)
+                name_free(kn);
+            goto unlock_memerr;
+        }
+        kn->current = v;
+        kn->next = ctx->names;
+        ctx->names = kn;
+        done = "created";
+    } else if (kn->current == NULL) {
+        /* the first key of a deferred name, no reader can see it yet */
+        if ((kn->n = BN_dup(n)) == NULL || (kn->e = BN_dup(e)) == NULL) {
+            BN_free(kn->n);
+            kn->n = NULL;
+            goto unlock_memerr;
+        }
+        OPENSSL_free(kn->uri);
+        kn->uri = NULL;
+        __atomic_store_n(&kn->current, v, __ATOMIC_RELEASE);
+        done = "loaded";
+    } else if (BN_cmp(kn->n, n) != 0 || BN_cmp(kn->e, e) != 0) {
+        CRYPTO_THREAD_unlock(ctx->names_lock);
+        pthread_mutex_unlock(&name_rotate_lock);
+        OPENSSL_free(v);
+        PKCS11err(PKCS11_F_PKCS11_KEY_NAME_SET, PKCS11_R_KEY_MISMATCH);
+        return 0;
+    } else {
+        old = name_publish(kn, v, &idx);
+        done = "rotated";
+    }
+    CRYPTO_THREAD_unlock(ctx->names_lock);
+    name_retire(kn, old, idx);
+    pthread_mutex_unlock(&name_rotate_lock);
+    PKCS11_trace("Key name %s %s\n", name, done);
+    return 1;
+
+ unlock_memerr:
+    CRYPTO_THREAD_unlock(ctx->names_lock);
+    pthread_mutex_unlock(&name_rotate_lock);
+ memerr:
+    OPENSSL_free(v);
+    PKCS11err(PKCS11_F_PKCS11_KEY_NAME_SET, ERR_R_MALLOC_FAILURE);
+    return 0;
+}
+
+/**
+ * A new EVP_PKEY signing with the current version of a name.
+ * @param ctx
+ * @param name
+ * @return the key or NULL on error
+ */
+EVP_PKEY *pkcs11_key_name_get(PKCS11_CTX *ctx, const char *name)
+{
+    PKCS11_KEY key = { 0 };
+    PKCS11_KEY_NAME *kn;
+    BIGNUM *n = NULL, *e = NULL;
+    EVP_PKEY *k = NULL;
+
+    if (!CRYPTO_THREAD_read_lock(ctx->names_lock))
+        return NULL;
+    if ((kn = name_find(ctx, name)) != NULL && kn->current == NULL)
+        kn = NULL;
+    if (kn != NULL) {
+        key.name = kn;
+        n = BN_dup(kn->n);
+        e = BN_dup(kn->e);
+    }
+    CRYPTO_THREAD_unlock(ctx->names_lock);
+
+    if (kn == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_ENGINE_LOAD_PRIVATE_KEY,
+                  PKCS11_R_KEY_NAME_NOT_FOUND);
+    } else if (n != NULL && e != NULL) {
+        k = pkcs11_new_pkey(ctx, &key, n, e);
+    }
+    if (k == NULL) {
+        BN_free(n);
+        BN_free(e);
+    }
+    return k;
+}
+
+/**
+ * Point a name at a URI without loading its key: ROTATE_KEY in a config
+ * file then costs no module load, login or search in the processes that
+ * never sign with the name.  Its first load as key-name:<name> loads the
+ * URI, see pkcs11_key_name_uri().
+ * @param ctx
+ * @param name a name not pointing at a key yet
+ * @param uri
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_key_name_defer(PKCS11_CTX *ctx, const char *name, const char *uri)
+{
+    PKCS11_KEY_NAME *kn;
+    char *copy;
+
+    if ((copy = OPENSSL_strdup(uri)) == NULL)
+        goto memerr;
+    if (!CRYPTO_THREAD_write_lock(ctx->names_lock)) {
+        OPENSSL_free(copy);
+        return 0;
+    }
+    if ((kn = name_find(ctx, name)) == NULL) {
+        if ((kn = OPENSSL_zalloc(sizeof(*kn))) == NULL
+            || (kn->name = OPENSSL_strdup(name)) == NULL) {
+            OPENSSL_free(kn);
+            CRYPTO_THREAD_unlock(ctx->names_lock);
+            OPENSSL_free(copy);
+            goto memerr;
+        }
+        kn->next = ctx->names;
+        ctx->names = kn;
+    } else if (kn->current != NULL) {
+        CRYPTO_THREAD_unlock(ctx->names_lock);
+        OPENSSL_free(copy);
+        PKCS11err(PKCS11_F_PKCS11_KEY_NAME_SET, PKCS11_R_KEY_MISMATCH);
+        return 0;
+    }
+    OPENSSL_free(kn->uri);
+    kn->uri = copy;
+    CRYPTO_THREAD_unlock(ctx->names_lock);
+    PKCS11_trace("Key name %s deferred to %s\n", name, uri);
+    return 1;
+
+ memerr:
+    PKCS11err(PKCS11_F_PKCS11_KEY_NAME_SET, ERR_R_MALLOC_FAILURE);
+    return 0;
+}
+
+/**
+ * The URI a deferred name is still to load.
+ * @param ctx
+ * @param name
+ * @return a copy to free, or NULL if the name points at a key or is not
+ *         known
+ */
+char *pkcs11_key_name_uri(PKCS11_CTX *ctx, const char *name)
+{
+    PKCS11_KEY_NAME *kn;
+    char *uri = NULL;
+
+    if (!CRYPTO_THREAD_read_lock(ctx->names_lock))
+        return NULL;
+    if ((kn = name_find(ctx, name)) != NULL && kn->uri != NULL)
+        uri = OPENSSL_strdup(kn->uri);
+    CRYPTO_THREAD_unlock(ctx->names_lock);
+    return uri;
+}
+
+/**
+ * Free the names, once no key of the engine is left.
+ * @param ctx
+ */
+void pkcs11_key_names_free(PKCS11_CTX *ctx)
+{
+    PKCS11_KEY_NAME *kn;
+
+    while ((kn = ctx->names) != NULL) {
+        ctx->names = kn->next;
+        name_free(kn);
+    }
+}
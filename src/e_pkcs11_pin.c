@@ -0,0 +1,476 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * PIN vault.  The engine keeps one PIN per token, found by the token's
+ * serial number, in pages locked in memory and left out of core dumps,
+ * and wipes them when it is destroyed.  A PIN is read once, from the
+ * pin-value or pin-source (file:, env: or fd:) of the URI or else from
+ * the UI, when the first key of its token is loaded; every later load,
+ * login and context specific login of the token takes it from the vault,
+ * so loading many keys costs one prompt and no repeated file reads.  The
+ * PIN ctrl is kept there too, for the tokens the vault has no PIN of.
+ */
+
+/* Required for secure_getenv */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/ui.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+# include <unistd.h>
+# include <sys/mman.h>
+# define PKCS11_PIN_MMAP
+#endif
+
+/**
+ * Set up the locks of a vault; its memory is only taken for the first PIN.
+ * @param vault
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_pin_vault_init(PKCS11_PIN_VAULT *vault)
+{
+    if (vault->lock == NULL
+        && (vault->lock = CRYPTO_THREAD_lock_new()) == NULL)
+        return 0;
+    if (vault->fill_lock == NULL
+        && (vault->fill_lock = CRYPTO_THREAD_lock_new()) == NULL)
+        return 0;
+    return 1;
+}
+
+/**
+ * Wipe the PINs and free the vault.
+ * @param vault
+ */
+void pkcs11_pin_vault_free(PKCS11_PIN_VAULT *vault)
+{
+    if (vault->pins != NULL) {
+        OPENSSL_cleanse(vault->pins, vault->size);
+#ifdef PKCS11_PIN_MMAP
+        if (vault->mapped) {
+            munlock(vault->pins, vault->size);
+            munmap(vault->pins, vault->size);
+        } else
+#endif
+            OPENSSL_free(vault->pins);
+    }
+    CRYPTO_THREAD_lock_free(vault->lock);
+    CRYPTO_THREAD_lock_free(vault->fill_lock);
+    memset(vault, 0, sizeof(*vault));
+}
+
+/* The entries, in locked pages if possible; called with the lock held */
+static int vault_map(PKCS11_PIN_VAULT *vault)
+{
+    size_t size = sizeof(PKCS11_PIN) * PKCS11_PIN_TOKENS;
+
+    if (vault->pins != NULL)
+        return 1;
+#ifdef PKCS11_PIN_MMAP
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        void *p;
+
+        if (page > 0)
+            size = (size + page - 1) / page * page;
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            if (mlock(p, size) != 0)
+                PKCS11_trace("Cannot lock the PIN vault in memory\n");
+# ifdef MADV_DONTDUMP
+            madvise(p, size, MADV_DONTDUMP);
+# endif
+            vault->pins = p;
+            vault->size = size;
+            vault->mapped = 1;
+            return 1;
+        }
+    }
+#endif
+    if ((vault->pins = OPENSSL_zalloc(size)) == NULL)
+        return 0;
+    vault->size = size;
+    return 1;
+}
+
+/* The PIN of the token in |slotid|, else the PIN ctrl; lock held */
+static PKCS11_PIN *vault_find(PKCS11_PIN_VAULT *vault, CK_SLOT_ID slotid)
+{
+    PKCS11_PIN *any = NULL;
+    size_t i;
+
+    if (vault->pins == NULL)
+        return NULL;
+    for (i = 0; i < PKCS11_PIN_TOKENS; i++) {
+        if (!vault->pins[i].used)
+            continue;
+        if (vault->pins[i].any)
+            any = &vault->pins[i];
+        else if (vault->pins[i].bound && vault->pins[i].slotid == slotid)
+            return &vault->pins[i];
+    }
+    return any;
+}
+
+/*
+ * The token of serial number |serial| is in |slotid|: the PIN of another
+ * token seen there is no longer used for the slot, and the PIN of this
+ * one, if kept, is.  Returns the entry of the token, NULL if there is
+ * none; lock held.
+ */
+static PKCS11_PIN *vault_bind(PKCS11_PIN_VAULT *vault, CK_SLOT_ID slotid,
+                              const CK_CHAR *serial)
+{
+    PKCS11_PIN *p, *found = NULL;
+    size_t i;
+
+    if (vault->pins == NULL)
+        return NULL;
+    for (i = 0; i < PKCS11_PIN_TOKENS; i++) {
+        p = &vault->pins[i];
+        if (!p->used || p->any)
+            continue;
+        if (memcmp(p->serial, serial, sizeof(p->serial)) == 0) {
+            p->slotid = slotid;
+            p->bound = 1;
+            found = p;
+        } else if (p->bound && p->slotid == slotid) {
+            PKCS11_trace("Another token in slot %lu, its PIN is not used\n",
+                         slotid);
+            p->bound = 0;
+        }
+    }
+    return found;
+}
+
+/*
+ * The entry of the token seen in |slotid| last, NULL if the vault has no
+ * PIN for it; lock held.
+ */
+static PKCS11_PIN *vault_bound(PKCS11_PIN_VAULT *vault, CK_SLOT_ID slotid)
+{
+    size_t i;
+
+    for (i = 0; vault->pins != NULL && i < PKCS11_PIN_TOKENS; i++)
+        if (vault->pins[i].used && !vault->pins[i].any
+            && vault->pins[i].bound && vault->pins[i].slotid == slotid)
+            return &vault->pins[i];
+    return NULL;
+}
+
+/*
+ * Keep |pin| for the token of serial number |serial| in |slotid|, or for
+ * every token if |any|.  An entry of the same token is replaced.
+ */
+static int vault_store(PKCS11_PIN_VAULT *vault, int any, CK_SLOT_ID slotid,
+                       const CK_CHAR *serial, const void *pin, size_t len)
+{
+    PKCS11_PIN *p, *free_entry = NULL, *found = NULL;
+    size_t i;
+    int ok = 0;
+
+    if (len >= PKCS11_PIN_MAX) {
+        PKCS11_trace("PIN too long\n");
+        return 0;
+    }
+    if (!CRYPTO_THREAD_write_lock(vault->lock))
+        return 0;
+    if (!vault_map(vault))
+        goto end;
+    if (!any)
+        found = vault_bind(vault, slotid, serial);
+    for (i = 0; i < PKCS11_PIN_TOKENS && found == NULL; i++) {
+        p = &vault->pins[i];
+        if (!p->used) {
+            if (free_entry == NULL)
+                free_entry = p;
+        } else if (any && p->any) {
+            found = p;
+        }
+    }
+    if ((p = found != NULL ? found : free_entry) == NULL) {
+        PKCS11_trace("PIN vault full\n");
+        goto end;
+    }
+    OPENSSL_cleanse(p, sizeof(*p));
+    p->used = 1;
+    p->any = any;
+    if (!any) {
+        memcpy(p->serial, serial, sizeof(p->serial));
+        p->slotid = slotid;
+        p->bound = 1;
+    }
+    memcpy(p->pin, pin, len);
+    p->len = (CK_ULONG)len;
+    ok = 1;
+
+ end:
+    CRYPTO_THREAD_unlock(vault->lock);
+    return ok;
+}
+
+/**
+ * Keep the PIN ctrl, the PIN of every token the vault has none for.
+ * @param ctx
+ * @param pin
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_pin_set_default(PKCS11_CTX *ctx, const char *pin)
+{
+    return pkcs11_pin_vault_init(&ctx->vault)
+           && vault_store(&ctx->vault, 1, 0, NULL, pin, strlen(pin));
+}
+
+/**
+ * Whether the vault has a PIN for the token in a slot.
+ * @param ctx
+ * @param slotid
+ * @return 1 if it has, 0 if not
+ */
+int pkcs11_pin_known(PKCS11_CTX *ctx, CK_SLOT_ID slotid)
+{
+    int known;
+
+    if (ctx->vault.lock == NULL || !CRYPTO_THREAD_read_lock(ctx->vault.lock))
+        return 0;
+    known = vault_find(&ctx->vault, slotid) != NULL;
+    CRYPTO_THREAD_unlock(ctx->vault.lock);
+    return known;
+}
+
+/**
+ * Copy out the PIN of the token in a slot, for a login.  The caller
+ * wipes it once done.
+ * @param ctx
+ * @param slotid
+ * @param pin at least PKCS11_PIN_MAX bytes
+ * @param len
+ * @return 1 on success, 0 if the vault has no PIN for the token
+ */
+int pkcs11_pin_get(PKCS11_CTX *ctx, CK_SLOT_ID slotid, CK_UTF8CHAR *pin,
+                   CK_ULONG *len)
+{
+    PKCS11_PIN *p;
+    int found = 0;
+
+    if (ctx->vault.lock == NULL || !CRYPTO_THREAD_read_lock(ctx->vault.lock))
+        return 0;
+    if ((p = vault_find(&ctx->vault, slotid)) != NULL) {
+        memcpy(pin, p->pin, p->len);
+        *len = p->len;
+        found = 1;
+    }
+    CRYPTO_THREAD_unlock(ctx->vault.lock);
+    return found;
+}
+
+/**
+ * Wipe the PIN a token refused, so that it is never tried again and the
+ * next key load asks for it anew.
+ * @param ctx
+ * @param slotid
+ */
+void pkcs11_pin_forget(PKCS11_CTX *ctx, CK_SLOT_ID slotid)
+{
+    PKCS11_PIN *p;
+
+    if (ctx->vault.lock == NULL || !CRYPTO_THREAD_write_lock(ctx->vault.lock))
+        return;
+    if ((p = vault_find(&ctx->vault, slotid)) != NULL)
+        OPENSSL_cleanse(p, sizeof(*p));
+    CRYPTO_THREAD_unlock(ctx->vault.lock);
+}
+
+/* The first line of a file, of the environment or of an inherited fd */
+static int pin_from_source(const char *source, char *buf, size_t size)
+{
+    const char *val;
+    size_t len = 0;
+    BIO *in = NULL;
+    int n;
+
+    if (strncmp(source, "file:", 5) == 0) {
+        if ((in = BIO_new_file(source + 5, "r")) == NULL)
+            goto err;
+        n = BIO_gets(in, buf, (int)size);
+        BIO_free(in);
+        if (n <= 0)
+            goto err;
+    } else if (strncmp(source, "env:", 4) == 0) {
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+# if __GLIBC_PREREQ(2, 17)
+        val = secure_getenv(source + 4);
+# else
+        val = getenv(source + 4);
+# endif
+#else
+        val = getenv(source + 4);
+#endif
+        if (val == NULL || strlen(val) >= size)
+            goto err;
+        strcpy(buf, val);
+#ifdef PKCS11_PIN_MMAP
+    } else if (strncmp(source, "fd:", 3) == 0) {
+        /* a pipe can be read only once, which is all the vault needs */
+        int fd = atoi(source + 3);
+        ssize_t r;
+
+        while (len < size - 1
+               && (r = read(fd, buf + len, size - 1 - len)) > 0)
+            len += r;
+        close(fd);
+        if (len == 0)
+            goto err;
+        buf[len] = '\0';
+#endif
+    } else {
+        PKCS11_trace("Unsupported pin-source %s\n", source);
+        return 0;
+    }
+    buf[strcspn(buf, "\r\n")] = '\0';
+    return 1;
+
+ err:
+    PKCS11_trace("Can't read PIN from %s\n", source);
+    return 0;
+}
+
+/* Ask the user for the PIN of the token labelled |label| */
+static int pin_from_ui(PKCS11_CTX *ctx, const char *label, char *buf,
+                       size_t size)
+{
+    UI *ui;
+    char *prompt = NULL;
+    int ok = 0;
+
+    if ((ui = UI_new()) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_GET_CONSOLE_PIN, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    if (ctx->ui_method != NULL)
+        UI_set_method(ui, ctx->ui_method);
+    UI_add_user_data(ui, ctx->callback_data);
+
+    if ((prompt = UI_construct_prompt(ui, "PIN", label)) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_GET_CONSOLE_PIN, ERR_R_MALLOC_FAILURE);
+    } else if (UI_add_input_string(ui, prompt, UI_INPUT_FLAG_DEFAULT_PWD,
+                                   buf, 0, (int)size - 1) < 0) {
+        PKCS11_trace("ERR UI_LIB\n");
+    } else {
+        switch (UI_process(ui)) {
+        case -2:
+            PKCS11_trace("PROCESS INTERRUPTED \n");
+            break;
+        case -1:
+            PKCS11_trace("ERR UI_LIB\n");
+            break;
+        default:
+            ok = 1;
+            break;
+        }
+    }
+
+    OPENSSL_free(prompt);
+    UI_free(ui);
+    return ok;
+}
+
+/* |field| without the blank padding of CK_TOKEN_INFO */
+static void pin_trim(char *out, const CK_UTF8CHAR *field, size_t len)
+{
+    while (len > 0 && field[len - 1] == ' ')
+        len--;
+    memcpy(out, field, len);
+    out[len] = '\0';
+}
+
+/**
+ * Make sure the vault has the PIN of the token in ctx->slotid before a
+ * key of the URI just parsed is loaded.  PINs are kept by the serial
+ * number of their token, read here: a token found in another slot than
+ * before takes its PIN along, and another token in a slot does not get
+ * the PIN of the one seen there before.  A pin-value replaces the PIN of
+ * the token; otherwise a token the vault has no PIN of, for a URI of a
+ * private object, has its PIN read from the pin-source or asked for, once
+ * whatever the number of threads loading its keys.
+ * @param ctx
+ * @return 1 on success, 0 if no PIN could be had
+ */
+int pkcs11_pin_fill(PKCS11_CTX *ctx)
+{
+    PKCS11_PIN_VAULT *vault = &ctx->vault;
+    CK_TOKEN_INFO info;
+    char buf[PKCS11_PIN_MAX], label[sizeof(info.label) + 1];
+    PKCS11_PIN *p;
+    int ok = 0, known = 0, bound = 0, same = 0;
+
+    if (!pkcs11_pin_vault_init(vault))
+        goto memerr;
+    if (!CRYPTO_THREAD_read_lock(vault->lock))
+        return 0;
+    if ((p = vault_bound(vault, ctx->slotid)) != NULL) {
+        bound = 1;
+        same = ctx->pin != NULL && p->len == ctx->pinlen
+               && CRYPTO_memcmp(p->pin, ctx->pin, ctx->pinlen) == 0;
+    }
+    CRYPTO_THREAD_unlock(vault->lock);
+    /*
+     * Nothing to send to the token, nor to keep from it; a pin-value the
+     * vault has for the slot is sent to whatever token the URI selects.
+     */
+    if (same || (ctx->pin == NULL && !ctx->need_pin && !bound))
+        return 1;
+
+    if (pkcs11_get_token_info(ctx->slotid, &info) != CKR_OK)
+        goto end;
+    if (ctx->pin != NULL)
+        return vault_store(vault, 0, ctx->slotid, info.serialNumber,
+                           ctx->pin, ctx->pinlen);
+    if (!CRYPTO_THREAD_write_lock(vault->lock))
+        return 0;
+    known = vault_bind(vault, ctx->slotid, info.serialNumber) != NULL;
+    CRYPTO_THREAD_unlock(vault->lock);
+    if (known || !ctx->need_pin || pkcs11_pin_known(ctx, ctx->slotid))
+        return 1;
+
+    if (!CRYPTO_THREAD_write_lock(vault->fill_lock))
+        return 0;
+    /* filled by another thread while this one waited */
+    if (pkcs11_pin_known(ctx, ctx->slotid)) {
+        ok = 1;
+        goto unlock;
+    }
+    pin_trim(label, info.label, sizeof(info.label));
+    if (ctx->pin_source != NULL ? pin_from_source(ctx->pin_source, buf,
+                                                  sizeof(buf))
+                                : pin_from_ui(ctx, label, buf, sizeof(buf)))
+        ok = vault_store(vault, 0, ctx->slotid, info.serialNumber, buf,
+                         strlen(buf));
+    OPENSSL_cleanse(buf, sizeof(buf));
+
+ unlock:
+    CRYPTO_THREAD_unlock(vault->fill_lock);
+ end:
+    if (!ok)
+        PKCS11err(PKCS11_F_PKCS11_PIN_FILL, PKCS11_R_PIN_UNAVAILABLE);
+    return ok;
+
+ memerr:
+    PKCS11err(PKCS11_F_PKCS11_PIN_FILL, ERR_R_MALLOC_FAILURE);
+    return 0;
+}
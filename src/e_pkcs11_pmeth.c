@@ -0,0 +1,355 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * EVP_PKEY_METHOD of the engine's RSA keys: OpenSSL's own, with a
+ * digest_custom and a signctx hook.  With TOKEN_DIGEST set, an
+ * EVP_DigestSign() of a token key with PKCS#1 v1.5 padding is not hashed
+ * here: the data goes to the token in large C_SignUpdate() chunks under
+ * the hash-and-sign mechanism of the digest (CKM_SHA256_RSA_PKCS, ...)
+ * and C_SignFinal() returns the signature, which is all that qualified
+ * signature cards refusing CKM_RSA_PKCS accept.  Everything else is
+ * hashed here and signed through the RSA_METHOD as before.
+ */
+
+#include <string.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+
+/* A token hash-and-sign under way, from the first update to the final */
+typedef struct PKCS11_DIGEST_SIGN_st {
+    EVP_PKEY_CTX *pctx;         /* of the EVP_MD_CTX, what it is found by */
+    PKCS11_CTX *ctx;
+    PKCS11_KEY key;
+    CK_SESSION_HANDLE session;
+    int ops;                    /* of pkcs11_key_ops_enter() */
+    int failed;                 /* the token ended the operation */
+    unsigned long flags;        /* of the EVP_MD_CTX before the operation */
+    int (*update)(EVP_MD_CTX *ctx, const void *data, size_t count);
+    unsigned char *buf;         /* small updates, gathered into a chunk */
+    size_t nbuf;
+    struct PKCS11_DIGEST_SIGN_st *next;
+} PKCS11_DIGEST_SIGN;
+
+static EVP_PKEY_METHOD *pkcs11_rsa_pmeth = NULL;
+static const int pkcs11_pmeth_nids[] = { EVP_PKEY_RSA };
+
+static int (*rsa_pmeth_sign)(EVP_PKEY_CTX *ctx, unsigned char *sig,
+                             size_t *siglen, const unsigned char *tbs,
+                             size_t tbslen);
+static int (*rsa_pmeth_ctrl)(EVP_PKEY_CTX *ctx, int type, int p1, void *p2);
+static void (*rsa_pmeth_cleanup)(EVP_PKEY_CTX *ctx);
+
+/* only guards |digest_signs|, never held across a module call */
+static CRYPTO_RWLOCK *digest_sign_lock = NULL;
+static PKCS11_DIGEST_SIGN *digest_signs = NULL;
+
+static int pkcs11_hash_sign_mechanism(const EVP_MD *md,
+                                      CK_MECHANISM_TYPE *mechanism)
+{
+    if (md == NULL)
+        return 0;
+    switch (EVP_MD_get_type(md)) {
+    case NID_sha1:
+        *mechanism = CKM_SHA1_RSA_PKCS;
+        return 1;
+    case NID_sha224:
+        *mechanism = CKM_SHA224_RSA_PKCS;
+        return 1;
+    case NID_sha256:
+        *mechanism = CKM_SHA256_RSA_PKCS;
+        return 1;
+    case NID_sha384:
+        *mechanism = CKM_SHA384_RSA_PKCS;
+        return 1;
+    case NID_sha512:
+        *mechanism = CKM_SHA512_RSA_PKCS;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Find the token operation of an EVP_PKEY_CTX.
+ * @param pctx
+ * @param remove take it off the list as well
+ * @return the operation or NULL if |pctx| has none
+ */
+static PKCS11_DIGEST_SIGN *digest_sign_find(EVP_PKEY_CTX *pctx, int remove)
+{
+    PKCS11_DIGEST_SIGN **p, *ds = NULL;
+    int locked;
+
+    locked = remove ? CRYPTO_THREAD_write_lock(digest_sign_lock)
+                    : CRYPTO_THREAD_read_lock(digest_sign_lock);
+    if (!locked)
+        return NULL;
+    for (p = &digest_signs; *p != NULL; p = &(*p)->next) {
+        if ((*p)->pctx == pctx) {
+            ds = *p;
+            if (remove)
+                *p = ds->next;
+            break;
+        }
+    }
+    CRYPTO_THREAD_unlock(digest_sign_lock);
+    return ds;
+}
+
+/* Free an operation that is off the list, ending it if still open */
+static void digest_sign_free(PKCS11_DIGEST_SIGN *ds, int open)
+{
+    if (open) {
+        pkcs11_key_ops_leave(ds->ctx, ds->ops);
+        pkcs11_session_put(ds->ctx, ds->key.slotid, ds->session, 0);
+    }
+    OPENSSL_clear_free(ds->buf, PKCS11_SIGN_CHUNK);
+    OPENSSL_free(ds);
+}
+
+static int digest_sign_flush(PKCS11_DIGEST_SIGN *ds)
+{
+    size_t n = ds->nbuf;
+
+    ds->nbuf = 0;
+    if (n > 0 && !pkcs11_digest_sign_update(ds->session, ds->buf, n))
+        ds->failed = 1;
+    return !ds->failed;
+}
+
+/*
+ * EVP_DigestSignUpdate() of a token operation.  Writes of a chunk or more
+ * go to the token as they are, smaller ones are gathered first so that
+ * the token is not called for every few bytes.
+ */
+static int pkcs11_digest_update(EVP_MD_CTX *mctx, const void *data,
+                                size_t count)
+{
+    PKCS11_DIGEST_SIGN *ds;
+    const unsigned char *p = data;
+    size_t n;
+
+    if ((ds = digest_sign_find(EVP_MD_CTX_pkey_ctx(mctx), 0)) == NULL
+        || ds->failed)
+        return 0;
+
+    while (count > 0) {
+        if (ds->nbuf == 0 && count >= PKCS11_SIGN_CHUNK) {
+            if (!pkcs11_digest_sign_update(ds->session, p, count))
+                ds->failed = 1;
+            return !ds->failed;
+        }
+        if (ds->buf == NULL
+            && (ds->buf = OPENSSL_malloc(PKCS11_SIGN_CHUNK)) == NULL) {
+            PKCS11err(PKCS11_F_PKCS11_DIGEST_SIGN, ERR_R_MALLOC_FAILURE);
+            return 0;
+        }
+        n = PKCS11_SIGN_CHUNK - ds->nbuf;
+        if (n > count)
+            n = count;
+        memcpy(ds->buf + ds->nbuf, p, n);
+        ds->nbuf += n;
+        p += n;
+        count -= n;
+        if (ds->nbuf == PKCS11_SIGN_CHUNK && !digest_sign_flush(ds))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Whether nothing was hashed into |mctx| yet.  Data written with a plain
+ * EVP_DigestUpdate(), as a BIO_f_md() does, reaches the host digest
+ * without going through EVP_DigestSignUpdate() and so before the first
+ * pkcs11_digest_custom() call; such an operation must stay on the host.
+ */
+static int digest_untouched(EVP_MD_CTX *mctx, const EVP_MD *md)
+{
+    EVP_MD_CTX *tmp;
+    unsigned char hashed[EVP_MAX_MD_SIZE], empty[EVP_MAX_MD_SIZE];
+    unsigned int hlen = 0, elen = 0;
+    int ok;
+
+    ok = (tmp = EVP_MD_CTX_new()) != NULL
+         && EVP_MD_CTX_copy_ex(tmp, mctx)
+         && EVP_DigestFinal_ex(tmp, hashed, &hlen)
+         && EVP_Digest(NULL, 0, empty, &elen, md, NULL)
+         && hlen == elen && memcmp(hashed, empty, hlen) == 0;
+    EVP_MD_CTX_free(tmp);
+    return ok;
+}
+
+/*
+ * Called by OpenSSL before the first data of an EVP_DigestSign*(), when
+ * the padding and the digest are final: start the operation on the token
+ * and divert the data to it, or leave the EVP_MD_CTX to hash here.
+ */
+static int pkcs11_digest_custom(EVP_PKEY_CTX *pctx, EVP_MD_CTX *mctx)
+{
+    PKCS11_DIGEST_SIGN *ds;
+    PKCS11_CTX *ctx;
+    PKCS11_KEY key;
+    const RSA *rsa;
+    const EVP_MD *md = NULL;
+    CK_MECHANISM_TYPE mechanism;
+    int padding = 0;
+
+    if (EVP_PKEY_CTX_get_operation(pctx) != EVP_PKEY_OP_SIGN
+        || (rsa = EVP_PKEY_get0_RSA(EVP_PKEY_CTX_get0_pkey(pctx))) == NULL
+        || !pkcs11_key_get(rsa, &key)
+        || (ctx = pkcs11_get_ctx(rsa)) == NULL || !ctx->token_digest)
+        return 1;
+    if (rsa_pmeth_ctrl(pctx, EVP_PKEY_CTRL_GET_RSA_PADDING, 0, &padding) <= 0
+        || padding != RSA_PKCS1_PADDING
+        || rsa_pmeth_ctrl(pctx, EVP_PKEY_CTRL_GET_MD, 0, &md) <= 0
+        || !pkcs11_hash_sign_mechanism(md, &mechanism)
+        || !digest_untouched(mctx, md))
+        return 1;
+
+    if ((ds = OPENSSL_zalloc(sizeof(*ds))) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_DIGEST_SIGN, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    ds->pctx = pctx;
+    ds->ctx = ctx;
+    if (!pkcs11_digest_sign_init(ctx, rsa, &key, mechanism, &ds->session,
+                                 &ds->ops)) {
+        OPENSSL_free(ds);
+        return 0;
+    }
+    ds->key = key;
+
+    /*
+     * The data skips the host digest, and the final must see this very
+     * EVP_MD_CTX rather than a copy: the token cannot sign twice.
+     */
+    ds->flags = EVP_MD_CTX_test_flags(mctx, EVP_MD_CTX_FLAG_NO_INIT
+                                            | EVP_MD_CTX_FLAG_FINALISE);
+    ds->update = EVP_MD_CTX_update_fn(mctx);
+    EVP_MD_CTX_set_flags(mctx, EVP_MD_CTX_FLAG_NO_INIT
+                               | EVP_MD_CTX_FLAG_FINALISE);
+    EVP_MD_CTX_set_update_fn(mctx, pkcs11_digest_update);
+
+    if (!CRYPTO_THREAD_write_lock(digest_sign_lock)) {
+        digest_sign_free(ds, 1);
+        return 0;
+    }
+    ds->next = digest_signs;
+    digest_signs = ds;
+    CRYPTO_THREAD_unlock(digest_sign_lock);
+    return 1;
+}
+
+/* EVP_DigestSignFinal(), on the token or hashed here */
+static int pkcs11_signctx(EVP_PKEY_CTX *pctx, unsigned char *sig,
+                          size_t *siglen, EVP_MD_CTX *mctx)
+{
+    PKCS11_DIGEST_SIGN *ds;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+    int ret;
+
+    if (sig == NULL) {
+        *siglen = EVP_PKEY_get_size(EVP_PKEY_CTX_get0_pkey(pctx));
+        return 1;
+    }
+
+    if ((ds = digest_sign_find(pctx, 1)) == NULL)
+        return EVP_DigestFinal_ex(mctx, md, &mdlen)
+               && rsa_pmeth_sign(pctx, sig, siglen, md, mdlen) > 0;
+
+    EVP_MD_CTX_clear_flags(mctx, (EVP_MD_CTX_FLAG_NO_INIT
+                                  | EVP_MD_CTX_FLAG_FINALISE) & ~ds->flags);
+    EVP_MD_CTX_set_update_fn(mctx, ds->update);
+
+    if (!digest_sign_flush(ds)) {
+        digest_sign_free(ds, 1);
+        return 0;
+    }
+    ret = pkcs11_digest_sign_final(ds->ctx, &ds->key, ds->session, ds->ops,
+                                   sig, siglen);
+    digest_sign_free(ds, 0);
+    return ret;
+}
+
+static void pkcs11_pmeth_cleanup(EVP_PKEY_CTX *pctx)
+{
+    PKCS11_DIGEST_SIGN *ds;
+
+    /* abandoned before its final */
+    if ((ds = digest_sign_find(pctx, 1)) != NULL)
+        digest_sign_free(ds, 1);
+    rsa_pmeth_cleanup(pctx);
+}
+
+/**
+ * Build the engine's RSA EVP_PKEY_METHOD from OpenSSL's.
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_pmeth_init(void)
+{
+    const EVP_PKEY_METHOD *rsa_pmeth;
+    int (*sign_init)(EVP_PKEY_CTX *ctx);
+    int (*ctrl_str)(EVP_PKEY_CTX *ctx, const char *type, const char *value);
+
+    if (pkcs11_rsa_pmeth != NULL)
+        return 1;
+    if ((rsa_pmeth = EVP_PKEY_meth_find(EVP_PKEY_RSA)) == NULL
+        || (digest_sign_lock = CRYPTO_THREAD_lock_new()) == NULL
+        || (pkcs11_rsa_pmeth = EVP_PKEY_meth_new(EVP_PKEY_RSA,
+                                   EVP_PKEY_FLAG_AUTOARGLEN)) == NULL) {
+        PKCS11err(PKCS11_F_BIND_PKCS11, PKCS11_R_RSA_INIT_FAILED);
+        EVP_PKEY_meth_free(pkcs11_rsa_pmeth);
+        pkcs11_pmeth_free();
+        return 0;
+    }
+
+    EVP_PKEY_meth_copy(pkcs11_rsa_pmeth, rsa_pmeth);
+    EVP_PKEY_meth_get_sign(rsa_pmeth, &sign_init, &rsa_pmeth_sign);
+    EVP_PKEY_meth_get_ctrl(rsa_pmeth, &rsa_pmeth_ctrl, &ctrl_str);
+    EVP_PKEY_meth_get_cleanup(rsa_pmeth, &rsa_pmeth_cleanup);
+
+    /* no signctx_init, the signature itself is initialised as usual */
+    EVP_PKEY_meth_set_signctx(pkcs11_rsa_pmeth, NULL, pkcs11_signctx);
+    EVP_PKEY_meth_set_digest_custom(pkcs11_rsa_pmeth, pkcs11_digest_custom);
+    EVP_PKEY_meth_set_cleanup(pkcs11_rsa_pmeth, pkcs11_pmeth_cleanup);
+    return 1;
+}
+
+/* The method itself is freed by ENGINE_free() with the engine's others */
+void pkcs11_pmeth_free(void)
+{
+    pkcs11_rsa_pmeth = NULL;
+    CRYPTO_THREAD_lock_free(digest_sign_lock);
+    digest_sign_lock = NULL;
+}
+
+/**
+ * ENGINE_set_pkey_meths() callback.
+ * @param e
+ * @param pmeth NULL to list the methods in |nids|
+ * @param nids
+ * @param nid
+ * @return the number of nids, or 1 if the method of |nid| was found
+ */
+int pkcs11_pkey_meths(ENGINE *e, EVP_PKEY_METHOD **pmeth, const int **nids,
+                      int nid)
+{
+    if (pmeth == NULL) {
+        *nids = pkcs11_pmeth_nids;
+        return sizeof(pkcs11_pmeth_nids) / sizeof(pkcs11_pmeth_nids[0]);
+    }
+    if (nid == EVP_PKEY_RSA && pkcs11_rsa_pmeth != NULL) {
+        *pmeth = pkcs11_rsa_pmeth;
+        return 1;
+    }
+    *pmeth = NULL;
+    return 0;
+}
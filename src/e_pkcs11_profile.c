@@ -0,0 +1,411 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Module profiles.  Modules differ in what they do well and in what they
+ * get wrong, so the settings the engine drives a module with come from the
+ * first profile matching its CK_INFO and the token's CK_TOKEN_INFO, picked
+ * when the first key or store is opened:
+ *
+ *  - the locking the module is initialized with: its own, or the engine's
+ *    mutexes for a module whose CKF_OS_LOCKING_OK support is broken;
+ *  - the RSA mechanism: CKM_RSA_PKCS, or CKM_RSA_X_509 with the PKCS#1
+ *    v1.5 padding done here;
+ *  - whether CKA_ALWAYS_AUTHENTICATE is read from the key or assumed;
+ *  - how many operations may be under way on one key object;
+ *  - how many handles a store listing asks for per C_FindObjects;
+ *  - after how long an idle pooled session is checked before it is used,
+ *    for modules whose sessions time out.
+ *
+ * PROFILE_FILE adds profiles that are tried before the built-in ones, one
+ * per line:
+ *
+ *   <name>: manufacturer=<prefix>; library=<prefix>; model=<prefix>;
+ *           os_locking=yes|no; mechanism=rsa_pkcs|rsa_x509;
+ *           always_auth=read|never|always; key_ops=<n>; find_batch=<n>;
+ *           keepalive=<ms>
+ *
+ * Any setting may be left out, the defaults are those of the "default"
+ * profile; lines starting with '#' are comments.  PROFILE picks a profile
+ * by name instead of by matching.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+
+/* From the most specific to the least, "default" matches any module */
+static const PKCS11_PROFILE profile_builtin[] = {
+    /* a software token: large batches cost nothing */
+    {"softhsm", "SoftHSM", NULL, NULL,
+     1, 0, PKCS11_AUTH_READ, 0, PKCS11_FIND_BATCH_MAX, 0},
+    /* smart cards and USB tokens work on one operation at a time */
+    {"opensc", "OpenSC", NULL, NULL,
+     1, 0, PKCS11_AUTH_READ, 1, PKCS11_FIND_BATCH, 0},
+    /* the connector closes sessions idle for 30 seconds */
+    {"yubihsm", "Yubico", "YubiHSM", NULL,
+     1, 0, PKCS11_AUTH_READ, 0, PKCS11_FIND_BATCH, 20000},
+    {"default", NULL, NULL, NULL,
+     1, 0, PKCS11_AUTH_READ, 0, PKCS11_FIND_BATCH, 0},
+};
+
+#define PROFILE_BUILTIN (sizeof(profile_builtin) / sizeof(profile_builtin[0]))
+
+/**
+ * The settings of the "default" profile.
+ * @param profile
+ */
+void pkcs11_profile_default(PKCS11_PROFILE *profile)
+{
+    *profile = profile_builtin[PROFILE_BUILTIN - 1];
+}
+
+/* Whether a blank padded CK_INFO or CK_TOKEN_INFO field starts with |p| */
+static int profile_prefix(const CK_UTF8CHAR *field, size_t size,
+                          const char *p)
+{
+    size_t len;
+
+    if (p == NULL)
+        return 1;
+    len = strlen(p);
+    return len <= size && memcmp(field, p, len) == 0;
+}
+
+static const PKCS11_PROFILE *profile_find(PKCS11_CTX *ctx, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->nprofiles; i++)
+        if (strcmp(ctx->profiles[i].name, name) == 0)
+            return &ctx->profiles[i];
+    for (i = 0; i < PROFILE_BUILTIN; i++)
+        if (strcmp(profile_builtin[i].name, name) == 0)
+            return &profile_builtin[i];
+    return NULL;
+}
+
+/*
+ * The first profile for the module and the token in |slotid|.  The token
+ * is only asked for its CK_TOKEN_INFO by a profile that needs it.
+ */
+static const PKCS11_PROFILE *profile_match(PKCS11_CTX *ctx,
+                                           const CK_INFO *info,
+                                           CK_SLOT_ID slotid)
+{
+    const PKCS11_PROFILE *p;
+    CK_TOKEN_INFO token;
+    int have_token = 0;
+    size_t i;
+
+    for (i = 0; i < ctx->nprofiles + PROFILE_BUILTIN; i++) {
+        p = i < ctx->nprofiles ? &ctx->profiles[i]
+                               : &profile_builtin[i - ctx->nprofiles];
+        if (!profile_prefix(info->manufacturerID,
+                            sizeof(info->manufacturerID), p->manufacturer)
+            || !profile_prefix(info->libraryDescription,
+                               sizeof(info->libraryDescription), p->library))
+            continue;
+        if (p->model != NULL && have_token == 0)
+            have_token = pkcs11_get_token_info(slotid, &token) == CKR_OK
+                         ? 1 : -1;
+        if (p->model != NULL
+            && (have_token < 0
+                || !profile_prefix(token.model, sizeof(token.model),
+                                   p->model)))
+            continue;
+        return p;
+    }
+    return &profile_builtin[PROFILE_BUILTIN - 1];
+}
+
+/* Have the profile chosen again at the next slot lookup */
+static void profile_reselect(PKCS11_CTX *ctx)
+{
+    if (!CRYPTO_THREAD_write_lock(ctx->lock))
+        return;
+    ctx->profile_chosen = 0;
+    CRYPTO_THREAD_unlock(ctx->lock);
+}
+
+/* Start using |p|, with nothing under way on the module meanwhile */
+static int profile_apply(PKCS11_CTX *ctx, const PKCS11_PROFILE *p)
+{
+    PKCS11_POOL *pool;
+    unsigned int gen;
+    int ret;
+
+    if (!pkcs11_module_hold(PKCS11_RELOAD_WAIT_MS)) {
+        /* tried again at the next slot lookup */
+        PKCS11_trace("Module busy, profile %s not applied yet\n", p->name);
+        profile_reselect(ctx);
+        return 1;
+    }
+    ctx->profile = *p;
+    gen = pkcs11_module_generation();
+    ret = pkcs11_module_relock(p->os_locking);
+    if (gen != pkcs11_module_generation()
+        && CRYPTO_THREAD_write_lock(ctx->lock)) {
+        /* C_Finalize closed the pooled sessions */
+        for (pool = ctx->pools; pool != NULL; pool = pool->next) {
+            pool->nidle = 0;
+            pool->logged_in = 0;
+        }
+        CRYPTO_THREAD_unlock(ctx->lock);
+    }
+    pkcs11_module_release();
+    PKCS11_trace("Using the %s module profile\n", p->name);
+    return ret;
+}
+
+/**
+ * Pick the profile of the module, or the one PROFILE named, and apply it.
+ * Called once a slot is found, until a profile is chosen.
+ * @param ctx
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_profile_select(PKCS11_CTX *ctx)
+{
+    const PKCS11_PROFILE *p;
+    CK_INFO info;
+    int chosen;
+
+    if (!CRYPTO_THREAD_write_lock(ctx->lock))
+        return 0;
+    chosen = ctx->profile_chosen;
+    ctx->profile_chosen = 1;
+    CRYPTO_THREAD_unlock(ctx->lock);
+    if (chosen)
+        return 1;
+
+    if (ctx->profile_name != NULL) {
+        if ((p = profile_find(ctx, ctx->profile_name)) == NULL) {
+            PKCS11err(PKCS11_F_PKCS11_PROFILE, PKCS11_R_PROFILE_NOT_FOUND);
+            profile_reselect(ctx);
+            return 0;
+        }
+    } else {
+        if (pkcs11_get_info(&info) != CKR_OK)
+            memset(&info, 0, sizeof(info));
+        p = profile_match(ctx, &info, ctx->slotid);
+    }
+    return profile_apply(ctx, p);
+}
+
+/**
+ * PROFILE: use the profile |name| rather than the one matching the module.
+ * @param ctx
+ * @param name
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_profile_set(PKCS11_CTX *ctx, const char *name)
+{
+    char *copy;
+
+    if (name == NULL || profile_find(ctx, name) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_PROFILE, PKCS11_R_PROFILE_NOT_FOUND);
+        return 0;
+    }
+    if ((copy = OPENSSL_strdup(name)) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_PROFILE, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    OPENSSL_free(ctx->profile_name);
+    ctx->profile_name = copy;
+    profile_reselect(ctx);
+    return 1;
+}
+
+/* |s| without the blanks around it, in place */
+static char *profile_trim(char *s)
+{
+    char *end;
+
+    while (*s == ' ' || *s == '\t')
+        s++;
+    end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        end--;
+    *end = '\0';
+    return s;
+}
+
+static int profile_number(const char *v, long max, long *n)
+{
+    char *end;
+
+    *n = strtol(v, &end, 10);
+    return *v != '\0' && *end == '\0' && *n >= 0 && *n <= max;
+}
+
+/* One "key=value" setting of a PROFILE_FILE line */
+static int profile_setting(PKCS11_PROFILE *p, char *k, char *v)
+{
+    long n;
+
+    if (strcmp(k, "manufacturer") == 0) {
+        p->manufacturer = v;
+    } else if (strcmp(k, "library") == 0) {
+        p->library = v;
+    } else if (strcmp(k, "model") == 0) {
+        p->model = v;
+    } else if (strcmp(k, "os_locking") == 0) {
+        if (strcmp(v, "yes") != 0 && strcmp(v, "no") != 0)
+            return 0;
+        p->os_locking = strcmp(v, "yes") == 0;
+    } else if (strcmp(k, "mechanism") == 0) {
+        if (strcmp(v, "rsa_pkcs") != 0 && strcmp(v, "rsa_x509") != 0)
+            return 0;
+        p->raw_rsa = strcmp(v, "rsa_x509") == 0;
+    } else if (strcmp(k, "always_auth") == 0) {
+        if (strcmp(v, "read") == 0)
+            p->always_auth = PKCS11_AUTH_READ;
+        else if (strcmp(v, "never") == 0)
+            p->always_auth = PKCS11_AUTH_NEVER;
+        else if (strcmp(v, "always") == 0)
+            p->always_auth = PKCS11_AUTH_ALWAYS;
+        else
+            return 0;
+    } else if (strcmp(k, "key_ops") == 0) {
+        if (!profile_number(v, 1L << 16, &n))
+            return 0;
+        p->key_ops = (unsigned int)n;
+    } else if (strcmp(k, "find_batch") == 0) {
+        if (!profile_number(v, PKCS11_FIND_BATCH_MAX, &n) || n == 0)
+            return 0;
+        p->find_batch = (unsigned int)n;
+    } else if (strcmp(k, "keepalive") == 0) {
+        if (!profile_number(v, 24L * 3600 * 1000, &n))
+            return 0;
+        p->keepalive_ms = n;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* A PROFILE_FILE line, its strings left in |line| */
+static int profile_line(PKCS11_PROFILE *p, char *line)
+{
+    char *name, *item, *v, *next;
+
+    if ((item = strchr(line, ':')) == NULL)
+        return 0;
+    *item++ = '\0';
+    if (*(name = profile_trim(line)) == '\0')
+        return 0;
+    pkcs11_profile_default(p);
+    p->name = name;
+    for (; item != NULL; item = next) {
+        if ((next = strchr(item, ';')) != NULL)
+            *next++ = '\0';
+        if (*(item = profile_trim(item)) == '\0')
+            continue;
+        if ((v = strchr(item, '=')) == NULL)
+            return 0;
+        *v++ = '\0';
+        if (!profile_setting(p, profile_trim(item), profile_trim(v)))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * PROFILE_FILE: read the profiles of a file, which replace those of the
+ * file read before.  They apply from the next slot lookup on.
+ * @param ctx
+ * @param path
+ * @return 1 on success, 0 on error, the profiles are then unchanged
+ */
+int pkcs11_profile_load(PKCS11_CTX *ctx, const char *path)
+{
+    PKCS11_PROFILE *profiles = NULL, *tmp;
+    BIO *in = NULL;
+    char *text = NULL, *line, *next, *grown, where[512];
+    size_t len = 0, size = 0, n = 0, lineno = 0;
+    int r, ret = 0;
+
+    if (path == NULL || (in = BIO_new_file(path, "r")) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_PROFILE, PKCS11_R_FILE_OPEN_ERROR);
+        return 0;
+    }
+    do {
+        if (size - len < 1024) {
+            if ((grown = OPENSSL_realloc(text, size + 4096)) == NULL)
+                goto memerr;
+            text = grown;
+            size += 4096;
+        }
+        r = BIO_read(in, text + len, (int)(size - len - 1));
+        if (r > 0)
+            len += r;
+    } while (r > 0);
+    text[len] = '\0';
+
+    for (line = text; line != NULL; line = next) {
+        lineno++;
+        if ((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        line = profile_trim(line);
+        if (*line == '\0' || *line == '#')
+            continue;
+        if ((tmp = OPENSSL_realloc(profiles, (n + 1) * sizeof(*tmp))) == NULL)
+            goto memerr;
+        profiles = tmp;
+        if (!profile_line(&profiles[n], line)) {
+            BIO_snprintf(where, sizeof(where), "%s line %lu", path,
+                         (unsigned long)lineno);
+            PKCS11err(PKCS11_F_PKCS11_PROFILE, PKCS11_R_PROFILE_INVALID);
+            ERR_add_error_data(1, where);
+            PKCS11_trace("Invalid profile at %s\n", where);
+            goto end;
+        }
+        n++;
+    }
+
+    pkcs11_profiles_free(ctx);
+    ctx->profiles = profiles;
+    ctx->nprofiles = n;
+    ctx->profile_text = text;
+    profiles = NULL;
+    text = NULL;
+    profile_reselect(ctx);
+    ret = 1;
+    goto end;
+
+ memerr:
+    PKCS11err(PKCS11_F_PKCS11_PROFILE, ERR_R_MALLOC_FAILURE);
+ end:
+    BIO_free(in);
+    OPENSSL_free(profiles);
+    OPENSSL_free(text);
+    return ret;
+}
+
+/**
+ * Free the profiles of PROFILE_FILE.
+ * @param ctx
+ */
+void pkcs11_profiles_free(PKCS11_CTX *ctx)
+{
+    /* the profile in use may point into the file, until chosen again */
+    if (ctx->profile_text != NULL) {
+        ctx->profile.name = NULL;
+        ctx->profile.manufacturer = NULL;
+        ctx->profile.library = NULL;
+        ctx->profile.model = NULL;
+    }
+    OPENSSL_free(ctx->profiles);
+    ctx->profiles = NULL;
+    ctx->nprofiles = 0;
+    OPENSSL_free(ctx->profile_text);
+    ctx->profile_text = NULL;
+}
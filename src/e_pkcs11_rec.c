@@ -0,0 +1,412 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * PKCS#11 call recorder.  When a trace file is configured, the function
+ * list of the module is replaced by a copy whose entries time the real
+ * call and append a record to the trace, see e_pkcs11_rec.h.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+#include "e_pkcs11_rec.h"
+
+typedef struct {
+    unsigned int index;
+    unsigned int op;
+    int first;
+} PKCS11_REC_THREAD;
+
+static CK_FUNCTION_LIST *rec_real = NULL;
+static CK_FUNCTION_LIST rec_funcs;
+static BIO *rec_out = NULL;
+static CRYPTO_RWLOCK *rec_lock = NULL;
+static CRYPTO_ONCE rec_once = CRYPTO_ONCE_STATIC_INIT;
+static CRYPTO_ONCE rec_env_once = CRYPTO_ONCE_STATIC_INIT;
+static CRYPTO_THREAD_LOCAL rec_thread_key;
+static int rec_inited = 0;
+static unsigned long long rec_epoch = 0;
+static unsigned int rec_nthreads = 0;
+static CK_SESSION_HANDLE *rec_sessions = NULL;
+static size_t rec_nsessions = 0;
+
+static void rec_thread_free(void *p)
+{
+    OPENSSL_free(p);
+}
+
+static void rec_init(void)
+{
+    rec_lock = CRYPTO_THREAD_lock_new();
+    rec_inited = rec_lock != NULL
+                 && CRYPTO_THREAD_init_local(&rec_thread_key, rec_thread_free);
+}
+
+static unsigned long long rec_clock(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned char *rec_put(unsigned char *p, unsigned long long v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++, v >>= 8)
+        *p++ = (unsigned char)(v & 0xff);
+    return p;
+}
+
+static PKCS11_REC_THREAD *rec_thread(void)
+{
+    PKCS11_REC_THREAD *t = CRYPTO_THREAD_get_local(&rec_thread_key);
+
+    if (t != NULL)
+        return t;
+    if ((t = OPENSSL_zalloc(sizeof(*t))) == NULL)
+        return NULL;
+    CRYPTO_THREAD_write_lock(rec_lock);
+    t->index = ++rec_nthreads;
+    CRYPTO_THREAD_unlock(rec_lock);
+    if (!CRYPTO_THREAD_set_local(&rec_thread_key, t)) {
+        OPENSSL_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+/* Called with rec_lock held */
+static unsigned int rec_session(CK_SESSION_HANDLE session)
+{
+    CK_SESSION_HANDLE *tmp;
+    size_t i;
+
+    if (session == 0)
+        return 0;
+    for (i = 0; i < rec_nsessions; i++) {
+        if (rec_sessions[i] == session)
+            return (unsigned int)i + 1;
+    }
+    tmp = OPENSSL_realloc(rec_sessions, sizeof(*tmp) * (rec_nsessions + 1));
+    if (tmp == NULL)
+        return 0;
+    rec_sessions = tmp;
+    rec_sessions[rec_nsessions++] = session;
+    return (unsigned int)rec_nsessions;
+}
+
+static void rec_write(PKCS11_REC_FUNC func, CK_SESSION_HANDLE session,
+                      CK_RV rv, unsigned long long start)
+{
+    unsigned char buf[PKCS11_REC_RECORD_SIZE], *p = buf;
+    unsigned long long end = rec_clock(CLOCK_MONOTONIC);
+    PKCS11_REC_THREAD *t = rec_thread();
+
+    if (t == NULL)
+        return;
+    CRYPTO_THREAD_write_lock(rec_lock);
+    if (rec_out != NULL) {
+        p = rec_put(p, start - rec_epoch, 8);
+        p = rec_put(p, end - start, 4);
+        p = rec_put(p, rv, 4);
+        p = rec_put(p, t->index, 2);
+        p = rec_put(p, rec_session(session), 2);
+        p = rec_put(p, func, 1);
+        p = rec_put(p, t->op, 1);
+        p = rec_put(p, t->first ? PKCS11_REC_FLAG_FIRST : 0, 1);
+        rec_put(p, 0, 1);
+        BIO_write(rec_out, buf, sizeof(buf));
+    }
+    CRYPTO_THREAD_unlock(rec_lock);
+    t->first = 0;
+}
+
+#define REC_CALL(name, session, args)                              \
+    unsigned long long start = rec_clock(CLOCK_MONOTONIC);         \
+    CK_RV rv = rec_real->name args;                                \
+                                                                   \
+    rec_write(PKCS11_REC_##name, (session), rv, start);            \
+    return rv
+
+static CK_RV rec_C_Initialize(CK_VOID_PTR pInitArgs)
+{
+    REC_CALL(C_Initialize, 0, (pInitArgs));
+}
+
+static CK_RV rec_C_Finalize(CK_VOID_PTR pReserved)
+{
+    unsigned long long start = rec_clock(CLOCK_MONOTONIC);
+    CK_RV rv = rec_real->C_Finalize(pReserved);
+
+    rec_write(PKCS11_REC_C_Finalize, 0, rv, start);
+    CRYPTO_THREAD_write_lock(rec_lock);
+    if (rec_out != NULL)
+        (void)BIO_flush(rec_out);
+    CRYPTO_THREAD_unlock(rec_lock);
+    return rv;
+}
+
+static CK_RV rec_C_GetSlotList(CK_BBOOL tokenPresent,
+                               CK_SLOT_ID_PTR pSlotList,
+                               CK_ULONG_PTR pulCount)
+{
+    REC_CALL(C_GetSlotList, 0, (tokenPresent, pSlotList, pulCount));
+}
+
+static CK_RV rec_C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
+{
+    REC_CALL(C_GetTokenInfo, 0, (slotID, pInfo));
+}
+
+static CK_RV rec_C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags,
+                               CK_VOID_PTR pApplication, CK_NOTIFY Notify,
+                               CK_SESSION_HANDLE_PTR phSession)
+{
+    unsigned long long start = rec_clock(CLOCK_MONOTONIC);
+    CK_RV rv = rec_real->C_OpenSession(slotID, flags, pApplication, Notify,
+                                       phSession);
+
+    rec_write(PKCS11_REC_C_OpenSession, rv == CKR_OK ? *phSession : 0, rv,
+              start);
+    return rv;
+}
+
+static CK_RV rec_C_CloseSession(CK_SESSION_HANDLE hSession)
+{
+    REC_CALL(C_CloseSession, hSession, (hSession));
+}
+
+static CK_RV rec_C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType,
+                         CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+    REC_CALL(C_Login, hSession, (hSession, userType, pPin, ulPinLen));
+}
+
+static CK_RV rec_C_Logout(CK_SESSION_HANDLE hSession)
+{
+    REC_CALL(C_Logout, hSession, (hSession));
+}
+
+static CK_RV rec_C_GetAttributeValue(CK_SESSION_HANDLE hSession,
+                                     CK_OBJECT_HANDLE hObject,
+                                     CK_ATTRIBUTE_PTR pTemplate,
+                                     CK_ULONG ulCount)
+{
+    REC_CALL(C_GetAttributeValue, hSession,
+             (hSession, hObject, pTemplate, ulCount));
+}
+
+static CK_RV rec_C_FindObjectsInit(CK_SESSION_HANDLE hSession,
+                                   CK_ATTRIBUTE_PTR pTemplate,
+                                   CK_ULONG ulCount)
+{
+    REC_CALL(C_FindObjectsInit, hSession, (hSession, pTemplate, ulCount));
+}
+
+static CK_RV rec_C_FindObjects(CK_SESSION_HANDLE hSession,
+                               CK_OBJECT_HANDLE_PTR phObject,
+                               CK_ULONG ulMaxObjectCount,
+                               CK_ULONG_PTR pulObjectCount)
+{
+    REC_CALL(C_FindObjects, hSession,
+             (hSession, phObject, ulMaxObjectCount, pulObjectCount));
+}
+
+static CK_RV rec_C_FindObjectsFinal(CK_SESSION_HANDLE hSession)
+{
+    REC_CALL(C_FindObjectsFinal, hSession, (hSession));
+}
+
+static CK_RV rec_C_EncryptInit(CK_SESSION_HANDLE hSession,
+                               CK_MECHANISM_PTR pMechanism,
+                               CK_OBJECT_HANDLE hKey)
+{
+    REC_CALL(C_EncryptInit, hSession, (hSession, pMechanism, hKey));
+}
+
+static CK_RV rec_C_Encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+                           CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData,
+                           CK_ULONG_PTR pulEncryptedDataLen)
+{
+    REC_CALL(C_Encrypt, hSession, (hSession, pData, ulDataLen,
+                                   pEncryptedData, pulEncryptedDataLen));
+}
+
+static CK_RV rec_C_DecryptInit(CK_SESSION_HANDLE hSession,
+                               CK_MECHANISM_PTR pMechanism,
+                               CK_OBJECT_HANDLE hKey)
+{
+    REC_CALL(C_DecryptInit, hSession, (hSession, pMechanism, hKey));
+}
+
+static CK_RV rec_C_Decrypt(CK_SESSION_HANDLE hSession,
+                           CK_BYTE_PTR pEncryptedData,
+                           CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData,
+                           CK_ULONG_PTR pulDataLen)
+{
+    REC_CALL(C_Decrypt, hSession, (hSession, pEncryptedData,
+                                   ulEncryptedDataLen, pData, pulDataLen));
+}
+
+static CK_RV rec_C_SignInit(CK_SESSION_HANDLE hSession,
+                            CK_MECHANISM_PTR pMechanism,
+                            CK_OBJECT_HANDLE hKey)
+{
+    REC_CALL(C_SignInit, hSession, (hSession, pMechanism, hKey));
+}
+
+static CK_RV rec_C_Sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+                        CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
+                        CK_ULONG_PTR pulSignatureLen)
+{
+    REC_CALL(C_Sign, hSession, (hSession, pData, ulDataLen, pSignature,
+                                pulSignatureLen));
+}
+
+static CK_RV rec_C_VerifyInit(CK_SESSION_HANDLE hSession,
+                              CK_MECHANISM_PTR pMechanism,
+                              CK_OBJECT_HANDLE hKey)
+{
+    REC_CALL(C_VerifyInit, hSession, (hSession, pMechanism, hKey));
+}
+
+static CK_RV rec_C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+                          CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
+                          CK_ULONG ulSignatureLen)
+{
+    REC_CALL(C_Verify, hSession, (hSession, pData, ulDataLen, pSignature,
+                                  ulSignatureLen));
+}
+
+/**
+ * Start recording into a new trace file.
+ * @param path
+ * @return 1 on success, 0 on error
+ */
+int pkcs11_rec_open(const char *path)
+{
+    unsigned char hdr[PKCS11_REC_HEADER_SIZE], *p = hdr;
+    BIO *out;
+
+    if (!CRYPTO_THREAD_run_once(&rec_once, rec_init) || !rec_inited) {
+        PKCS11err(PKCS11_F_PKCS11_REC_OPEN, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    if ((out = BIO_new_file(path, "wb")) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_REC_OPEN, PKCS11_R_FILE_OPEN_ERROR);
+        return 0;
+    }
+
+    memcpy(p, PKCS11_REC_MAGIC, 4);
+    p = rec_put(p + 4, PKCS11_REC_VERSION, 2);
+    p = rec_put(p, PKCS11_REC_RECORD_SIZE, 2);
+    rec_put(p, rec_clock(CLOCK_REALTIME), 8);
+    if (BIO_write(out, hdr, sizeof(hdr)) != sizeof(hdr)) {
+        PKCS11err(PKCS11_F_PKCS11_REC_OPEN, PKCS11_R_FILE_OPEN_ERROR);
+        BIO_free(out);
+        return 0;
+    }
+
+    CRYPTO_THREAD_write_lock(rec_lock);
+    if (rec_out != NULL) {
+        (void)BIO_flush(rec_out);
+        BIO_free(rec_out);
+    }
+    rec_out = out;
+    rec_epoch = rec_clock(CLOCK_MONOTONIC);
+    rec_nsessions = 0;
+    CRYPTO_THREAD_unlock(rec_lock);
+    return 1;
+}
+
+void pkcs11_rec_close(void)
+{
+    if (!rec_inited)
+        return;
+    CRYPTO_THREAD_write_lock(rec_lock);
+    if (rec_out != NULL) {
+        (void)BIO_flush(rec_out);
+        BIO_free(rec_out);
+        rec_out = NULL;
+    }
+    OPENSSL_free(rec_sessions);
+    rec_sessions = NULL;
+    rec_nsessions = 0;
+    CRYPTO_THREAD_unlock(rec_lock);
+}
+
+/**
+ * Mark the start of an engine operation on the calling thread; the next
+ * recorded call carries PKCS11_REC_FLAG_FIRST.
+ * @param op one of PKCS11_REC_OP_*
+ */
+static void rec_env_open(void)
+{
+    const char *path = getenv("PKCS11_TRACE_FILE");
+
+    if (rec_out == NULL && path != NULL && *path != '\0')
+        pkcs11_rec_open(path);
+}
+
+void pkcs11_rec_op(int op)
+{
+    PKCS11_REC_THREAD *t;
+
+    /* the first operation may come before the module is loaded */
+    if (rec_out == NULL)
+        CRYPTO_THREAD_run_once(&rec_env_once, rec_env_open);
+    if (rec_out == NULL || (t = rec_thread()) == NULL)
+        return;
+    t->op = op;
+    t->first = 1;
+}
+
+/**
+ * Return the function list the engine should call: the module's own list,
+ * or the recording copy when recording is enabled through the TRACE_FILE
+ * ctrl or the PKCS11_TRACE_FILE environment variable.
+ * @param funcs
+ * @return
+ */
+CK_FUNCTION_LIST *pkcs11_rec_wrap(CK_FUNCTION_LIST *funcs)
+{
+    if (rec_out == NULL)
+        CRYPTO_THREAD_run_once(&rec_env_once, rec_env_open);
+    if (rec_out == NULL || funcs == &rec_funcs)
+        return funcs;
+
+    rec_real = funcs;
+    rec_funcs = *funcs;
+    rec_funcs.C_Initialize = rec_C_Initialize;
+    rec_funcs.C_Finalize = rec_C_Finalize;
+    rec_funcs.C_GetSlotList = rec_C_GetSlotList;
+    rec_funcs.C_GetTokenInfo = rec_C_GetTokenInfo;
+    rec_funcs.C_OpenSession = rec_C_OpenSession;
+    rec_funcs.C_CloseSession = rec_C_CloseSession;
+    rec_funcs.C_Login = rec_C_Login;
+    rec_funcs.C_Logout = rec_C_Logout;
+    rec_funcs.C_GetAttributeValue = rec_C_GetAttributeValue;
+    rec_funcs.C_FindObjectsInit = rec_C_FindObjectsInit;
+    rec_funcs.C_FindObjects = rec_C_FindObjects;
+    rec_funcs.C_FindObjectsFinal = rec_C_FindObjectsFinal;
+    rec_funcs.C_EncryptInit = rec_C_EncryptInit;
+    rec_funcs.C_Encrypt = rec_C_Encrypt;
+    rec_funcs.C_DecryptInit = rec_C_DecryptInit;
+    rec_funcs.C_Decrypt = rec_C_Decrypt;
+    rec_funcs.C_SignInit = rec_C_SignInit;
+    rec_funcs.C_Sign = rec_C_Sign;
+    rec_funcs.C_VerifyInit = rec_C_VerifyInit;
+    rec_funcs.C_Verify = rec_C_Verify;
+    return &rec_funcs;
+}
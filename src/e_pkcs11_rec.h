@@ -0,0 +1,64 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+#ifndef HEADER_PKCS11REC_H
+# define HEADER_PKCS11REC_H
+
+/*
+ * PKCS#11 call trace format.
+ *
+ * A trace is a 16 byte header followed by fixed size records, all integers
+ * little endian.  No argument of the recorded calls is stored: only which
+ * function was called, when, for how long, by which thread, on which
+ * session and with which result.
+ *
+ *   header:  "P11T" | u16 version | u16 record size | u64 start (us, epoch)
+ *   record:  u64 start (us since the header start) | u32 duration (us)
+ *            | u32 CK_RV | u16 thread | u16 session (0 = none)
+ *            | u8 function | u8 operation | u8 flags | u8 reserved
+ *
+ * Threads and sessions are numbered from 1 in order of appearance.
+ * "function" is the position of the function in pkcs11f.h, "operation" is
+ * the engine entry point that issued the call and PKCS11_REC_FLAG_FIRST
+ * marks the first call of every such operation.
+ */
+
+# define PKCS11_REC_MAGIC            "P11T"
+# define PKCS11_REC_VERSION          1
+# define PKCS11_REC_HEADER_SIZE      16
+# define PKCS11_REC_RECORD_SIZE      24
+
+# define PKCS11_REC_OP_NONE          0
+# define PKCS11_REC_OP_LOAD_KEY      1
+# define PKCS11_REC_OP_SIGN          2
+# define PKCS11_REC_OP_DECRYPT       3
+# define PKCS11_REC_OP_STORE         4
+
+# define PKCS11_REC_FLAG_FIRST       0x01
+
+typedef enum {
+# define CK_PKCS11_FUNCTION_INFO(name) PKCS11_REC_##name,
+# include "pkcs11f.h"
+# undef CK_PKCS11_FUNCTION_INFO
+    PKCS11_REC_NUM
+} PKCS11_REC_FUNC;
+
+typedef struct {
+    unsigned long long start;
+    unsigned long duration;
+    unsigned long rv;
+    unsigned int thread;
+    unsigned int session;
+    unsigned int func;
+    unsigned int op;
+    unsigned int flags;
+} PKCS11_REC;
+
+#endif
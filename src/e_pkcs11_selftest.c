@@ -0,0 +1,368 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * SELFTEST ctrl.  A timed burst of signatures with one key of the engine,
+ * from several threads and through the same session pool as the
+ * application, measuring what the module actually delivers: the rate,
+ * the latency percentiles and the number of signatures in flight.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/objects.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+
+#define SELFTEST_THREADS        8
+#define SELFTEST_DURATION_MS    1000
+#define SELFTEST_MAX_THREADS    1024
+#define SELFTEST_MAX_MS         3600000
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int ready;                  /* threads that have signed once */
+    int started;                /* |end| is set */
+    unsigned long long end;
+    RSA *rsa;
+} SELFTEST_RUN;
+
+typedef struct {
+    pthread_t tid;
+    SELFTEST_RUN *run;
+    unsigned long long *lat;    /* ns per signature */
+    size_t nlat;
+    size_t size;
+    unsigned long errors;
+} SELFTEST_WORKER;
+
+static unsigned long long selftest_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int selftest_sign(RSA *rsa, unsigned char *sig)
+{
+    unsigned char md[32];
+    unsigned int siglen = RSA_size(rsa);
+
+    memset(md, 0x5a, sizeof(md));
+    if (RSA_sign(NID_sha256, md, sizeof(md), sig, &siglen, rsa))
+        return 1;
+    ERR_clear_error();
+    return 0;
+}
+
+static void *selftest_worker(void *arg)
+{
+    SELFTEST_WORKER *w = arg;
+    SELFTEST_RUN *run = w->run;
+    unsigned long long t0, t1, *lat;
+    unsigned char *sig = OPENSSL_malloc(RSA_size(run->rsa));
+    size_t size;
+
+    /* the first signature may have to open a session, leave it out */
+    if (sig == NULL || !selftest_sign(run->rsa, sig))
+        w->errors++;
+    pthread_mutex_lock(&run->lock);
+    run->ready++;
+    pthread_cond_broadcast(&run->cond);
+    while (!run->started)
+        pthread_cond_wait(&run->cond, &run->lock);
+    pthread_mutex_unlock(&run->lock);
+    if (sig == NULL)
+        return NULL;
+
+    while ((t0 = selftest_now()) < run->end) {
+        if (!selftest_sign(run->rsa, sig)) {
+            w->errors++;
+            continue;
+        }
+        t1 = selftest_now();
+        if (w->nlat == w->size) {
+            size = w->size == 0 ? 1024 : w->size * 2;
+            lat = OPENSSL_realloc(w->lat, size * sizeof(*lat));
+            if (lat == NULL) {
+                w->errors++;
+                break;
+            }
+            w->lat = lat;
+            w->size = size;
+        }
+        w->lat[w->nlat++] = t1 - t0;
+    }
+    OPENSSL_free(sig);
+    return NULL;
+}
+
+static int selftest_cmp(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double selftest_pct(const unsigned long long *lat, size_t n, double p)
+{
+    size_t i = (size_t)(p * n);
+
+    if (n == 0)
+        return 0;
+    return (i < n ? lat[i] : lat[n - 1]) / 1000.0;
+}
+
+/*
+ * Start the threads, let them sign for |st->duration_ms| and merge what
+ * they measured into |st|.
+ */
+static int selftest_measure(PKCS11_SELFTEST *st, RSA *rsa)
+{
+    SELFTEST_RUN run;
+    SELFTEST_WORKER *w;
+    unsigned long long start, busy = 0, *lat = NULL;
+    size_t nlat = 0;
+    int i, n, ret = 0;
+
+    w = OPENSSL_zalloc(st->threads * sizeof(*w));
+    if (w == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_SELFTEST, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    run.rsa = rsa;
+    run.ready = 0;
+    run.started = 0;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.cond, NULL);
+
+    for (n = 0; n < st->threads; n++) {
+        w[n].run = &run;
+        if (pthread_create(&w[n].tid, NULL, selftest_worker, &w[n]) != 0)
+            break;
+    }
+
+    /* start the clock once every thread has its session */
+    pthread_mutex_lock(&run.lock);
+    while (run.ready < n)
+        pthread_cond_wait(&run.cond, &run.lock);
+    start = selftest_now();
+    /* if a thread could not be started, stop the others right away */
+    run.end = n < st->threads ? start : start + st->duration_ms * 1000000ULL;
+    run.started = 1;
+    pthread_cond_broadcast(&run.cond);
+    pthread_mutex_unlock(&run.lock);
+
+    st->ops = 0;
+    st->errors = 0;
+    for (i = 0; i < n; i++) {
+        pthread_join(w[i].tid, NULL);
+        st->ops += w[i].nlat;
+        st->errors += w[i].errors;
+    }
+    pthread_cond_destroy(&run.cond);
+    pthread_mutex_destroy(&run.lock);
+    if (n < st->threads) {
+        PKCS11err(PKCS11_F_PKCS11_SELFTEST, PKCS11_R_SELFTEST_FAILED);
+        goto end;
+    }
+
+    if (st->ops > 0 && (lat = OPENSSL_malloc(st->ops * sizeof(*lat))) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_SELFTEST, ERR_R_MALLOC_FAILURE);
+        goto end;
+    }
+    for (i = 0; i < n; i++) {
+        memcpy(lat + nlat, w[i].lat, w[i].nlat * sizeof(*lat));
+        nlat += w[i].nlat;
+    }
+    for (i = 0; (size_t)i < nlat; i++)
+        busy += lat[i];
+    qsort(lat, nlat, sizeof(*lat), selftest_cmp);
+
+    st->ops_per_sec = st->ops * 1000.0 / st->duration_ms;
+    st->p50_us = selftest_pct(lat, nlat, 0.50);
+    st->p99_us = selftest_pct(lat, nlat, 0.99);
+    st->p999_us = selftest_pct(lat, nlat, 0.999);
+    st->min_us = nlat > 0 ? lat[0] / 1000.0 : 0;
+    st->max_us = nlat > 0 ? lat[nlat - 1] / 1000.0 : 0;
+    /* Little's law, this includes signatures queued for a session */
+    st->in_flight = (double)busy / (st->duration_ms * 1000000.0);
+    /*
+     * The fastest signature did not wait, so it is the service time: the
+     * rate times the service time is how many the module ran at once.
+     */
+    st->parallelism = st->ops_per_sec * st->min_us / 1000000.0;
+    ret = 1;
+
+ end:
+    for (i = 0; i < n; i++)
+        OPENSSL_free(w[i].lat);
+    OPENSSL_free(w);
+    OPENSSL_free(lat);
+    return ret;
+}
+
+/**
+ * Check the results of a run against the thresholds that are set.
+ * @param st
+ * @return 1 if every threshold is met, 0 otherwise
+ */
+static int selftest_check(const PKCS11_SELFTEST *st)
+{
+    if (st->errors > 0 || st->ops == 0) {
+        ERR_raise_data(ERR_LIB_PKCS11, PKCS11_R_SELFTEST_FAILED,
+                       "%lu signatures failed, %lu succeeded",
+                       st->errors, st->ops);
+        return 0;
+    }
+    if (st->min_ops_per_sec > 0 && st->ops_per_sec < st->min_ops_per_sec) {
+        ERR_raise_data(ERR_LIB_PKCS11, PKCS11_R_SELFTEST_BELOW_THRESHOLD,
+                       "%.1f signatures/s, minimum %.1f",
+                       st->ops_per_sec, st->min_ops_per_sec);
+        return 0;
+    }
+    if (st->max_p99_us > 0 && st->p99_us > st->max_p99_us) {
+        ERR_raise_data(ERR_LIB_PKCS11, PKCS11_R_SELFTEST_BELOW_THRESHOLD,
+                       "p99 latency %.1f us, maximum %.1f",
+                       st->p99_us, st->max_p99_us);
+        return 0;
+    }
+    if (st->min_parallelism > 0 && st->parallelism < st->min_parallelism) {
+        ERR_raise_data(ERR_LIB_PKCS11, PKCS11_R_SELFTEST_BELOW_THRESHOLD,
+                       "parallelism %.2f, minimum %.2f",
+                       st->parallelism, st->min_parallelism);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Run the self test described by |st| and fill in its results.  The key
+ * is loaded through the engine, so a key already in use costs no token
+ * call, and signs through the session pool of its slot.
+ * @param e
+ * @param st key, threads, duration and thresholds, 0 for the defaults
+ * @return 1 if the key signed and every threshold is met, 0 otherwise
+ */
+int pkcs11_selftest(ENGINE *e, PKCS11_SELFTEST *st)
+{
+    PKCS11_CTX *ctx;
+    PKCS11_KEY key;
+    EVP_PKEY *pkey = NULL;
+    RSA *rsa = NULL;
+    char *uri = NULL;
+    int inited = 0, ret = 0;
+
+    st->measured = 0;
+    if (st->threads == 0)
+        st->threads = SELFTEST_THREADS;
+    if (st->duration_ms == 0)
+        st->duration_ms = SELFTEST_DURATION_MS;
+    if (st->key == NULL || st->threads < 1
+        || st->threads > SELFTEST_MAX_THREADS
+        || st->duration_ms < 1 || st->duration_ms > SELFTEST_MAX_MS) {
+        PKCS11err(PKCS11_F_PKCS11_SELFTEST,
+                  PKCS11_R_SELFTEST_INVALID_ARGUMENT);
+        return 0;
+    }
+
+    /* the URI is parsed in place */
+    if ((uri = OPENSSL_strdup(st->key)) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_SELFTEST, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    if (!ENGINE_init(e))
+        goto end;
+    inited = 1;
+    if ((pkey = ENGINE_load_private_key(e, uri, NULL, NULL)) == NULL
+        || (rsa = EVP_PKEY_get1_RSA(pkey)) == NULL
+        || !pkcs11_key_get(rsa, &key)
+        || (ctx = pkcs11_get_ctx(rsa)) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_SELFTEST, PKCS11_R_RSA_NOT_FOUND);
+        goto end;
+    }
+
+    if (!selftest_measure(st, rsa))
+        goto end;
+    st->sessions = pkcs11_session_idle(ctx, key.slotid);
+    st->measured = 1;
+    ret = selftest_check(st);
+
+ end:
+    RSA_free(rsa);
+    EVP_PKEY_free(pkey);
+    OPENSSL_free(uri);
+    if (inited)
+        ENGINE_finish(e);
+    return ret;
+}
+
+/**
+ * SELFTEST with its arguments as a string of space separated settings,
+ * "key=<uri> [threads=n] [ms=n] [min-ops=x] [max-p99-us=x]
+ * [min-parallel=x]".  The results are written to stderr as one line.
+ * @param e
+ * @param args
+ * @return 1 if the self test passed, 0 otherwise
+ */
+int pkcs11_selftest_str(ENGINE *e, const char *args)
+{
+    PKCS11_SELFTEST st;
+    char *copy, *tok, *save = NULL;
+    int ret = 0;
+
+    memset(&st, 0, sizeof(st));
+    if (args == NULL || (copy = OPENSSL_strdup(args)) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_SELFTEST,
+                  PKCS11_R_SELFTEST_INVALID_ARGUMENT);
+        return 0;
+    }
+    for (tok = strtok_r(copy, " \t", &save); tok != NULL;
+         tok = strtok_r(NULL, " \t", &save)) {
+        if (strncmp(tok, "key=", 4) == 0) {
+            st.key = tok + 4;
+        } else if (strncmp(tok, "threads=", 8) == 0) {
+            st.threads = atoi(tok + 8);
+        } else if (strncmp(tok, "ms=", 3) == 0) {
+            st.duration_ms = atol(tok + 3);
+        } else if (strncmp(tok, "min-ops=", 8) == 0) {
+            st.min_ops_per_sec = atof(tok + 8);
+        } else if (strncmp(tok, "max-p99-us=", 11) == 0) {
+            st.max_p99_us = atof(tok + 11);
+        } else if (strncmp(tok, "min-parallel=", 13) == 0) {
+            st.min_parallelism = atof(tok + 13);
+        } else {
+            ERR_raise_data(ERR_LIB_PKCS11, PKCS11_R_SELFTEST_INVALID_ARGUMENT,
+                           "%s", tok);
+            goto end;
+        }
+    }
+
+    ret = pkcs11_selftest(e, &st);
+    if (st.measured)
+        printf_stderr("SELFTEST %s: threads=%d ms=%ld ops=%lu errors=%lu "
+                      "ops/s=%.1f min_us=%.1f p50_us=%.1f p99_us=%.1f "
+                      "p99.9_us=%.1f max_us=%.1f in_flight=%.2f "
+                      "parallelism=%.2f sessions=%lu\n",
+                      ret ? "pass" : "FAIL", st.threads, st.duration_ms,
+                      st.ops, st.errors, st.ops_per_sec, st.min_us,
+                      st.p50_us, st.p99_us, st.p999_us, st.max_us,
+                      st.in_flight, st.parallelism,
+                      (unsigned long)st.sessions);
+
+ end:
+    OPENSSL_free(copy);
+    return ret;
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Loaded keys of tokens that other hosts provision.  When several hosts
+ * share an HSM partition, a key one of them deletes or replaces is still
+ * in the others' caches of loaded keys.  With CACHE_CHECK, loading a
+ * cached key reads what stands for the state of its token, at most once
+ * every sync_ms per slot and by one thread, the others going on with
+ * their cached keys meanwhile:
+ *
+ *  - the value of a CKO_DATA object of the label given, a generation
+ *    counter that the provisioning tools bump whenever they change the
+ *    token: one C_GetAttributeValue;
+ *  - else the total and free memory of C_GetTokenInfo, which most HSMs
+ *    keep up to date as objects come and go.
+ *
+ * When it changed, every key loaded from the slot is forgotten and
+ * searched for again on its next load.  A key handle the token no longer
+ * knows (CKR_OBJECT_HANDLE_INVALID) is such a change too, found between
+ * two checks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "e_pkcs11.h"
+#include "e_pkcs11_err.h"
+#include "e_pkcs11_call.h"
+
+#define SYNC_VALUE_MAX 256      /* of the generation object */
+
+static long sync_now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned long sync_hash(unsigned long h, const void *p, size_t len)
+{
+    const unsigned char *b = p;
+
+    /* FNV-1a */
+    while (len-- > 0)
+        h = (h ^ *b++) * 16777619UL;
+    return h;
+}
+
+/* The state of a slot, created if |create|; lock held */
+static PKCS11_SYNC *sync_find(PKCS11_CTX *ctx, CK_SLOT_ID slotid,
+                              int create)
+{
+    PKCS11_SYNC *sync;
+
+    for (sync = ctx->syncs; sync != NULL; sync = sync->next)
+        if (sync->slotid == slotid)
+            return sync;
+    if (!create || (sync = OPENSSL_zalloc(sizeof(*sync))) == NULL)
+        return NULL;
+    sync->slotid = slotid;
+    sync->next = ctx->syncs;
+    ctx->syncs = sync;
+    return sync;
+}
+
+/**
+ * Read the state of a token: the value of its generation object, its
+ * memory without one.
+ * @param ctx
+ * @param slotid
+ * @param object the handle of the generation object, updated
+ * @param state set to the hash of what was read
+ * @return 1 on success, 0 if it could not be read
+ */
+static int sync_read(PKCS11_CTX *ctx, CK_SLOT_ID slotid,
+                     CK_OBJECT_HANDLE *object, unsigned long *state)
+{
+    CK_SESSION_HANDLE session;
+    CK_TOKEN_INFO info;
+    CK_BYTE value[SYNC_VALUE_MAX];
+    CK_ULONG len;
+    CK_RV rv = CKR_OK;
+    int i, ok = 0;
+
+    *state = 2166136261UL;
+    if (ctx->sync_object == NULL) {
+        if (pkcs11_get_token_info(slotid, &info) != CKR_OK)
+            return 0;
+        *state = sync_hash(*state, &info.ulTotalPublicMemory,
+                           sizeof(info.ulTotalPublicMemory));
+        *state = sync_hash(*state, &info.ulFreePublicMemory,
+                           sizeof(info.ulFreePublicMemory));
+        *state = sync_hash(*state, &info.ulTotalPrivateMemory,
+                           sizeof(info.ulTotalPrivateMemory));
+        *state = sync_hash(*state, &info.ulFreePrivateMemory,
+                           sizeof(info.ulFreePrivateMemory));
+        return 1;
+    }
+
+    if (!pkcs11_session_get(ctx, slotid, &session))
+        return 0;
+    /* the handle known, then, if it is gone, the object found again */
+    for (i = 0; i < 2; i++) {
+        if (*object == 0
+            && (*object = pkcs11_find_data(session, ctx->sync_object)) == 0)
+            break;
+        len = sizeof(value);
+        rv = pkcs11_get_value(session, *object, value, &len);
+        if (rv == CKR_OK) {
+            *state = sync_hash(*state, value, len);
+            ok = 1;
+            break;
+        }
+        if (pkcs11_rv_class(rv) != PKCS11_RV_OBJECT)
+            break;
+        *object = 0;
+    }
+    /* no generation object is a state too, until one is created */
+    if (*object == 0)
+        ok = 1;
+    pkcs11_session_put(ctx, slotid, session, rv == CKR_OK);
+    return ok;
+}
+
+/**
+ * CACHE_CHECK: "ms=<n>" how often a token is checked, 1000 by default,
+ * "object=<label>" its generation object, "off" no checks.
+ * @param ctx
+ * @param args
+ * @return 1 on success, 0 on a bad argument
+ */
+int pkcs11_sync_set(PKCS11_CTX *ctx, const char *args)
+{
+    char *copy, *tok, *save = NULL, *end, *object = NULL;
+    long ms = PKCS11_SYNC_MS;
+    int ret = 0;
+
+    if (args == NULL || (copy = OPENSSL_strdup(args)) == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_SYNC_SET, PKCS11_R_CACHE_CHECK_INVALID);
+        return 0;
+    }
+    for (tok = strtok_r(copy, " \t,", &save); tok != NULL;
+         tok = strtok_r(NULL, " \t,", &save)) {
+        if (strcmp(tok, "off") == 0) {
+            ms = 0;
+        } else if (strncmp(tok, "ms=", 3) == 0) {
+            ms = strtol(tok + 3, &end, 10);
+            if (*end != '\0' || ms <= 0)
+                goto bad;
+        } else if (strncmp(tok, "object=", 7) == 0 && tok[7] != '\0') {
+            OPENSSL_free(object);
+            if ((object = OPENSSL_strdup(tok + 7)) == NULL)
+                goto bad;
+        } else {
+            goto bad;
+        }
+    }
+
+    if (!CRYPTO_THREAD_write_lock(ctx->lock))
+        goto end;
+    ctx->sync_ms = ms;
+    OPENSSL_free(ctx->sync_object);
+    ctx->sync_object = object;
+    object = NULL;
+    /* what was read was of the settings before */
+    pkcs11_sync_free(ctx);
+    CRYPTO_THREAD_unlock(ctx->lock);
+    if (ms > 0)
+        PKCS11_trace("Checking tokens every %ld ms, %s%s\n", ms,
+                     ctx->sync_object != NULL ? "generation object "
+                                              : "token memory",
+                     ctx->sync_object != NULL ? ctx->sync_object : "");
+    ret = 1;
+    goto end;
+
+ bad:
+    ERR_raise_data(ERR_LIB_PKCS11, PKCS11_R_CACHE_CHECK_INVALID, "%s", tok);
+ end:
+    OPENSSL_free(object);
+    OPENSSL_free(copy);
+    return ret;
+}
+
+/**
+ * Check whether the token in a slot changed, if it was not checked for
+ * sync_ms, and forget the keys loaded from it if it did.  The first check
+ * of a token only reads its state.
+ * @param ctx
+ * @param slotid
+ * @return 1 if the keys of the slot were forgotten, 0 otherwise
+ */
+int pkcs11_sync_check(PKCS11_CTX *ctx, CK_SLOT_ID slotid)
+{
+    PKCS11_SYNC *sync;
+    CK_OBJECT_HANDLE object;
+    unsigned long state, before = 0;
+    long now = sync_now_ms();
+    int known = 0, changed = 0;
+
+    if (ctx->sync_ms <= 0 || !CRYPTO_THREAD_write_lock(ctx->lock))
+        return 0;
+    if ((sync = sync_find(ctx, slotid, 1)) == NULL
+        || (sync->checked_ms != 0 && now - sync->checked_ms < ctx->sync_ms)) {
+        CRYPTO_THREAD_unlock(ctx->lock);
+        return 0;
+    }
+    /* the other threads keep their cached keys until it is read */
+    known = sync->checked_ms != 0;
+    before = sync->state;
+    object = sync->object;
+    sync->checked_ms = now;
+    CRYPTO_THREAD_unlock(ctx->lock);
+
+    ERR_set_mark();
+    if (!sync_read(ctx, slotid, &object, &state)) {
+        ERR_pop_to_mark();
+        return 0;
+    }
+    ERR_pop_to_mark();
+
+    if (!CRYPTO_THREAD_write_lock(ctx->lock))
+        return 0;
+    if ((sync = sync_find(ctx, slotid, 0)) != NULL) {
+        changed = known && state != before;
+        sync->state = state;
+        sync->object = object;
+    }
+    CRYPTO_THREAD_unlock(ctx->lock);
+
+    if (changed) {
+        PKCS11_trace("Token in slot %lu changed, its keys are searched again\n",
+                     slotid);
+        pkcs11_key_cache_drop_slot(ctx, slotid);
+    }
+    return changed;
+}
+
+/**
+ * A key handle of the token in a slot is gone: with CACHE_CHECK, forget
+ * every key loaded from it and read its state again at the next check.
+ * @param ctx
+ * @param slotid
+ */
+void pkcs11_sync_stale(PKCS11_CTX *ctx, CK_SLOT_ID slotid)
+{
+    PKCS11_SYNC *sync;
+
+    if (ctx->sync_ms <= 0 || !CRYPTO_THREAD_write_lock(ctx->lock))
+        return;
+    if ((sync = sync_find(ctx, slotid, 0)) != NULL)
+        sync->checked_ms = 0;
+    CRYPTO_THREAD_unlock(ctx->lock);
+    pkcs11_key_cache_drop_slot(ctx, slotid);
+}
+
+/**
+ * Forget what was read of every token.
+ * @param ctx
+ */
+void pkcs11_sync_free(PKCS11_CTX *ctx)
+{
+    PKCS11_SYNC *sync;
+
+    while ((sync = ctx->syncs) != NULL) {
+        ctx->syncs = sync->next;
+        OPENSSL_free(sync);
+    }
+}
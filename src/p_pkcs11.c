@@ -0,0 +1,617 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * OpenSSL 3 provider: its entry point, the keymgmt of token keys and the
+ * pkcs11: store that loads them.  The store opens a URI the way the
+ * engine's does, then hands the private key it names to the keymgmt by
+ * reference; certificates, public keys and names go out as the engine's
+ * store finds them.  Signatures and decryption are in p_pkcs11_ops.c.
+ *
+ * In openssl.cnf:
+ *
+ *  [provider_sect]
+ *  default = default_sect
+ *  pkcs11 = pkcs11_sect
+ *
+ *  [pkcs11_sect]
+ *  module = /usr/local/lib/ossl-modules/pkcs11prov.so
+ *  pkcs11-module-path = /usr/lib/softhsm/libsofthsm2.so
+ *  pkcs11-pin = 1234
+ *  activate = 1
+ */
+
+#include <string.h>
+#include <openssl/core_names.h>
+#include <openssl/core_object.h>
+#include <openssl/params.h>
+#include <openssl/param_build.h>
+#include <openssl/x509.h>
+#include "p_pkcs11.h"
+#include "e_pkcs11_err.h"
+
+#define PKCS11_PROV_PARAM_MODULE_PATH   "pkcs11-module-path"
+#define PKCS11_PROV_PARAM_PIN           "pkcs11-pin"
+
+/* The store as it goes through the objects of a URI */
+typedef struct PKCS11_PROV_STORE_st {
+    PKCS11_PROV *prov;
+    PKCS11_PROV_KEY *key;       /* the private key, until it is loaded */
+    OSSL_STORE_LOADER_CTX search;   /* the engine's store search */
+} PKCS11_PROV_STORE;
+
+static OSSL_FUNC_core_get_params_fn *core_get_params = NULL;
+
+/**
+ * Build the public half of a token key pair with another provider, for
+ * what needs no private key and for the key's parameters.
+ * @param key
+ * @return 1 on success, 0 on error
+ */
+static int pkcs11_prov_key_public(PKCS11_PROV_KEY *key)
+{
+    PKCS11_KEY_PAIR *kp = &key->kp;
+    OSSL_PARAM_BLD *bld;
+    OSSL_PARAM *params = NULL;
+    EVP_PKEY_CTX *pctx = NULL;
+    ASN1_OBJECT *curve = NULL;
+    const unsigned char *p;
+    const char *name;
+    int nid, ret = 0;
+
+    if ((bld = OSSL_PARAM_BLD_new()) == NULL)
+        goto end;
+    if (kp->type == CKK_RSA) {
+        name = "RSA";
+        if (!OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, kp->n)
+            || !OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, kp->e))
+            goto end;
+    } else {
+        name = "EC";
+        /* only named curves */
+        p = kp->ec_params;
+        if ((curve = d2i_ASN1_OBJECT(NULL, &p, kp->ec_params_len)) == NULL
+            || (nid = OBJ_obj2nid(curve)) == NID_undef) {
+            PKCS11err(PKCS11_F_PKCS11_PROV_INIT,
+                      PKCS11_R_UNKNOWN_ALGORITHM_TYPE);
+            goto end;
+        }
+        if (!OSSL_PARAM_BLD_push_utf8_string(bld, OSSL_PKEY_PARAM_GROUP_NAME,
+                                             OBJ_nid2sn(nid), 0)
+            || !OSSL_PARAM_BLD_push_octet_string(bld, OSSL_PKEY_PARAM_PUB_KEY,
+                                                 kp->ec_point,
+                                                 kp->ec_point_len))
+            goto end;
+    }
+    if ((params = OSSL_PARAM_BLD_to_param(bld)) == NULL
+        || (pctx = EVP_PKEY_CTX_new_from_name(key->prov->libctx, name,
+                                              PKCS11_PROV_PROPQ)) == NULL
+        || EVP_PKEY_fromdata_init(pctx) <= 0
+        || EVP_PKEY_fromdata(pctx, &key->pub, EVP_PKEY_PUBLIC_KEY,
+                             params) <= 0)
+        goto end;
+    ret = 1;
+
+ end:
+    EVP_PKEY_CTX_free(pctx);
+    OSSL_PARAM_free(params);
+    OSSL_PARAM_BLD_free(bld);
+    ASN1_OBJECT_free(curve);
+    return ret;
+}
+
+/**
+ * The key pair the URI just parsed into the provider's context names.
+ * Called with the load lock.
+ * @param prov
+ * @param session a session of the URI's slot
+ * @return the key, or NULL on error
+ */
+static PKCS11_PROV_KEY *pkcs11_prov_key_new(PKCS11_PROV *prov,
+                                            CK_SESSION_HANDLE session)
+{
+    PKCS11_PROV_KEY *key;
+
+    if ((key = OPENSSL_zalloc(sizeof(*key))) == NULL)
+        return NULL;
+    key->prov = prov;
+    key->refs = 1;
+    if (!pkcs11_key_pair_read(session, prov->ctx, &key->kp)
+        || !pkcs11_prov_key_public(key)) {
+        pkcs11_prov_key_free(key);
+        return NULL;
+    }
+    return key;
+}
+
+PKCS11_PROV_KEY *pkcs11_prov_key_ref(PKCS11_PROV_KEY *key)
+{
+    __atomic_add_fetch(&key->refs, 1, __ATOMIC_RELAXED);
+    return key;
+}
+
+void pkcs11_prov_key_free(PKCS11_PROV_KEY *key)
+{
+    if (key == NULL || __atomic_sub_fetch(&key->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    pkcs11_key_pair_free(&key->kp);
+    EVP_PKEY_free(key->pub);
+    OPENSSL_free(key);
+}
+
+/* keymgmt */
+
+static void *pkcs11_prov_keymgmt_load(const void *reference,
+                                      size_t reference_sz)
+{
+    if (reference_sz != sizeof(PKCS11_PROV_KEY *))
+        return NULL;
+    return pkcs11_prov_key_ref(*(PKCS11_PROV_KEY **)reference);
+}
+
+static void pkcs11_prov_keymgmt_free(void *keydata)
+{
+    pkcs11_prov_key_free(keydata);
+}
+
+static int pkcs11_prov_keymgmt_has(const void *keydata, int selection)
+{
+    /* a private key of the token always comes with its public half */
+    return keydata != NULL;
+}
+
+static int pkcs11_prov_keymgmt_get_params(void *keydata, OSSL_PARAM params[])
+{
+    PKCS11_PROV_KEY *key = keydata;
+
+    return EVP_PKEY_get_params(key->pub, params);
+}
+
+static const OSSL_PARAM pkcs11_prov_key_params[] = {
+    OSSL_PARAM_int(OSSL_PKEY_PARAM_BITS, NULL),
+    OSSL_PARAM_int(OSSL_PKEY_PARAM_SECURITY_BITS, NULL),
+    OSSL_PARAM_int(OSSL_PKEY_PARAM_MAX_SIZE, NULL),
+    OSSL_PARAM_utf8_string(OSSL_PKEY_PARAM_DEFAULT_DIGEST, NULL, 0),
+    OSSL_PARAM_BN(OSSL_PKEY_PARAM_RSA_N, NULL, 0),
+    OSSL_PARAM_BN(OSSL_PKEY_PARAM_RSA_E, NULL, 0),
+    OSSL_PARAM_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME, NULL, 0),
+    OSSL_PARAM_octet_string(OSSL_PKEY_PARAM_PUB_KEY, NULL, 0),
+    OSSL_PARAM_octet_string(OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY, NULL, 0),
+    OSSL_PARAM_END
+};
+
+static const OSSL_PARAM *pkcs11_prov_keymgmt_gettable_params(void *provctx)
+{
+    return pkcs11_prov_key_params;
+}
+
+/*
+ * Only the public half leaves the token.  Refusing the rest also keeps
+ * EVP from moving a key to another provider to sign or decrypt with it.
+ */
+static int pkcs11_prov_keymgmt_export(void *keydata, int selection,
+                                      OSSL_CALLBACK *param_cb, void *cbarg)
+{
+    PKCS11_PROV_KEY *key = keydata;
+
+    if ((selection & OSSL_KEYMGMT_SELECT_PRIVATE_KEY) != 0)
+        return 0;
+    return EVP_PKEY_export(key->pub, selection, param_cb, cbarg);
+}
+
+static const OSSL_PARAM *pkcs11_prov_keymgmt_export_types(int selection)
+{
+    if ((selection & OSSL_KEYMGMT_SELECT_PRIVATE_KEY) != 0)
+        return NULL;
+    return pkcs11_prov_key_params + 4;
+}
+
+static const char *pkcs11_prov_rsa_operation_name(int operation_id)
+{
+    return "RSA";
+}
+
+static const char *pkcs11_prov_ec_operation_name(int operation_id)
+{
+    return operation_id == OSSL_OP_SIGNATURE ? "ECDSA" : "EC";
+}
+
+#define PKCS11_PROV_KEYMGMT_FUNCTIONS                                       \
+    { OSSL_FUNC_KEYMGMT_LOAD, (void (*)(void))pkcs11_prov_keymgmt_load },   \
+    { OSSL_FUNC_KEYMGMT_FREE, (void (*)(void))pkcs11_prov_keymgmt_free },   \
+    { OSSL_FUNC_KEYMGMT_HAS, (void (*)(void))pkcs11_prov_keymgmt_has },     \
+    { OSSL_FUNC_KEYMGMT_GET_PARAMS,                                         \
+      (void (*)(void))pkcs11_prov_keymgmt_get_params },                     \
+    { OSSL_FUNC_KEYMGMT_GETTABLE_PARAMS,                                    \
+      (void (*)(void))pkcs11_prov_keymgmt_gettable_params },                \
+    { OSSL_FUNC_KEYMGMT_EXPORT, (void (*)(void))pkcs11_prov_keymgmt_export }, \
+    { OSSL_FUNC_KEYMGMT_EXPORT_TYPES,                                       \
+      (void (*)(void))pkcs11_prov_keymgmt_export_types }
+
+static const OSSL_DISPATCH pkcs11_prov_rsa_keymgmt_functions[] = {
+    PKCS11_PROV_KEYMGMT_FUNCTIONS,
+    { OSSL_FUNC_KEYMGMT_QUERY_OPERATION_NAME,
+      (void (*)(void))pkcs11_prov_rsa_operation_name },
+    { 0, NULL }
+};
+
+static const OSSL_DISPATCH pkcs11_prov_ec_keymgmt_functions[] = {
+    PKCS11_PROV_KEYMGMT_FUNCTIONS,
+    { OSSL_FUNC_KEYMGMT_QUERY_OPERATION_NAME,
+      (void (*)(void))pkcs11_prov_ec_operation_name },
+    { 0, NULL }
+};
+
+/* store */
+
+static void pkcs11_prov_store_close(void *loaderctx);
+
+/**
+ * Open a pkcs11: URI as the engine's store does, reading the private key
+ * it names right away: the provider's context only holds the URI while
+ * the load lock is held.
+ * @param provctx
+ * @param uri
+ * @return the store, or NULL on error
+ */
+static void *pkcs11_prov_store_open(void *provctx, const char *uri)
+{
+    PKCS11_PROV *prov = provctx;
+    PKCS11_CTX *ctx = prov->ctx;
+    PKCS11_PROV_STORE *store;
+    CK_SESSION_HANDLE session;
+    int named, private;
+
+    if ((store = OPENSSL_zalloc(sizeof(*store))) == NULL)
+        return NULL;
+    store->prov = prov;
+    if (!CRYPTO_THREAD_write_lock(prov->ctx->load_lock)) {
+        OPENSSL_free(store);
+        return NULL;
+    }
+
+    if (!pkcs11_parse(ctx, uri, 1)
+        || pkcs11_initialize(ctx->module_path) != CKR_OK)
+        goto err;
+    named = ctx->id != NULL || ctx->label != NULL;
+    private = ctx->type == NULL || strncmp(ctx->type, "private", 7) == 0;
+    /* the engine's store stops at public objects, this one does not */
+    if (named && private)
+        ctx->need_pin = 1;
+    if (!pkcs11_get_slot(ctx) || !pkcs11_pin_fill(ctx)
+        || !pkcs11_session_get(ctx, ctx->slotid, &session))
+        goto err;
+
+    /* a session of its own, back to the pool when the store is closed */
+    store->search.pkcs11_ctx = ctx;
+    store->search.slotid = ctx->slotid;
+    store->search.session = session;
+
+    if (named && private) {
+        ERR_set_mark();
+        store->key = pkcs11_prov_key_new(prov, session);
+        /* without a type the URI may well name a certificate only */
+        if (store->key == NULL && ctx->type != NULL) {
+            ERR_clear_last_mark();
+            goto err;
+        }
+        ERR_pop_to_mark();
+    }
+    if (!named) {
+        store->search.listflag = 1;     /* we want names */
+    } else if (ctx->type != NULL && private) {
+        store->search.found_all = 1;    /* nothing else to look for */
+        goto end;
+    }
+    if (!pkcs11_search_start(&store->search, ctx))
+        goto err;
+
+ end:
+    CRYPTO_THREAD_unlock(prov->ctx->load_lock);
+    return store;
+
+ err:
+    CRYPTO_THREAD_unlock(prov->ctx->load_lock);
+    pkcs11_prov_store_close(store);
+    return NULL;
+}
+
+/**
+ * Hand the private key of the URI to the keymgmt, by reference.
+ * @param key
+ * @param object_cb
+ * @param object_cbarg
+ * @return what |object_cb| returns
+ */
+static int pkcs11_prov_store_key(PKCS11_PROV_KEY *key,
+                                 OSSL_CALLBACK *object_cb, void *object_cbarg)
+{
+    OSSL_PARAM params[4];
+    int type = OSSL_OBJECT_PKEY;
+
+    params[0] = OSSL_PARAM_construct_int(OSSL_OBJECT_PARAM_TYPE, &type);
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_OBJECT_PARAM_DATA_TYPE,
+                                                 key->kp.type == CKK_RSA
+                                                 ? "RSA" : "EC", 0);
+    params[2] = OSSL_PARAM_construct_octet_string(OSSL_OBJECT_PARAM_REFERENCE,
+                                                  &key, sizeof(key));
+    params[3] = OSSL_PARAM_construct_end();
+    return object_cb(params, object_cbarg);
+}
+
+/**
+ * The next object of the store: the private key, then what the engine's
+ * search finds.  Certificates and public keys go out as DER for the
+ * decoders of the caller, names as names.
+ * @return 1 on success or at the end, 0 on error
+ */
+static int pkcs11_prov_store_load(void *loaderctx,
+                                  OSSL_CALLBACK *object_cb,
+                                  void *object_cbarg,
+                                  OSSL_PASSPHRASE_CALLBACK *pw_cb,
+                                  void *pw_cbarg)
+{
+    PKCS11_PROV_STORE *store = loaderctx;
+    OSSL_STORE_LOADER_CTX *search = &store->search;
+    OSSL_PARAM params[5], *p;
+    PKCS11_PROV_KEY *key;
+    CK_OBJECT_CLASS class;
+    char *name = NULL, *description = NULL;
+    unsigned char *der = NULL;
+    int type, len = 0, ret;
+
+    if ((key = store->key) != NULL) {
+        store->key = NULL;
+        ret = pkcs11_prov_store_key(key, object_cb, object_cbarg);
+        pkcs11_prov_key_free(key);
+        return ret;
+    }
+
+    /* the search skips private keys, go on to something to return */
+    while (!search->eof) {
+        p = params;
+        if (search->listflag) {
+            if ((search->eof = pkcs11_search_next_ids(search, &name,
+                                                      &description)))
+                break;
+            if (name == NULL)
+                continue;
+            type = OSSL_OBJECT_NAME;
+            *p++ = OSSL_PARAM_construct_utf8_string(OSSL_OBJECT_PARAM_DATA,
+                                                    name, 0);
+            if (description != NULL)
+                *p++ = OSSL_PARAM_construct_utf8_string(
+                           OSSL_OBJECT_PARAM_DESC, description, 0);
+        } else {
+            if ((search->eof = pkcs11_search_next_object(search, &class)))
+                break;
+            if (class == CKO_CERTIFICATE) {
+                type = OSSL_OBJECT_CERT;
+                len = i2d_X509(search->cert, &der);
+                X509_free(search->cert);
+                search->cert = NULL;
+            } else if (class == CKO_PUBLIC_KEY) {
+                type = OSSL_OBJECT_PKEY;
+                len = i2d_PUBKEY(search->key, &der);
+                EVP_PKEY_free(search->key);
+                search->key = NULL;
+                *p++ = OSSL_PARAM_construct_utf8_string(
+                           OSSL_OBJECT_PARAM_DATA_TYPE, "RSA", 0);
+                *p++ = OSSL_PARAM_construct_utf8_string(
+                           OSSL_OBJECT_PARAM_DATA_STRUCTURE,
+                           "SubjectPublicKeyInfo", 0);
+            } else {
+                continue;
+            }
+            if (len <= 0)
+                return 0;
+            *p++ = OSSL_PARAM_construct_octet_string(OSSL_OBJECT_PARAM_DATA,
+                                                     der, len);
+        }
+        *p++ = OSSL_PARAM_construct_int(OSSL_OBJECT_PARAM_TYPE, &type);
+        *p = OSSL_PARAM_construct_end();
+        ret = object_cb(params, object_cbarg);
+        OPENSSL_free(name);
+        OPENSSL_free(description);
+        OPENSSL_free(der);
+        return ret;
+    }
+    return 1;
+}
+
+static int pkcs11_prov_store_eof(void *loaderctx)
+{
+    PKCS11_PROV_STORE *store = loaderctx;
+
+    return store->key == NULL && store->search.eof;
+}
+
+static void pkcs11_prov_store_close(void *loaderctx)
+{
+    PKCS11_PROV_STORE *store = loaderctx;
+    OSSL_STORE_LOADER_CTX *search = &store->search;
+
+    pkcs11_prov_key_free(store->key);
+    /* a search still open would fail the next user of the session */
+    if (search->session != 0)
+        pkcs11_session_put(search->pkcs11_ctx, search->slotid,
+                           search->session,
+                           pkcs11_close_operation(search->session));
+    X509_free(search->cert);
+    EVP_PKEY_free(search->key);
+    OPENSSL_free(store);
+}
+
+static int pkcs11_prov_store_close_fn(void *loaderctx)
+{
+    pkcs11_prov_store_close(loaderctx);
+    return 1;
+}
+
+static const OSSL_DISPATCH pkcs11_prov_store_functions[] = {
+    { OSSL_FUNC_STORE_OPEN, (void (*)(void))pkcs11_prov_store_open },
+    { OSSL_FUNC_STORE_LOAD, (void (*)(void))pkcs11_prov_store_load },
+    { OSSL_FUNC_STORE_EOF, (void (*)(void))pkcs11_prov_store_eof },
+    { OSSL_FUNC_STORE_CLOSE, (void (*)(void))pkcs11_prov_store_close_fn },
+    { 0, NULL }
+};
+
+/* provider */
+
+static const OSSL_ALGORITHM pkcs11_prov_keymgmt[] = {
+    { "RSA:rsaEncryption", PKCS11_PROV_PROPS,
+      pkcs11_prov_rsa_keymgmt_functions, "PKCS#11 RSA key" },
+    { "EC:id-ecPublicKey", PKCS11_PROV_PROPS,
+      pkcs11_prov_ec_keymgmt_functions, "PKCS#11 EC key" },
+    { NULL, NULL, NULL, NULL }
+};
+
+static const OSSL_ALGORITHM pkcs11_prov_signature[] = {
+    { "RSA:rsaEncryption", PKCS11_PROV_PROPS,
+      pkcs11_prov_signature_functions, "PKCS#11 RSA signature" },
+    { "ECDSA", PKCS11_PROV_PROPS,
+      pkcs11_prov_signature_functions, "PKCS#11 ECDSA signature" },
+    { NULL, NULL, NULL, NULL }
+};
+
+static const OSSL_ALGORITHM pkcs11_prov_asym_cipher[] = {
+    { "RSA:rsaEncryption", PKCS11_PROV_PROPS,
+      pkcs11_prov_asym_cipher_functions, "PKCS#11 RSA decryption" },
+    { NULL, NULL, NULL, NULL }
+};
+
+static const OSSL_ALGORITHM pkcs11_prov_store[] = {
+    { "pkcs11", PKCS11_PROV_PROPS, pkcs11_prov_store_functions,
+      "PKCS#11 URI store" },
+    { NULL, NULL, NULL, NULL }
+};
+
+static const OSSL_ALGORITHM *pkcs11_prov_query(void *provctx,
+                                               int operation_id,
+                                               int *no_cache)
+{
+    *no_cache = 0;
+    switch (operation_id) {
+    case OSSL_OP_KEYMGMT:
+        return pkcs11_prov_keymgmt;
+    case OSSL_OP_SIGNATURE:
+        return pkcs11_prov_signature;
+    case OSSL_OP_ASYM_CIPHER:
+        return pkcs11_prov_asym_cipher;
+    case OSSL_OP_STORE:
+        return pkcs11_prov_store;
+    }
+    return NULL;
+}
+
+static const OSSL_PARAM pkcs11_prov_params[] = {
+    OSSL_PARAM_utf8_ptr(OSSL_PROV_PARAM_NAME, NULL, 0),
+    OSSL_PARAM_int(OSSL_PROV_PARAM_STATUS, NULL),
+    OSSL_PARAM_END
+};
+
+static const OSSL_PARAM *pkcs11_prov_gettable_params(void *provctx)
+{
+    return pkcs11_prov_params;
+}
+
+static int pkcs11_prov_get_params(void *provctx, OSSL_PARAM params[])
+{
+    OSSL_PARAM *p;
+
+    p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_NAME);
+    if (p != NULL && !OSSL_PARAM_set_utf8_ptr(p, "PKCS#11 provider"))
+        return 0;
+    p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_STATUS);
+    if (p != NULL && !OSSL_PARAM_set_int(p, 1))
+        return 0;
+    return 1;
+}
+
+static void pkcs11_prov_teardown(void *provctx)
+{
+    PKCS11_PROV *prov = provctx;
+    PKCS11_CTX *ctx = prov->ctx;
+
+    if (ctx != NULL) {
+        pkcs11_ctx_free(ctx);
+        pkcs11_pin_vault_free(&ctx->vault);
+        pkcs11_profiles_free(ctx);
+        /* that of the configuration, else the environment's */
+        if (prov->module_path != ctx->module_path)
+            ctx->module_path = NULL;
+        pkcs11_key_ops_free(ctx);
+        OPENSSL_free(ctx);
+    }
+    OPENSSL_free(prov->module_path);
+    OSSL_LIB_CTX_free(prov->libctx);
+    OPENSSL_free(prov);
+}
+
+static const OSSL_DISPATCH pkcs11_prov_functions[] = {
+    { OSSL_FUNC_PROVIDER_TEARDOWN, (void (*)(void))pkcs11_prov_teardown },
+    { OSSL_FUNC_PROVIDER_GETTABLE_PARAMS,
+      (void (*)(void))pkcs11_prov_gettable_params },
+    { OSSL_FUNC_PROVIDER_GET_PARAMS, (void (*)(void))pkcs11_prov_get_params },
+    { OSSL_FUNC_PROVIDER_QUERY_OPERATION, (void (*)(void))pkcs11_prov_query },
+    { 0, NULL }
+};
+
+int OSSL_provider_init(const OSSL_CORE_HANDLE *handle,
+                       const OSSL_DISPATCH *in, const OSSL_DISPATCH **out,
+                       void **provctx)
+{
+    const OSSL_DISPATCH *fn;
+    PKCS11_PROV *prov;
+    PKCS11_CTX *ctx;
+    char *module_path = NULL, *pin = NULL;
+    OSSL_PARAM params[3];
+
+    for (fn = in; fn->function_id != 0; fn++) {
+        if (fn->function_id == OSSL_FUNC_CORE_GET_PARAMS)
+            core_get_params = OSSL_FUNC_core_get_params(fn);
+    }
+    ERR_load_PKCS11_strings();
+
+    if ((prov = OPENSSL_zalloc(sizeof(*prov))) == NULL)
+        goto memerr;
+    prov->handle = handle;
+    if ((prov->libctx = OSSL_LIB_CTX_new_child(handle, in)) == NULL
+        || (prov->ctx = ctx = pkcs11_ctx_new()) == NULL
+        || ctx->load_lock == NULL
+        || (ctx->names_lock = CRYPTO_THREAD_lock_new()) == NULL
+        || !pkcs11_pin_vault_init(&ctx->vault))
+        goto memerr;
+
+    /* the provider's section of the configuration */
+    params[0] = OSSL_PARAM_construct_utf8_ptr(PKCS11_PROV_PARAM_MODULE_PATH,
+                                              &module_path, 0);
+    params[1] = OSSL_PARAM_construct_utf8_ptr(PKCS11_PROV_PARAM_PIN, &pin, 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (core_get_params != NULL && !core_get_params(handle, params))
+        goto err;
+    if (module_path != NULL
+        && (prov->module_path = ctx->module_path =
+            OPENSSL_strdup(module_path)) == NULL)
+        goto memerr;
+    if (pin != NULL && !pkcs11_pin_set_default(ctx, pin))
+        goto err;
+
+    *out = pkcs11_prov_functions;
+    *provctx = prov;
+    return 1;
+
+ memerr:
+    PKCS11err(PKCS11_F_PKCS11_PROV_INIT, ERR_R_MALLOC_FAILURE);
+ err:
+    if (prov != NULL)
+        pkcs11_prov_teardown(prov);
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+#ifndef HEADER_PKCS11PROV_H
+# define HEADER_PKCS11PROV_H
+
+# include <openssl/core_dispatch.h>
+# include "e_pkcs11.h"
+
+/*
+ * OpenSSL 3 provider.  It drives the module with the engine's core, the
+ * same session pools, slot lookup, PIN vault and profiles, through a
+ * PKCS11_CTX of its own that no engine owns.  Private key operations run
+ * on the token; what only needs the public half, verification and
+ * encryption, goes to another provider with a copy of it.
+ */
+
+/* Every algorithm of the provider says so, and the public halves not */
+# define PKCS11_PROV_PROPS      "provider=pkcs11"
+# define PKCS11_PROV_PROPQ      "provider!=pkcs11"
+
+/* One per library context the provider is loaded into */
+typedef struct PKCS11_PROV_st {
+    const OSSL_CORE_HANDLE *handle;
+    OSSL_LIB_CTX *libctx;       /* a child of the caller's */
+    PKCS11_CTX *ctx;
+    char *module_path;          /* of the configuration, else NULL */
+} PKCS11_PROV;
+
+/*
+ * A key of the keymgmt: a key pair of the token, and the same public key
+ * built by another provider.  Operations only read it.
+ */
+typedef struct PKCS11_PROV_KEY_st {
+    PKCS11_PROV *prov;
+    PKCS11_KEY_PAIR kp;
+    EVP_PKEY *pub;
+    int refs;
+} PKCS11_PROV_KEY;
+
+extern const OSSL_DISPATCH pkcs11_prov_signature_functions[];
+extern const OSSL_DISPATCH pkcs11_prov_asym_cipher_functions[];
+
+PKCS11_PROV_KEY *pkcs11_prov_key_ref(PKCS11_PROV_KEY *key);
+void pkcs11_prov_key_free(PKCS11_PROV_KEY *key);
+
+#endif
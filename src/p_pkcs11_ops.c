@@ -0,0 +1,732 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Operations of the provider's keys.  Each operation context is the
+ * caller's own: the parameters it was given, a digest under way and the
+ * key it holds a reference to; signing or decrypting takes a pooled
+ * session of the key's slot for one single-part token operation, with no
+ * lock of the provider.  Verification and encryption are made by another
+ * provider with the key's public half, EVP_DigestSign() hashes here.
+ */
+
+#include <string.h>
+#include <openssl/core_names.h>
+#include <openssl/ec.h>
+#include <openssl/params.h>
+#include <openssl/rsa.h>
+#include "p_pkcs11.h"
+#include "e_pkcs11_err.h"
+
+#define PKCS11_PROV_ECDSA_MAX   132     /* r || s of P-521 */
+
+/* A signature under way */
+typedef struct PKCS11_PROV_SIG_st {
+    PKCS11_PROV *prov;
+    PKCS11_PROV_KEY *key;
+    int pad;                    /* RSA_PKCS1_PADDING, PSS or none */
+    EVP_MD *md;                 /* NULL signs the input as it is */
+    EVP_MD *mgf1;               /* NULL for |md| */
+    int saltlen;                /* RSA_PSS_SALTLEN_* or a length */
+    EVP_MD_CTX *mdctx;          /* EVP_DigestSign() */
+    EVP_MD_CTX *pubmd;          /* EVP_DigestVerify(), with the public half */
+    EVP_PKEY_CTX *pubctx;       /* verification, that of |pubmd| if any */
+} PKCS11_PROV_SIG;
+
+/* A decryption, or an encryption, under way */
+typedef struct PKCS11_PROV_CIPHER_st {
+    PKCS11_PROV *prov;
+    PKCS11_PROV_KEY *key;
+    int pad;
+    EVP_MD *md;                 /* OAEP, NULL for SHA-1 */
+    EVP_MD *mgf1;               /* NULL for |md| */
+    unsigned char *label;
+    size_t labellen;
+    EVP_PKEY_CTX *pubctx;       /* encryption, with the public half */
+} PKCS11_PROV_CIPHER;
+
+/**
+ * The PKCS#11 mechanism and MGF of a digest, for PSS and OAEP.
+ * @param md
+ * @param mech
+ * @param mgf
+ * @return 1 on success, 0 if the digest has none
+ */
+static int pkcs11_prov_md_mech(const EVP_MD *md, CK_MECHANISM_TYPE *mech,
+                               CK_RSA_PKCS_MGF_TYPE *mgf)
+{
+    CK_MECHANISM_TYPE m;
+    CK_RSA_PKCS_MGF_TYPE g;
+
+    switch (EVP_MD_get_type(md)) {
+    case NID_sha1:
+        m = CKM_SHA_1;
+        g = CKG_MGF1_SHA1;
+        break;
+    case NID_sha224:
+        m = CKM_SHA224;
+        g = CKG_MGF1_SHA224;
+        break;
+    case NID_sha256:
+        m = CKM_SHA256;
+        g = CKG_MGF1_SHA256;
+        break;
+    case NID_sha384:
+        m = CKM_SHA384;
+        g = CKG_MGF1_SHA384;
+        break;
+    case NID_sha512:
+        m = CKM_SHA512;
+        g = CKG_MGF1_SHA512;
+        break;
+    default:
+        PKCS11err(PKCS11_F_PKCS11_KEY_OP, PKCS11_R_UNKNOWN_ALGORITHM_TYPE);
+        return 0;
+    }
+    if (mech != NULL)
+        *mech = m;
+    *mgf = g;
+    return 1;
+}
+
+/**
+ * A digest of a parameter, fetched from the provider's library context.
+ * @param prov
+ * @param p a digest name
+ * @param md replaced on success
+ * @return 1 on success, 0 on error
+ */
+static int pkcs11_prov_get_md(PKCS11_PROV *prov, const OSSL_PARAM *p,
+                              EVP_MD **md)
+{
+    const char *name;
+    EVP_MD *fetched;
+
+    if (!OSSL_PARAM_get_utf8_string_ptr(p, &name)
+        || (fetched = EVP_MD_fetch(prov->libctx, name, NULL)) == NULL)
+        return 0;
+    EVP_MD_free(*md);
+    *md = fetched;
+    return 1;
+}
+
+/* An RSA padding mode, by name or by number */
+static int pkcs11_prov_get_pad(const OSSL_PARAM *p, int *pad)
+{
+    static const struct {
+        const char *name;
+        int pad;
+    } modes[] = {
+        { OSSL_PKEY_RSA_PAD_MODE_NONE, RSA_NO_PADDING },
+        { OSSL_PKEY_RSA_PAD_MODE_PKCSV15, RSA_PKCS1_PADDING },
+        { OSSL_PKEY_RSA_PAD_MODE_OAEP, RSA_PKCS1_OAEP_PADDING },
+        { OSSL_PKEY_RSA_PAD_MODE_PSS, RSA_PKCS1_PSS_PADDING }
+    };
+    size_t i;
+
+    if (p->data_type != OSSL_PARAM_UTF8_STRING)
+        return OSSL_PARAM_get_int(p, pad);
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (strcmp(p->data, modes[i].name) == 0) {
+            *pad = modes[i].pad;
+            return 1;
+        }
+    }
+    PKCS11err(PKCS11_F_PKCS11_KEY_OP, PKCS11_R_UNSUPPORTED_PADDING);
+    return 0;
+}
+
+/* signature */
+
+static void *pkcs11_prov_sig_newctx(void *provctx, const char *propq)
+{
+    PKCS11_PROV_SIG *sig;
+
+    if ((sig = OPENSSL_zalloc(sizeof(*sig))) == NULL)
+        return NULL;
+    sig->prov = provctx;
+    sig->pad = RSA_PKCS1_PADDING;
+    /* what tokens take, and verifiers asking for "auto" too */
+    sig->saltlen = RSA_PSS_SALTLEN_DIGEST;
+    return sig;
+}
+
+/* Drop what the last init left behind, before another */
+static void pkcs11_prov_sig_reset(PKCS11_PROV_SIG *sig)
+{
+    pkcs11_prov_key_free(sig->key);
+    sig->key = NULL;
+    EVP_MD_CTX_free(sig->mdctx);
+    sig->mdctx = NULL;
+    if (sig->pubmd != NULL)
+        EVP_MD_CTX_free(sig->pubmd);
+    else
+        EVP_PKEY_CTX_free(sig->pubctx);
+    sig->pubmd = NULL;
+    sig->pubctx = NULL;
+}
+
+static void pkcs11_prov_sig_freectx(void *vsig)
+{
+    PKCS11_PROV_SIG *sig = vsig;
+
+    pkcs11_prov_sig_reset(sig);
+    EVP_MD_free(sig->md);
+    EVP_MD_free(sig->mgf1);
+    OPENSSL_free(sig);
+}
+
+static void *pkcs11_prov_sig_dupctx(void *vsig)
+{
+    PKCS11_PROV_SIG *sig = vsig, *dup;
+
+    if ((dup = OPENSSL_memdup(sig, sizeof(*sig))) == NULL)
+        return NULL;
+    if (dup->key != NULL)
+        pkcs11_prov_key_ref(dup->key);
+    if (dup->md != NULL)
+        EVP_MD_up_ref(dup->md);
+    if (dup->mgf1 != NULL)
+        EVP_MD_up_ref(dup->mgf1);
+    dup->mdctx = dup->pubmd = NULL;
+    dup->pubctx = NULL;
+    if (sig->mdctx != NULL
+        && ((dup->mdctx = EVP_MD_CTX_new()) == NULL
+            || !EVP_MD_CTX_copy_ex(dup->mdctx, sig->mdctx)))
+        goto err;
+    if (sig->pubmd != NULL) {
+        if ((dup->pubmd = EVP_MD_CTX_new()) == NULL
+            || !EVP_MD_CTX_copy_ex(dup->pubmd, sig->pubmd))
+            goto err;
+        dup->pubctx = EVP_MD_CTX_get_pkey_ctx(dup->pubmd);
+    } else if (sig->pubctx != NULL
+               && (dup->pubctx = EVP_PKEY_CTX_dup(sig->pubctx)) == NULL) {
+        goto err;
+    }
+    return dup;
+
+ err:
+    pkcs11_prov_sig_freectx(dup);
+    return NULL;
+}
+
+static int pkcs11_prov_sig_set_ctx_params(void *vsig,
+                                          const OSSL_PARAM params[])
+{
+    PKCS11_PROV_SIG *sig = vsig;
+    const OSSL_PARAM *p;
+    const char *s;
+
+    /* a verification is the other provider's */
+    if (sig->pubctx != NULL)
+        return EVP_PKEY_CTX_set_params(sig->pubctx, params);
+    if (params == NULL)
+        return 1;
+
+    p = OSSL_PARAM_locate_const(params, OSSL_SIGNATURE_PARAM_PAD_MODE);
+    if (p != NULL && !pkcs11_prov_get_pad(p, &sig->pad))
+        return 0;
+    p = OSSL_PARAM_locate_const(params, OSSL_SIGNATURE_PARAM_DIGEST);
+    if (p != NULL && !pkcs11_prov_get_md(sig->prov, p, &sig->md))
+        return 0;
+    p = OSSL_PARAM_locate_const(params, OSSL_SIGNATURE_PARAM_MGF1_DIGEST);
+    if (p != NULL && !pkcs11_prov_get_md(sig->prov, p, &sig->mgf1))
+        return 0;
+    p = OSSL_PARAM_locate_const(params, OSSL_SIGNATURE_PARAM_PSS_SALTLEN);
+    if (p != NULL) {
+        if (p->data_type != OSSL_PARAM_UTF8_STRING)
+            return OSSL_PARAM_get_int(p, &sig->saltlen);
+        s = p->data;
+        if (strcmp(s, OSSL_PKEY_RSA_PSS_SALT_LEN_DIGEST) == 0)
+            sig->saltlen = RSA_PSS_SALTLEN_DIGEST;
+        else if (strcmp(s, OSSL_PKEY_RSA_PSS_SALT_LEN_MAX) == 0
+                 || strcmp(s, OSSL_PKEY_RSA_PSS_SALT_LEN_AUTO) == 0)
+            sig->saltlen = RSA_PSS_SALTLEN_MAX;
+        else
+            sig->saltlen = atoi(s);
+    }
+    return 1;
+}
+
+static const OSSL_PARAM pkcs11_prov_sig_params[] = {
+    OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_PAD_MODE, NULL, 0),
+    OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_DIGEST, NULL, 0),
+    OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_MGF1_DIGEST, NULL, 0),
+    OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_PSS_SALTLEN, NULL, 0),
+    OSSL_PARAM_END
+};
+
+static const OSSL_PARAM *pkcs11_prov_sig_settable_ctx_params(void *vsig,
+                                                             void *provctx)
+{
+    return pkcs11_prov_sig_params;
+}
+
+static int pkcs11_prov_sig_init(PKCS11_PROV_SIG *sig, void *provkey,
+                                const OSSL_PARAM params[], int verify)
+{
+    PKCS11_PROV_KEY *key = provkey;
+
+    pkcs11_prov_sig_reset(sig);
+    sig->key = pkcs11_prov_key_ref(key);
+    if (verify
+        && ((sig->pubctx =
+             EVP_PKEY_CTX_new_from_pkey(sig->prov->libctx, key->pub,
+                                        PKCS11_PROV_PROPQ)) == NULL
+            || EVP_PKEY_verify_init(sig->pubctx) <= 0))
+        return 0;
+    return pkcs11_prov_sig_set_ctx_params(sig, params);
+}
+
+static int pkcs11_prov_sign_init(void *vsig, void *provkey,
+                                 const OSSL_PARAM params[])
+{
+    return pkcs11_prov_sig_init(vsig, provkey, params, 0);
+}
+
+static int pkcs11_prov_verify_init(void *vsig, void *provkey,
+                                   const OSSL_PARAM params[])
+{
+    return pkcs11_prov_sig_init(vsig, provkey, params, 1);
+}
+
+/**
+ * CK_RSA_PKCS_PSS_PARAMS of the signature's parameters.
+ * @param sig
+ * @param pss
+ * @return 1 on success, 0 on error
+ */
+static int pkcs11_prov_pss_params(PKCS11_PROV_SIG *sig,
+                                  CK_RSA_PKCS_PSS_PARAMS *pss)
+{
+    int hlen, emlen;
+
+    if (sig->md == NULL
+        || !pkcs11_prov_md_mech(sig->md, &pss->hashAlg, &pss->mgf)
+        || (sig->mgf1 != NULL
+            && !pkcs11_prov_md_mech(sig->mgf1, NULL, &pss->mgf)))
+        return 0;
+    hlen = EVP_MD_get_size(sig->md);
+    emlen = (EVP_PKEY_get_bits(sig->key->pub) + 6) / 8;
+    if (sig->saltlen == RSA_PSS_SALTLEN_DIGEST)
+        pss->sLen = hlen;
+    else if (sig->saltlen < 0)
+        pss->sLen = emlen - hlen - 2;
+    else
+        pss->sLen = sig->saltlen;
+    return 1;
+}
+
+/**
+ * DER of an ECDSA signature the token made as r || s.
+ * @param raw
+ * @param len
+ * @param out
+ * @param outlen
+ * @return 1 on success, 0 on error
+ */
+static int pkcs11_prov_ecdsa_der(const unsigned char *raw, size_t len,
+                                 unsigned char *out, size_t *outlen)
+{
+    ECDSA_SIG *s;
+    BIGNUM *r = BN_bin2bn(raw, len / 2, NULL);
+    BIGNUM *ss = BN_bin2bn(raw + len / 2, len / 2, NULL);
+    int derlen = 0;
+
+    if ((s = ECDSA_SIG_new()) != NULL && r != NULL && ss != NULL
+        && ECDSA_SIG_set0(s, r, ss)) {
+        r = ss = NULL;
+        derlen = i2d_ECDSA_SIG(s, &out);
+    }
+    BN_free(r);
+    BN_free(ss);
+    ECDSA_SIG_free(s);
+    if (derlen <= 0)
+        return 0;
+    *outlen = derlen;
+    return 1;
+}
+
+static int pkcs11_prov_sign(void *vsig, unsigned char *sigret,
+                            size_t *siglen, size_t sigsize,
+                            const unsigned char *tbs, size_t tbslen)
+{
+    PKCS11_PROV_SIG *sig = vsig;
+    PKCS11_PROV_KEY *key = sig->key;
+    PKCS11_CTX *ctx = sig->prov->ctx;
+    CK_MECHANISM mech = { 0 };
+    CK_RSA_PKCS_PSS_PARAMS pss;
+    unsigned char raw[PKCS11_PROV_ECDSA_MAX];
+    unsigned char *encoded = NULL, *padded = NULL;
+    const unsigned char *in = tbs;
+    size_t inlen = tbslen, len, size = EVP_PKEY_get_size(key->pub);
+    int enclen = 0, ret = 0;
+
+    if (sigret == NULL) {
+        *siglen = size;
+        return 1;
+    }
+    if (sigsize < size) {
+        PKCS11err(PKCS11_F_PKCS11_KEY_OP, PKCS11_R_SIGN_FAILED);
+        return 0;
+    }
+
+    if (key->kp.type == CKK_EC) {
+        mech.mechanism = CKM_ECDSA;
+        len = sizeof(raw);
+        return pkcs11_key_op(ctx, &key->kp, 0, &mech, tbs, tbslen, raw,
+                             &len)
+               && pkcs11_prov_ecdsa_der(raw, len, sigret, siglen);
+    }
+
+    switch (sig->pad) {
+    case RSA_PKCS1_PADDING:
+        /* no digest for a DigestInfo made already, or TLS 1.1 MD5+SHA1 */
+        if (sig->md != NULL) {
+            if (tbslen != (size_t)EVP_MD_get_size(sig->md)
+                || !pkcs11_rsa_encode_pkcs1(&encoded, &enclen,
+                                            EVP_MD_get_type(sig->md),
+                                            tbs, tbslen))
+                goto end;
+            in = encoded;
+            inlen = enclen;
+        }
+        if (ctx->profile.raw_rsa) {
+            /* the module signs raw blocks better than it pads them */
+            if ((padded = OPENSSL_malloc(size)) == NULL
+                || RSA_padding_add_PKCS1_type_1(padded, size, in,
+                                                inlen) <= 0) {
+                PKCS11err(PKCS11_F_PKCS11_KEY_OP,
+                          PKCS11_R_PADDING_ADD_FAILED);
+                goto end;
+            }
+            in = padded;
+            inlen = size;
+            mech.mechanism = CKM_RSA_X_509;
+        } else {
+            mech.mechanism = CKM_RSA_PKCS;
+        }
+        break;
+    case RSA_PKCS1_PSS_PADDING:
+        if (!pkcs11_prov_pss_params(sig, &pss))
+            goto end;
+        mech.mechanism = CKM_RSA_PKCS_PSS;
+        mech.pParameter = &pss;
+        mech.ulParameterLen = sizeof(pss);
+        break;
+    case RSA_NO_PADDING:
+        mech.mechanism = CKM_RSA_X_509;
+        break;
+    default:
+        PKCS11err(PKCS11_F_PKCS11_KEY_OP, PKCS11_R_UNSUPPORTED_PADDING);
+        goto end;
+    }
+
+    len = sigsize;
+    if (pkcs11_key_op(ctx, &key->kp, 0, &mech, in, inlen, sigret, &len)) {
+        *siglen = len;
+        ret = 1;
+    }
+
+ end:
+    OPENSSL_clear_free(encoded, enclen);
+    OPENSSL_clear_free(padded, size);
+    return ret;
+}
+
+static int pkcs11_prov_verify(void *vsig, const unsigned char *sigret,
+                              size_t siglen, const unsigned char *tbs,
+                              size_t tbslen)
+{
+    PKCS11_PROV_SIG *sig = vsig;
+
+    return EVP_PKEY_verify(sig->pubctx, sigret, siglen, tbs, tbslen);
+}
+
+static int pkcs11_prov_digest_sign_init(void *vsig, const char *mdname,
+                                        void *provkey,
+                                        const OSSL_PARAM params[])
+{
+    PKCS11_PROV_SIG *sig = vsig;
+    OSSL_PARAM md[2];
+
+    if (!pkcs11_prov_sig_init(sig, provkey, params, 0))
+        return 0;
+    if (mdname != NULL) {
+        md[0] = OSSL_PARAM_construct_utf8_string(OSSL_SIGNATURE_PARAM_DIGEST,
+                                                 (char *)mdname, 0);
+        md[1] = OSSL_PARAM_construct_end();
+        if (!pkcs11_prov_sig_set_ctx_params(sig, md))
+            return 0;
+    }
+    if (sig->md == NULL) {
+        PKCS11err(PKCS11_F_PKCS11_KEY_OP, PKCS11_R_UNKNOWN_ALGORITHM_TYPE);
+        return 0;
+    }
+    return (sig->mdctx = EVP_MD_CTX_new()) != NULL
+           && EVP_DigestInit_ex2(sig->mdctx, sig->md, NULL);
+}
+
+static int pkcs11_prov_digest_sign_update(void *vsig,
+                                          const unsigned char *data,
+                                          size_t datalen)
+{
+    PKCS11_PROV_SIG *sig = vsig;
+
+    return EVP_DigestUpdate(sig->mdctx, data, datalen);
+}
+
+static int pkcs11_prov_digest_sign_final(void *vsig, unsigned char *sigret,
+                                         size_t *siglen, size_t sigsize)
+{
+    PKCS11_PROV_SIG *sig = vsig;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+
+    if (sigret == NULL)
+        return pkcs11_prov_sign(sig, NULL, siglen, 0, NULL, 0);
+    return EVP_DigestFinal_ex(sig->mdctx, md, &mdlen)
+           && pkcs11_prov_sign(sig, sigret, siglen, sigsize, md, mdlen);
+}
+
+static int pkcs11_prov_digest_verify_init(void *vsig, const char *mdname,
+                                          void *provkey,
+                                          const OSSL_PARAM params[])
+{
+    PKCS11_PROV_SIG *sig = vsig;
+    PKCS11_PROV_KEY *key = provkey;
+
+    pkcs11_prov_sig_reset(sig);
+    sig->key = pkcs11_prov_key_ref(key);
+    return (sig->pubmd = EVP_MD_CTX_new()) != NULL
+           && EVP_DigestVerifyInit_ex(sig->pubmd, &sig->pubctx, mdname,
+                                      sig->prov->libctx, PKCS11_PROV_PROPQ,
+                                      key->pub, NULL)
+           && pkcs11_prov_sig_set_ctx_params(sig, params);
+}
+
+static int pkcs11_prov_digest_verify_update(void *vsig,
+                                            const unsigned char *data,
+                                            size_t datalen)
+{
+    PKCS11_PROV_SIG *sig = vsig;
+
+    return EVP_DigestVerifyUpdate(sig->pubmd, data, datalen);
+}
+
+static int pkcs11_prov_digest_verify_final(void *vsig,
+                                           const unsigned char *sigret,
+                                           size_t siglen)
+{
+    PKCS11_PROV_SIG *sig = vsig;
+
+    return EVP_DigestVerifyFinal(sig->pubmd, sigret, siglen);
+}
+
+const OSSL_DISPATCH pkcs11_prov_signature_functions[] = {
+    { OSSL_FUNC_SIGNATURE_NEWCTX, (void (*)(void))pkcs11_prov_sig_newctx },
+    { OSSL_FUNC_SIGNATURE_FREECTX, (void (*)(void))pkcs11_prov_sig_freectx },
+    { OSSL_FUNC_SIGNATURE_DUPCTX, (void (*)(void))pkcs11_prov_sig_dupctx },
+    { OSSL_FUNC_SIGNATURE_SIGN_INIT, (void (*)(void))pkcs11_prov_sign_init },
+    { OSSL_FUNC_SIGNATURE_SIGN, (void (*)(void))pkcs11_prov_sign },
+    { OSSL_FUNC_SIGNATURE_VERIFY_INIT,
+      (void (*)(void))pkcs11_prov_verify_init },
+    { OSSL_FUNC_SIGNATURE_VERIFY, (void (*)(void))pkcs11_prov_verify },
+    { OSSL_FUNC_SIGNATURE_DIGEST_SIGN_INIT,
+      (void (*)(void))pkcs11_prov_digest_sign_init },
+    { OSSL_FUNC_SIGNATURE_DIGEST_SIGN_UPDATE,
+      (void (*)(void))pkcs11_prov_digest_sign_update },
+    { OSSL_FUNC_SIGNATURE_DIGEST_SIGN_FINAL,
+      (void (*)(void))pkcs11_prov_digest_sign_final },
+    { OSSL_FUNC_SIGNATURE_DIGEST_VERIFY_INIT,
+      (void (*)(void))pkcs11_prov_digest_verify_init },
+    { OSSL_FUNC_SIGNATURE_DIGEST_VERIFY_UPDATE,
+      (void (*)(void))pkcs11_prov_digest_verify_update },
+    { OSSL_FUNC_SIGNATURE_DIGEST_VERIFY_FINAL,
+      (void (*)(void))pkcs11_prov_digest_verify_final },
+    { OSSL_FUNC_SIGNATURE_SET_CTX_PARAMS,
+      (void (*)(void))pkcs11_prov_sig_set_ctx_params },
+    { OSSL_FUNC_SIGNATURE_SETTABLE_CTX_PARAMS,
+      (void (*)(void))pkcs11_prov_sig_settable_ctx_params },
+    { 0, NULL }
+};
+
+/* asym-cipher */
+
+static void *pkcs11_prov_cipher_newctx(void *provctx)
+{
+    PKCS11_PROV_CIPHER *cipher;
+
+    if ((cipher = OPENSSL_zalloc(sizeof(*cipher))) == NULL)
+        return NULL;
+    cipher->prov = provctx;
+    cipher->pad = RSA_PKCS1_PADDING;
+    return cipher;
+}
+
+static void pkcs11_prov_cipher_freectx(void *vcipher)
+{
+    PKCS11_PROV_CIPHER *cipher = vcipher;
+
+    pkcs11_prov_key_free(cipher->key);
+    EVP_PKEY_CTX_free(cipher->pubctx);
+    EVP_MD_free(cipher->md);
+    EVP_MD_free(cipher->mgf1);
+    OPENSSL_free(cipher->label);
+    OPENSSL_free(cipher);
+}
+
+static int pkcs11_prov_cipher_set_ctx_params(void *vcipher,
+                                             const OSSL_PARAM params[])
+{
+    PKCS11_PROV_CIPHER *cipher = vcipher;
+    const OSSL_PARAM *p;
+    void *label = NULL;
+
+    /* an encryption is the other provider's */
+    if (cipher->pubctx != NULL)
+        return EVP_PKEY_CTX_set_params(cipher->pubctx, params);
+    if (params == NULL)
+        return 1;
+
+    p = OSSL_PARAM_locate_const(params, OSSL_ASYM_CIPHER_PARAM_PAD_MODE);
+    if (p != NULL && !pkcs11_prov_get_pad(p, &cipher->pad))
+        return 0;
+    p = OSSL_PARAM_locate_const(params, OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST);
+    if (p != NULL && !pkcs11_prov_get_md(cipher->prov, p, &cipher->md))
+        return 0;
+    p = OSSL_PARAM_locate_const(params, OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST);
+    if (p != NULL && !pkcs11_prov_get_md(cipher->prov, p, &cipher->mgf1))
+        return 0;
+    p = OSSL_PARAM_locate_const(params, OSSL_ASYM_CIPHER_PARAM_OAEP_LABEL);
+    if (p != NULL) {
+        if (!OSSL_PARAM_get_octet_string(p, &label, 0, &cipher->labellen))
+            return 0;
+        OPENSSL_free(cipher->label);
+        cipher->label = label;
+    }
+    return 1;
+}
+
+static const OSSL_PARAM pkcs11_prov_cipher_params[] = {
+    OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_PAD_MODE, NULL, 0),
+    OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST, NULL, 0),
+    OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST, NULL, 0),
+    OSSL_PARAM_octet_string(OSSL_ASYM_CIPHER_PARAM_OAEP_LABEL, NULL, 0),
+    OSSL_PARAM_END
+};
+
+static const OSSL_PARAM *pkcs11_prov_cipher_settable_ctx_params(
+    void *vcipher, void *provctx)
+{
+    return pkcs11_prov_cipher_params;
+}
+
+static int pkcs11_prov_cipher_init(PKCS11_PROV_CIPHER *cipher, void *provkey,
+                                   const OSSL_PARAM params[], int encrypt)
+{
+    PKCS11_PROV_KEY *key = provkey;
+
+    pkcs11_prov_key_free(cipher->key);
+    EVP_PKEY_CTX_free(cipher->pubctx);
+    cipher->pubctx = NULL;
+    cipher->key = pkcs11_prov_key_ref(key);
+    if (encrypt
+        && ((cipher->pubctx =
+             EVP_PKEY_CTX_new_from_pkey(cipher->prov->libctx, key->pub,
+                                        PKCS11_PROV_PROPQ)) == NULL
+            || EVP_PKEY_encrypt_init(cipher->pubctx) <= 0))
+        return 0;
+    return pkcs11_prov_cipher_set_ctx_params(cipher, params);
+}
+
+static int pkcs11_prov_encrypt_init(void *vcipher, void *provkey,
+                                    const OSSL_PARAM params[])
+{
+    return pkcs11_prov_cipher_init(vcipher, provkey, params, 1);
+}
+
+static int pkcs11_prov_decrypt_init(void *vcipher, void *provkey,
+                                    const OSSL_PARAM params[])
+{
+    return pkcs11_prov_cipher_init(vcipher, provkey, params, 0);
+}
+
+static int pkcs11_prov_encrypt(void *vcipher, unsigned char *out,
+                               size_t *outlen, size_t outsize,
+                               const unsigned char *in, size_t inlen)
+{
+    PKCS11_PROV_CIPHER *cipher = vcipher;
+
+    *outlen = outsize;
+    return EVP_PKEY_encrypt(cipher->pubctx, out, outlen, in, inlen);
+}
+
+static int pkcs11_prov_decrypt(void *vcipher, unsigned char *out,
+                               size_t *outlen, size_t outsize,
+                               const unsigned char *in, size_t inlen)
+{
+    PKCS11_PROV_CIPHER *cipher = vcipher;
+    CK_MECHANISM mech = { 0 };
+    CK_RSA_PKCS_OAEP_PARAMS oaep;
+    const EVP_MD *md;
+
+    if (out == NULL) {
+        *outlen = EVP_PKEY_get_size(cipher->key->pub);
+        return 1;
+    }
+
+    switch (cipher->pad) {
+    case RSA_PKCS1_PADDING:
+        mech.mechanism = CKM_RSA_PKCS;
+        break;
+    case RSA_PKCS1_OAEP_PADDING:
+        md = cipher->md != NULL ? cipher->md : EVP_sha1();
+        if (!pkcs11_prov_md_mech(md, &oaep.hashAlg, &oaep.mgf)
+            || !pkcs11_prov_md_mech(cipher->mgf1 != NULL ? cipher->mgf1 : md,
+                                    NULL, &oaep.mgf))
+            return 0;
+        oaep.source = CKZ_DATA_SPECIFIED;
+        oaep.pSourceData = cipher->label;
+        oaep.ulSourceDataLen = cipher->labellen;
+        mech.mechanism = CKM_RSA_PKCS_OAEP;
+        mech.pParameter = &oaep;
+        mech.ulParameterLen = sizeof(oaep);
+        break;
+    case RSA_NO_PADDING:
+        mech.mechanism = CKM_RSA_X_509;
+        break;
+    default:
+        PKCS11err(PKCS11_F_PKCS11_KEY_OP, PKCS11_R_UNSUPPORTED_PADDING);
+        return 0;
+    }
+
+    *outlen = outsize;
+    return pkcs11_key_op(cipher->prov->ctx, &cipher->key->kp, 1, &mech, in,
+                         inlen, out, outlen);
+}
+
+const OSSL_DISPATCH pkcs11_prov_asym_cipher_functions[] = {
+    { OSSL_FUNC_ASYM_CIPHER_NEWCTX,
+      (void (*)(void))pkcs11_prov_cipher_newctx },
+    { OSSL_FUNC_ASYM_CIPHER_FREECTX,
+      (void (*)(void))pkcs11_prov_cipher_freectx },
+    { OSSL_FUNC_ASYM_CIPHER_ENCRYPT_INIT,
+      (void (*)(void))pkcs11_prov_encrypt_init },
+    { OSSL_FUNC_ASYM_CIPHER_ENCRYPT, (void (*)(void))pkcs11_prov_encrypt },
+    { OSSL_FUNC_ASYM_CIPHER_DECRYPT_INIT,
+      (void (*)(void))pkcs11_prov_decrypt_init },
+    { OSSL_FUNC_ASYM_CIPHER_DECRYPT, (void (*)(void))pkcs11_prov_decrypt },
+    { OSSL_FUNC_ASYM_CIPHER_SET_CTX_PARAMS,
+      (void (*)(void))pkcs11_prov_cipher_set_ctx_params },
+    { OSSL_FUNC_ASYM_CIPHER_SETTABLE_CTX_PARAMS,
+      (void (*)(void))pkcs11_prov_cipher_settable_ctx_params },
+    { 0, NULL }
+};
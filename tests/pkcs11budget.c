@@ -0,0 +1,175 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Round trip budgets.  The mock module counts the calls the engine makes
+ * into it, and every step below must stay within its budget of PKCS#11
+ * calls: a regression that adds a round trip to a hot path fails here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rsa.h>
+#include <openssl/store.h>
+#include "e_pkcs11.h"
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+/* certificates in the store listing, not a multiple of the batch */
+#define STORE_OBJECTS 100
+#define SIGNATURES 16
+
+#define FIRST_LOAD_BUDGET   11  /* module, profile, slot, token serial,
+                                   session, login, key */
+#define COLD_LOAD_BUDGET    5   /* slot list, search, one attribute read */
+#define CACHED_LOAD_BUDGET  0
+#define SIGN_BUDGET         2   /* C_SignInit and C_Sign */
+
+static const char *key0_uri = "pkcs11:object=rsa0;type=private;pin-value=1234";
+static const char *key1_uri = "pkcs11:object=rsa1;type=private;pin-value=1234";
+
+static PKCS11MOCK_CALLS_FN mock_calls;
+static PKCS11MOCK_SESSIONS_CALLED_FN mock_sessions_called;
+static PKCS11MOCK_CALLS_RESET_FN mock_calls_reset;
+
+static void within(const char *what, unsigned long calls, unsigned long budget)
+{
+    printf("%-28s %8lu %8lu %s\n", what, calls, budget,
+           calls <= budget ? "ok" : "OVER BUDGET");
+    if (calls > budget)
+        failures++;
+}
+
+static EVP_PKEY *load_key(ENGINE *e, const char *uri)
+{
+    char *copy = OPENSSL_strdup(uri);
+    EVP_PKEY *pkey = NULL;
+
+    if (copy != NULL)
+        pkey = ENGINE_load_private_key(e, copy, NULL, NULL);
+    OPENSSL_free(copy);
+    if (pkey == NULL) {
+        fprintf(stderr, "cannot load %s\n", uri);
+        ERR_print_errors_fp(stderr);
+    }
+    return pkey;
+}
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey0 = NULL, *pkey1 = NULL, *again = NULL;
+    RSA *rsa = NULL;
+    void *dso = NULL;
+    unsigned char md[32], sig[1024];
+    unsigned int siglen;
+    char conf[256];
+    int i, n, ret = TEST_SKIP;
+
+    BIO_snprintf(conf, sizeof(conf),
+                 "crypto=fake;key=label=rsa0,id=01,type=rsa,cert=yes;"
+                 "key=label=rsa1,id=03,type=rsa;"
+                 "key=label=obj,id=20,type=ec,cert=yes,count=%d",
+                 STORE_OBJECTS);
+    setenv("PKCS11MOCK", conf, 1);
+
+    /* the engine opens the same file, so this is the same module */
+    if (module == NULL || (dso = dlopen(module, RTLD_NOW)) == NULL
+        || (mock_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL
+        || (mock_sessions_called = (PKCS11MOCK_SESSIONS_CALLED_FN)
+                dlsym(dso, "pkcs11mock_sessions_called")) == NULL
+        || (mock_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(dso, "pkcs11mock_calls_reset")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+    if (!ENGINE_set_default_RSA(e))
+        goto end;
+
+    printf("%-28s %8s %8s\n", "step", "calls", "budget");
+
+    mock_calls_reset();
+    if ((pkey0 = load_key(e, key0_uri)) == NULL)
+        goto end;
+    within("first key load", mock_calls(NULL), FIRST_LOAD_BUDGET);
+
+    mock_calls_reset();
+    if ((pkey1 = load_key(e, key1_uri)) == NULL)
+        goto end;
+    within("cold key load", mock_calls(NULL), COLD_LOAD_BUDGET);
+
+    mock_calls_reset();
+    if ((again = load_key(e, key0_uri)) == NULL)
+        goto end;
+    within("cached key load", mock_calls(NULL), CACHED_LOAD_BUDGET);
+
+    /* the first signature may still have to open a session */
+    memset(md, 0x5a, sizeof(md));
+    rsa = EVP_PKEY_get1_RSA(pkey0);
+    siglen = sizeof(sig);
+    if (rsa == NULL
+        || !RSA_sign(NID_sha256, md, sizeof(md), sig, &siglen, rsa))
+        goto end;
+    mock_calls_reset();
+    for (i = 0; i < SIGNATURES; i++) {
+        siglen = sizeof(sig);
+        if (!RSA_sign(NID_sha256, md, sizeof(md), sig, &siglen, rsa)) {
+            ERR_print_errors_fp(stderr);
+            goto end;
+        }
+    }
+    within("warm signature", mock_calls(NULL) / SIGNATURES, SIGN_BUDGET);
+    within("sessions for the signatures", mock_sessions_called(), 1);
+
+    mock_calls_reset();
+    if ((n = store_count("pkcs11:type=cert")) < STORE_OBJECTS) {
+        fprintf(stderr, "store listing returned %d objects\n", n);
+        goto end;
+    }
+    within("store listing C_FindObjects", mock_calls("C_FindObjects"),
+           n / PKCS11_FIND_BATCH + 1);
+    within("store listing attribute reads",
+           mock_calls("C_GetAttributeValue"), n);
+
+    mock_calls_reset();
+    if (store_count("pkcs11:object=obj7;type=cert") != 1)
+        goto end;
+    within("store cert C_FindObjects", mock_calls("C_FindObjects"), 1);
+    within("store cert attribute reads", mock_calls("C_GetAttributeValue"), 1);
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    RSA_free(rsa);
+    EVP_PKEY_free(pkey0);
+    EVP_PKEY_free(pkey1);
+    EVP_PKEY_free(again);
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (dso != NULL)
+        dlclose(dso);
+    return ret;
+}
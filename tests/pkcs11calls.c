@@ -0,0 +1,129 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * PKCS#11 call layer.  With CALLS metrics every call of a signature must
+ * be counted and timed; a transient failure of C_SignInit must be retried
+ * without the module seeing more than the last try, one of C_Sign, which
+ * leaves an operation behind, must not; and with the layer off nothing is
+ * counted any more.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rsa.h>
+#include "e_pkcs11.h"
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+static const char *key_uri = "pkcs11:object=tls;type=private;pin-value=1234";
+
+static ENGINE *e = NULL;
+static RSA *rsa = NULL;
+
+static PKCS11_CALL_STATS *stats(const char *name)
+{
+    static PKCS11_CALL_STATS st;
+
+    memset(&st, 0, sizeof(st));
+    st.name = name;
+    if (!ENGINE_ctrl_cmd(e, "CALL_STATS_CTRL", 0, &st, NULL, 0))
+        memset(&st, 0xff, sizeof(st));
+    return &st;
+}
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    PKCS11MOCK_CALLS_FN mock_calls;
+    PKCS11MOCK_CALLS_RESET_FN mock_calls_reset;
+    PKCS11_CALL_STATS *st;
+    EVP_PKEY *pkey = NULL;
+    void *dso = NULL;
+    int ok, ret = TEST_SKIP;
+
+    setenv("PKCS11MOCK", "key=label=tls,id=70,type=rsa,bits=1024", 1);
+    if (module == NULL
+        || (dso = dlopen(module, RTLD_NOW)) == NULL
+        || (mock_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL
+        || (mock_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(dso, "pkcs11mock_calls_reset")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+
+    check("bad settings refused",
+          !ENGINE_ctrl_cmd_string(e, "CALLS", "retries=x", 0)
+          && !ENGINE_ctrl_cmd_string(e, "CALLS", "fail=C_Nothing:0x30:1", 0)
+          && !ENGINE_ctrl_cmd_string(e, "CALLS", "fast", 0));
+    if (!ENGINE_ctrl_cmd_string(e, "CALLS", "metrics", 0)
+        || !ENGINE_set_default_RSA(e)
+        || (pkey = ENGINE_load_private_key(e, key_uri, NULL, NULL)) == NULL
+        || (rsa = EVP_PKEY_get1_RSA(pkey)) == NULL) {
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+
+    ENGINE_ctrl_cmd_string(e, "CALLS", "metrics reset", 0);
+    ok = sign_verify(rsa);
+    st = stats("C_Sign");
+    check("signature counted and timed",
+          ok && st->calls == 1 && st->errors == 0 && st->total_ns > 0
+          && st->max_ns == st->total_ns);
+
+    mock_calls_reset();
+    ENGINE_ctrl_cmd_string(e, "CALLS",
+                           "metrics reset retries=2 fail=C_SignInit:0x30:2", 0);
+    ok = sign_verify(rsa);
+    st = stats("C_SignInit");
+    check("transient C_SignInit failure retried",
+          ok && st->calls == 1 && st->retries == 2 && st->injected == 2
+          && st->errors == 0 && mock_calls("C_SignInit") == 1);
+
+    ENGINE_ctrl_cmd_string(e, "CALLS",
+                           "metrics reset retries=2 fail=C_Sign:0x30:1", 0);
+    ok = sign_verify(rsa);
+    st = stats("C_Sign");
+    check("transient C_Sign failure not retried",
+          !ok && st->calls == 1 && st->retries == 0 && st->errors == 1);
+    check("next signature made", sign_verify(rsa));
+
+    ENGINE_ctrl_cmd_string(e, "CALLS", "metrics reset", 0);
+    ENGINE_ctrl_cmd_string(e, "CALLS", "off", 0);
+    ok = sign_verify(rsa);
+    check("nothing counted with the layer off",
+          ok && stats("C_Sign")->calls == 0);
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    RSA_free(rsa);
+    EVP_PKEY_free(pkey);
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (dso != NULL)
+        dlclose(dso);
+    return ret;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Token side hash-and-sign.  The mock token refuses CKM_RSA_PKCS like a
+ * qualified signature card, so EVP_DigestSign() only works with
+ * TOKEN_DIGEST set, when the data goes to the token in large
+ * C_SignUpdate() chunks.  The signature must be the one the host would
+ * have computed, and digests or paddings the token cannot hash must keep
+ * the host path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include "e_pkcs11.h"
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+/* not a multiple of the chunk, written in pieces of every size */
+#define DATA_LEN    (3 * PKCS11_SIGN_CHUNK + 12345)
+
+static const char *key_uri = "pkcs11:object=rsa0;type=private;pin-value=1234";
+
+static PKCS11MOCK_CONFIGURE_FN mock_configure;
+static PKCS11MOCK_CALLS_FN mock_calls;
+static PKCS11MOCK_CALLS_RESET_FN mock_calls_reset;
+
+/*
+ * Sign |data| in pieces of 1, 1000, 100000 and then DATA_LEN bytes.
+ * Returns the signature length, 0 on error.
+ */
+static size_t sign(EVP_PKEY *pkey, const EVP_MD *md, int padding,
+                   const unsigned char *data, unsigned char *sig)
+{
+    static const size_t pieces[] = { 1, 1000, 100000, DATA_LEN };
+    EVP_MD_CTX *mctx;
+    EVP_PKEY_CTX *pctx;
+    size_t i, n, off = 0, siglen = 0;
+
+    if ((mctx = EVP_MD_CTX_new()) == NULL
+        || EVP_DigestSignInit(mctx, &pctx, md, NULL, pkey) <= 0
+        || EVP_PKEY_CTX_set_rsa_padding(pctx, padding) <= 0)
+        goto end;
+    for (i = 0; off < DATA_LEN; i++, off += n) {
+        n = pieces[i] < DATA_LEN - off ? pieces[i] : DATA_LEN - off;
+        if (EVP_DigestSignUpdate(mctx, data + off, n) <= 0)
+            goto end;
+    }
+    if (EVP_DigestSignFinal(mctx, NULL, &siglen) <= 0
+        || EVP_DigestSignFinal(mctx, sig, &siglen) <= 0)
+        siglen = 0;
+
+ end:
+    EVP_MD_CTX_free(mctx);
+    return siglen;
+}
+
+static int verify(EVP_PKEY *pkey, const EVP_MD *md, int padding,
+                  const unsigned char *data, const unsigned char *sig,
+                  size_t siglen)
+{
+    EVP_MD_CTX *mctx;
+    EVP_PKEY_CTX *pctx;
+    int ok;
+
+    ok = (mctx = EVP_MD_CTX_new()) != NULL
+         && EVP_DigestVerifyInit(mctx, &pctx, md, NULL, pkey) > 0
+         && EVP_PKEY_CTX_set_rsa_padding(pctx, padding) > 0
+         && EVP_DigestVerify(mctx, sig, siglen, data, DATA_LEN) > 0;
+    EVP_MD_CTX_free(mctx);
+    return ok;
+}
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey = NULL;
+    EVP_MD_CTX *mctx = NULL;
+    unsigned char *data = NULL, sig[1024], host_sig[1024], md_sig[1024];
+    size_t siglen, host_siglen, md_siglen;
+    unsigned long updates;
+    char *uri = NULL;
+    void *dso = NULL;
+    int i, ret = TEST_SKIP;
+
+    setenv("PKCS11MOCK", "raw_sign=no", 1);
+
+    if (module == NULL || (dso = dlopen(module, RTLD_NOW)) == NULL
+        || (mock_configure = (PKCS11MOCK_CONFIGURE_FN)
+                dlsym(dso, "pkcs11mock_configure")) == NULL
+        || (mock_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL
+        || (mock_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(dso, "pkcs11mock_calls_reset")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+    if ((data = malloc(DATA_LEN)) == NULL
+        || (uri = OPENSSL_strdup(key_uri)) == NULL)
+        goto end;
+    for (i = 0; i < DATA_LEN; i++)
+        data[i] = (unsigned char)(i * 31 + (i >> 12));
+    if ((pkey = ENGINE_load_private_key(e, uri, NULL, NULL)) == NULL) {
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+
+    check("card refuses a host digest",
+          sign(pkey, EVP_sha256(), RSA_PKCS1_PADDING, data, sig) == 0);
+
+    if (!ENGINE_ctrl_cmd(e, "TOKEN_DIGEST", 1, NULL, NULL, 0))
+        goto end;
+    mock_calls_reset();
+    siglen = sign(pkey, EVP_sha256(), RSA_PKCS1_PADDING, data, sig);
+    updates = mock_calls("C_SignUpdate");
+    check("token hashes and signs", siglen > 0);
+    check("signature verifies",
+          verify(pkey, EVP_sha256(), RSA_PKCS1_PADDING, data, sig, siglen));
+    printf("%lu C_SignUpdate for %d bytes\n", updates, DATA_LEN);
+    check("chunks of PKCS11_SIGN_CHUNK or more",
+          updates > 0 && updates <= DATA_LEN / PKCS11_SIGN_CHUNK + 1);
+    check("no C_Sign", mock_calls("C_Sign") == 0);
+
+    /* data hashed with EVP_DigestUpdate(), as a BIO_f_md() does, stays here */
+    md_siglen = 0;
+    if ((mctx = EVP_MD_CTX_new()) == NULL
+        || EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, pkey) <= 0
+        || EVP_DigestUpdate(mctx, data, DATA_LEN) <= 0)
+        goto end;
+    if (EVP_DigestSignFinal(mctx, NULL, &md_siglen) <= 0
+        || EVP_DigestSignFinal(mctx, md_sig, &md_siglen) <= 0)
+        md_siglen = 0;
+    EVP_MD_CTX_free(mctx);
+    mctx = NULL;
+    check("no token signature of a host digest", md_siglen == 0);
+
+    /* the same key on a token that accepts a DigestInfo */
+    if (!mock_configure("raw_sign=yes")
+        || !ENGINE_ctrl_cmd(e, "TOKEN_DIGEST", 0, NULL, NULL, 0))
+        goto end;
+    host_siglen = sign(pkey, EVP_sha256(), RSA_PKCS1_PADDING, data, host_sig);
+    check("same signature as with a host digest",
+          host_siglen == siglen && memcmp(sig, host_sig, siglen) == 0);
+
+    /* what the token has no hash-and-sign mechanism for stays on the host */
+    if (!ENGINE_ctrl_cmd(e, "TOKEN_DIGEST", 1, NULL, NULL, 0))
+        goto end;
+    mock_calls_reset();
+    siglen = sign(pkey, EVP_sha256(), RSA_PKCS1_PSS_PADDING, data, sig);
+    check("PSS is hashed on the host",
+          siglen > 0 && mock_calls("C_SignUpdate") == 0
+          && verify(pkey, EVP_sha256(), RSA_PKCS1_PSS_PADDING, data, sig,
+                    siglen));
+    siglen = sign(pkey, EVP_sha3_256(), RSA_PKCS1_PADDING, data, sig);
+    check("SHA3 is hashed on the host",
+          siglen > 0 && mock_calls("C_SignUpdate") == 0
+          && verify(pkey, EVP_sha3_256(), RSA_PKCS1_PADDING, data, sig,
+                    siglen));
+
+    /* an operation dropped half way must not keep its session busy */
+    for (i = 0; i < 64; i++) {
+        if ((mctx = EVP_MD_CTX_new()) == NULL
+            || EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, pkey) <= 0
+            || EVP_DigestSignUpdate(mctx, data, 100) <= 0)
+            break;
+        EVP_MD_CTX_free(mctx);
+        mctx = NULL;
+    }
+    check("abandoned operations", i == 64);
+    siglen = sign(pkey, EVP_sha256(), RSA_PKCS1_PADDING, data, sig);
+    check("signing after abandoned operations", siglen > 0);
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    EVP_MD_CTX_free(mctx);
+    EVP_PKEY_free(pkey);
+    OPENSSL_free(uri);
+    free(data);
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (dso != NULL)
+        dlclose(dso);
+    return ret;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Many keys.  Every key of a token with ten thousand of them is loaded
+ * once, with HOT_KEYS set far below that; loading one of the keys used
+ * last again must cost no token call, loading one of the first a single
+ * attribute read and no search, and the key must still sign.  A URI that
+ * only differs in its PIN attribute is the same key, and keys of other
+ * URIs loaded from several threads at once must each be the key of their
+ * own URI.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+#define NKEYS 10000
+#define HOT   100
+#define LOADERS 8               /* threads, each with a key of its own */
+#define COPIES  64              /* objects of each of their keys */
+
+#define HOT_LOAD_BUDGET     0
+#define EVICTED_LOAD_BUDGET 1   /* the public key attributes */
+
+typedef struct {
+    pthread_t tid;
+    ENGINE *e;
+    char label;
+    BIGNUM *n;                  /* of every object of the label */
+    int wrong;
+} LOADER;
+
+static PKCS11MOCK_CALLS_FN mock_calls;
+static PKCS11MOCK_CALLS_RESET_FN mock_calls_reset;
+
+static EVP_PKEY *load(ENGINE *e, int i)
+{
+    char uri[128];
+
+    BIO_snprintf(uri, sizeof(uri),
+                 "pkcs11:object=k%d;type=private;pin-value=1234", i);
+    return ENGINE_load_private_key(e, uri, NULL, NULL);
+}
+
+static int sign(EVP_PKEY *pkey)
+{
+    static const unsigned char data[] = "many keys";
+    unsigned char sig[512];
+    size_t siglen = sizeof(sig);
+    EVP_MD_CTX *mctx;
+    int ok;
+
+    ok = (mctx = EVP_MD_CTX_new()) != NULL
+         && EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, pkey) > 0
+         && EVP_DigestSign(mctx, sig, &siglen, data, sizeof(data)) > 0;
+    EVP_MD_CTX_free(mctx);
+    return ok;
+}
+
+static EVP_PKEY *load_copy(ENGINE *e, char label, int i)
+{
+    char uri[128];
+
+    BIO_snprintf(uri, sizeof(uri),
+                 "pkcs11:object=%c%d;type=private;pin-value=1234", label, i);
+    return ENGINE_load_private_key(e, uri, NULL, NULL);
+}
+
+/* every object of one label, none of them loaded before */
+static void *loader(void *arg)
+{
+    LOADER *l = arg;
+    EVP_PKEY *pkey;
+    const RSA *rsa;
+    int i;
+
+    for (i = 1; i < COPIES; i++) {
+        pkey = load_copy(l->e, l->label, i);
+        if (pkey == NULL || (rsa = EVP_PKEY_get0_RSA(pkey)) == NULL
+            || BN_cmp(RSA_get0_n(rsa), l->n) != 0)
+            l->wrong++;
+        EVP_PKEY_free(pkey);
+    }
+    ERR_clear_error();
+    return NULL;
+}
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey = NULL;
+    LOADER loaders[LOADERS];
+    const RSA *rsa;
+    unsigned long calls = 0;
+    char conf[1024], uri[128];
+    void *dso = NULL;
+    int i, n, len, wrong, ret = TEST_SKIP;
+
+    memset(loaders, 0, sizeof(loaders));
+    len = BIO_snprintf(conf, sizeof(conf), "crypto=fake;"
+                       "key=label=k,id=50,type=rsa,bits=1024,count=%d",
+                       NKEYS);
+    for (i = 0; i < LOADERS; i++)
+        len += BIO_snprintf(conf + len, sizeof(conf) - len,
+                            ";key=label=%c,id=%d,type=rsa,bits=1024,"
+                            "count=%d", 'a' + i, 60 + i, COPIES);
+    setenv("PKCS11MOCK", conf, 1);
+    if (module == NULL || (dso = dlopen(module, RTLD_NOW)) == NULL
+        || (mock_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL
+        || (mock_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(dso, "pkcs11mock_calls_reset")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+    if (!ENGINE_ctrl_cmd(e, "HOT_KEYS", HOT, NULL, NULL, 0))
+        goto end;
+
+    for (i = n = 0; i < NKEYS; i++) {
+        if ((pkey = load(e, i)) != NULL)
+            n++;
+        EVP_PKEY_free(pkey);
+        pkey = NULL;
+    }
+    check("every key loaded", n == NKEYS);
+
+    mock_calls_reset();
+    for (i = NKEYS - HOT, n = 0; i < NKEYS; i++) {
+        if ((pkey = load(e, i)) != NULL)
+            n++;
+        EVP_PKEY_free(pkey);
+        pkey = NULL;
+    }
+    calls = mock_calls(NULL);
+    printf("hot loads: %d keys, %lu calls\n", n, calls);
+    check("hot keys loaded without a token call",
+          n == HOT && calls <= HOT_LOAD_BUDGET * HOT);
+
+    mock_calls_reset();
+    for (i = 0, n = 0; i < HOT; i++) {
+        if ((pkey = load(e, i)) != NULL)
+            n++;
+        EVP_PKEY_free(pkey);
+        pkey = NULL;
+    }
+    calls = mock_calls(NULL);
+    printf("evicted loads: %d keys, %lu calls\n", n, calls);
+    check("evicted keys loaded with one attribute read",
+          n == HOT && calls <= EVICTED_LOAD_BUDGET * HOT);
+    check("evicted keys not searched for",
+          mock_calls("C_FindObjectsInit") == 0);
+
+    /* and the keys made hot again push the others out */
+    mock_calls_reset();
+    pkey = load(e, NKEYS - 1);
+    check("hot keys bounded", pkey != NULL && mock_calls(NULL) == 1);
+    check("reloaded key signs", pkey != NULL && sign(pkey));
+
+    /* the cache keeps no PIN, so it is the same entry */
+    EVP_PKEY_free(pkey);
+    BIO_snprintf(uri, sizeof(uri), "pkcs11:object=k%d;type=private;"
+                 "pin-source=env:PKCS11KEYS_UNSET", NKEYS - 1);
+    mock_calls_reset();
+    pkey = ENGINE_load_private_key(e, uri, NULL, NULL);
+    check("URI with another PIN attribute cached",
+          pkey != NULL && mock_calls(NULL) == 0);
+
+    /* loads that miss the cache at the same time */
+    for (i = 0; i < LOADERS; i++) {
+        loaders[i].e = e;
+        loaders[i].label = 'a' + i;
+        EVP_PKEY_free(pkey);
+        if ((pkey = load_copy(e, loaders[i].label, 0)) == NULL
+            || (rsa = EVP_PKEY_get0_RSA(pkey)) == NULL
+            || (loaders[i].n = BN_dup(RSA_get0_n(rsa))) == NULL)
+            goto end;
+    }
+    for (n = 0; n < LOADERS; n++)
+        if (pthread_create(&loaders[n].tid, NULL, loader, &loaders[n]) != 0)
+            break;
+    for (i = wrong = 0; i < n; i++) {
+        pthread_join(loaders[i].tid, NULL);
+        wrong += loaders[i].wrong;
+    }
+    printf("concurrent loads: %d threads, %d wrong keys\n", n, wrong);
+    check("concurrent loads get their own keys", n == LOADERS && wrong == 0);
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    for (i = 0; i < LOADERS; i++)
+        BN_free(loaders[i].n);
+    EVP_PKEY_free(pkey);
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (dso != NULL)
+        dlclose(dso);
+    return ret;
+}
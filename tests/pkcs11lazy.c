@@ -0,0 +1,123 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Lazy start.  A config file loads and initializes the engine and sets
+ * its module, PIN, hot keys and a key name, as short-lived openssl
+ * invocations do, and the module must not even be loaded afterwards.  The
+ * first load of the name then loads it, logs in once and signs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <openssl/conf.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rsa.h>
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+static int module_loaded(const char *module)
+{
+    void *dso = dlopen(module, RTLD_NOW | RTLD_NOLOAD);
+
+    if (dso == NULL)
+        return 0;
+    dlclose(dso);
+    return 1;
+}
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    char conf[] = "pkcs11lazy.cnfXXXXXX";
+    unsigned char digest[32], sig[512];
+    unsigned int siglen;
+    struct timespec t0, t1;
+    PKCS11MOCK_CALLS_FN mock_calls;
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey = NULL;
+    RSA *rsa = NULL;
+    void *dso;
+    FILE *f;
+    int fd, ret = TEST_FAIL;
+
+    if (module == NULL) {
+        fprintf(stderr, "PKCS11_MODULE_PATH not set, skipping\n");
+        return TEST_SKIP;
+    }
+    setenv("PKCS11MOCK", "key=label=tls,id=70,type=rsa,bits=1024", 1);
+    if ((fd = mkstemp(conf)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+        perror(conf);
+        return TEST_FAIL;
+    }
+    fprintf(f, "openssl_conf = openssl_init\n"
+            "[openssl_init]\n"
+            "engines = engine_section\n"
+            "[engine_section]\n"
+            "pkcs11 = pkcs11_section\n"
+            "[pkcs11_section]\n"
+            "engine_id = pkcs11\n"
+            "MODULE_PATH = %s\n"
+            "PIN = 1234\n"
+            "HOT_KEYS = 64\n"
+            "ROTATE_KEY = tls=pkcs11:object=tls;type=private\n"
+            "init = 1\n", module);
+    fclose(f);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    check("config loaded", CONF_modules_load_file(conf, NULL, 0) > 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    unlink(conf);
+    printf("config load with the engine: %ld us\n",
+           (long)((t1.tv_sec - t0.tv_sec) * 1000000
+                  + (t1.tv_nsec - t0.tv_nsec) / 1000));
+    if (failures)
+        goto end;
+    check("module not loaded by the config", !module_loaded(module));
+
+    memset(digest, 0x5a, sizeof(digest));
+    if ((e = ENGINE_by_id("pkcs11")) == NULL) {
+        check("engine configured", 0);
+        goto end;
+    }
+    pkey = ENGINE_load_private_key(e, "key-name:tls", NULL, NULL);
+    check("deferred key name loaded", pkey != NULL
+          && (rsa = EVP_PKEY_get1_RSA(pkey)) != NULL);
+    if (rsa == NULL)
+        goto end;
+    check("signature verifies",
+          RSA_sign(NID_sha256, digest, sizeof(digest), sig, &siglen, rsa)
+          && RSA_verify(NID_sha256, digest, sizeof(digest), sig, siglen,
+                        rsa));
+
+    if ((dso = dlopen(module, RTLD_NOW | RTLD_NOLOAD)) == NULL
+        || (mock_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL) {
+        check("module loaded by the key", 0);
+        goto end;
+    }
+    check("one login", mock_calls("C_Login") == 1);
+    check("one initialization", mock_calls("C_Initialize") == 1);
+    dlclose(dso);
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    RSA_free(rsa);
+    EVP_PKEY_free(pkey);
+    ENGINE_free(e);
+    return ret;
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * PIN vault.  Loading many keys of a token without a pin-value must ask
+ * for the PIN once and log in once; later loads and context specific
+ * logins take it from the vault without reading their pin-source, each
+ * token has a PIN of its own from a file, the environment or an inherited
+ * fd, a PIN the token refuses is asked for again, and another token
+ * put in a slot is not sent the PIN of the one seen there before.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ui.h>
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+#define NKEYS 200
+
+static const char conf[] =
+    "slots=3;"
+    "key=slot=0,label=k,id=30,type=rsa,bits=1024,count=200;"
+    "key=slot=0,label=auth,id=40,type=rsa,bits=1024,always_auth=yes;"
+    "key=slot=1,label=env,id=50,type=rsa,bits=1024;"
+    "key=slot=2,label=fd,id=60,type=rsa,bits=1024";
+
+static PKCS11MOCK_CALLS_FN mock_calls;
+static PKCS11MOCK_CALLS_RESET_FN mock_calls_reset;
+static PKCS11MOCK_PROVISION_FN mock_provision;
+static int prompts = 0;
+
+/* answers every PIN prompt with the mock PIN, and counts them */
+static int pin_reader(UI *ui, UI_STRING *uis)
+{
+    switch (UI_get_string_type(uis)) {
+    case UIT_PROMPT:
+    case UIT_VERIFY:
+        prompts++;
+        return UI_set_result(ui, uis, "1234") == 0;
+    default:
+        return 1;
+    }
+}
+
+static EVP_PKEY *load(ENGINE *e, UI_METHOD *ui, const char *uri)
+{
+    return ENGINE_load_private_key(e, uri, ui, NULL);
+}
+
+static int sign(EVP_PKEY *pkey)
+{
+    static const unsigned char data[] = "vault";
+    unsigned char sig[512];
+    size_t siglen = sizeof(sig);
+    EVP_MD_CTX *mctx;
+    int ok;
+
+    ok = (mctx = EVP_MD_CTX_new()) != NULL
+         && EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, pkey) > 0
+         && EVP_DigestSign(mctx, sig, &siglen, data, sizeof(data)) > 0;
+    EVP_MD_CTX_free(mctx);
+    return ok;
+}
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    ENGINE *e = NULL;
+    UI_METHOD *ui = NULL;
+    EVP_PKEY *pkeys[NKEYS] = { NULL }, *pkey = NULL;
+    char uri[128];
+    void *dso = NULL;
+    int i, n, fds[2] = { -1, -1 }, ret = TEST_SKIP;
+
+    setenv("PKCS11MOCK", conf, 1);
+    if (module == NULL || (dso = dlopen(module, RTLD_NOW)) == NULL
+        || (mock_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL
+        || (mock_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(dso, "pkcs11mock_calls_reset")) == NULL
+        || (mock_provision = (PKCS11MOCK_PROVISION_FN)
+                dlsym(dso, "pkcs11mock_provision")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+    if ((ui = UI_create_method("pin counter")) == NULL
+        || UI_method_set_reader(ui, pin_reader) < 0)
+        goto end;
+
+    /* every key of the token, none of the URIs with a PIN */
+    mock_calls_reset();
+    for (i = n = 0; i < NKEYS; i++) {
+        BIO_snprintf(uri, sizeof(uri), "pkcs11:object=k%d;type=private", i);
+        if ((pkeys[i] = load(e, ui, uri)) != NULL)
+            n++;
+    }
+    printf("%d keys, %d prompts, %lu C_Login\n", n, prompts,
+           mock_calls("C_Login"));
+    check("every key loaded", n == NKEYS);
+    check("one prompt", prompts == 1);
+    check("one login", mock_calls("C_Login") == 1);
+
+    /* the vault is used before the pin-source, which is not read */
+    pkey = load(e, ui, "pkcs11:object=auth;type=private;"
+                "pin-source=file:/nonexistent/pin");
+    check("pin-source of a known token not read", pkey != NULL);
+    mock_calls_reset();
+    check("context specific login from the vault",
+          pkey != NULL && sign(pkey) && mock_calls("C_Login") == 1);
+    check("no prompt for a re-login", prompts == 1);
+
+    /* a PIN of its own for another token, from the environment */
+    setenv("PKCS11PIN_TEST_BAD", "0000", 1);
+    setenv("PKCS11PIN_TEST", "1234", 1);
+    check("wrong PIN refused",
+          load(e, ui, "pkcs11:object=env;type=private;slot-id=1;"
+               "pin-source=env:PKCS11PIN_TEST_BAD") == NULL);
+    EVP_PKEY_free(pkey);
+    pkey = load(e, ui, "pkcs11:object=env;type=private;slot-id=1;"
+                "pin-source=env:PKCS11PIN_TEST");
+    check("refused PIN asked for again", pkey != NULL);
+
+    /* and from a pipe, which can only be read once */
+    if (pipe(fds) != 0 || write(fds[1], "1234\n", 5) != 5)
+        goto end;
+    close(fds[1]);
+    fds[1] = -1;
+    EVP_PKEY_free(pkey);
+    BIO_snprintf(uri, sizeof(uri),
+                 "pkcs11:object=fd;type=private;slot-id=2;pin-source=fd:%d",
+                 fds[0]);
+    pkey = load(e, ui, uri);
+    fds[0] = -1;
+    check("PIN from an inherited fd", pkey != NULL && sign(pkey));
+    check("no prompt for tokens with a pin-source", prompts == 1);
+
+    /* the PIN is the token's, not the slot's */
+    if (!mock_provision("serial=0:OTHER"))
+        goto end;
+    EVP_PKEY_free(pkey);
+    pkey = load(e, ui, "pkcs11:object=k5;type=private;slot-id=0");
+    check("PIN asked for another token in the slot",
+          pkey != NULL && prompts == 2);
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    for (i = 0; i < NKEYS; i++)
+        EVP_PKEY_free(pkeys[i]);
+    EVP_PKEY_free(pkey);
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    UI_destroy_method(ui);
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (dso != NULL)
+        dlclose(dso);
+    return ret;
+}
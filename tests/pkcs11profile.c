@@ -0,0 +1,154 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Module profiles.  A PROFILE_FILE entry matching the mock module turns
+ * every setting away from its default; the engine must initialize the
+ * module again with its own mutexes, sign through CKM_RSA_X_509 with
+ * signatures that verify, log in for every signature, list a store in
+ * batches of the profile's size, check a session left idle, and keep
+ * signing from several threads with one operation at a time on the key.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rsa.h>
+#include <openssl/store.h>
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+#define STORE_OBJECTS 20
+#define BATCH         8
+#define THREADS       4
+
+static const char *profiles =
+    "# the mock module, with nothing left at its default\n"
+    "mock: manufacturer=pkcs11engine; library=pkcs11engine mock;"
+    " model=mock; os_locking=no; mechanism=rsa_x509; always_auth=always;"
+    " key_ops=1; find_batch=8; keepalive=1\n";
+
+static const char *key_uri = "pkcs11:object=tls;type=private;pin-value=1234";
+
+static PKCS11MOCK_CALLS_FN mock_calls;
+static PKCS11MOCK_CALLS_RESET_FN mock_calls_reset;
+static PKCS11MOCK_LANES_PEAK_FN mock_lanes_peak;
+static RSA *rsa = NULL;
+
+static int write_profiles(char *path)
+{
+    FILE *fp;
+    int fd, ok;
+
+    if ((fd = mkstemp(path)) < 0)
+        return 0;
+    if ((fp = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        return 0;
+    }
+    ok = fputs(profiles, fp) >= 0;
+    return fclose(fp) == 0 && ok;
+}
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey = NULL;
+    WORKER w[THREADS];
+    char path[] = "/tmp/pkcs11profileXXXXXX", conf[256];
+    unsigned long ops = 0, errors = 0;
+    void *dso = NULL;
+    int n, started = 0, ret = TEST_SKIP;
+
+    BIO_snprintf(conf, sizeof(conf),
+                 "key=label=tls,id=70,type=rsa,bits=1024;"
+                 "latency.C_Sign=fixed:200;"
+                 "key=label=obj,id=20,type=ec,cert=yes,count=%d",
+                 STORE_OBJECTS);
+    setenv("PKCS11MOCK", conf, 1);
+    if (module == NULL || !write_profiles(path)
+        || (dso = dlopen(module, RTLD_NOW)) == NULL
+        || (mock_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL
+        || (mock_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(dso, "pkcs11mock_calls_reset")) == NULL
+        || (mock_lanes_peak = (PKCS11MOCK_LANES_PEAK_FN)
+                dlsym(dso, "pkcs11mock_lanes_peak")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+
+    check("unknown profile refused",
+          !ENGINE_ctrl_cmd_string(e, "PROFILE", "no-such-module", 0));
+    check("profile file read",
+          ENGINE_ctrl_cmd_string(e, "PROFILE_FILE", path, 0));
+    if (!ENGINE_set_default_RSA(e)
+        || (pkey = ENGINE_load_private_key(e, key_uri, NULL, NULL)) == NULL
+        || (rsa = EVP_PKEY_get1_RSA(pkey)) == NULL) {
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    check("module initialized again with our mutexes",
+          mock_calls("C_Initialize") == 2 && mock_calls("C_Finalize") == 1);
+
+    mock_calls_reset();
+    check("raw RSA signature verifies",
+          sign_verify(rsa) && mock_calls("C_Sign") == 1);
+    check("context login for every signature", mock_calls("C_Login") == 1);
+
+    mock_calls_reset();
+    n = store_count("pkcs11:type=cert");
+    check("store listed in batches of the profile",
+          n >= STORE_OBJECTS
+          && mock_calls("C_FindObjects") == (unsigned long)n / BATCH + 1);
+
+    sleep_ms(5);
+    mock_calls_reset();
+    check("idle session checked",
+          sign_verify(rsa) && mock_calls("C_GetSessionInfo") == 1);
+
+    mock_calls_reset();
+    started = workers_start(w, THREADS, rsa);
+    sleep_ms(100);
+    workers_stop(w, started, &ops, &errors);
+    printf("%lu signatures, %lu errors\n", ops, errors);
+    check("signatures with one operation per key",
+          started == THREADS && ops > 0 && errors == 0
+          && mock_lanes_peak() == 1);
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    RSA_free(rsa);
+    EVP_PKEY_free(pkey);
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (dso != NULL)
+        dlclose(dso);
+    unlink(path);
+    return ret;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * OpenSSL 3 provider.  Keys loaded through its pkcs11: store must sign
+ * with PKCS#1 v1.5, PSS and ECDSA so that the certificate's public key, of
+ * the default provider, verifies them; must verify themselves; and must
+ * decrypt what the certificate's key encrypts with OAEP.  The provider is
+ * loaded into a library context of its own, the mock module does its
+ * crypto in the default one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/provider.h>
+#include <openssl/rsa.h>
+#include <openssl/store.h>
+#include <openssl/x509.h>
+#include "testutil.h"
+
+static OSSL_LIB_CTX *libctx = NULL;
+
+/* The first object of a URI, a key or a certificate */
+static void *load(const char *uri, int want)
+{
+    OSSL_STORE_CTX *store;
+    OSSL_STORE_INFO *info;
+    void *obj = NULL;
+
+    if ((store = OSSL_STORE_open_ex(uri, libctx, NULL, NULL, NULL, NULL,
+                                    NULL, NULL)) == NULL)
+        return NULL;
+    while (obj == NULL && !OSSL_STORE_eof(store)) {
+        if ((info = OSSL_STORE_load(store)) == NULL)
+            continue;
+        if (OSSL_STORE_INFO_get_type(info) != want)
+            ;
+        else if (want == OSSL_STORE_INFO_CERT)
+            obj = OSSL_STORE_INFO_get1_CERT(info);
+        else
+            obj = OSSL_STORE_INFO_get1_PKEY(info);
+        OSSL_STORE_INFO_free(info);
+    }
+    OSSL_STORE_close(store);
+    return obj;
+}
+
+static int names(const char *uri)
+{
+    OSSL_STORE_CTX *store;
+    OSSL_STORE_INFO *info;
+    int n = 0;
+
+    if ((store = OSSL_STORE_open_ex(uri, libctx, NULL, NULL, NULL, NULL,
+                                    NULL, NULL)) == NULL)
+        return 0;
+    while (!OSSL_STORE_eof(store)) {
+        if ((info = OSSL_STORE_load(store)) == NULL)
+            continue;
+        n += OSSL_STORE_INFO_get_type(info) == OSSL_STORE_INFO_NAME;
+        OSSL_STORE_INFO_free(info);
+    }
+    OSSL_STORE_close(store);
+    return n;
+}
+
+static int set_pad(EVP_PKEY_CTX *pctx, int pad)
+{
+    return pad == 0 || EVP_PKEY_CTX_set_rsa_padding(pctx, pad) > 0;
+}
+
+/* Sign with |key|, then verify with |pub| and with |key| itself */
+static int pkey_sign_verify(EVP_PKEY *key, EVP_PKEY *pub, int pad)
+{
+    static const unsigned char msg[] = "pkcs11 provider";
+    unsigned char sig[1024];
+    size_t siglen = sizeof(sig);
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    EVP_PKEY_CTX *pctx;
+    int ok;
+
+    ok = md != NULL
+         && EVP_DigestSignInit_ex(md, &pctx, "SHA256", libctx, NULL, key,
+                                  NULL)
+         && set_pad(pctx, pad)
+         && EVP_DigestSign(md, sig, &siglen, msg, sizeof(msg));
+    EVP_MD_CTX_reset(md);
+    ok = ok
+         && EVP_DigestVerifyInit_ex(md, &pctx, "SHA256", libctx, NULL, pub,
+                                    NULL)
+         && set_pad(pctx, pad)
+         && EVP_DigestVerify(md, sig, siglen, msg, sizeof(msg)) == 1;
+    EVP_MD_CTX_reset(md);
+    ok = ok
+         && EVP_DigestVerifyInit_ex(md, &pctx, "SHA256", libctx, NULL, key,
+                                    NULL)
+         && set_pad(pctx, pad)
+         && EVP_DigestVerify(md, sig, siglen, msg, sizeof(msg)) == 1;
+    EVP_MD_CTX_free(md);
+    return ok;
+}
+
+/* Encrypt with |pub|, decrypt with |key| */
+static int encrypt_decrypt(EVP_PKEY *key, EVP_PKEY *pub, int pad)
+{
+    static const unsigned char msg[] = "session key";
+    unsigned char enc[512], dec[512];
+    size_t enclen = sizeof(enc), declen = sizeof(dec);
+    EVP_PKEY_CTX *ectx, *dctx;
+    int ok;
+
+    ectx = EVP_PKEY_CTX_new_from_pkey(libctx, pub, NULL);
+    dctx = EVP_PKEY_CTX_new_from_pkey(libctx, key, NULL);
+    ok = ectx != NULL && dctx != NULL
+         && EVP_PKEY_encrypt_init(ectx) > 0 && set_pad(ectx, pad)
+         && (pad != RSA_PKCS1_OAEP_PADDING
+             || EVP_PKEY_CTX_set_rsa_oaep_md(ectx, EVP_sha256()) > 0)
+         && EVP_PKEY_encrypt(ectx, enc, &enclen, msg, sizeof(msg)) > 0
+         && EVP_PKEY_decrypt_init(dctx) > 0 && set_pad(dctx, pad)
+         && (pad != RSA_PKCS1_OAEP_PADDING
+             || EVP_PKEY_CTX_set_rsa_oaep_md(dctx, EVP_sha256()) > 0)
+         && EVP_PKEY_decrypt(dctx, dec, &declen, enc, enclen) > 0
+         && declen == sizeof(msg) && memcmp(dec, msg, declen) == 0;
+    EVP_PKEY_CTX_free(ectx);
+    EVP_PKEY_CTX_free(dctx);
+    return ok;
+}
+
+int main(void)
+{
+    OSSL_PROVIDER *dflt = NULL, *prov = NULL;
+    EVP_PKEY *rsa = NULL, *ec = NULL;
+    X509 *rsa_cert = NULL, *ec_cert = NULL;
+    int ret = TEST_SKIP;
+
+    setenv("PKCS11MOCK", "key=label=tls,id=70,type=rsa,bits=2048;"
+           "key=label=ecc,id=71,type=ec", 1);
+    if (getenv("PKCS11_MODULE_PATH") == NULL
+        || (libctx = OSSL_LIB_CTX_new()) == NULL
+        || (dflt = OSSL_PROVIDER_load(libctx, "default")) == NULL
+        || (prov = OSSL_PROVIDER_load(libctx, "pkcs11prov")) == NULL) {
+        fprintf(stderr, "cannot load the pkcs11 provider, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+
+    rsa = load("pkcs11:object=tls;type=private;pin-value=1234",
+               OSSL_STORE_INFO_PKEY);
+    rsa_cert = load("pkcs11:object=tls;type=cert", OSSL_STORE_INFO_CERT);
+    ec = load("pkcs11:object=ecc;type=private", OSSL_STORE_INFO_PKEY);
+    ec_cert = load("pkcs11:object=ecc;type=cert", OSSL_STORE_INFO_CERT);
+    check("keys and certificates loaded",
+          rsa != NULL && ec != NULL && rsa_cert != NULL && ec_cert != NULL
+          && EVP_PKEY_get0_provider(rsa) == prov
+          && EVP_PKEY_get0_provider(ec) == prov
+          && EVP_PKEY_get_bits(rsa) == 2048 && EVP_PKEY_get_bits(ec) == 256
+          && EVP_PKEY_is_a(rsa, "RSA") && EVP_PKEY_is_a(ec, "EC"));
+    if (failures)
+        goto end;
+    check("names listed", names("pkcs11:") >= 2);
+
+    check("RSA PKCS#1 v1.5 signature",
+          pkey_sign_verify(rsa, X509_get0_pubkey(rsa_cert),
+                           RSA_PKCS1_PADDING));
+    check("RSA PSS signature",
+          pkey_sign_verify(rsa, X509_get0_pubkey(rsa_cert),
+                           RSA_PKCS1_PSS_PADDING));
+    check("ECDSA signature",
+          pkey_sign_verify(ec, X509_get0_pubkey(ec_cert), 0));
+    check("RSA OAEP decryption",
+          encrypt_decrypt(rsa, X509_get0_pubkey(rsa_cert),
+                          RSA_PKCS1_OAEP_PADDING));
+    check("RSA PKCS#1 v1.5 encryption and decryption",
+          encrypt_decrypt(rsa, rsa, RSA_PKCS1_PADDING));
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    EVP_PKEY_free(rsa);
+    EVP_PKEY_free(ec);
+    X509_free(rsa_cert);
+    X509_free(ec_cert);
+    OSSL_PROVIDER_unload(prov);
+    OSSL_PROVIDER_unload(dflt);
+    OSSL_LIB_CTX_free(libctx);
+    return ret;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Module reload under load.  Threads sign with a key while RELOAD_MODULE
+ * switches the engine to a copy of the mock module, on which the objects
+ * have other handles.  No signature may fail or not verify, the old module
+ * must be finalized, the signatures must then go to the new one, and the
+ * hot key must load again without a token call.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+#define THREADS 4
+
+static const char *tls_uri = "pkcs11:object=tls;type=private;pin-value=1234";
+static const char *hot_uri = "pkcs11:object=hot;type=private;pin-value=1234";
+
+static RSA *rsa = NULL;
+
+/* the new build of the module: another file with the same code */
+static int copy_module(const char *from, char *to)
+{
+    FILE *in = NULL, *out = NULL;
+    char buf[8192];
+    size_t n;
+    int fd, ok = 0;
+
+    if ((fd = mkstemps(to, 3)) < 0)
+        return 0;
+    if ((out = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+        return 0;
+    }
+    if ((in = fopen(from, "rb")) != NULL) {
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+            if (fwrite(buf, 1, n, out) != n)
+                break;
+        ok = feof(in) && !ferror(in);
+        fclose(in);
+    }
+    return fclose(out) == 0 && ok;
+}
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey = NULL, *hot = NULL;
+    WORKER w[THREADS];
+    PKCS11MOCK_CALLS_FN old_calls, new_calls;
+    PKCS11MOCK_CALLS_RESET_FN new_calls_reset;
+    char tls_path[] = "/tmp/pkcs11reloadXXXXXX";
+    char hot_path[] = "/tmp/pkcs11reloadXXXXXX";
+    char copy[] = "/tmp/pkcs11reloadXXXXXX.so", conf[512];
+    unsigned long ops = 0, errors = 0;
+    void *dso = NULL, *new_dso = NULL;
+    int started = 0, reloaded = 0, ret = TEST_SKIP;
+
+    if (module == NULL || !write_key(tls_path) || !write_key(hot_path)
+        || !copy_module(module, copy)) {
+        fprintf(stderr, "cannot set up the modules, skipping\n");
+        goto end;
+    }
+    BIO_snprintf(conf, sizeof(conf),
+                 "key=label=tls,id=70,file=%s;key=label=hot,id=71,file=%s",
+                 tls_path, hot_path);
+    setenv("PKCS11MOCK", conf, 1);
+
+    if ((dso = dlopen(module, RTLD_NOW)) == NULL
+        || (old_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+
+    /* only the last key loaded is hot, the other one is found again later */
+    if (!ENGINE_ctrl_cmd(e, "HOT_KEYS", 1, NULL, NULL, 0)
+        || (pkey = ENGINE_load_private_key(e, tls_uri, NULL, NULL)) == NULL
+        || (rsa = EVP_PKEY_get1_RSA(pkey)) == NULL
+        || (hot = ENGINE_load_private_key(e, hot_uri, NULL, NULL)) == NULL) {
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    EVP_PKEY_free(hot);
+    hot = NULL;
+
+    /* the new module is read at its C_Initialize, with other handles */
+    BIO_snprintf(conf, sizeof(conf),
+                 "key=label=pad,id=01,bits=1024;"
+                 "key=label=hot,id=71,file=%s;key=label=tls,id=70,file=%s",
+                 hot_path, tls_path);
+    setenv("PKCS11MOCK", conf, 1);
+
+    started = workers_start(w, THREADS, rsa);
+    sleep_ms(50);
+    if (ENGINE_ctrl_cmd_string(e, "RELOAD_MODULE", copy, 0))
+        reloaded = 1;
+    else
+        ERR_print_errors_fp(stdout);
+    sleep_ms(50);
+    workers_stop(w, started, &ops, &errors);
+    printf("%lu signatures, %lu errors\n", ops, errors);
+    check("module reloaded", started == THREADS && reloaded);
+    check("every signature made and verified", ops > 0 && errors == 0);
+    check("old module finalized", old_calls("C_Finalize") == 1);
+
+    if ((new_dso = dlopen(copy, RTLD_NOW)) == NULL
+        || (new_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(new_dso, "pkcs11mock_calls")) == NULL
+        || (new_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(new_dso, "pkcs11mock_calls_reset")) == NULL)
+        goto end;
+    new_calls_reset();
+    check("signature on the new module",
+          sign_verify(rsa) && new_calls("C_Sign") == 1
+          && new_calls("C_FindObjectsInit") == 0);
+    new_calls_reset();
+    hot = ENGINE_load_private_key(e, hot_uri, NULL, NULL);
+    check("hot key loaded without a token call",
+          hot != NULL && new_calls(NULL) == 0);
+    check("same module refused",
+          !ENGINE_ctrl_cmd_string(e, "RELOAD_MODULE", copy, 0));
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    RSA_free(rsa);
+    EVP_PKEY_free(pkey);
+    EVP_PKEY_free(hot);
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (new_dso != NULL)
+        dlclose(new_dso);
+    if (dso != NULL)
+        dlclose(dso);
+    unlink(tls_path);
+    unlink(hot_path);
+    unlink(copy);
+    return ret;
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Key rotation under load.  The same key pair is on two tokens, the second
+ * one with CKA_ALWAYS_AUTHENTICATE; threads sign with the key loaded as
+ * key-name:tls while ROTATE_KEY moves the name from one token to the other
+ * and back.  No signature may fail or not verify, the key must sign with
+ * the profile of the version it was rotated to, and a key of another key
+ * pair must be refused.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+#define THREADS   4
+#define ROTATIONS 40
+
+static const char *uris[] = {
+    "tls=pkcs11:object=tls;type=private;pin-value=1234",
+    "tls=pkcs11:object=tls;type=private;slot-id=1;pin-value=1234"
+};
+
+static PKCS11MOCK_CALLS_FN mock_calls;
+static PKCS11MOCK_CALLS_RESET_FN mock_calls_reset;
+static RSA *rsa = NULL;
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey = NULL;
+    WORKER w[THREADS];
+    char path[] = "/tmp/pkcs11rotateXXXXXX", conf[512];
+    unsigned long ops = 0, errors = 0;
+    void *dso = NULL;
+    int i, started = 0, rotated = 0, ret = TEST_SKIP;
+
+    if (!write_key(path)) {
+        fprintf(stderr, "cannot write a key file, skipping\n");
+        return TEST_SKIP;
+    }
+    BIO_snprintf(conf, sizeof(conf),
+                 "slots=2;"
+                 "key=slot=0,label=tls,id=70,file=%s;"
+                 "key=slot=1,label=tls,id=70,file=%s,always_auth=yes;"
+                 "key=slot=0,label=other,id=71,bits=1024", path, path);
+    setenv("PKCS11MOCK", conf, 1);
+
+    if (module == NULL || (dso = dlopen(module, RTLD_NOW)) == NULL
+        || (mock_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL
+        || (mock_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(dso, "pkcs11mock_calls_reset")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+
+    check("unknown key name refused",
+          ENGINE_load_private_key(e, "key-name:tls", NULL, NULL) == NULL);
+    if (!ENGINE_ctrl_cmd_string(e, "ROTATE_KEY", uris[0], 0)
+        || (pkey = ENGINE_load_private_key(e, "key-name:tls", NULL,
+                                           NULL)) == NULL
+        || (rsa = EVP_PKEY_get1_RSA(pkey)) == NULL) {
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+
+    started = workers_start(w, THREADS, rsa);
+    for (i = 0; i < ROTATIONS; i++) {
+        sleep_ms(5);
+        if (ENGINE_ctrl_cmd_string(e, "ROTATE_KEY", uris[(i + 1) % 2], 0))
+            rotated++;
+        else
+            ERR_print_errors_fp(stdout);
+    }
+    sleep_ms(5);
+    workers_stop(w, started, &ops, &errors);
+    printf("%d rotations, %lu signatures, %lu errors\n", rotated, ops,
+           errors);
+    check("every rotation done", started == THREADS && rotated == ROTATIONS);
+    check("every signature made and verified", ops > 0 && errors == 0);
+
+    /* the profile goes with the version */
+    if (!ENGINE_ctrl_cmd_string(e, "ROTATE_KEY", uris[1], 0))
+        goto end;
+    mock_calls_reset();
+    check("always authenticate version",
+          sign_verify(rsa) && mock_calls("C_Login") == 1);
+    if (!ENGINE_ctrl_cmd_string(e, "ROTATE_KEY", uris[0], 0))
+        goto end;
+    mock_calls_reset();
+    check("plain version", sign_verify(rsa) && mock_calls("C_Login") == 0);
+
+    check("other key pair refused",
+          !ENGINE_ctrl_cmd_string(e, "ROTATE_KEY",
+                                  "tls=pkcs11:object=other;type=private;"
+                                  "pin-value=1234", 0));
+    check("key still signs", sign_verify(rsa));
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    RSA_free(rsa);
+    EVP_PKEY_free(pkey);
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (dso != NULL)
+        dlclose(dso);
+    unlink(path);
+    return ret;
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Thread scaling of the RSA sign path.  The mock module is given K lanes
+ * (at most K crypto operations in flight) and a fixed C_Sign latency, so
+ * with no serialization in the engine N threads keep min(N, K) signatures
+ * in flight at once.  Each run is checked against the most the mock module
+ * saw, which catches a lock held across the call into the module whatever
+ * the number of CPUs.  With -r, the signature rate of each run must also
+ * reach that fraction of min(N, K) times the single thread rate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rsa.h>
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+typedef struct {
+    pthread_t tid;
+    unsigned long ops;
+    unsigned long errors;
+} SIGNER;
+
+static RSA *rsa = NULL;
+static volatile int running = 0;
+static volatile int measuring = 0;
+
+static void *worker(void *arg)
+{
+    SIGNER *w = arg;
+    unsigned char md[32], sig[1024];
+    unsigned int siglen;
+
+    memset(md, 0x5a, sizeof(md));
+    while (running) {
+        siglen = sizeof(sig);
+        if (!RSA_sign(NID_sha256, md, sizeof(md), sig, &siglen, rsa)) {
+            ERR_clear_error();
+            if (measuring)
+                w->errors++;
+            continue;
+        }
+        if (measuring)
+            w->ops++;
+    }
+    return NULL;
+}
+
+/*
+ * Sign from |nthreads| threads for |ms| milliseconds, after a warm-up that
+ * lets the engine open its sessions, and return the signatures per second.
+ */
+static double run(int nthreads, long ms, unsigned long *errors)
+{
+    SIGNER *w;
+    unsigned long ops = 0;
+    int i, n;
+
+    if ((w = calloc(nthreads, sizeof(*w))) == NULL)
+        return -1;
+    running = 1;
+    measuring = 0;
+    for (n = 0; n < nthreads; n++)
+        if (pthread_create(&w[n].tid, NULL, worker, &w[n]) != 0)
+            break;
+    sleep_ms(ms / 4);
+    measuring = 1;
+    sleep_ms(ms);
+    measuring = 0;
+    running = 0;
+    *errors = 0;
+    for (i = 0; i < n; i++) {
+        pthread_join(w[i].tid, NULL);
+        ops += w[i].ops;
+        *errors += w[i].errors;
+    }
+    free(w);
+    if (n != nthreads)
+        return -1;
+    return ops * 1000.0 / ms;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -k lanes    mock module lanes (8)\n"
+            "  -l us       C_Sign latency in microseconds (2000)\n"
+            "  -T threads  largest thread count (64)\n"
+            "  -d ms       measuring time per thread count (400)\n"
+            "  -r ratio    lowest accepted fraction of the ideal rate (none)\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *key_uri = "pkcs11:object=rsa0;type=private;pin-value=1234";
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    PKCS11MOCK_CALLS_RESET_FN mock_calls_reset;
+    PKCS11MOCK_LANES_PEAK_FN mock_lanes_peak;
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey = NULL;
+    char conf[256], *uri = NULL;
+    void *dso = NULL;
+    int c, lanes = 8, latency = 2000, max_threads = 64, nthreads;
+    int want, peak, ret = TEST_SKIP;
+    long ms = 400;
+    double ratio = 0, base = 0, rate, ideal;
+    unsigned long errors;
+
+    while ((c = getopt(argc, argv, "k:l:T:d:r:")) != -1) {
+        switch (c) {
+        case 'k':
+            lanes = atoi(optarg);
+            break;
+        case 'l':
+            latency = atoi(optarg);
+            break;
+        case 'T':
+            max_threads = atoi(optarg);
+            break;
+        case 'd':
+            ms = atol(optarg);
+            break;
+        case 'r':
+            ratio = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (lanes < 1 || latency < 1 || max_threads < 1 || ms < 1 || ratio < 0)
+        usage(argv[0]);
+
+    /* fake key maths, so the C_Sign latency is all the module costs */
+    BIO_snprintf(conf, sizeof(conf),
+                 "lanes=%d;latency.C_Sign=fixed:%d;crypto=fake",
+                 lanes, latency);
+    setenv("PKCS11MOCK", conf, 1);
+
+    /* the engine opens the same file, so this is the same module */
+    if (module == NULL || (dso = dlopen(module, RTLD_NOW)) == NULL
+        || (mock_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(dso, "pkcs11mock_calls_reset")) == NULL
+        || (mock_lanes_peak = (PKCS11MOCK_LANES_PEAK_FN)
+                dlsym(dso, "pkcs11mock_lanes_peak")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+    if (!ENGINE_set_default_RSA(e)
+        || (uri = OPENSSL_strdup(key_uri)) == NULL
+        || (pkey = ENGINE_load_private_key(e, uri, NULL, NULL)) == NULL
+        || (rsa = EVP_PKEY_get1_RSA(pkey)) == NULL) {
+        fprintf(stderr, "cannot load %s\n", key_uri);
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+
+    printf("lanes %d, C_Sign latency %d us\n", lanes, latency);
+    printf("%8s %8s %12s %12s %8s %8s\n", "threads", "peak", "sign/s",
+           "ideal/s", "ratio", "errors");
+    ret = TEST_PASS;
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        mock_calls_reset();
+        if ((rate = run(nthreads, ms, &errors)) < 0) {
+            fprintf(stderr, "cannot start %d threads\n", nthreads);
+            ret = TEST_FAIL;
+            break;
+        }
+        if (nthreads == 1)
+            base = rate;
+        want = nthreads < lanes ? nthreads : lanes;
+        ideal = base * want;
+        peak = mock_lanes_peak();
+        printf("%8d %8d %12.1f %12.1f %8.2f %8lu\n", nthreads, peak, rate,
+               ideal, ideal > 0 ? rate / ideal : 0, errors);
+        fflush(stdout);
+        if (errors != 0 || peak < want) {
+            fprintf(stderr, "%d threads: %d signatures in flight at most, "
+                    "expected %d\n", nthreads, peak, want);
+            ret = TEST_FAIL;
+        }
+        if (ratio > 0 && (ideal <= 0 || rate < ratio * ideal)) {
+            fprintf(stderr, "%d threads: %.1f signatures/s, expected at "
+                    "least %.1f\n", nthreads, rate, ratio * ideal);
+            ret = TEST_FAIL;
+        }
+    }
+
+ end:
+    RSA_free(rsa);
+    EVP_PKEY_free(pkey);
+    OPENSSL_free(uri);
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (dso != NULL)
+        dlclose(dso);
+    return ret;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Multi-token listing.  The mock module has SLOTS tokens of OBJECTS keys
+ * and certificates each, the same labels on every token, and every
+ * attribute read takes LATENCY_US.  A store URI that picks no token must
+ * list the names of all of them, searched at once: in well under the time
+ * of their attribute reads one after the other.  A certificate's URI must
+ * find it on every token, and a slot-id or token label only on its own;
+ * a URI without a token after one with a token label lists every token.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/store.h>
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+#define SLOTS           8
+#define OBJECTS         4
+#define LATENCY_US      2000
+
+static long elapsed_us(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (long)((t1.tv_sec - t0->tv_sec) * 1000000
+                  + (t1.tv_nsec - t0->tv_nsec) / 1000);
+}
+
+/*
+ * Objects of a store URI of type |want|, or -1 on error; |slots| gets a
+ * bit for each slot a name says it is in.
+ */
+static int store_list(const char *uri, int want, unsigned int *slots)
+{
+    OSSL_STORE_CTX *store;
+    OSSL_STORE_INFO *info;
+    const char *desc;
+    unsigned long slot;
+    int n = 0;
+
+    if ((store = OSSL_STORE_open(uri, NULL, NULL, NULL, NULL)) == NULL)
+        return -1;
+    while (!OSSL_STORE_eof(store)) {
+        if ((info = OSSL_STORE_load(store)) == NULL)
+            continue;
+        if (OSSL_STORE_INFO_get_type(info) == want) {
+            n++;
+            if (slots != NULL
+                && (desc = OSSL_STORE_INFO_get0_NAME_description(info))
+                   != NULL
+                && sscanf(desc, "Slot %lu,", &slot) == 1 && slot < SLOTS)
+                *slots |= 1U << slot;
+        }
+        OSSL_STORE_INFO_free(info);
+    }
+    OSSL_STORE_close(store);
+    return n;
+}
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    PKCS11MOCK_CALLS_FN mock_calls;
+    PKCS11MOCK_CALLS_RESET_FN mock_calls_reset;
+    ENGINE *e = NULL;
+    OSSL_STORE_CTX *store;
+    OSSL_STORE_INFO *info = NULL;
+    struct timespec t0;
+    unsigned int slots = 0;
+    char conf[1024];
+    void *dso = NULL;
+    long us, serial_us;
+    int i, n, len, ret = TEST_SKIP;
+
+    len = BIO_snprintf(conf, sizeof(conf), "slots=%d;crypto=fake;"
+                       "latency.C_GetAttributeValue=fixed:%d", SLOTS,
+                       LATENCY_US);
+    for (i = 0; i < SLOTS; i++)
+        len += BIO_snprintf(conf + len, sizeof(conf) - len,
+                            ";key=slot=%d,label=obj,type=ec,cert=yes,"
+                            "count=%d", i, OBJECTS);
+    setenv("PKCS11MOCK", conf, 1);
+
+    /* the engine opens the same file, so this is the same module */
+    if (module == NULL || (dso = dlopen(module, RTLD_NOW)) == NULL
+        || (mock_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL
+        || (mock_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(dso, "pkcs11mock_calls_reset")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+
+    mock_calls_reset();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    n = store_list("pkcs11:", OSSL_STORE_INFO_NAME, &slots);
+    us = elapsed_us(&t0);
+    serial_us = (long)mock_calls("C_GetAttributeValue") * LATENCY_US;
+    printf("%d names in %ld us, %ld us one token after the other\n",
+           n, us, serial_us);
+    check("names of every token", n >= SLOTS * OBJECTS
+          && slots == (1U << SLOTS) - 1);
+    check("tokens searched at once", us < serial_us / 2);
+
+    n = store_list("pkcs11:object=obj2;type=cert", OSSL_STORE_INFO_CERT,
+                   NULL);
+    check("certificate of every token", n == SLOTS);
+
+    n = store_list("pkcs11:slot-id=3;object=obj2;type=cert",
+                   OSSL_STORE_INFO_CERT, NULL);
+    check("certificate of one slot-id", n == 1);
+
+    n = store_list("pkcs11:token=mock-token-5;object=obj2;type=cert",
+                   OSSL_STORE_INFO_CERT, NULL);
+    check("certificate of one token label", n == 1);
+
+    /* the token of the URI before is not that of the next one */
+    slots = 0;
+    n = store_list("pkcs11:", OSSL_STORE_INFO_NAME, &slots);
+    check("every token again after a token label",
+          n >= SLOTS * OBJECTS && slots == (1U << SLOTS) - 1);
+
+    /* closed long before its end, the threads must give up */
+    store = OSSL_STORE_open("pkcs11:", NULL, NULL, NULL, NULL);
+    check("listing closed early", store != NULL
+          && (info = OSSL_STORE_load(store)) != NULL);
+    OSSL_STORE_INFO_free(info);
+    OSSL_STORE_close(store);
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (dso != NULL)
+        dlclose(dso);
+    return ret;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Cache coherence.  The mock module's objects are changed behind the
+ * engine's back, as another host sharing the token would.  With
+ * CACHE_CHECK, a cached key must cost no call within the interval and a
+ * single read of the generation object after it; a key replaced on the
+ * token, with the generation object bumped or only the token's free
+ * memory changed, must be found again once the interval is over; and a
+ * key handle the token no longer knows must make every key of the token
+ * be searched again at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include "pkcs11mock.h"
+#include "testutil.h"
+
+#define CHECK_MS 100
+
+static const char tls_uri[] = "pkcs11:object=tls;type=private;pin-value=1234";
+static const char web_uri[] = "pkcs11:object=web;type=private;pin-value=1234";
+
+/* The modulus of the key of |uri| as loaded now, NULL on error */
+static BIGNUM *load_n(ENGINE *e, const char *uri)
+{
+    EVP_PKEY *pkey = ENGINE_load_private_key(e, uri, NULL, NULL);
+    const RSA *rsa;
+    BIGNUM *n = NULL;
+
+    if (pkey != NULL && (rsa = EVP_PKEY_get0_RSA(pkey)) != NULL)
+        n = BN_dup(RSA_get0_n(rsa));
+    EVP_PKEY_free(pkey);
+    return n;
+}
+
+static int digest_sign_verify(EVP_PKEY *pkey)
+{
+    static const unsigned char data[] = "cache coherence";
+    unsigned char sig[512];
+    size_t siglen = sizeof(sig);
+    EVP_MD_CTX *mctx;
+    int ok;
+
+    ok = (mctx = EVP_MD_CTX_new()) != NULL
+         && EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, pkey) > 0
+         && EVP_DigestSign(mctx, sig, &siglen, data, sizeof(data)) > 0;
+    EVP_MD_CTX_reset(mctx);
+    ok = ok
+         && EVP_DigestVerifyInit(mctx, NULL, EVP_sha256(), NULL, pkey) > 0
+         && EVP_DigestVerify(mctx, sig, siglen, data, sizeof(data)) == 1;
+    EVP_MD_CTX_free(mctx);
+    return ok;
+}
+
+int main(void)
+{
+    const char *module = getenv("PKCS11_MODULE_PATH");
+    PKCS11MOCK_CALLS_FN mock_calls;
+    PKCS11MOCK_CALLS_RESET_FN mock_calls_reset;
+    PKCS11MOCK_PROVISION_FN mock_provision;
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey = NULL;
+    BIGNUM *n1 = NULL, *n2 = NULL, *n3 = NULL, *w1 = NULL, *w2 = NULL;
+    void *dso = NULL;
+    int ret = TEST_SKIP;
+
+    setenv("PKCS11MOCK",
+           "key=label=tls,id=70,type=rsa,bits=1024;"
+           "key=label=tls-b,id=71,type=rsa,bits=1024;"
+           "key=label=tls-c,id=72,type=rsa,bits=1024;"
+           "key=label=web,id=73,type=rsa,bits=1024;"
+           "key=label=web-b,id=74,type=rsa,bits=1024;"
+           "data=label=generation,id=7f,value=1", 1);
+
+    /* the engine opens the same file, so this is the same module */
+    if (module == NULL || (dso = dlopen(module, RTLD_NOW)) == NULL
+        || (mock_calls = (PKCS11MOCK_CALLS_FN)
+                dlsym(dso, "pkcs11mock_calls")) == NULL
+        || (mock_calls_reset = (PKCS11MOCK_CALLS_RESET_FN)
+                dlsym(dso, "pkcs11mock_calls_reset")) == NULL
+        || (mock_provision = (PKCS11MOCK_PROVISION_FN)
+                dlsym(dso, "pkcs11mock_provision")) == NULL) {
+        fprintf(stderr, "no mock module at $PKCS11_MODULE_PATH, skipping\n");
+        goto end;
+    }
+    if ((e = ENGINE_by_id("pkcs11")) == NULL || !ENGINE_init(e)) {
+        fprintf(stderr, "cannot load the pkcs11 engine, skipping\n");
+        ERR_print_errors_fp(stderr);
+        goto end;
+    }
+    ret = TEST_FAIL;
+
+    /* a generation object the provisioning tools bump */
+    check("CACHE_CHECK with a generation object",
+          ENGINE_ctrl_cmd_string(e, "CACHE_CHECK",
+                                 "ms=100 object=generation", 0));
+    check("bad CACHE_CHECK refused",
+          !ENGINE_ctrl_cmd_string(e, "CACHE_CHECK", "ms=soon", 0));
+    if ((n1 = load_n(e, tls_uri)) == NULL)
+        goto end;
+    mock_calls_reset();
+    BN_free(n2);
+    n2 = load_n(e, tls_uri);
+    check("no call within the interval",
+          n2 != NULL && BN_cmp(n1, n2) == 0 && mock_calls(NULL) == 0);
+    sleep_ms(CHECK_MS + 20);
+    mock_calls_reset();
+    BN_free(n2);
+    n2 = load_n(e, tls_uri);
+    check("one call to check an unchanged token",
+          n2 != NULL && BN_cmp(n1, n2) == 0 && mock_calls(NULL) == 1
+          && mock_calls("C_GetAttributeValue") == 1);
+
+    if (!mock_provision("destroy=tls;rename=tls-b:tls;value=generation:2"))
+        goto end;
+    sleep_ms(CHECK_MS + 20);
+    BN_free(n2);
+    n2 = load_n(e, tls_uri);
+    pkey = ENGINE_load_private_key(e, tls_uri, NULL, NULL);
+    check("key replaced with the generation bumped",
+          n2 != NULL && BN_cmp(n1, n2) != 0 && pkey != NULL
+          && digest_sign_verify(pkey));
+    EVP_PKEY_free(pkey);
+    pkey = NULL;
+
+    /* no generation object, the free memory of the token */
+    check("CACHE_CHECK with the token memory",
+          ENGINE_ctrl_cmd_string(e, "CACHE_CHECK", "ms=100", 0));
+    BN_free(n3);
+    n3 = load_n(e, tls_uri);
+    if (!mock_provision("destroy=tls;rename=tls-c:tls"))
+        goto end;
+    sleep_ms(CHECK_MS + 20);
+    BN_free(n3);
+    n3 = load_n(e, tls_uri);
+    check("key replaced with the token memory changed",
+          n3 != NULL && BN_cmp(n2, n3) != 0 && BN_cmp(n1, n3) != 0);
+
+    /* a stale handle, long before the next check */
+    check("CACHE_CHECK with a long interval",
+          ENGINE_ctrl_cmd_string(e, "CACHE_CHECK",
+                                 "ms=100000 object=generation", 0));
+    w1 = load_n(e, web_uri);
+    pkey = ENGINE_load_private_key(e, tls_uri, NULL, NULL);
+    if (w1 == NULL || pkey == NULL
+        || !mock_provision("destroy=tls;destroy=web;rename=web-b:web"))
+        goto end;
+    check("key destroyed on another host fails",
+          !digest_sign_verify(pkey));
+    w2 = load_n(e, web_uri);
+    check("other keys of the token searched again",
+          w2 != NULL && BN_cmp(w1, w2) != 0);
+
+    ret = failures == 0 ? TEST_PASS : TEST_FAIL;
+
+ end:
+    EVP_PKEY_free(pkey);
+    BN_free(n1);
+    BN_free(n2);
+    BN_free(n3);
+    BN_free(w1);
+    BN_free(w2);
+    if (e != NULL) {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    if (dso != NULL)
+        dlclose(dso);
+    return ret;
+}
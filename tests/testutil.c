@@ -0,0 +1,133 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/store.h>
+#include "testutil.h"
+
+int failures = 0;
+
+static volatile int running = 0;
+
+void check(const char *what, int ok)
+{
+    printf("%-44s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) {
+        ERR_print_errors_fp(stdout);
+        failures++;
+    }
+    ERR_clear_error();
+}
+
+void sleep_ms(long ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+int sign_verify(RSA *rsa)
+{
+    unsigned char md[32], sig[1024];
+    unsigned int siglen = sizeof(sig);
+
+    memset(md, 0x5a, sizeof(md));
+    return RSA_sign(NID_sha256, md, sizeof(md), sig, &siglen, rsa)
+           && RSA_verify(NID_sha256, md, sizeof(md), sig, siglen, rsa);
+}
+
+int store_count(const char *uri)
+{
+    OSSL_STORE_CTX *store;
+    OSSL_STORE_INFO *info;
+    int n = 0;
+
+    if ((store = OSSL_STORE_open(uri, NULL, NULL, NULL, NULL)) == NULL)
+        return -1;
+    while (!OSSL_STORE_eof(store)) {
+        if ((info = OSSL_STORE_load(store)) == NULL)
+            break;
+        OSSL_STORE_INFO_free(info);
+        n++;
+    }
+    OSSL_STORE_close(store);
+    return n;
+}
+
+int write_key(char *path)
+{
+    EVP_PKEY *pkey = NULL;
+    FILE *fp = NULL;
+    int fd, ok = 0;
+
+    if ((fd = mkstemp(path)) < 0)
+        return 0;
+    if ((fp = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        return 0;
+    }
+    ok = (pkey = EVP_RSA_gen(2048)) != NULL
+         && PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL);
+    fclose(fp);
+    EVP_PKEY_free(pkey);
+    return ok;
+}
+
+static void *worker(void *arg)
+{
+    WORKER *w = arg;
+
+    while (running) {
+        if (sign_verify(w->rsa)) {
+            w->ops++;
+        } else {
+            ERR_clear_error();
+            w->errors++;
+        }
+    }
+    return NULL;
+}
+
+int workers_start(WORKER *w, int n, RSA *rsa)
+{
+    int i;
+
+    running = 1;
+    for (i = 0; i < n; i++) {
+        memset(&w[i], 0, sizeof(w[i]));
+        w[i].rsa = rsa;
+        if (pthread_create(&w[i].tid, NULL, worker, &w[i]) != 0)
+            break;
+    }
+    return i;
+}
+
+void workers_stop(WORKER *w, int started, unsigned long *ops,
+                  unsigned long *errors)
+{
+    int i;
+
+    running = 0;
+    for (i = 0; i < started; i++) {
+        pthread_join(w[i].tid, NULL);
+        *ops += w[i].ops;
+        *errors += w[i].errors;
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2020 Antonio Iacono and the OpenSSL Project Authors.
+ * All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+#ifndef HEADER_TESTUTIL_H
+# define HEADER_TESTUTIL_H
+
+/*
+ * Helpers shared by the tests.  A test prints one line per check() and
+ * passes if none failed; the exit status is TEST_SKIP when what it needs,
+ * e.g. the mock module or the engine, cannot be loaded.
+ */
+
+# include <pthread.h>
+# include <openssl/rsa.h>
+
+# define TEST_PASS 0
+# define TEST_FAIL 1
+# define TEST_SKIP 77
+
+/* Checks that failed so far */
+extern int failures;
+
+/* Print |what| with the outcome, and the OpenSSL errors if not |ok| */
+void check(const char *what, int ok);
+
+void sleep_ms(long ms);
+
+/* Sign a SHA-256 digest with |rsa| and verify the signature */
+int sign_verify(RSA *rsa);
+
+/* Objects the store of |uri| lists, -1 if it cannot be opened */
+int store_count(const char *uri);
+
+/*
+ * Write a new RSA-2048 key in PEM to a file made from the mkstemp()
+ * template |path|, for the mock module to hold.  Returns 0 on error.
+ */
+int write_key(char *path);
+
+/* A thread signing and verifying with |rsa| until workers_stop() */
+typedef struct {
+    pthread_t tid;
+    RSA *rsa;
+    unsigned long ops;
+    unsigned long errors;
+} WORKER;
+
+/* Start |n| workers with |rsa|; returns how many started */
+int workers_start(WORKER *w, int n, RSA *rsa);
+
+/* Stop the |started| workers and add up what they did */
+void workers_stop(WORKER *w, int started, unsigned long *ops,
+                  unsigned long *errors);
+
+#endif